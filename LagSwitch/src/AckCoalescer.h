@@ -0,0 +1,469 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include "Platform.h"
+#include "PacketHeaders.h"
+#include "PacketDivert.h"
+
+// The amount of connections the last queued ACK is remembered for. Must be a power of two.
+#define ACK_TABLE_CAPACITY 4096
+// The TCP options a coalesced ACK may carry. Any other option, SACK blocks included, keeps the ACK as it is.
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_TIMESTAMP 8
+#define TCP_OPTION_SACK 5
+// The ACK benchmark's bulk connections, the share of its packets that are game traffic instead of ACKs, how often
+// a connection sends a duplicate ACK followed by one with a SACK block or changes its window, and its segment size.
+#define ACK_BENCHMARK_CONNECTIONS 32
+#define ACK_BENCHMARK_GAME_EVERY 8
+#define ACK_BENCHMARK_DUPLICATE_EVERY 40
+#define ACK_BENCHMARK_WINDOW_EVERY 100
+#define ACK_BENCHMARK_SEGMENT 1460
+
+// A TCP connection as seen in the packets sent in one direction.
+struct ACK_CONNECTION_KEY {
+	BYTE source[16];
+	BYTE destination[16];
+	UINT16 sourcePort;
+	UINT16 destinationPort;
+	UINT8 ipv6;
+	UINT8 reserved[3];
+};
+
+// The fields of a pure ACK that a newer ACK must share to replace it, and the acknowledgment number it advances.
+struct PURE_ACK {
+	ACK_CONNECTION_KEY key;
+	UINT32 sequence;
+	UINT32 acknowledgment;
+	UINT16 window;
+	UINT8 tos;
+	UINT8 reserved;
+	UINT length;
+};
+
+// The last pure ACK queued for a connection: its list, its place in the list counted from the first packet ever
+// added to the list, and the list element it is held in.
+struct ACK_ENTRY {
+	bool used;
+	PURE_ACK ack;
+	UINT queue;
+	UINT64 position;
+	void* element;
+};
+
+// Replaces a queued pure TCP ACK with a newer one of the same connection that only acknowledges more, so a bulk
+// download doesn't fill the packet lists with ACKs that a later one makes redundant. The newer ACK takes the older
+// one's place and send time, so the acknowledgment goes out no later than the first of them would have.
+// Only ACKs without data, SACK blocks, or flags other than ACK are replaced, and only by an ACK with the same
+// sequence number, window, and header layout, so duplicate ACKs and window updates are always sent.
+// Any other packet of the connection makes the coalescer forget its ACK, so nothing is moved past it,
+// and so does any packet of the connection that is held elsewhere than the packet lists or sent right away.
+// The table is direct-mapped, and a connection that collides with another only loses its chance to coalesce.
+// Not thread-safe, the delayer calls it with the packet mutex locked.
+class AckCoalescer {
+private:
+	std::vector<ACK_ENTRY> _table;
+	// The slot of the ACK last checked, which Queued() fills in.
+	ACK_ENTRY* _pending = nullptr;
+	PURE_ACK _pendingAck;
+
+	static UINT64 _hash(const ACK_CONNECTION_KEY& key) {
+		UINT64 words[5];
+		std::memcpy(words, &key, sizeof(words));
+		UINT64 hash = 0x9E3779B97F4A7C15ull;
+		for (UINT64 word : words) {
+			hash ^= word;
+			hash *= 0xBF58476D1CE4E5B9ull;
+			hash ^= hash >> 31;
+		}
+		return hash;
+	}
+
+	// Whether TCP sequence number a comes after b, allowing for the numbers wrapping around.
+	static bool _sequenceAfter(UINT32 a, UINT32 b) {
+		return (INT32)(a - b) > 0;
+	}
+
+	// Whether the TCP options only contain padding and a timestamp, whose value changes with every ACK.
+	static bool _plainOptions(const BYTE* options, UINT length) {
+		UINT offset = 0;
+		while (offset < length) {
+			BYTE kind = options[offset];
+			if (kind == TCP_OPTION_END)
+				return true;
+			if (kind == TCP_OPTION_NOP) {
+				offset += 1;
+				continue;
+			}
+			if (kind != TCP_OPTION_TIMESTAMP || offset + 10 > length || options[offset + 1] != 10)
+				return false;
+			offset += 10;
+		}
+		return offset == length;
+	}
+
+public:
+	// Turns the coalescing on or off. The table is only allocated while it is on.
+	void SetEnabled(bool enabled) {
+		if (enabled)
+			_table.assign(ACK_TABLE_CAPACITY, ACK_ENTRY());
+		else
+			std::vector<ACK_ENTRY>().swap(_table);
+		_pending = nullptr;
+	}
+
+	bool IsEnabled() const {
+		return !_table.empty();
+	}
+
+	// Reads the connection of a TCP packet. Sets pure if the packet is an ACK that can be coalesced.
+	// Returns false if the packet isn't TCP.
+	static bool ReadAck(const void* packet, UINT length, PURE_ACK& ack, bool& pure) {
+		PACKET_HEADERS headers;
+		pure = false;
+		if (!ParsePacketHeaders((PVOID)packet, length, headers) || headers.protocol != IP_PROTOCOL_TCP || headers.transport == nullptr)
+			return false;
+		std::memset(&ack, 0, sizeof(ack));
+		UINT addressLength = headers.ipv6 ? 16 : 4;
+		std::memcpy(ack.key.source, headers.ip + (headers.ipv6 ? IPV6_SRC_ADDR_OFFSET : IPV4_SRC_ADDR_OFFSET), addressLength);
+		std::memcpy(ack.key.destination, headers.ip + (headers.ipv6 ? IPV6_DST_ADDR_OFFSET : IPV4_DST_ADDR_OFFSET), addressLength);
+		ack.key.sourcePort = ReadNet16(headers.transport + SRC_PORT_OFFSET);
+		ack.key.destinationPort = ReadNet16(headers.transport + DST_PORT_OFFSET);
+		ack.key.ipv6 = headers.ipv6;
+		if (headers.fragment)
+			return true;
+		UINT tcpHeaderLength = (headers.transport[TCP_DATA_OFFSET_OFFSET] >> 4) * 4;
+		// A pure ACK carries no data and has no other flag, ECN ones included.
+		if (tcpHeaderLength < 20 || tcpHeaderLength != headers.transportLength || headers.transport[TCP_FLAGS_OFFSET] != TCP_FLAG_ACK)
+			return true;
+		if (!_plainOptions(headers.transport + 20, tcpHeaderLength - 20))
+			return true;
+		ack.sequence = ReadNet32(headers.transport + TCP_SEQ_OFFSET);
+		ack.acknowledgment = ReadNet32(headers.transport + TCP_ACK_OFFSET);
+		ack.window = ReadNet16(headers.transport + TCP_WINDOW_OFFSET);
+		ack.tos = headers.ipv6 ? (BYTE)(ReadNet16(headers.ip) >> 4) : headers.ip[IPV4_TOS_OFFSET];
+		ack.length = length;
+		pure = true;
+		return true;
+	}
+
+	// Checks a packet about to be added to the given list, whose front packet is at the given place.
+	// Returns the list element of the queued ACK the packet replaces, or null if the packet should be queued.
+	// The caller swaps the packet into the returned element, or calls Queued() once it has queued the packet.
+	void* Replace(const void* packet, UINT length, UINT queue, UINT64 front) {
+		_pending = nullptr;
+		bool pure;
+		if (!ReadAck(packet, length, _pendingAck, pure))
+			return nullptr;
+		ACK_ENTRY& entry = _table[_hash(_pendingAck.key) & (ACK_TABLE_CAPACITY - 1)];
+		bool sameConnection = entry.used && std::memcmp(&entry.ack.key, &_pendingAck.key, sizeof(ACK_CONNECTION_KEY)) == 0;
+		if (!pure) {
+			// Nothing may be moved past this packet.
+			if (sameConnection)
+				entry.used = false;
+			return nullptr;
+		}
+		// The remembered ACK must still be queued, in the same list, and differ only by acknowledging more.
+		if (sameConnection && entry.queue == queue && entry.position >= front
+			&& entry.ack.sequence == _pendingAck.sequence && entry.ack.window == _pendingAck.window
+			&& entry.ack.tos == _pendingAck.tos && entry.ack.length == _pendingAck.length
+			&& _sequenceAfter(_pendingAck.acknowledgment, entry.ack.acknowledgment)) {
+			entry.ack = _pendingAck;
+			return entry.element;
+		}
+		_pending = &entry;
+		return nullptr;
+	}
+
+	// Forgets the ACK of the connection of a packet that doesn't go through Replace(), so no later ACK is moved past it.
+	void Forget(const void* packet, UINT length) {
+		PURE_ACK ack;
+		bool pure;
+		if (!ReadAck(packet, length, ack, pure))
+			return;
+		ACK_ENTRY& entry = _table[_hash(ack.key) & (ACK_TABLE_CAPACITY - 1)];
+		if (entry.used && std::memcmp(&entry.ack.key, &ack.key, sizeof(ACK_CONNECTION_KEY)) == 0)
+			entry.used = false;
+	}
+
+	// Remembers the pure ACK last passed to Replace() as queued at the given place of its list.
+	void Queued(UINT queue, UINT64 position, void* element) {
+		if (_pending == nullptr)
+			return;
+		_pending->used = true;
+		_pending->ack = _pendingAck;
+		_pending->queue = queue;
+		_pending->position = position;
+		_pending->element = element;
+		_pending = nullptr;
+	}
+};
+
+// The kinds of packets the ACK benchmark generates, stored in the IPv4 identification field.
+enum class AckStreamKind {
+	// An ACK that only acknowledges more, which may be coalesced.
+	Plain,
+	// Packets that must all be sent: duplicate ACKs, ACKs with a SACK block, and game traffic.
+	Duplicate,
+	Sack,
+	// An ACK with a new window. A later ACK with the same window may replace it, but the change must be sent.
+	Window,
+	Game,
+	Count
+};
+
+// Hands out the pure ACKs of bulk TCP downloads mixed with game traffic at a fixed rate, and checks what is sent back:
+// every duplicate ACK, SACK, and game packet and every window change must arrive, no connection's acknowledgment
+// number may go backwards, and the last acknowledgment of every connection must arrive.
+class AckStreamDivert : public PacketDivert {
+private:
+	double _packetsPerSecond;
+	UINT64 _total;
+	UINT64 _handedOut = 0;
+	TIME_DATA _start;
+	std::atomic<bool> _shutdown{ false };
+	// The packet Recv() built but couldn't hand out.
+	BYTE _next[128];
+	UINT _nextLength = 0;
+
+	// The generated state of every connection, and how many of each kind were handed out.
+	std::vector<UINT32> _acks;
+	std::vector<UINT64> _connectionAcks;
+	std::vector<UINT16> _windows;
+	UINT64 _generated[(size_t)AckStreamKind::Count] = {};
+
+	// What was sent back.
+	std::mutex _sendMutex;
+	std::vector<UINT32> _sentAcks;
+	std::vector<bool> _sentAny;
+	std::vector<UINT16> _sentWindows;
+	UINT64 _windowChanges = 0;
+	UINT64 _sent[(size_t)AckStreamKind::Count] = {};
+	UINT64 _sendCalls = 0;
+	UINT64 _sentBytes = 0;
+	UINT64 _regressions = 0;
+
+	// Builds the next packet. Returns its length.
+	UINT _build(BYTE* packet) {
+		UINT64 index = _handedOut++;
+		if (index % ACK_BENCHMARK_GAME_EVERY == 0) {
+			WINDIVERT_ADDRESS address;
+			std::vector<BYTE> game = MakeGamePacket(address);
+			std::memcpy(packet, game.data(), game.size());
+			_generated[(size_t)AckStreamKind::Game] += 1;
+			return (UINT)game.size();
+		}
+		size_t connection = (size_t)(index % ACK_BENCHMARK_CONNECTIONS);
+		UINT64 count = _connectionAcks[connection]++;
+		AckStreamKind kind = AckStreamKind::Plain;
+		if (count % ACK_BENCHMARK_DUPLICATE_EVERY == ACK_BENCHMARK_DUPLICATE_EVERY - 2)
+			kind = AckStreamKind::Duplicate;
+		else if (count % ACK_BENCHMARK_DUPLICATE_EVERY == ACK_BENCHMARK_DUPLICATE_EVERY - 1)
+			kind = AckStreamKind::Sack;
+		else if (count % ACK_BENCHMARK_WINDOW_EVERY == ACK_BENCHMARK_WINDOW_EVERY - 1) {
+			kind = AckStreamKind::Window;
+			_windows[connection] ^= 0x0100;
+		}
+		if (kind != AckStreamKind::Duplicate)
+			_acks[connection] += 2 * ACK_BENCHMARK_SEGMENT;
+		UINT optionsLength = kind == AckStreamKind::Sack ? 24 : 12;
+		UINT length = 40 + optionsLength;
+		std::memset(packet, 0, length);
+		packet[0] = 0x45;
+		WriteNet16(packet + 2, (UINT16)length);
+		WriteNet16(packet + 4, (UINT16)kind);
+		WriteNet16(packet + IPV4_FRAGMENT_OFFSET, 0x4000);
+		packet[IPV4_TTL_OFFSET] = 128;
+		packet[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_TCP;
+		const BYTE source[4] = { 192, 168, 1, 2 };
+		const BYTE destination[4] = { 203, 0, 113, 10 };
+		std::memcpy(packet + IPV4_SRC_ADDR_OFFSET, source, 4);
+		std::memcpy(packet + IPV4_DST_ADDR_OFFSET, destination, 4);
+		BYTE* tcp = packet + 20;
+		WriteNet16(tcp + SRC_PORT_OFFSET, (UINT16)(50000 + connection));
+		WriteNet16(tcp + DST_PORT_OFFSET, 443);
+		WriteNet32(tcp + TCP_SEQ_OFFSET, 1000000 + (UINT32)connection);
+		WriteNet32(tcp + TCP_ACK_OFFSET, _acks[connection]);
+		tcp[TCP_DATA_OFFSET_OFFSET] = (BYTE)(((20 + optionsLength) / 4) << 4);
+		tcp[TCP_FLAGS_OFFSET] = TCP_FLAG_ACK;
+		WriteNet16(tcp + TCP_WINDOW_OFFSET, _windows[connection]);
+		BYTE* options = tcp + 20;
+		options[0] = TCP_OPTION_NOP;
+		options[1] = TCP_OPTION_NOP;
+		options[2] = TCP_OPTION_TIMESTAMP;
+		options[3] = 10;
+		WriteNet32(options + 4, (UINT32)index);
+		if (kind == AckStreamKind::Sack) {
+			options[12] = TCP_OPTION_NOP;
+			options[13] = TCP_OPTION_NOP;
+			options[14] = TCP_OPTION_SACK;
+			options[15] = 10;
+			WriteNet32(options + 16, _acks[connection] + ACK_BENCHMARK_SEGMENT);
+			WriteNet32(options + 20, _acks[connection] + 2 * ACK_BENCHMARK_SEGMENT);
+		}
+		_generated[(size_t)kind] += 1;
+		return length;
+	}
+
+	// Waits until a packet is due or the divert is shut down. Returns false once shut down.
+	bool _waitForPacket(TIME_DATA deadline) {
+		while (true) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			TIME_DATA now = std::chrono::steady_clock::now();
+			UINT64 due = std::min<UINT64>(_total, (UINT64)(std::chrono::duration<double>(now - _start).count() * _packetsPerSecond) + 1);
+			if (_handedOut < due)
+				return true;
+			if (now >= deadline) {
+				SetLastError(ERROR_TIMEOUT);
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+public:
+	AckStreamDivert(double packetsPerSecond, std::chrono::milliseconds duration)
+		: _packetsPerSecond(packetsPerSecond), _total((UINT64)(packetsPerSecond * duration.count() / 1000)),
+		_acks(ACK_BENCHMARK_CONNECTIONS, 5000), _connectionAcks(ACK_BENCHMARK_CONNECTIONS, 0), _windows(ACK_BENCHMARK_CONNECTIONS, 0x2000),
+		_sentAcks(ACK_BENCHMARK_CONNECTIONS, 0), _sentAny(ACK_BENCHMARK_CONNECTIONS, false), _sentWindows(ACK_BENCHMARK_CONNECTIONS, 0) {}
+
+	// A UDP packet of the game traffic.
+	static std::vector<BYTE> MakeGamePacket(WINDIVERT_ADDRESS& address) {
+		std::vector<BYTE> packet(120, 0);
+		packet[0] = 0x45;
+		WriteNet16(&packet[2], (UINT16)packet.size());
+		WriteNet16(&packet[4], (UINT16)AckStreamKind::Game);
+		packet[IPV4_TTL_OFFSET] = 128;
+		packet[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_UDP;
+		WriteNet16(&packet[20 + UDP_LENGTH_OFFSET], (UINT16)(packet.size() - 20));
+		address = WINDIVERT_ADDRESS();
+		address.Outbound = 1;
+		return packet;
+	}
+
+	bool Open(const std::string& filter) override {
+		_shutdown = false;
+		_start = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		// A packet that didn't fit is handed out on the next call.
+		if (_nextLength == 0) {
+			if (!_waitForPacket(TIME_DATA::max()))
+				return false;
+			_nextLength = _build(_next);
+		}
+		if (length < _nextLength) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		std::memcpy(packet, _next, _nextLength);
+		*received = _nextLength;
+		_nextLength = 0;
+		*address = WINDIVERT_ADDRESS();
+		address->Outbound = 1;
+		return true;
+	}
+
+	bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) override {
+		if (!_waitForPacket(std::chrono::steady_clock::now() + timeout))
+			return false;
+		BYTE* packet = (BYTE*)packets;
+		UINT taken = 0;
+		*received = 0;
+		UINT64 due = std::min<UINT64>(_total, (UINT64)(std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count() * _packetsPerSecond) + 1);
+		while (taken < *count && _handedOut < due && length - *received >= sizeof(_next)) {
+			UINT packetLength = _build(packet + *received);
+			addresses[taken] = WINDIVERT_ADDRESS();
+			addresses[taken].Outbound = 1;
+			*received += packetLength;
+			taken += 1;
+		}
+		if (taken == 0) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		*count = taken;
+		return true;
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		const BYTE* data = (const BYTE*)packet;
+		size_t kind = std::min<size_t>(ReadNet16(data + 4), (size_t)AckStreamKind::Game);
+		std::lock_guard<std::mutex> lock(_sendMutex);
+		_sendCalls += 1;
+		_sentBytes += length;
+		_sent[kind] += 1;
+		if (kind == (size_t)AckStreamKind::Game)
+			return true;
+		size_t connection = (size_t)(ReadNet16(data + 20 + SRC_PORT_OFFSET) - 50000);
+		UINT32 ack = ReadNet32(data + 20 + TCP_ACK_OFFSET);
+		if (_sentAny[connection] && (INT32)(ack - _sentAcks[connection]) < 0)
+			_regressions += 1;
+		UINT16 window = ReadNet16(data + 20 + TCP_WINDOW_OFFSET);
+		if (_sentAny[connection] && window != _sentWindows[connection])
+			_windowChanges += 1;
+		_sentAcks[connection] = ack;
+		_sentWindows[connection] = window;
+		_sentAny[connection] = true;
+		return true;
+	}
+
+	bool Shutdown() override {
+		_shutdown = true;
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+
+	UINT64 Generated() const {
+		return _handedOut;
+	}
+
+	UINT64 Generated(AckStreamKind kind) const {
+		return _generated[(size_t)kind];
+	}
+
+	UINT64 Sent(AckStreamKind kind) const {
+		return _sent[(size_t)kind];
+	}
+
+	// The times a connection's window changed in the sent ACKs.
+	UINT64 WindowChanges() const {
+		return _windowChanges;
+	}
+
+	UINT64 SendCalls() const {
+		return _sendCalls;
+	}
+
+	UINT64 SentBytes() const {
+		return _sentBytes;
+	}
+
+	// The ACKs sent with a lower acknowledgment number than the one sent before them on the same connection.
+	UINT64 Regressions() const {
+		return _regressions;
+	}
+
+	// The connections whose last generated acknowledgment number wasn't the last one sent.
+	UINT64 StaleConnections() const {
+		UINT64 stale = 0;
+		for (size_t i = 0; i < _acks.size(); ++i) {
+			if (_connectionAcks[i] != 0 && _sentAcks[i] != _acks[i])
+				stale += 1;
+		}
+		return stale;
+	}
+};
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+#include "Platform.h"
+#include "Logging.h"
+#include "Clock.h"
+#include "PacketHeaders.h"
+#include "PacketDivert.h"
+
+// How many receives and sends are kept in flight at once.
+#define ASYNC_RECV_DEPTH 8
+#define ASYNC_SEND_DEPTH 8
+// The most packets and bytes a single receive or send moves.
+#define ASYNC_IO_PACKETS WINDIVERT_BATCH_MAX
+#define ASYNC_IO_BYTES (256 * 1024)
+
+// How the delayer receives and sends its packets.
+enum class IoMode {
+	// A receiver thread blocks in Recv and a sender thread sends the due packets.
+	Threads,
+	// One thread keeps receives and sends in flight and schedules the packets between their completions.
+	Async
+};
+
+enum class AsyncOp {
+	Recv,
+	Send
+};
+
+struct ASYNC_IO;
+
+// The OVERLAPPED of an operation, with a way back to the operation from the completion.
+struct ASYNC_OVERLAPPED {
+#ifdef _WIN32
+	OVERLAPPED overlapped;
+#endif
+	ASYNC_IO* io;
+};
+
+// A receive or send with the packets it moves. Stays at the same address while it is in flight.
+struct ASYNC_IO {
+	ASYNC_OVERLAPPED overlapped;
+	AsyncOp op = AsyncOp::Recv;
+	// The packets follow each other in the buffer, with an address for each.
+	std::vector<BYTE> buffer;
+	std::vector<WINDIVERT_ADDRESS> addresses;
+	// The bytes and packets to send, or that were received.
+	UINT length = 0;
+	UINT count = 0;
+	// The bytes of addresses the driver wrote for a receive.
+	UINT addressLength = 0;
+	// The bytes of a failed send that went out before it failed.
+	UINT sent = 0;
+	bool success = false;
+	DWORD error = ERROR_SUCCESS;
+	// The divert supervisor's generation when the operation was started, so a failure is recovered from only once.
+	UINT64 generation = 0;
+
+	ASYNC_IO() : buffer(ASYNC_IO_BYTES), addresses(ASYNC_IO_PACKETS) {
+		overlapped.io = this;
+	}
+
+	ASYNC_IO(const ASYNC_IO&) = delete;
+	ASYNC_IO& operator=(const ASYNC_IO&) = delete;
+};
+
+// Runs receives and sends on a divert without blocking on them. The operations are started,
+// and the thread that started them collects their completions later. Not thread-safe.
+// An operation that fails to start is completed with its error, so every failure is handled in one place.
+class AsyncEngine {
+public:
+	virtual ~AsyncEngine() {}
+
+	// Starts using the divert's current handle. Called again after the divert has been reopened.
+	virtual bool Attach() = 0;
+
+	virtual void PostRecv(ASYNC_IO* io) = 0;
+
+	virtual void PostSend(ASYNC_IO* io) = 0;
+
+	// Waits until an operation completes or the deadline passes, and stores up to max completed operations.
+	// Returns how many were stored.
+	virtual UINT Wait(ASYNC_IO** completed, UINT max, TIME_DATA deadline) = 0;
+
+	// The operations started and not yet collected.
+	virtual UINT InFlight() const = 0;
+
+	// Waits for every operation in flight to end, so their buffers can be freed. The divert should be shut down first.
+	virtual void Drain() = 0;
+};
+
+#ifdef _WIN32
+// Starts overlapped WinDivertRecvEx and WinDivertSendEx calls on the driver handle and collects them
+// from an I/O completion port.
+class CompletionPortEngine : public AsyncEngine {
+private:
+	WinDivertHandle* _divert;
+	HANDLE _port = NULL;
+	// The handle last added to the port. A reopened handle has to be added again.
+	HANDLE _attached = INVALID_HANDLE_VALUE;
+	UINT _inFlight = 0;
+	// The operations that failed to start, completed on the next wait.
+	std::vector<ASYNC_IO*> _failed;
+
+	void _start(ASYNC_IO* io, BOOL started) {
+		DWORD error = GetLastError();
+		if (started || error == ERROR_IO_PENDING) {
+			_inFlight += 1;
+			return;
+		}
+		io->success = false;
+		io->error = error;
+		io->sent = 0;
+		_failed.push_back(io);
+	}
+
+public:
+	explicit CompletionPortEngine(WinDivertHandle* divert) : _divert(divert) {}
+
+	~CompletionPortEngine() {
+		if (_port != NULL)
+			CloseHandle(_port);
+	}
+
+	bool Attach() override {
+		HANDLE handle = _divert->Handle();
+		if (handle == _attached)
+			return true;
+		// The port outlives the handles added to it, so a reopened handle joins the same port.
+		HANDLE port = CreateIoCompletionPort(handle, _port, 0, 1);
+		if (port == NULL) {
+			PRINT_ERROR("CreateIoCompletionPort() failed with error code " << GetLastError() << ".");
+			return false;
+		}
+		_port = port;
+		_attached = handle;
+		return true;
+	}
+
+	void PostRecv(ASYNC_IO* io) override {
+		std::memset(&io->overlapped.overlapped, 0, sizeof(io->overlapped.overlapped));
+		io->op = AsyncOp::Recv;
+		io->addressLength = (UINT)(io->addresses.size() * sizeof(WINDIVERT_ADDRESS));
+		_start(io, WinDivertRecvEx(
+			_divert->Handle(), io->buffer.data(), (UINT)io->buffer.size(), NULL, 0,
+			io->addresses.data(), &io->addressLength, &io->overlapped.overlapped
+		));
+	}
+
+	void PostSend(ASYNC_IO* io) override {
+		std::memset(&io->overlapped.overlapped, 0, sizeof(io->overlapped.overlapped));
+		io->op = AsyncOp::Send;
+		_start(io, WinDivertSendEx(
+			_divert->Handle(), io->buffer.data(), io->length, NULL, 0,
+			io->addresses.data(), io->count * sizeof(WINDIVERT_ADDRESS), &io->overlapped.overlapped
+		));
+	}
+
+	UINT Wait(ASYNC_IO** completed, UINT max, TIME_DATA deadline) override {
+		UINT count = 0;
+		while (!_failed.empty() && count < max) {
+			completed[count++] = _failed.back();
+			_failed.pop_back();
+		}
+		// Only the first completion is waited for, the rest are collected if they are already there.
+		std::chrono::milliseconds wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		DWORD timeout = count != 0 || wait.count() <= 0 ? 0 : (DWORD)wait.count();
+		while (count < max && _inFlight > 0) {
+			DWORD bytes = 0;
+			ULONG_PTR key = 0;
+			LPOVERLAPPED overlapped = NULL;
+			BOOL success = GetQueuedCompletionStatus(_port, &bytes, &key, &overlapped, timeout);
+			if (overlapped == NULL)
+				break;
+			ASYNC_IO* io = ((ASYNC_OVERLAPPED*)overlapped)->io;
+			_inFlight -= 1;
+			io->success = success != FALSE;
+			io->error = success ? ERROR_SUCCESS : GetLastError();
+			// The driver doesn't report how much of a failed batch it injected, so all of it counts as unsent.
+			io->sent = 0;
+			if (io->op == AsyncOp::Recv) {
+				io->length = bytes;
+				io->count = io->addressLength / sizeof(WINDIVERT_ADDRESS);
+			}
+			completed[count++] = io;
+			timeout = 0;
+		}
+		return count;
+	}
+
+	UINT InFlight() const override {
+		return _inFlight + (UINT)_failed.size();
+	}
+
+	void Drain() override {
+		_failed.clear();
+		if (_inFlight == 0)
+			return;
+		CancelIoEx(_divert->Handle(), NULL);
+		while (_inFlight > 0) {
+			DWORD bytes = 0;
+			ULONG_PTR key = 0;
+			LPOVERLAPPED overlapped = NULL;
+			GetQueuedCompletionStatus(_port, &bytes, &key, &overlapped, 1000);
+			if (overlapped == NULL) {
+				PRINT_ERROR(_inFlight << " WinDivert operations didn't end after they were canceled.");
+				return;
+			}
+			_inFlight -= 1;
+		}
+	}
+};
+#endif
+
+// Runs the operations against a divert without overlapped calls. A receive completes when the divert's RecvBatch
+// returns packets within the wait, and a send completes as soon as it is posted. Used for the diverts that stand in
+// for the driver, whose packets are ready as soon as they are asked for.
+// After a send fails, the sends posted until the failure is collected fail without sending, so the packets are
+// sent again in the order they were posted in.
+class PollingEngine : public AsyncEngine {
+private:
+	PacketDivert* _divert;
+	// The receives waiting for packets, oldest first, like the requests queued on the driver.
+	std::deque<ASYNC_IO*> _recvs;
+	std::vector<ASYNC_IO*> _completed;
+	// The error of the failed send that hasn't been collected yet.
+	DWORD _sendError = ERROR_SUCCESS;
+
+public:
+	explicit PollingEngine(PacketDivert* divert) : _divert(divert) {}
+
+	bool Attach() override {
+		return true;
+	}
+
+	void PostRecv(ASYNC_IO* io) override {
+		io->op = AsyncOp::Recv;
+		_recvs.push_back(io);
+	}
+
+	void PostSend(ASYNC_IO* io) override {
+		io->op = AsyncOp::Send;
+		io->sent = 0;
+		if (_sendError != ERROR_SUCCESS) {
+			io->success = false;
+			io->error = _sendError;
+		}
+		else {
+			io->success = _divert->SendBatch(io->buffer.data(), io->length, io->addresses.data(), io->count, &io->sent);
+			io->error = io->success ? ERROR_SUCCESS : GetLastError();
+			if (!io->success)
+				_sendError = io->error;
+		}
+		_completed.push_back(io);
+	}
+
+	UINT Wait(ASYNC_IO** completed, UINT max, TIME_DATA deadline) override {
+		UINT count = 0;
+		while (!_completed.empty() && count < max) {
+			completed[count++] = _completed.front();
+			_completed.erase(_completed.begin());
+		}
+		if (_completed.empty())
+			_sendError = ERROR_SUCCESS;
+		while (count < max && !_recvs.empty()) {
+			ASYNC_IO* io = _recvs.front();
+			std::chrono::nanoseconds timeout = count != 0
+				? std::chrono::nanoseconds(0)
+				: std::max<std::chrono::nanoseconds>(std::chrono::nanoseconds(0), deadline - std::chrono::steady_clock::now());
+			io->count = (UINT)io->addresses.size();
+			io->success = _divert->RecvBatch(io->buffer.data(), (UINT)io->buffer.size(), &io->length, io->addresses.data(), &io->count, timeout);
+			io->error = io->success ? ERROR_SUCCESS : GetLastError();
+			if (!io->success && io->error == ERROR_TIMEOUT)
+				break;
+			_recvs.pop_front();
+			completed[count++] = io;
+		}
+		if (count == 0 && _recvs.empty())
+			std::this_thread::sleep_until(deadline);
+		return count;
+	}
+
+	UINT InFlight() const override {
+		return (UINT)(_recvs.size() + _completed.size());
+	}
+
+	void Drain() override {
+		_recvs.clear();
+		_completed.clear();
+		_sendError = ERROR_SUCCESS;
+	}
+};
+
+// Creates the engine for the divert: a completion port for the driver, and polling for the diverts that stand in for it.
+inline std::unique_ptr<AsyncEngine> CreateAsyncEngine(PacketDivert* divert) {
+#ifdef _WIN32
+	WinDivertHandle* handle = dynamic_cast<WinDivertHandle*>(divert);
+	if (handle != nullptr)
+		return std::unique_ptr<AsyncEngine>(new CompletionPortEngine(handle));
+#endif
+	return std::unique_ptr<AsyncEngine>(new PollingEngine(divert));
+}
+
+// Collects the packets the delayer sends into batches and posts each batch as one send on the engine,
+// so the sending code works the same with either I/O mode. A send only fails when the batch completes,
+// and the delayer then handles the batch's packets. The receiving functions aren't used.
+class AsyncSender : public PacketDivert {
+private:
+	AsyncEngine* _engine = nullptr;
+	// Sends through this divert directly when every batch is in flight.
+	PacketDivert* _divert = nullptr;
+	std::vector<std::unique_ptr<ASYNC_IO>> _ios;
+	std::vector<ASYNC_IO*> _free;
+	// The batch being filled, null if none is.
+	ASYNC_IO* _current = nullptr;
+	// The completions collected while waiting for a free batch, for the delayer to handle next.
+	std::vector<ASYNC_IO*> _deferred;
+
+	// The batches posted and not yet collected.
+	UINT _inFlight = 0;
+
+	// Waits for a send to complete so its batch can be filled again. The other completions are kept for the delayer.
+	bool _waitForFree() {
+		std::vector<ASYNC_IO*> completed(ASYNC_RECV_DEPTH + ASYNC_SEND_DEPTH);
+		while (_free.empty() && _inFlight > 0) {
+			UINT count = _engine->Wait(completed.data(), (UINT)completed.size(), std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+			for (UINT i = 0; i < count; ++i) {
+				if (completed[i]->op == AsyncOp::Send)
+					_inFlight -= 1;
+				// A failed batch still holds its packets until the delayer has handled them.
+				if (completed[i]->op == AsyncOp::Send && completed[i]->success)
+					_free.push_back(completed[i]);
+				else
+					_deferred.push_back(completed[i]);
+			}
+		}
+		return !_free.empty();
+	}
+
+public:
+	AsyncSender() {
+		for (UINT i = 0; i < ASYNC_SEND_DEPTH; ++i)
+			_ios.emplace_back(new ASYNC_IO());
+	}
+
+	// Sends through the engine, or directly through the divert if every batch is in flight.
+	void Reset(AsyncEngine* engine, PacketDivert* divert) {
+		_engine = engine;
+		_divert = divert;
+		_free.clear();
+		for (std::unique_ptr<ASYNC_IO>& io : _ios)
+			_free.push_back(io.get());
+		_current = nullptr;
+		_deferred.clear();
+		_inFlight = 0;
+	}
+
+	bool Open(const std::string& filter) override {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return false;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return false;
+	}
+
+	// Adds the packet to the current batch, posting the batch first if the packet doesn't fit.
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		if (_current != nullptr && (_current->count == _current->addresses.size() || _current->length + length > _current->buffer.size()))
+			Flush();
+		if (_current == nullptr) {
+			// With every batch in flight and nothing completing, the packet goes out on its own.
+			if (_free.empty() && !_waitForFree())
+				return _divert->Send(packet, length, address);
+			_current = _free.back();
+			_free.pop_back();
+			_current->length = 0;
+			_current->count = 0;
+		}
+		std::memcpy(_current->buffer.data() + _current->length, packet, length);
+		_current->addresses[_current->count] = *address;
+		_current->length += length;
+		_current->count += 1;
+		return true;
+	}
+
+	// Posts the current batch.
+	void Flush() {
+		if (_current == nullptr)
+			return;
+		if (_current->count != 0) {
+			_inFlight += 1;
+			_engine->PostSend(_current);
+		}
+		else
+			_free.push_back(_current);
+		_current = nullptr;
+	}
+
+	// Counts a send the delayer collected as completed.
+	void Collected() {
+		_inFlight -= 1;
+	}
+
+	// Gives a completed send's batch back to be filled again, once the delayer has handled it.
+	void Release(ASYNC_IO* io) {
+		_free.push_back(io);
+	}
+
+	// Takes the completions collected while waiting for a free batch.
+	void TakeDeferred(std::vector<ASYNC_IO*>& completed) {
+		completed.insert(completed.end(), _deferred.begin(), _deferred.end());
+		_deferred.clear();
+	}
+
+	bool Shutdown() override {
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+};
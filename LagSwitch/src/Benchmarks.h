@@ -0,0 +1,413 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <sstream>
+#include <functional>
+#include <random>
+#include "Platform.h"
+#include "Logging.h"
+#include "ThreadConfig.h"
+#include "Checksum.h"
+#include "PacketRewrite.h"
+#include "PacketCapture.h"
+#include "SpillQueue.h"
+#include "RuleEngine.h"
+
+// A summary of a set of measurements in microseconds.
+struct LATENCY_SUMMARY {
+	size_t count = 0;
+	double mean = 0;
+	double p50 = 0;
+	double p99 = 0;
+	double max = 0;
+};
+
+// Summarizes the given measurements. The vector is sorted in place.
+inline LATENCY_SUMMARY SummarizeMicroseconds(std::vector<double>& samples) {
+	LATENCY_SUMMARY summary;
+	if (samples.empty())
+		return summary;
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (double sample : samples)
+		sum += sample;
+	summary.count = samples.size();
+	summary.mean = sum / samples.size();
+	summary.p50 = samples[samples.size() / 2];
+	summary.p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+	summary.max = samples.back();
+	return summary;
+}
+
+// Prints a row of a latency summary table.
+// The row is formatted separately so the manipulators don't stick to the standard output.
+inline void PrintSummaryRow(const std::string& name, const LATENCY_SUMMARY& summary) {
+	std::ostringstream row;
+	row << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(10) << summary.mean << std::setw(10) << summary.p50
+		<< std::setw(10) << summary.p99 << std::setw(10) << summary.max
+		<< std::setw(10) << summary.count;
+	SYNC_COUT(row.str());
+}
+
+// Prints the header of a latency summary table with the unit of the measurements.
+inline void PrintSummaryHeader(const std::string& unit) {
+	std::ostringstream row;
+	row << std::left << std::setw(28) << ("Variant (" + unit + ")") << std::right
+		<< std::setw(10) << "mean" << std::setw(10) << "p50"
+		<< std::setw(10) << "p99" << std::setw(10) << "max" << std::setw(10) << "samples";
+	SYNC_COUT(row.str());
+}
+
+// Measures how late a thread wakes up from the sleep the sender loop uses between checks.
+// Runs for the given duration with the given thread configuration while hog threads spin on every CPU.
+inline LATENCY_SUMMARY MeasureWakeUpJitter(const THREAD_CONFIG& config, std::chrono::milliseconds sleepTime, std::chrono::seconds duration) {
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> hogs;
+	unsigned int hogCount = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned int i = 0; i < hogCount; ++i) {
+		hogs.emplace_back([&stop] {
+			volatile unsigned long long spins = 0;
+			while (!stop.load(std::memory_order_relaxed))
+				spins = spins + 1;
+		});
+	}
+
+	std::vector<double> lateness;
+	std::thread measurer([&] {
+		ScopedThreadConfig threadConfig(config, "benchmark");
+		auto end = std::chrono::steady_clock::now() + duration;
+		while (std::chrono::steady_clock::now() < end) {
+			auto before = std::chrono::steady_clock::now();
+			std::this_thread::sleep_for(sleepTime);
+			auto late = std::chrono::steady_clock::now() - before - sleepTime;
+			lateness.push_back(std::chrono::duration<double, std::micro>(late).count());
+		}
+	});
+	measurer.join();
+
+	stop = true;
+	for (std::thread& hog : hogs)
+		hog.join();
+	return SummarizeMicroseconds(lateness);
+}
+
+// Compares the wake-up jitter of a thread with default scheduling and with the given configuration under a CPU hog.
+inline void RunJitterBenchmark(THREAD_CONFIG pinned, std::chrono::milliseconds sleepTime, std::chrono::seconds duration) {
+	// Without an explicit configuration, pin to the last allowed CPU with the highest priority.
+	if (pinned.affinityMask == 0 && pinned.priority == ThreadPriority::Normal && !pinned.mmcss) {
+		uint64_t processMask = GetProcessCpuMask();
+		for (int cpu = 63; cpu >= 0; --cpu) {
+			if (processMask & ((uint64_t)1 << cpu)) {
+				pinned.affinityMask = (uint64_t)1 << cpu;
+				break;
+			}
+		}
+		pinned.priority = ThreadPriority::TimeCritical;
+		pinned.mmcss = true;
+	}
+	PRINT_INFO(
+		"Measuring wake-up lateness of a " << sleepTime.count() << " ms sleep for " << duration.count()
+		<< " s per variant with " << std::max(1u, std::thread::hardware_concurrency()) << " hog threads..."
+	);
+	LATENCY_SUMMARY unpinned = MeasureWakeUpJitter(THREAD_CONFIG(), sleepTime, duration);
+	LATENCY_SUMMARY configured = MeasureWakeUpJitter(pinned, sleepTime, duration);
+	PrintSummaryHeader("us late");
+	PrintSummaryRow("default scheduling", unpinned);
+	PrintSummaryRow("pinned and prioritized", configured);
+}
+
+// Runs the operation repeatedly for the given time and returns the average time per call in nanoseconds.
+inline double MeasureNanosecondsPerCall(const std::function<void()>& operation, std::chrono::milliseconds duration) {
+	// Calls are timed in batches so reading the clock doesn't dominate short operations.
+	const int batch = 1024;
+	size_t calls = 0;
+	auto start = std::chrono::steady_clock::now();
+	auto end = start + duration;
+	auto now = start;
+	while (now < end) {
+		for (int i = 0; i < batch; ++i)
+			operation();
+		calls += batch;
+		now = std::chrono::steady_clock::now();
+	}
+	return std::chrono::duration<double, std::nano>(now - start).count() / calls;
+}
+
+// Builds an IPv4 UDP packet of the given total length with valid checksums.
+inline std::vector<BYTE> MakeUdpPacket(UINT length, WINDIVERT_ADDRESS& address) {
+	std::vector<BYTE> packet(length);
+	for (UINT i = 0; i < length; ++i)
+		packet[i] = (BYTE)(i * 7 + 3);
+	packet[0] = 0x45;
+	packet[1] = 0;
+	WriteNet16(&packet[2], (UINT16)length);
+	WriteNet16(&packet[IPV4_FRAGMENT_OFFSET], 0x4000);
+	packet[IPV4_TTL_OFFSET] = 128;
+	packet[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_UDP;
+	WriteNet16(&packet[20 + UDP_LENGTH_OFFSET], (UINT16)(length - 20));
+	address = WINDIVERT_ADDRESS();
+	address.Outbound = 1;
+	CalcPacketChecksums(packet.data(), length, &address);
+	return packet;
+}
+
+// Compares incremental checksum updates, the SSE2 and scalar full checksums, and WinDivertHelperCalcChecksums.
+inline void RunChecksumBenchmark(std::chrono::seconds duration) {
+	const UINT sizes[] = { 64, 576, 1500 };
+	// Every variant and size gets an equal share of the duration.
+	std::chrono::milliseconds share = std::chrono::duration_cast<std::chrono::milliseconds>(duration) / (6 * 3);
+	PRINT_INFO("Measuring checksum costs for " << duration.count() << " s" << (CHECKSUM_SSE2 ? " (SSE2 enabled)" : " (SSE2 unavailable)") << "...");
+
+	PacketRewriter rewriter;
+	UINT32 testServer = 0;
+	ParseIPv4("127.0.0.1", testServer);
+	rewriter.AddEdit(RewriteField::DstAddr, testServer);
+	rewriter.AddEdit(RewriteField::DstPort, 27015);
+
+	volatile UINT16 sink = 0;
+	std::ostringstream header;
+	header << std::left << std::setw(36) << "Variant (ns per packet)" << std::right;
+	for (UINT size : sizes)
+		header << std::setw(10) << (std::to_string(size) + " B");
+	SYNC_COUT(header.str());
+
+	auto row = [&](const std::string& name, const std::function<void(std::vector<BYTE>&, WINDIVERT_ADDRESS&)>& operation) {
+		std::ostringstream line;
+		line << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(1);
+		for (UINT size : sizes) {
+			WINDIVERT_ADDRESS address;
+			std::vector<BYTE> packet = MakeUdpPacket(size, address);
+			line << std::setw(10) << MeasureNanosecondsPerCall([&] { operation(packet, address); }, share);
+		}
+		SYNC_COUT(line.str());
+	};
+
+	row("rewrite, incremental checksums", [&](std::vector<BYTE>& packet, WINDIVERT_ADDRESS& address) {
+		rewriter.Apply(packet.data(), (UINT)packet.size(), &address);
+	});
+	row("rewrite, full checksums", [&](std::vector<BYTE>& packet, WINDIVERT_ADDRESS& address) {
+		rewriter.Apply(packet.data(), (UINT)packet.size(), &address);
+		CalcPacketChecksums(packet.data(), (UINT)packet.size(), &address);
+	});
+	row("full checksums", [&](std::vector<BYTE>& packet, WINDIVERT_ADDRESS& address) {
+		CalcPacketChecksums(packet.data(), (UINT)packet.size(), &address);
+	});
+	row("sum of the whole packet", [&](std::vector<BYTE>& packet, WINDIVERT_ADDRESS& address) {
+		sink = ChecksumFold(ChecksumAdd(packet.data(), packet.size(), 0));
+	});
+	row("sum of the whole packet, scalar", [&](std::vector<BYTE>& packet, WINDIVERT_ADDRESS& address) {
+		sink = ChecksumFold(ChecksumAddScalar(packet.data(), packet.size(), 0));
+	});
+#ifdef _WIN32
+	row("WinDivertHelperCalcChecksums", [&](std::vector<BYTE>& packet, WINDIVERT_ADDRESS& address) {
+		WinDivertHelperCalcChecksums(packet.data(), (UINT)packet.size(), &address, 0);
+	});
+#endif
+	(void)sink;
+}
+
+// Compares classifying packets with compiled rules to checking the rules one at a time.
+// The rules and packets are random but always the same, with ports and addresses drawn from ranges small enough
+// that the packets match rules at every depth of the list, and about half match none.
+inline void RunRuleBenchmark(size_t ruleCount, std::chrono::seconds duration) {
+	std::mt19937 random(12345);
+	auto between = [&](UINT min, UINT max) {
+		return std::uniform_int_distribution<UINT>(min, max)(random);
+	};
+	auto address = [&](UINT prefix) {
+		return "10." + std::to_string(between(0, 3)) + "." + std::to_string(between(0, 255)) + ".0/" + std::to_string(prefix);
+	};
+
+	RuleEngine rules;
+	for (size_t i = 0; i < ruleCount; ++i) {
+		std::ostringstream text;
+		UINT protocol = between(0, 2);
+		text << (protocol == 0 ? "udp" : protocol == 1 ? "tcp" : "proto=17");
+		UINT port = between(1000, 9000);
+		text << ",dst-port=" << port << "-" << port + between(0, 50);
+		if (between(0, 2) == 0)
+			text << ",dst-addr=" << address(between(16, 24));
+		if (between(0, 3) == 0)
+			text << ",src-addr=" << address(between(20, 24));
+		if (between(0, 4) == 0)
+			text << ",size=" << between(40, 200) << "-" << between(200, 1500);
+		if (protocol == 1 && between(0, 4) == 0)
+			text << (between(0, 1) == 0 ? ",+syn" : ",-ack");
+		if (between(0, 5) == 0)
+			text << ",dscp=" << between(0, 31) << "-" << between(32, 63);
+		text << ",delay=" << between(10, 200);
+		PACKET_RULE rule;
+		std::string error;
+		if (!ParseRule(text.str(), rule, error)) {
+			PRINT_ERROR("The generated rule \"" << text.str() << "\" is invalid: " << error);
+			return;
+		}
+		rules.AddRule(rule);
+	}
+	auto compileStart = std::chrono::steady_clock::now();
+	rules.Compile();
+	double compileMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - compileStart).count();
+
+	std::vector<std::vector<BYTE>> packets;
+	for (int i = 0; i < 4096; ++i) {
+		WINDIVERT_ADDRESS packetAddress;
+		std::vector<BYTE> packet = MakeUdpPacket(between(40, 1400), packetAddress);
+		bool tcp = between(0, 1) == 0;
+		packet[IPV4_PROTOCOL_OFFSET] = tcp ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+		for (int part = 0; part < 4; ++part) {
+			packet[IPV4_SRC_ADDR_OFFSET + part] = (BYTE)(part == 0 ? 10 : part == 1 ? between(0, 3) : between(0, 255));
+			packet[IPV4_DST_ADDR_OFFSET + part] = (BYTE)(part == 0 ? 10 : part == 1 ? between(0, 3) : between(0, 255));
+		}
+		WriteNet16(&packet[20 + SRC_PORT_OFFSET], (UINT16)between(1024, 65535));
+		WriteNet16(&packet[20 + DST_PORT_OFFSET], (UINT16)between(1000, 9100));
+		packet[IPV4_TOS_OFFSET] = (BYTE)(between(0, 63) << 2);
+		if (tcp) {
+			packet[20 + TCP_DATA_OFFSET_OFFSET] = 0x50;
+			packet[20 + TCP_FLAGS_OFFSET] = (BYTE)(between(0, 1) == 0 ? TCP_FLAG_SYN : TCP_FLAG_ACK);
+		}
+		packets.push_back(packet);
+	}
+
+	// Both ways of matching have to agree before their speed means anything.
+	size_t matched = 0;
+	double depth = 0;
+	// The single flow is one that matches no rule, so every rule has to be ruled out for it.
+	size_t flowPacket = 0;
+	for (size_t i = 0; i < packets.size(); ++i) {
+		const std::vector<BYTE>& packet = packets[i];
+		int compiled = rules.Match(packet.data(), (UINT)packet.size());
+		if (compiled != rules.MatchLinear(packet.data(), (UINT)packet.size())) {
+			PRINT_ERROR("The compiled rules matched rule " << compiled << " instead of rule " << rules.MatchLinear(packet.data(), (UINT)packet.size()) << ".");
+			return;
+		}
+		if (compiled >= 0) {
+			matched += 1;
+			depth += compiled;
+		}
+		else
+			flowPacket = i;
+	}
+	PRINT_INFO(
+		"Compiled " << ruleCount << " rules in " << compileMs << " ms. "
+		<< matched * 100 / packets.size() << "% of the packets match a rule, on average rule "
+		<< (matched > 0 ? (size_t)(depth / matched) : 0) << "."
+	);
+
+	// Going through every packet keeps few of the bitmaps cached, while a single flow keeps hitting the same ones.
+	std::chrono::milliseconds share = std::chrono::duration_cast<std::chrono::milliseconds>(duration) / 2;
+	volatile int sink = 0;
+	SYNC_COUT(std::left << std::setw(36) << "Variant (ns per packet)" << std::right << std::setw(14) << "all packets" << std::setw(14) << "one flow");
+	auto row = [&](const std::string& name, const std::function<int(const std::vector<BYTE>&)>& match) {
+		std::ostringstream line;
+		line << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(1);
+		for (size_t flows : { packets.size(), (size_t)1 }) {
+			size_t next = 0;
+			line << std::setw(14) << MeasureNanosecondsPerCall([&] {
+				sink = match(packets[flows == 1 ? flowPacket : next++ % flows]);
+			}, share / 2);
+		}
+		SYNC_COUT(line.str());
+	};
+	row("compiled rules", [&](const std::vector<BYTE>& packet) {
+		return rules.Match(packet.data(), (UINT)packet.size());
+	});
+	row("one rule at a time", [&](const std::vector<BYTE>& packet) {
+		return rules.MatchLinear(packet.data(), (UINT)packet.size());
+	});
+	(void)sink;
+}
+
+// Measures what capturing costs the thread that releases packets at the given rate.
+// Each Capture() call is timed on its own, with the cost of reading the clock measured and subtracted.
+inline void RunCaptureBenchmark(const std::string& path, UINT packetsPerSecond, std::chrono::seconds duration) {
+	const UINT packetLength = 1000;
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(packetLength, address);
+
+	// Measure the cost of an empty timed region first.
+	std::vector<double> empty;
+	for (int i = 0; i < 100000; ++i) {
+		auto before = std::chrono::steady_clock::now();
+		auto after = std::chrono::steady_clock::now();
+		empty.push_back(std::chrono::duration<double, std::nano>(after - before).count());
+	}
+	double clockCost = SummarizeMicroseconds(empty).p50;
+
+	PacketCapture capture;
+	if (!capture.Open(path, 0, THREAD_CONFIG()))
+		return;
+	PRINT_INFO("Capturing " << packetLength << " byte packets at " << packetsPerSecond << " pps to \"" << path << "\" for " << duration.count() << " s...");
+
+	std::vector<double> costs;
+	costs.reserve((size_t)packetsPerSecond * (size_t)duration.count());
+	// Release the packets in 1 ms ticks, like a sender that wakes up periodically.
+	UINT perTick = std::max(1u, packetsPerSecond / 1000);
+	auto start = std::chrono::steady_clock::now();
+	auto tick = start;
+	while (tick - start < duration) {
+		for (UINT i = 0; i < perTick; ++i) {
+			auto before = std::chrono::steady_clock::now();
+			capture.Capture(packet.data(), packetLength, true, before - std::chrono::milliseconds(100), before, CaptureResult::Sent);
+			auto after = std::chrono::steady_clock::now();
+			costs.push_back(std::max(0.0, std::chrono::duration<double, std::nano>(after - before).count() - clockCost));
+		}
+		tick += std::chrono::milliseconds(1);
+		std::this_thread::sleep_until(tick);
+	}
+	auto closeStart = std::chrono::steady_clock::now();
+	capture.Close();
+	double drainMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - closeStart).count();
+
+	LATENCY_SUMMARY summary = SummarizeMicroseconds(costs);
+	PrintSummaryHeader("ns per Capture()");
+	PrintSummaryRow("capture enabled", summary);
+	double busyFraction = summary.mean * packetsPerSecond / 1e9;
+	PRINT_INFO(
+		"Written: " << capture.Written() << ", missed: " << capture.Missed()
+		<< ", sender time spent capturing: " << busyFraction * 100 << " %, final drain: " << drainMs << " ms."
+	);
+}
+
+// Measures how fast packets can be spilled and read back, appending for up to the duration or
+// the given amount of bytes and then reading everything back. The segment files go to the given directory.
+inline void RunSpillBenchmark(const std::string& directory, UINT64 maxBytes, std::chrono::seconds duration) {
+	const UINT packetLength = 1400;
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(packetLength, address);
+	SpillQueue spill;
+	spill.SetDirectory(directory);
+	PRINT_INFO("Spilling " << packetLength << " byte packets for up to " << duration.count() << " s or " << maxBytes / (1024 * 1024) << " MB...");
+
+	auto start = std::chrono::steady_clock::now();
+	auto end = start + duration;
+	UINT64 count = 0;
+	while (spill.Bytes() + packetLength <= maxBytes && (count % 1024 != 0 || std::chrono::steady_clock::now() < end)) {
+		if (!spill.Push(packet.data(), packetLength, &address, (INT64)count, (INT64)count))
+			return;
+		count += 1;
+	}
+	double writeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	UINT64 checksum = 0;
+	while (!spill.IsEmpty()) {
+		const SPILL_RECORD* record = spill.Front();
+		if (record == nullptr)
+			return;
+		// Touch the data like copying it back to the heap would.
+		checksum += ChecksumAdd(record + 1, record->length, 0);
+		spill.Pop();
+	}
+	double readSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double megabytes = (double)count * packetLength / 1e6;
+	PRINT_INFO("Appended " << count << " packets at " << megabytes / writeSeconds << " MB/s (" << writeSeconds * 1e9 / count << " ns per packet).");
+	PRINT_INFO("Read back " << count << " packets at " << megabytes / readSeconds << " MB/s (" << readSeconds * 1e9 / count << " ns per packet).");
+	PRINT_TRACE("Checksum of the read back data: " << checksum << ".");
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+// A fixed-size lock-free queue that any number of threads can push to and pop from (Vyukov's bounded MPMC queue).
+// Pushing to a full queue and popping from an empty one fail immediately instead of waiting,
+// so the data-plane threads never block on it.
+template<typename T>
+class BoundedQueue {
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> _cells;
+	size_t _mask;
+
+	// The positions are padded onto separate cache lines so producers and consumers don't contend.
+	char _padding0[64];
+	std::atomic<size_t> _pushPosition;
+	char _padding1[64];
+	std::atomic<size_t> _popPosition;
+	char _padding2[64];
+
+public:
+	// The capacity is rounded up to a power of two.
+	explicit BoundedQueue(size_t capacity = 2) {
+		Reset(capacity);
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// Empties the queue and changes its capacity. Not thread-safe.
+	void Reset(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+		_cells.reset(new Cell[size]);
+		_mask = size - 1;
+		for (size_t i = 0; i < size; ++i)
+			_cells[i].sequence.store(i, std::memory_order_relaxed);
+		_pushPosition.store(0, std::memory_order_relaxed);
+		_popPosition.store(0, std::memory_order_relaxed);
+	}
+
+	size_t Capacity() const {
+		return _mask + 1;
+	}
+
+	// Adds an element to the queue. Returns false if the queue was full.
+	bool TryPush(const T& data) {
+		size_t position = _pushPosition.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &_cells[position & _mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+			if (difference == 0) {
+				if (_pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = _pushPosition.load(std::memory_order_relaxed);
+		}
+		cell->data = data;
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Removes the oldest element from the queue. Returns false if the queue was empty.
+	bool TryPop(T& data) {
+		size_t position = _popPosition.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &_cells[position & _mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)(position + 1);
+			if (difference == 0) {
+				if (_popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = _popPosition.load(std::memory_order_relaxed);
+		}
+		data = cell->data;
+		cell->sequence.store(position + _mask + 1, std::memory_order_release);
+		return true;
+	}
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstring>
+#include "Platform.h"
+#include "PacketHeaders.h"
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHECKSUM_SSE2 1
+#include <emmintrin.h>
+#else
+#define CHECKSUM_SSE2 0
+#endif
+
+// Internet checksums (RFC 1071) and their incremental updates (RFC 1624).
+// The ones' complement sum doesn't depend on byte order, so the words are summed in memory order
+// and the result can be stored into the packet as is.
+
+// Folds a 64-bit ones' complement accumulator into 16 bits.
+inline UINT16 ChecksumFold(UINT64 sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (UINT16)sum;
+}
+
+// Adds the buffer to a ones' complement accumulator one 32-bit word at a time.
+inline UINT64 ChecksumAddScalar(const void* buffer, size_t length, UINT64 sum) {
+	const BYTE* data = (const BYTE*)buffer;
+	while (length >= 4) {
+		UINT32 word;
+		std::memcpy(&word, data, sizeof(word));
+		sum += word;
+		data += 4;
+		length -= 4;
+	}
+	if (length >= 2) {
+		sum += ReadWord(data);
+		data += 2;
+		length -= 2;
+	}
+	// An odd byte is padded with a zero byte after it, which is the low byte on little-endian machines.
+	if (length == 1)
+		sum += data[0];
+	return sum;
+}
+
+// Adds the buffer to a ones' complement accumulator, 32 bytes at a time with SSE2 when available.
+inline UINT64 ChecksumAdd(const void* buffer, size_t length, UINT64 sum) {
+#if CHECKSUM_SSE2
+	const BYTE* data = (const BYTE*)buffer;
+	if (length >= 32) {
+		const __m128i zero = _mm_setzero_si128();
+		// Each 64-bit lane sums 32-bit words, so the lanes can't overflow for any packet size.
+		__m128i accumulator0 = _mm_setzero_si128();
+		__m128i accumulator1 = _mm_setzero_si128();
+		while (length >= 32) {
+			__m128i first = _mm_loadu_si128((const __m128i*)data);
+			__m128i second = _mm_loadu_si128((const __m128i*)(data + 16));
+			accumulator0 = _mm_add_epi64(accumulator0, _mm_unpacklo_epi32(first, zero));
+			accumulator1 = _mm_add_epi64(accumulator1, _mm_unpackhi_epi32(first, zero));
+			accumulator0 = _mm_add_epi64(accumulator0, _mm_unpacklo_epi32(second, zero));
+			accumulator1 = _mm_add_epi64(accumulator1, _mm_unpackhi_epi32(second, zero));
+			data += 32;
+			length -= 32;
+		}
+		UINT64 lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, accumulator0);
+		_mm_storeu_si128((__m128i*)(lanes + 2), accumulator1);
+		// Fold each lane before adding them up so the total can't overflow.
+		sum += ChecksumFold(lanes[0]);
+		sum += ChecksumFold(lanes[1]);
+		sum += ChecksumFold(lanes[2]);
+		sum += ChecksumFold(lanes[3]);
+	}
+	return ChecksumAddScalar(data, length, sum);
+#else
+	return ChecksumAddScalar(buffer, length, sum);
+#endif
+}
+
+// Calculates the checksum of a buffer.
+inline UINT16 Checksum(const void* buffer, size_t length) {
+	return (UINT16)~ChecksumFold(ChecksumAdd(buffer, length, 0));
+}
+
+// Updates a checksum after a 16-bit word it covers changed from the old value to the new one (RFC 1624, eqn. 3).
+inline UINT16 ChecksumAdjust(UINT16 checksum, UINT16 oldWord, UINT16 newWord) {
+	UINT32 sum = (UINT16)~checksum;
+	sum += (UINT16)~oldWord;
+	sum += newWord;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (UINT16)~sum;
+}
+
+// Gets the ones' complement sum of the TCP/UDP pseudo header.
+inline UINT64 PseudoHeaderSum(const PACKET_HEADERS& headers) {
+	UINT64 sum = 0;
+	if (headers.ipv6)
+		sum = ChecksumAddScalar(headers.ip + IPV6_SRC_ADDR_OFFSET, 32, sum);
+	else
+		sum = ChecksumAddScalar(headers.ip + IPV4_SRC_ADDR_OFFSET, 8, sum);
+	// The protocol and the length are added as big-endian words.
+	BYTE tail[4];
+	WriteNet16(tail, (UINT16)headers.protocol);
+	WriteNet16(tail + 2, (UINT16)headers.transportLength);
+	return ChecksumAddScalar(tail, sizeof(tail), sum);
+}
+
+// Recalculates the IPv4, TCP, and UDP checksums of a packet from scratch and sets the matching address flags.
+// Fragmented transport checksums cover the whole datagram, so they are left alone, as are ICMP checksums,
+// which no rewrite affects. Returns false if the packet couldn't be parsed.
+inline bool CalcPacketChecksums(PVOID packet, UINT length, WINDIVERT_ADDRESS* address) {
+	PACKET_HEADERS headers;
+	if (!ParsePacketHeaders(packet, length, headers))
+		return false;
+	if (!headers.ipv6) {
+		WriteWord(headers.ip + IPV4_CHECKSUM_OFFSET, 0);
+		WriteWord(headers.ip + IPV4_CHECKSUM_OFFSET, Checksum(headers.ip, headers.ipHeaderLength));
+		if (address != nullptr)
+			address->IPChecksum = 1;
+	}
+	if (headers.transport == nullptr || headers.fragment)
+		return true;
+
+	UINT checksumOffset = headers.protocol == IP_PROTOCOL_TCP ? TCP_CHECKSUM_OFFSET : UDP_CHECKSUM_OFFSET;
+	WriteWord(headers.transport + checksumOffset, 0);
+	UINT64 sum = PseudoHeaderSum(headers);
+	UINT16 checksum = (UINT16)~ChecksumFold(ChecksumAdd(headers.transport, headers.transportLength, sum));
+	// A zero UDP checksum means no checksum, so it is sent as all ones instead.
+	if (headers.protocol == IP_PROTOCOL_UDP && checksum == 0)
+		checksum = 0xFFFF;
+	WriteWord(headers.transport + checksumOffset, checksum);
+	if (address != nullptr) {
+		if (headers.protocol == IP_PROTOCOL_TCP)
+			address->TCPChecksum = 1;
+		else
+			address->UDPChecksum = 1;
+	}
+	return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+typedef std::chrono::time_point<std::chrono::steady_clock> TIME_DATA;
+
+// The time source of the delayer. Everything that schedules packets reads the time and waits through a clock,
+// so the scheduling can be run against simulated time instead of the system's.
+class Clock {
+public:
+	virtual ~Clock() {}
+
+	virtual TIME_DATA Now() = 0;
+
+	// Waits until the given time has been reached.
+	virtual void SleepUntil(TIME_DATA time) = 0;
+
+	void SleepFor(std::chrono::nanoseconds duration) {
+		SleepUntil(Now() + duration);
+	}
+};
+
+// The steady system clock.
+class SystemClock : public Clock {
+public:
+	TIME_DATA Now() override {
+		return std::chrono::steady_clock::now();
+	}
+
+	void SleepUntil(TIME_DATA time) override {
+		std::this_thread::sleep_until(time);
+	}
+};
+
+// A clock that only moves when it is advanced. Sleeping on it jumps straight to the wake-up time,
+// so a simulation runs as fast as its events can be processed and always gives the same times.
+// It is not thread-safe and should only be used by a single thread.
+class VirtualClock : public Clock {
+private:
+	TIME_DATA _now;
+
+public:
+	VirtualClock() : _now() {}
+
+	TIME_DATA Now() override {
+		return _now;
+	}
+
+	void SleepUntil(TIME_DATA time) override {
+		AdvanceTo(time);
+	}
+
+	// Moves the clock forward to the given time. The clock never moves backwards.
+	void AdvanceTo(TIME_DATA time) {
+		if (time > _now)
+			_now = time;
+	}
+};
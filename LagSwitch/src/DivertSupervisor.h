@@ -0,0 +1,193 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "Platform.h"
+#include "Logging.h"
+#include "PacketDivert.h"
+
+// The first and the longest wait between retries. The wait doubles on every failure in a row.
+#define SUPERVISOR_MIN_BACKOFF std::chrono::milliseconds(1)
+#define SUPERVISOR_MAX_BACKOFF std::chrono::milliseconds(500)
+// How many transient errors in a row are retried before the handle is reopened.
+#define SUPERVISOR_TRANSIENT_LIMIT 16
+// How often a wait checks whether the supervisor is stopping.
+#define SUPERVISOR_STOP_CHECK std::chrono::milliseconds(10)
+
+// How an error from the divert is handled.
+enum class DivertFault {
+	// The call is retried as it is after a short wait.
+	Transient,
+	// The packet itself was rejected. It is skipped and counted, and the rest are sent.
+	BadPacket,
+	// The handle no longer works and has to be reopened.
+	Handle,
+	// The handle was shut down. Unless the delayer is deactivating, it is reopened.
+	Shutdown
+};
+
+inline const char* DivertFaultName(DivertFault fault) {
+	switch (fault) {
+	case DivertFault::Transient:
+		return "transient";
+	case DivertFault::BadPacket:
+		return "bad packet";
+	case DivertFault::Handle:
+		return "handle";
+	default:
+		return "shutdown";
+	}
+}
+
+// Classifies an error from receiving a packet. ERROR_INSUFFICIENT_BUFFER is handled by the receiver before this.
+// Unknown errors are treated as transient, and reopen the handle if they keep coming.
+inline DivertFault ClassifyRecvError(DWORD error) {
+	switch (error) {
+	case ERROR_NO_DATA:
+		return DivertFault::Shutdown;
+	case ERROR_INVALID_HANDLE:
+	case ERROR_OPERATION_ABORTED:
+		return DivertFault::Handle;
+	default:
+		return DivertFault::Transient;
+	}
+}
+
+// Classifies an error from sending a packet.
+// WinDivert fails with ERROR_HOST_UNREACHABLE for packets it can't route, and with ERROR_INVALID_PARAMETER
+// or ERROR_INVALID_DATA for packets it can't parse, so sending them again wouldn't help.
+inline DivertFault ClassifySendError(DWORD error) {
+	switch (error) {
+	case ERROR_INVALID_PARAMETER:
+	case ERROR_INVALID_DATA:
+	case ERROR_HOST_UNREACHABLE:
+		return DivertFault::BadPacket;
+	case ERROR_NO_DATA:
+	case ERROR_INVALID_HANDLE:
+	case ERROR_OPERATION_ABORTED:
+		return DivertFault::Handle;
+	default:
+		return DivertFault::Transient;
+	}
+}
+
+// Keeps the divert working through errors. The receiver and sender report their errors to it, and it waits
+// before they retry, or closes and reopens the handle with the same filter while both threads keep running.
+// The packet queues aren't touched, so the held packets keep their send times through a reopen.
+// A thread remembers the generation before its call, so when both threads fail on the same broken handle,
+// only the first one reopens it.
+class DivertSupervisor {
+private:
+	PacketDivert* _divert = nullptr;
+	std::string _filter;
+	// Held while reopening.
+	std::mutex _mutex;
+	std::atomic<UINT64> _generation{ 0 };
+	std::atomic<bool> _stopping{ false };
+
+	std::atomic<UINT64> _retried{ 0 };
+	std::atomic<UINT64> _skipped{ 0 };
+	std::atomic<UINT64> _reopens{ 0 };
+
+	// Sleeps for the given time. Returns false if the supervisor started stopping meanwhile.
+	bool _sleep(std::chrono::milliseconds duration) {
+		auto end = std::chrono::steady_clock::now() + duration;
+		while (!_stopping) {
+			auto now = std::chrono::steady_clock::now();
+			if (now >= end)
+				return true;
+			std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(end - now, SUPERVISOR_STOP_CHECK));
+		}
+		return false;
+	}
+
+	static std::chrono::milliseconds _backoff(UINT failures) {
+		UINT shift = std::min<UINT>(failures > 0 ? failures - 1 : 0, 16);
+		return std::min(SUPERVISOR_MIN_BACKOFF * (1 << shift), SUPERVISOR_MAX_BACKOFF);
+	}
+
+public:
+	// Starts supervising a divert that was opened with the given filter.
+	void Start(PacketDivert* divert, const std::string& filter) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_divert = divert;
+		_filter = filter;
+		_stopping = false;
+		_retried = 0;
+		_skipped = 0;
+		_reopens = 0;
+	}
+
+	// Stops retrying and reopening. Waits for a reopen in progress, so the handle can be shut down after this.
+	void Stop() {
+		_stopping = true;
+		std::lock_guard<std::mutex> lock(_mutex);
+	}
+
+	// Changes every time the handle is reopened.
+	UINT64 Generation() const {
+		return _generation;
+	}
+
+	// Recovers from an error the thread got from a call it made in the given generation.
+	// A transient error is waited out, longer for every failure in a row, until there have been
+	// SUPERVISOR_TRANSIENT_LIMIT of them. After that, and for a broken handle, the handle is reopened.
+	// The thread's failure count is reset on success. Returns false if the supervisor is stopping.
+	bool Recover(DivertFault fault, UINT64 generation, UINT& failures) {
+		failures += 1;
+		if (fault == DivertFault::Transient && failures < SUPERVISOR_TRANSIENT_LIMIT) {
+			_retried += 1;
+			return _sleep(_backoff(failures));
+		}
+		failures = 0;
+		return Reopen(generation);
+	}
+
+	// Counts a packet that was skipped because the divert rejected it.
+	void CountSkipped() {
+		_skipped += 1;
+	}
+
+	// Closes and reopens the handle, unless it was already reopened after the given generation.
+	// Opening is retried with a growing wait until it succeeds. Returns false if the supervisor is stopping.
+	bool Reopen(UINT64 failedGeneration) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_stopping)
+			return false;
+		if (_generation != failedGeneration)
+			return true;
+		PRINT_ERROR("The WinDivert handle stopped working, reopening it.");
+		// Wake up a receiver blocked on the old handle before closing it.
+		_divert->Shutdown();
+		_divert->Close();
+		UINT attempts = 0;
+		while (!_divert->Open(_filter)) {
+			DWORD error = GetLastError();
+			attempts += 1;
+			std::chrono::milliseconds wait = _backoff(attempts);
+			PRINT_ERROR("WinDivertOpen() failed with error code " << error << " while reopening, retrying in " << wait.count() << " ms.");
+			if (!_sleep(wait))
+				return false;
+		}
+		_generation += 1;
+		_reopens += 1;
+		PRINT_INFO("Reopened the WinDivert handle.");
+		return true;
+	}
+
+	UINT64 Retried() const {
+		return _retried;
+	}
+
+	UINT64 Skipped() const {
+		return _skipped;
+	}
+
+	UINT64 Reopens() const {
+		return _reopens;
+	}
+};
@@ -0,0 +1,523 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include "Platform.h"
+#include "Logging.h"
+#include "Clock.h"
+#include "ThreadConfig.h"
+#include "BoundedQueue.h"
+#include "PacketCapture.h"
+#include "FlowProfiler.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// The magic bytes and version at the start of an event log file.
+#define EVENT_LOG_MAGIC "LSEVENTS"
+#define EVENT_LOG_VERSION 1
+// Every block takes this many bytes of the file, so every block starts at a multiple of the 64 KB that the views
+// of a file mapping have to start at on Windows. The file header takes the place of the first block.
+#define EVENT_LOG_BLOCK_BYTES (64 * 1024)
+#define EVENT_LOG_BLOCK_HEADER_BYTES 64
+// How many events a block holds. An event takes 15 bytes, spread over the columns.
+#define EVENT_LOG_BLOCK_ROWS 4360
+// Where each column starts in a block: the capture times, the held times, the lengths, the flow hashes, and the actions.
+#define EVENT_LOG_CAPTURED_OFFSET EVENT_LOG_BLOCK_HEADER_BYTES
+#define EVENT_LOG_HELD_OFFSET (EVENT_LOG_CAPTURED_OFFSET + 4 * EVENT_LOG_BLOCK_ROWS)
+#define EVENT_LOG_LENGTH_OFFSET (EVENT_LOG_HELD_OFFSET + 4 * EVENT_LOG_BLOCK_ROWS)
+#define EVENT_LOG_FLOW_OFFSET (EVENT_LOG_LENGTH_OFFSET + 2 * EVENT_LOG_BLOCK_ROWS)
+#define EVENT_LOG_ACTION_OFFSET (EVENT_LOG_FLOW_OFFSET + 4 * EVENT_LOG_BLOCK_ROWS)
+// How many blocks can be filled or wait for the flusher before new events are left out of the log.
+#define EVENT_LOG_BUFFERS 32
+#define EVENT_LOG_NO_BUFFER UINT32_MAX
+// How often the flusher writes the events of the block that is still being filled, and how long it sleeps
+// when there is nothing to write.
+#define EVENT_LOG_FLUSH_INTERVAL std::chrono::milliseconds(200)
+#define EVENT_LOG_IDLE_SLEEP std::chrono::milliseconds(5)
+// The reader's histogram of the held times, in buckets of 100 microseconds up to a minute.
+#define EVENT_LOG_HELD_BUCKET_US 100
+#define EVENT_LOG_HELD_BUCKETS 600000
+// How many of the flows with the most events the reader lists.
+#define EVENT_LOG_TOP_FLOWS 5
+
+static_assert(EVENT_LOG_ACTION_OFFSET + EVENT_LOG_BLOCK_ROWS <= EVENT_LOG_BLOCK_BYTES, "The event log columns must fit in a block.");
+
+#pragma pack(push, 1)
+// The header at the start of an event log file. The blocks follow it at multiples of BlockBytes.
+struct EVENT_LOG_HEADER {
+	char Magic[8];
+	UINT32 Version;
+	UINT32 BlockBytes;
+	UINT32 BlockRows;
+	UINT32 Reserved;
+};
+
+// The header at the start of every block. The capture times in the block are signed microseconds from the base time,
+// which is in nanoseconds since the Unix epoch. A block with no rows ends the log.
+struct EVENT_BLOCK_HEADER {
+	INT64 BaseNs;
+	UINT32 Rows;
+	UINT32 Reserved;
+};
+#pragma pack(pop)
+
+// Where each column starts in a block and the size of its values.
+static const size_t EVENT_LOG_COLUMN_OFFSETS[] = {
+	EVENT_LOG_CAPTURED_OFFSET, EVENT_LOG_HELD_OFFSET, EVENT_LOG_LENGTH_OFFSET, EVENT_LOG_FLOW_OFFSET, EVENT_LOG_ACTION_OFFSET
+};
+static const size_t EVENT_LOG_COLUMN_SIZES[] = { 4, 4, 2, 4, 1 };
+
+// Writes a compact record of every released or dropped packet for offline analysis: when it was captured, how long
+// it was held, its length, a hash of its flow, and what happened to it. The events are kept in fixed-size blocks with
+// a column for each field, and the file only grows a block at a time, through a mapping of the block being written.
+// Log() adds an event to a block in memory under a short lock, and a flusher thread copies the blocks to the file.
+// The block that is still being filled is copied every EVENT_LOG_FLUSH_INTERVAL, so a slow trickle of events
+// doesn't wait for a block to fill up. If the flusher falls behind and every block is in use, the event is left out
+// of the log and counted instead.
+class EventLog {
+private:
+	// The blocks in memory, laid out as they are in the file.
+	std::vector<BYTE> _buffers;
+	BoundedQueue<UINT32> _freeBuffers;
+	BoundedQueue<UINT32> _filledBuffers;
+
+	// The block being filled and its place in the file, and the place of the next one. Guarded by the mutex.
+	std::mutex _mutex;
+	UINT32 _current = EVENT_LOG_NO_BUFFER;
+	UINT64 _currentBlock = 0;
+	UINT64 _nextBlock = 0;
+
+	// Used by the flusher only: the file block being written, how many events it has, and its mapping.
+	UINT64 _diskBlock = 0;
+	UINT32 _diskRows = 0;
+	BYTE* _view = nullptr;
+#ifdef _WIN32
+	HANDLE _file = INVALID_HANDLE_VALUE;
+#else
+	int _file = -1;
+#endif
+
+	// The offset from steady clock time to time since the Unix epoch.
+	std::chrono::nanoseconds _wallClockOffset{ 0 };
+
+	std::thread _flusherThread;
+	std::atomic<bool> _stopping{ false };
+	bool _open = false;
+
+	std::atomic<UINT64> _logged{ 0 };
+	std::atomic<UINT64> _missed{ 0 };
+
+	EVENT_BLOCK_HEADER* _header(UINT32 buffer) {
+		return (EVENT_BLOCK_HEADER*)&_buffers[(size_t)buffer * EVENT_LOG_BLOCK_BYTES];
+	}
+
+	// Maps the block of the file at the given offset, growing the file to hold it.
+	bool _map(UINT64 offset) {
+		UINT64 end = offset + EVENT_LOG_BLOCK_BYTES;
+#ifdef _WIN32
+		HANDLE mapping = CreateFileMappingA(_file, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+		if (mapping == NULL) {
+			PRINT_ERROR("CreateFileMappingA() failed for the event log with error code " << GetLastError() << ".");
+			return false;
+		}
+		_view = (BYTE*)MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, EVENT_LOG_BLOCK_BYTES);
+		DWORD error = GetLastError();
+		// The view keeps the mapping open.
+		CloseHandle(mapping);
+		if (_view == nullptr) {
+			PRINT_ERROR("MapViewOfFile() failed for the event log with error code " << error << ".");
+			return false;
+		}
+#else
+		if (ftruncate(_file, (off_t)end) != 0) {
+			PRINT_ERROR("ftruncate() failed for the event log with error code " << errno << ".");
+			return false;
+		}
+		void* view = mmap(nullptr, EVENT_LOG_BLOCK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, _file, (off_t)offset);
+		if (view == MAP_FAILED) {
+			PRINT_ERROR("mmap() failed for the event log with error code " << errno << ".");
+			return false;
+		}
+		_view = (BYTE*)view;
+#endif
+		return true;
+	}
+
+	void _unmap() {
+		if (_view == nullptr)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(_view);
+#else
+		munmap(_view, EVENT_LOG_BLOCK_BYTES);
+#endif
+		_view = nullptr;
+	}
+
+	// Copies the events of a block in memory that aren't in the file yet to the file block being written.
+	// The rows are written before the header that counts them, so a reader never sees rows that aren't there.
+	void _writeRows(UINT32 buffer, UINT32 rows) {
+		if (rows <= _diskRows)
+			return;
+		if (_view == nullptr && !_map((_diskBlock + 1) * EVENT_LOG_BLOCK_BYTES)) {
+			_missed.fetch_add(rows - _diskRows, std::memory_order_relaxed);
+			_diskRows = rows;
+			return;
+		}
+		const BYTE* source = &_buffers[(size_t)buffer * EVENT_LOG_BLOCK_BYTES];
+		for (size_t column = 0; column < sizeof(EVENT_LOG_COLUMN_SIZES) / sizeof(EVENT_LOG_COLUMN_SIZES[0]); ++column) {
+			size_t start = EVENT_LOG_COLUMN_OFFSETS[column] + EVENT_LOG_COLUMN_SIZES[column] * _diskRows;
+			std::memcpy(_view + start, source + start, EVENT_LOG_COLUMN_SIZES[column] * (rows - _diskRows));
+		}
+		EVENT_BLOCK_HEADER header = {};
+		header.BaseNs = ((const EVENT_BLOCK_HEADER*)source)->BaseNs;
+		header.Rows = rows;
+		std::memcpy(_view, &header, sizeof(header));
+		_diskRows = rows;
+	}
+
+	// Copies the new events of the block being filled, unless a full block is still waiting to be written before it.
+	void _writeCurrent() {
+		UINT32 buffer;
+		UINT32 rows;
+		UINT64 block;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			buffer = _current;
+			if (buffer == EVENT_LOG_NO_BUFFER)
+				return;
+			rows = _header(buffer)->Rows;
+			block = _currentBlock;
+		}
+		// The rows counted are never changed again, and the block isn't reused before the flusher has written it.
+		if (block == _diskBlock)
+			_writeRows(buffer, rows);
+	}
+
+	void _flusherLoop(THREAD_CONFIG config) {
+		ScopedThreadConfig threadConfig(config, "event log flusher");
+		PRINT_TRACE("Event log flusher loop started...");
+		std::chrono::steady_clock::time_point lastFlush = std::chrono::steady_clock::now();
+		while (true) {
+			UINT32 buffer;
+			bool wrote = false;
+			while (_filledBuffers.TryPop(buffer)) {
+				_writeRows(buffer, _header(buffer)->Rows);
+				_unmap();
+				_diskBlock += 1;
+				_diskRows = 0;
+				_freeBuffers.TryPush(buffer);
+				wrote = true;
+			}
+			// Everything logged before stopping has been handed over.
+			if (!wrote && _stopping.load(std::memory_order_acquire)) {
+				_writeCurrent();
+				break;
+			}
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now - lastFlush >= EVENT_LOG_FLUSH_INTERVAL) {
+				_writeCurrent();
+				lastFlush = now;
+			}
+			if (!wrote)
+				std::this_thread::sleep_for(EVENT_LOG_IDLE_SLEEP);
+		}
+		_unmap();
+		PRINT_TRACE("Event log flusher loop finished.");
+	}
+
+	void _closeFile() {
+#ifdef _WIN32
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+#else
+		if (_file >= 0)
+			close(_file);
+		_file = -1;
+#endif
+	}
+
+public:
+	EventLog() {}
+
+	~EventLog() {
+		Close();
+	}
+
+	EventLog(const EventLog&) = delete;
+	EventLog& operator=(const EventLog&) = delete;
+
+	// Starts logging to the given file, replacing it. The flusher thread runs with the given scheduling settings.
+	bool Open(const std::string& path, const THREAD_CONFIG& flusherConfig) {
+		if (_open)
+			Close();
+#ifdef _WIN32
+		_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (_file == INVALID_HANDLE_VALUE) {
+			PRINT_ERROR("CreateFileA() failed for the event log \"" << path << "\" with error code " << GetLastError() << ".");
+			return false;
+		}
+#else
+		_file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (_file < 0) {
+			PRINT_ERROR("open() failed for the event log \"" << path << "\" with error code " << errno << ".");
+			return false;
+		}
+#endif
+		if (!_map(0)) {
+			_closeFile();
+			return false;
+		}
+		EVENT_LOG_HEADER header = {};
+		std::memcpy(header.Magic, EVENT_LOG_MAGIC, sizeof(header.Magic));
+		header.Version = EVENT_LOG_VERSION;
+		header.BlockBytes = EVENT_LOG_BLOCK_BYTES;
+		header.BlockRows = EVENT_LOG_BLOCK_ROWS;
+		std::memcpy(_view, &header, sizeof(header));
+		_unmap();
+
+		_buffers.assign((size_t)EVENT_LOG_BUFFERS * EVENT_LOG_BLOCK_BYTES, 0);
+		_freeBuffers.Reset(EVENT_LOG_BUFFERS);
+		_filledBuffers.Reset(EVENT_LOG_BUFFERS);
+		for (UINT32 buffer = 0; buffer < EVENT_LOG_BUFFERS; ++buffer)
+			_freeBuffers.TryPush(buffer);
+		_current = EVENT_LOG_NO_BUFFER;
+		_currentBlock = 0;
+		_nextBlock = 0;
+		_diskBlock = 0;
+		_diskRows = 0;
+
+		_wallClockOffset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch() - std::chrono::steady_clock::now().time_since_epoch()
+		);
+		_logged = 0;
+		_missed = 0;
+		_stopping = false;
+		_flusherThread = std::thread(&EventLog::_flusherLoop, this, flusherConfig);
+		_open = true;
+		return true;
+	}
+
+	// Writes the remaining events and stops the flusher thread.
+	void Close() {
+		if (!_open)
+			return;
+		_stopping.store(true, std::memory_order_release);
+		_flusherThread.join();
+		_closeFile();
+		_open = false;
+	}
+
+	bool IsOpen() const {
+		return _open;
+	}
+
+	// Adds the event of a released or dropped packet. Never waits for the flusher.
+	void Log(const void* packet, UINT length, TIME_DATA captured, TIME_DATA released, CaptureResult result) {
+		UINT64 flow = 0;
+		FlowProfiler::HashFlow((PVOID)packet, length, flow);
+		INT64 capturedNs = (INT64)(std::chrono::duration_cast<std::chrono::nanoseconds>(captured.time_since_epoch()) + _wallClockOffset).count();
+		long long heldUs = std::chrono::duration_cast<std::chrono::microseconds>(released - captured).count();
+		UINT32 held = (UINT32)std::min<long long>(std::max<long long>(heldUs, 0), UINT32_MAX);
+		UINT16 shortLength = (UINT16)std::min<UINT>(length, UINT16_MAX);
+		UINT32 shortFlow = (UINT32)flow;
+		BYTE action = (BYTE)result;
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		// A block ends when it is full or the capture time is too far from its base time to be stored.
+		if (_current != EVENT_LOG_NO_BUFFER) {
+			const EVENT_BLOCK_HEADER* header = _header(_current);
+			INT64 offsetUs = (capturedNs - header->BaseNs) / 1000;
+			if (header->Rows == EVENT_LOG_BLOCK_ROWS || offsetUs < INT32_MIN || offsetUs > INT32_MAX) {
+				_filledBuffers.TryPush(_current);
+				_current = EVENT_LOG_NO_BUFFER;
+			}
+		}
+		if (_current == EVENT_LOG_NO_BUFFER) {
+			UINT32 buffer;
+			if (!_freeBuffers.TryPop(buffer)) {
+				_missed.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			EVENT_BLOCK_HEADER* header = _header(buffer);
+			header->BaseNs = capturedNs;
+			header->Rows = 0;
+			_current = buffer;
+			_currentBlock = _nextBlock;
+			_nextBlock += 1;
+		}
+		EVENT_BLOCK_HEADER* header = _header(_current);
+		BYTE* block = (BYTE*)header;
+		UINT32 row = header->Rows;
+		INT32 offsetUs = (INT32)((capturedNs - header->BaseNs) / 1000);
+		std::memcpy(block + EVENT_LOG_CAPTURED_OFFSET + 4 * row, &offsetUs, 4);
+		std::memcpy(block + EVENT_LOG_HELD_OFFSET + 4 * row, &held, 4);
+		std::memcpy(block + EVENT_LOG_LENGTH_OFFSET + 2 * row, &shortLength, 2);
+		std::memcpy(block + EVENT_LOG_FLOW_OFFSET + 4 * row, &shortFlow, 4);
+		block[EVENT_LOG_ACTION_OFFSET + row] = action;
+		header->Rows = row + 1;
+		_logged.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// The amount of events added to the log.
+	UINT64 Logged() const {
+		return _logged.load(std::memory_order_relaxed);
+	}
+
+	// The amount of events left out because the flusher fell behind or the file couldn't be grown.
+	UINT64 Missed() const {
+		return _missed.load(std::memory_order_relaxed);
+	}
+};
+
+// Reads an event log, prints how many events of each action it has, the held times of the sent packets, and the flows
+// with the most events, and writes every event to a CSV file if a path is given. Sets the amount of events read.
+// Returns false and sets the error message if the log can't be read.
+inline bool SummarizeEventLog(const std::string& path, const std::string& csvPath, UINT64& events, std::string& error) {
+	events = 0;
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		error = "Could not open \"" + path + "\".";
+		return false;
+	}
+	std::vector<BYTE> block(EVENT_LOG_BLOCK_BYTES);
+	if (!file.read((char*)block.data(), EVENT_LOG_BLOCK_BYTES)) {
+		error = "The file is too small to be an event log.";
+		return false;
+	}
+	const EVENT_LOG_HEADER* header = (const EVENT_LOG_HEADER*)block.data();
+	if (std::memcmp(header->Magic, EVENT_LOG_MAGIC, sizeof(header->Magic)) != 0) {
+		error = "The file is not an event log.";
+		return false;
+	}
+	if (header->Version != EVENT_LOG_VERSION || header->BlockBytes != EVENT_LOG_BLOCK_BYTES || header->BlockRows != EVENT_LOG_BLOCK_ROWS) {
+		error = "Unsupported event log version " + std::to_string(header->Version) + ".";
+		return false;
+	}
+	std::ofstream csv;
+	if (!csvPath.empty()) {
+		csv.open(csvPath);
+		if (!csv) {
+			error = "Could not open \"" + csvPath + "\".";
+			return false;
+		}
+		csv << "captured_ns,released_ns,held_us,length,flow,action\n";
+	}
+
+	const size_t actions = (size_t)CaptureResult::RuleDropped + 1;
+	UINT64 actionEvents[actions] = {};
+	UINT64 actionBytes[actions] = {};
+	std::vector<UINT64> heldHistogram(EVENT_LOG_HELD_BUCKETS);
+	UINT64 heldCount = 0;
+	UINT32 heldMax = 0;
+	std::unordered_map<UINT32, PROFILER_COUNTER> flows;
+	INT64 firstNs = INT64_MAX;
+	INT64 lastNs = INT64_MIN;
+	UINT64 blocks = 0;
+	while (file.read((char*)block.data(), EVENT_LOG_BLOCK_BYTES)) {
+		const EVENT_BLOCK_HEADER* blockHeader = (const EVENT_BLOCK_HEADER*)block.data();
+		if (blockHeader->Rows == 0)
+			break;
+		if (blockHeader->Rows > EVENT_LOG_BLOCK_ROWS) {
+			error = "Block " + std::to_string(blocks) + " is corrupt.";
+			return false;
+		}
+		blocks += 1;
+		for (UINT32 row = 0; row < blockHeader->Rows; ++row) {
+			INT32 offsetUs;
+			UINT32 held;
+			UINT16 length;
+			UINT32 flow;
+			std::memcpy(&offsetUs, &block[EVENT_LOG_CAPTURED_OFFSET + 4 * row], 4);
+			std::memcpy(&held, &block[EVENT_LOG_HELD_OFFSET + 4 * row], 4);
+			std::memcpy(&length, &block[EVENT_LOG_LENGTH_OFFSET + 2 * row], 2);
+			std::memcpy(&flow, &block[EVENT_LOG_FLOW_OFFSET + 4 * row], 4);
+			size_t action = std::min<size_t>(block[EVENT_LOG_ACTION_OFFSET + row], actions - 1);
+			INT64 capturedNs = blockHeader->BaseNs + (INT64)offsetUs * 1000;
+			firstNs = std::min(firstNs, capturedNs);
+			lastNs = std::max(lastNs, capturedNs);
+			actionEvents[action] += 1;
+			actionBytes[action] += length;
+			if ((CaptureResult)action == CaptureResult::Sent) {
+				heldHistogram[std::min<size_t>(held / EVENT_LOG_HELD_BUCKET_US, EVENT_LOG_HELD_BUCKETS - 1)] += 1;
+				heldCount += 1;
+				heldMax = std::max(heldMax, held);
+			}
+			PROFILER_COUNTER& counter = flows[flow];
+			counter.packets += 1;
+			counter.bytes += length;
+			if (csv.is_open()) {
+				csv << capturedNs << ',' << capturedNs + (INT64)held * 1000 << ',' << held << ',' << length << ",0x"
+					<< std::hex << std::setw(8) << std::setfill('0') << flow << std::dec << std::setfill(' ') << ','
+					<< CaptureResultName((CaptureResult)action) << '\n';
+			}
+		}
+		events += blockHeader->Rows;
+	}
+	if (csv.is_open() && !csv) {
+		error = "Writing \"" + csvPath + "\" failed.";
+		return false;
+	}
+
+	double seconds = events == 0 ? 0 : (lastNs - firstNs) / 1e9;
+	PRINT_INFO("Read " << events << " events in " << blocks << " blocks, captured over " << seconds << " s.");
+	std::ostringstream table;
+	table << std::left << std::setw(16) << "Action" << std::right << std::setw(14) << "events" << std::setw(14) << "KB" << std::setw(10) << "%";
+	SYNC_COUT(table.str());
+	for (size_t action = 0; action < actions; ++action) {
+		std::ostringstream row;
+		row << std::left << std::setw(16) << CaptureResultName((CaptureResult)action) << std::right << std::setw(14) << actionEvents[action]
+			<< std::setw(14) << actionBytes[action] / 1024 << std::setw(10) << std::fixed << std::setprecision(2)
+			<< (events == 0 ? 0.0 : 100.0 * actionEvents[action] / events);
+		SYNC_COUT(row.str());
+	}
+	if (heldCount != 0) {
+		// A percentile is the upper edge of the bucket it falls in.
+		auto percentile = [&](double fraction) {
+			UINT64 target = (UINT64)std::ceil(fraction * heldCount);
+			UINT64 sum = 0;
+			for (size_t bucket = 0; bucket < heldHistogram.size(); ++bucket) {
+				sum += heldHistogram[bucket];
+				if (sum >= target)
+					return (bucket + 1) * EVENT_LOG_HELD_BUCKET_US / 1000.0;
+			}
+			return heldMax / 1000.0;
+		};
+		PRINT_INFO(
+			"The sent packets were held for " << percentile(0.5) << " ms at the median, " << percentile(0.99)
+			<< " ms at the 99th percentile, and " << heldMax / 1000.0 << " ms at most."
+		);
+	}
+	std::vector<std::pair<UINT32, PROFILER_COUNTER>> top(flows.begin(), flows.end());
+	size_t shown = std::min<size_t>(EVENT_LOG_TOP_FLOWS, top.size());
+	std::partial_sort(top.begin(), top.begin() + shown, top.end(), [](const std::pair<UINT32, PROFILER_COUNTER>& a, const std::pair<UINT32, PROFILER_COUNTER>& b) {
+		return a.second.packets > b.second.packets;
+	});
+	if (shown != 0) {
+		SYNC_COUT("The flows with the most events, out of " << flows.size() << ":");
+		for (size_t i = 0; i < shown; ++i) {
+			std::ostringstream row;
+			row << "  0x" << std::hex << std::setw(8) << std::setfill('0') << top[i].first << std::dec << std::setfill(' ')
+				<< std::setw(14) << top[i].second.packets << " events" << std::setw(14) << top[i].second.bytes / 1024 << " KB";
+			SYNC_COUT(row.str());
+		}
+	}
+	return true;
+}
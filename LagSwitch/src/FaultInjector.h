@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <random>
+#include "Platform.h"
+#include "PacketDivert.h"
+
+// How often the fault injector fails a call, as a probability for every call.
+struct FAULT_RATES {
+	// Fails a receive or send with ERROR_NO_SYSTEM_RESOURCES.
+	double transient = 0;
+	// Rejects a sent packet with ERROR_INVALID_PARAMETER.
+	double badPacket = 0;
+	// Breaks the handle, so every call fails with ERROR_INVALID_HANDLE until it is reopened.
+	double handleLoss = 0;
+};
+
+// Wraps another divert and makes its calls fail at random, to check that the delayer recovers from errors
+// without losing the packets it holds. A failed call is never passed on, so a failed receive doesn't take
+// a packet from the wrapped divert and a failed send doesn't deliver one.
+// Receives and sends are made from different threads, so each has its own random generator.
+class FaultInjector : public PacketDivert {
+private:
+	PacketDivert* _divert;
+	FAULT_RATES _rates;
+	std::mt19937_64 _recvRandom;
+	std::mt19937_64 _sendRandom;
+	std::uniform_real_distribution<double> _chance{ 0.0, 1.0 };
+	std::atomic<bool> _broken{ false };
+
+	std::atomic<UINT64> _transient{ 0 };
+	std::atomic<UINT64> _badPackets{ 0 };
+	std::atomic<UINT64> _handleLosses{ 0 };
+
+	// Picks the fault for the next call, if any. Returns false if the call should fail.
+	bool _inject(std::mt19937_64& random, bool sending) {
+		if (_broken) {
+			SetLastError(ERROR_INVALID_HANDLE);
+			return false;
+		}
+		double roll = _chance(random);
+		if (roll < _rates.handleLoss) {
+			_broken = true;
+			_handleLosses += 1;
+			SetLastError(ERROR_INVALID_HANDLE);
+			return false;
+		}
+		roll -= _rates.handleLoss;
+		if (roll < _rates.transient) {
+			_transient += 1;
+			SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+			return false;
+		}
+		roll -= _rates.transient;
+		if (sending && roll < _rates.badPacket) {
+			_badPackets += 1;
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+		return true;
+	}
+
+public:
+	FaultInjector(PacketDivert* divert, const FAULT_RATES& rates, UINT64 seed)
+		: _divert(divert), _rates(rates), _recvRandom(seed), _sendRandom(seed + 1) {}
+
+	// Opening repairs a broken handle.
+	bool Open(const std::string& filter) override {
+		_broken = false;
+		return _divert->Open(filter);
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		if (!_inject(_recvRandom, false))
+			return false;
+		return _divert->Recv(packet, length, received, address);
+	}
+
+	// A batch fails or succeeds as a whole, like a single receive.
+	bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) override {
+		if (!_inject(_recvRandom, false))
+			return false;
+		return _divert->RecvBatch(packets, length, received, addresses, count, timeout);
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		if (!_inject(_sendRandom, true))
+			return false;
+		return _divert->Send(packet, length, address);
+	}
+
+	bool CaptureTime(const WINDIVERT_ADDRESS& address, TIME_DATA& time) override {
+		return _divert->CaptureTime(address, time);
+	}
+
+	bool HasCaptureTime() const override {
+		return _divert->HasCaptureTime();
+	}
+
+	bool Shutdown() override {
+		return _divert->Shutdown();
+	}
+
+	bool Close() override {
+		return _divert->Close();
+	}
+
+	UINT64 Transient() const {
+		return _transient;
+	}
+
+	// The packets rejected on purpose. These are the only packets the delayer is allowed to lose.
+	UINT64 BadPackets() const {
+		return _badPackets;
+	}
+
+	UINT64 HandleLosses() const {
+		return _handleLosses;
+	}
+};
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <random>
+#include "Platform.h"
+#include "Logging.h"
+#include "Clock.h"
+#include "PacketHeaders.h"
+#include "Benchmarks.h"
+
+// The rows and columns of the count-min sketch. A packet adds to one counter in every row, and a flow's count
+// is the smallest of its counters, which is never below the real count. The width must be a power of two.
+#define PROFILER_DEPTH 4
+#define PROFILER_WIDTH 2048
+// The window is split into slices, and the oldest slice is dropped whenever a new one starts.
+#define PROFILER_SLICES 5
+#define PROFILER_DEFAULT_WINDOW_S 10
+// How many of the heaviest flows are kept, and how many of them the logger lists every second.
+#define PROFILER_TOP_FLOWS 16
+#define PROFILER_LOG_FLOWS 3
+// The flows and packets the profiler benchmark generates, and how skewed the flow sizes are.
+#define PROFILER_BENCHMARK_FLOWS 50000
+#define PROFILER_BENCHMARK_PACKETS 4000000
+#define PROFILER_BENCHMARK_SKEW 1.1
+
+// A flow's 5-tuple. Packets that aren't TCP or UDP, and the fragments after the first, have no ports.
+struct PROFILER_FLOW_KEY {
+	BYTE source[16];
+	BYTE destination[16];
+	UINT16 sourcePort;
+	UINT16 destinationPort;
+	UINT8 protocol;
+	UINT8 ipv6;
+	UINT8 reserved[2];
+};
+
+// One of the heaviest flows, with its packets and bytes in the window as the sketch estimates them.
+struct PROFILER_FLOW {
+	PROFILER_FLOW_KEY key;
+	UINT64 hash;
+	UINT64 packets;
+	UINT64 bytes;
+};
+
+struct PROFILER_COUNTER {
+	UINT64 packets;
+	UINT64 bytes;
+};
+
+// Finds the flows that send the most bytes in a sliding window, in constant memory whatever the amount of flows.
+// Every packet is hashed once, the hash picks a counter in each row of a count-min sketch, and the flows whose estimate
+// beats the lightest of the heaviest flows kept replace it in a min-heap. The sketch is kept for every slice of
+// the window along with the sum of the slices, so dropping the oldest slice subtracts it from the sum, and the flows
+// in the heap are estimated again. Allocates its counters when a window is set. Not thread-safe, the delayer calls it
+// with the packet mutex locked.
+class FlowProfiler {
+private:
+	std::chrono::nanoseconds _sliceLength{ 0 };
+	// The counters of every slice, row after row, and their sums, which the flows are estimated from.
+	std::vector<PROFILER_COUNTER> _slices;
+	std::vector<PROFILER_COUNTER> _total;
+	// The packets and bytes of every slice.
+	PROFILER_COUNTER _sliceTotals[PROFILER_SLICES];
+	UINT _slice = 0;
+	TIME_DATA _sliceEnd;
+	bool _started = false;
+	// A min-heap by bytes, so the lightest of the heaviest flows is at the front.
+	std::vector<PROFILER_FLOW> _top;
+
+	static UINT64 _hash(const PROFILER_FLOW_KEY& key) {
+		UINT64 words[5];
+		std::memcpy(words, &key, sizeof(words));
+		UINT64 hash = 0x9E3779B97F4A7C15ull;
+		for (UINT64 word : words) {
+			hash ^= word;
+			hash *= 0xBF58476D1CE4E5B9ull;
+			hash ^= hash >> 31;
+		}
+		return hash;
+	}
+
+	// The counter of the row for a hash. The rows use the two halves of the hash as a base and a step,
+	// so one hash stands in for a hash function per row.
+	static size_t _index(UINT64 hash, UINT row) {
+		UINT32 step = (UINT32)(hash >> 32) | 1;
+		return row * PROFILER_WIDTH + (((UINT32)hash + row * step) & (PROFILER_WIDTH - 1));
+	}
+
+	// Reads the flow of a packet. Returns false if it isn't an IP packet.
+	static bool _readKey(PVOID packet, UINT length, PROFILER_FLOW_KEY& key) {
+		PACKET_HEADERS headers;
+		if (!ParsePacketHeaders(packet, length, headers))
+			return false;
+		std::memset(&key, 0, sizeof(key));
+		UINT addressLength = headers.ipv6 ? 16 : 4;
+		std::memcpy(key.source, headers.ip + (headers.ipv6 ? IPV6_SRC_ADDR_OFFSET : IPV4_SRC_ADDR_OFFSET), addressLength);
+		std::memcpy(key.destination, headers.ip + (headers.ipv6 ? IPV6_DST_ADDR_OFFSET : IPV4_DST_ADDR_OFFSET), addressLength);
+		if (headers.transport != nullptr) {
+			key.sourcePort = ReadNet16(headers.transport + SRC_PORT_OFFSET);
+			key.destinationPort = ReadNet16(headers.transport + DST_PORT_OFFSET);
+		}
+		key.protocol = headers.protocol;
+		key.ipv6 = headers.ipv6;
+		return true;
+	}
+
+	void _estimate(PROFILER_FLOW& flow) const {
+		flow.packets = UINT64_MAX;
+		flow.bytes = UINT64_MAX;
+		for (UINT row = 0; row < PROFILER_DEPTH; ++row) {
+			const PROFILER_COUNTER& counter = _total[_index(flow.hash, row)];
+			flow.packets = std::min(flow.packets, counter.packets);
+			flow.bytes = std::min(flow.bytes, counter.bytes);
+		}
+	}
+
+	// Moves a flow whose bytes grew down the heap.
+	void _siftDown(size_t i) {
+		while (true) {
+			size_t lightest = i;
+			for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < _top.size(); ++child) {
+				if (_top[child].bytes < _top[lightest].bytes)
+					lightest = child;
+			}
+			if (lightest == i)
+				return;
+			std::swap(_top[i], _top[lightest]);
+			i = lightest;
+		}
+	}
+
+	static bool _heavier(const PROFILER_FLOW& a, const PROFILER_FLOW& b) {
+		return a.bytes > b.bytes;
+	}
+
+	// Updates the flow in the heap, or adds it in place of the lightest flow if it is heavier.
+	void _offer(const PROFILER_FLOW& flow) {
+		if (_top.size() == PROFILER_TOP_FLOWS && flow.bytes <= _top.front().bytes)
+			return;
+		for (size_t i = 0; i < _top.size(); ++i) {
+			if (_top[i].hash == flow.hash && std::memcmp(&_top[i].key, &flow.key, sizeof(flow.key)) == 0) {
+				_top[i].packets = flow.packets;
+				_top[i].bytes = flow.bytes;
+				_siftDown(i);
+				return;
+			}
+		}
+		if (_top.size() == PROFILER_TOP_FLOWS) {
+			std::pop_heap(_top.begin(), _top.end(), _heavier);
+			_top.back() = flow;
+		}
+		else
+			_top.push_back(flow);
+		std::push_heap(_top.begin(), _top.end(), _heavier);
+	}
+
+	// Drops the slices that ended before the given time and starts new ones in their place.
+	void _advance(TIME_DATA now) {
+		if (!_started) {
+			_sliceEnd = now + _sliceLength;
+			_started = true;
+			return;
+		}
+		if (now < _sliceEnd)
+			return;
+		UINT64 passed = 1 + (UINT64)((now - _sliceEnd) / _sliceLength);
+		_sliceEnd += _sliceLength * passed;
+		for (UINT64 i = 0; i < std::min<UINT64>(passed, PROFILER_SLICES); ++i) {
+			_slice = (_slice + 1) % PROFILER_SLICES;
+			PROFILER_COUNTER* slice = &_slices[(size_t)_slice * PROFILER_DEPTH * PROFILER_WIDTH];
+			for (size_t c = 0; c < (size_t)PROFILER_DEPTH * PROFILER_WIDTH; ++c) {
+				_total[c].packets -= slice[c].packets;
+				_total[c].bytes -= slice[c].bytes;
+			}
+			std::memset(slice, 0, sizeof(PROFILER_COUNTER) * PROFILER_DEPTH * PROFILER_WIDTH);
+			_sliceTotals[_slice] = PROFILER_COUNTER();
+		}
+		// The flows lost what they sent in the dropped slices, and the ones that sent nothing since leave the heap.
+		for (PROFILER_FLOW& flow : _top)
+			_estimate(flow);
+		_top.erase(std::remove_if(_top.begin(), _top.end(), [](const PROFILER_FLOW& flow) { return flow.bytes == 0; }), _top.end());
+		std::make_heap(_top.begin(), _top.end(), _heavier);
+	}
+
+	static std::string _formatAddress(const BYTE* address, bool ipv6) {
+		std::ostringstream text;
+		if (!ipv6) {
+			text << (int)address[0] << '.' << (int)address[1] << '.' << (int)address[2] << '.' << (int)address[3];
+			return text.str();
+		}
+		text << '[' << std::hex;
+		for (UINT i = 0; i < 16; i += 2)
+			text << (i == 0 ? "" : ":") << ReadNet16(address + i);
+		text << ']';
+		return text.str();
+	}
+
+public:
+	// Profiles the flows over a window of the given length. Zero stops profiling and frees the counters.
+	void SetWindow(std::chrono::seconds window) {
+		_sliceLength = std::chrono::duration_cast<std::chrono::nanoseconds>(window) / PROFILER_SLICES;
+		if (window.count() == 0) {
+			std::vector<PROFILER_COUNTER>().swap(_slices);
+			std::vector<PROFILER_COUNTER>().swap(_total);
+		}
+		else {
+			_slices.assign((size_t)PROFILER_SLICES * PROFILER_DEPTH * PROFILER_WIDTH, PROFILER_COUNTER());
+			_total.assign((size_t)PROFILER_DEPTH * PROFILER_WIDTH, PROFILER_COUNTER());
+		}
+		for (PROFILER_COUNTER& totals : _sliceTotals)
+			totals = PROFILER_COUNTER();
+		_slice = 0;
+		_started = false;
+		_top.clear();
+	}
+
+	bool IsEnabled() const {
+		return !_total.empty();
+	}
+
+	std::chrono::nanoseconds Window() const {
+		return _sliceLength * PROFILER_SLICES;
+	}
+
+	// The memory the counters take.
+	size_t MemoryBytes() const {
+		return (_slices.size() + _total.size()) * sizeof(PROFILER_COUNTER);
+	}
+
+	// Counts a packet of the given length that was received at the given time.
+	void Add(PVOID packet, UINT length, TIME_DATA now) {
+		_advance(now);
+		PROFILER_FLOW flow;
+		if (!_readKey(packet, length, flow.key))
+			return;
+		flow.hash = _hash(flow.key);
+		flow.packets = UINT64_MAX;
+		flow.bytes = UINT64_MAX;
+		PROFILER_COUNTER* slice = &_slices[(size_t)_slice * PROFILER_DEPTH * PROFILER_WIDTH];
+		for (UINT row = 0; row < PROFILER_DEPTH; ++row) {
+			size_t index = _index(flow.hash, row);
+			slice[index].packets += 1;
+			slice[index].bytes += length;
+			PROFILER_COUNTER& total = _total[index];
+			total.packets += 1;
+			total.bytes += length;
+			flow.packets = std::min(flow.packets, total.packets);
+			flow.bytes = std::min(flow.bytes, total.bytes);
+		}
+		_sliceTotals[_slice].packets += 1;
+		_sliceTotals[_slice].bytes += length;
+		_offer(flow);
+	}
+
+	// Stores up to count of the heaviest flows in the window, heaviest first, and the window's packets and bytes.
+	void Top(size_t count, std::vector<PROFILER_FLOW>& flows, PROFILER_COUNTER& window) const {
+		flows = _top;
+		std::sort(flows.begin(), flows.end(), _heavier);
+		if (flows.size() > count)
+			flows.resize(count);
+		window = PROFILER_COUNTER();
+		for (const PROFILER_COUNTER& totals : _sliceTotals) {
+			window.packets += totals.packets;
+			window.bytes += totals.bytes;
+		}
+	}
+
+	// Hashes the flow of a packet the way the profiler tells flows apart. Returns false if it isn't an IP packet.
+	static bool HashFlow(PVOID packet, UINT length, UINT64& hash) {
+		PROFILER_FLOW_KEY key;
+		if (!_readKey(packet, length, key))
+			return false;
+		hash = _hash(key);
+		return true;
+	}
+
+	// Describes a flow like "UDP 10.0.0.1:50000 -> 10.0.0.2:27015".
+	static std::string FormatFlow(const PROFILER_FLOW_KEY& key) {
+		std::ostringstream text;
+		bool ports = key.protocol == IP_PROTOCOL_TCP || key.protocol == IP_PROTOCOL_UDP;
+		if (key.protocol == IP_PROTOCOL_TCP)
+			text << "TCP ";
+		else if (key.protocol == IP_PROTOCOL_UDP)
+			text << "UDP ";
+		else
+			text << "protocol " << (int)key.protocol << ' ';
+		text << _formatAddress(key.source, key.ipv6 != 0);
+		if (ports)
+			text << ':' << key.sourcePort;
+		text << " -> " << _formatAddress(key.destination, key.ipv6 != 0);
+		if (ports)
+			text << ':' << key.destinationPort;
+		return text.str();
+	}
+
+	// Prints the heaviest flows as a table, with their share of the window's bytes.
+	static void PrintTop(const std::vector<PROFILER_FLOW>& flows, const PROFILER_COUNTER& window, std::chrono::nanoseconds length) {
+		double seconds = std::chrono::duration<double>(length).count();
+		std::ostringstream header;
+		header << "The heaviest flows of the last " << seconds << " s, out of " << window.packets << " packets and "
+			<< window.bytes / 1024 << " KB:";
+		SYNC_COUT(header.str());
+		if (flows.empty()) {
+			SYNC_COUT("  No packets were held.");
+			return;
+		}
+		for (const PROFILER_FLOW& flow : flows) {
+			std::ostringstream row;
+			row << "  " << std::left << std::setw(56) << FormatFlow(flow.key) << std::right << std::fixed << std::setprecision(1)
+				<< std::setw(10) << flow.packets << " packets" << std::setw(10) << flow.bytes / 1024.0 << " KB"
+				<< std::setw(8) << (window.bytes != 0 ? 100.0 * flow.bytes / window.bytes : 0) << " %"
+				<< std::setw(10) << flow.bytes * 8 / seconds / 1e6 << " Mbit/s";
+			SYNC_COUT(row.str());
+		}
+	}
+};
+
+// Runs generated flows through the profiler, a few heavy ones and a long tail of light ones, and compares the heaviest
+// flows it finds with exact counts. The flows trade places halfway, so the window has to forget the first half.
+// The packets run on a simulated clock over two windows, as fast as they can be generated.
+inline void RunFlowProfileBenchmark(std::chrono::seconds window) {
+	FlowProfiler profiler;
+	profiler.SetWindow(window);
+	const UINT compared = 10;
+	// The flow sizes follow a Zipf distribution.
+	std::vector<double> weights(PROFILER_BENCHMARK_FLOWS);
+	for (UINT i = 0; i < PROFILER_BENCHMARK_FLOWS; ++i)
+		weights[i] = 1.0 / std::pow(i + 1.0, PROFILER_BENCHMARK_SKEW);
+	std::mt19937_64 random(1);
+	std::discrete_distribution<UINT> flowOf(weights.begin(), weights.end());
+	std::uniform_int_distribution<UINT> sizeOf(64, 1400);
+	std::vector<UINT> flows(PROFILER_BENCHMARK_PACKETS);
+	std::vector<UINT> sizes(PROFILER_BENCHMARK_PACKETS);
+	for (UINT i = 0; i < PROFILER_BENCHMARK_PACKETS; ++i) {
+		flows[i] = flowOf(random);
+		// In the second half the heaviest flows are the ones that were in the middle of the ranking.
+		if (i >= PROFILER_BENCHMARK_PACKETS / 2)
+			flows[i] = (flows[i] + PROFILER_BENCHMARK_FLOWS / 2) % PROFILER_BENCHMARK_FLOWS;
+		sizes[i] = sizeOf(random);
+	}
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(1400, address);
+	const BYTE destination[] = { 10, 0, 0, 1 };
+	std::memcpy(packet.data() + IPV4_DST_ADDR_OFFSET, destination, sizeof(destination));
+	WriteNet16(packet.data() + 20 + DST_PORT_OFFSET, 27015);
+	std::chrono::nanoseconds length = profiler.Window();
+	std::chrono::nanoseconds step = length * 2 / PROFILER_BENCHMARK_PACKETS;
+	std::chrono::nanoseconds sliceLength = length / PROFILER_SLICES;
+	// The exact bytes of every flow in every slice, to sum the slices the window still holds.
+	std::vector<std::vector<UINT64>> exact(PROFILER_SLICES * 2 + 1, std::vector<UINT64>(PROFILER_BENCHMARK_FLOWS));
+	TIME_DATA start;
+	PRINT_INFO(
+		"Profiling " << PROFILER_BENCHMARK_PACKETS << " packets of " << PROFILER_BENCHMARK_FLOWS << " flows over "
+		<< std::chrono::duration<double>(length * 2).count() << " simulated seconds..."
+	);
+	auto began = std::chrono::steady_clock::now();
+	for (UINT i = 0; i < PROFILER_BENCHMARK_PACKETS; ++i) {
+		UINT flow = flows[i];
+		packet[IPV4_SRC_ADDR_OFFSET] = 10;
+		packet[IPV4_SRC_ADDR_OFFSET + 1] = (BYTE)(flow >> 16);
+		packet[IPV4_SRC_ADDR_OFFSET + 2] = (BYTE)(flow >> 8);
+		packet[IPV4_SRC_ADDR_OFFSET + 3] = (BYTE)flow;
+		WriteNet16(packet.data() + 20 + SRC_PORT_OFFSET, (UINT16)(1024 + flow % 60000));
+		profiler.Add(packet.data(), sizes[i], start + step * i);
+	}
+	double nanosecondsPerPacket = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - began).count() / PROFILER_BENCHMARK_PACKETS;
+	for (UINT i = 0; i < PROFILER_BENCHMARK_PACKETS; ++i)
+		exact[(size_t)((step * i) / sliceLength)][flows[i]] += sizes[i];
+
+	// The window holds the slice of the last packet and the ones before it.
+	size_t lastSlice = (size_t)((step * (PROFILER_BENCHMARK_PACKETS - 1)) / sliceLength);
+	std::vector<UINT64> windowBytes(PROFILER_BENCHMARK_FLOWS);
+	for (size_t s = lastSlice + 1 - PROFILER_SLICES; s <= lastSlice; ++s) {
+		for (UINT f = 0; f < PROFILER_BENCHMARK_FLOWS; ++f)
+			windowBytes[f] += exact[s][f];
+	}
+	std::vector<UINT> ranking(PROFILER_BENCHMARK_FLOWS);
+	for (UINT f = 0; f < PROFILER_BENCHMARK_FLOWS; ++f)
+		ranking[f] = f;
+	std::partial_sort(ranking.begin(), ranking.begin() + compared, ranking.end(), [&](UINT a, UINT b) { return windowBytes[a] > windowBytes[b]; });
+
+	std::vector<PROFILER_FLOW> top;
+	PROFILER_COUNTER totals;
+	profiler.Top(compared, top, totals);
+	UINT found = 0;
+	std::vector<double> errors;
+	for (const PROFILER_FLOW& flow : top) {
+		UINT index = ((UINT)flow.key.source[1] << 16) | ((UINT)flow.key.source[2] << 8) | flow.key.source[3];
+		if (std::find(ranking.begin(), ranking.begin() + compared, index) != ranking.begin() + compared)
+			found += 1;
+		// The overestimate in percent of the flow's real bytes.
+		errors.push_back(windowBytes[index] != 0 ? 100.0 * ((double)flow.bytes - windowBytes[index]) / windowBytes[index] : 100.0);
+	}
+	FlowProfiler::PrintTop(top, totals, length);
+	PrintSummaryHeader("% overestimated");
+	PrintSummaryRow("top " + std::to_string(compared) + " flows", SummarizeMicroseconds(errors));
+	PRINT_INFO(
+		"Found " << found << " of the " << compared << " heaviest flows of the window in " << profiler.MemoryBytes() / 1024
+		<< " KB of counters, at " << nanosecondsPerPacket << " ns per packet."
+	);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include "Clock.h"
+
+// How often the controller adjusts the release offset, as long as enough packets were released meanwhile.
+#define HOLD_CONTROLLER_INTERVAL std::chrono::milliseconds(100)
+#define HOLD_CONTROLLER_MIN_SAMPLES 16
+// The share of a window's mean error the offset is moved by.
+#define HOLD_CONTROLLER_GAIN 0.5
+// The most the packets are released ahead of their send time.
+#define HOLD_CONTROLLER_MAX_OFFSET std::chrono::milliseconds(50)
+
+// The samples of a batch of released packets, which the sender adds to the controller at once.
+// A packet later than the most the offset can make up for was held up by something else than the pipeline,
+// e.g. a stall of the sender, so it is left out.
+struct HOLD_SAMPLES {
+	double errorSumNs = 0;
+	size_t count = 0;
+	std::chrono::nanoseconds minHold = std::chrono::nanoseconds::max();
+
+	// Adds how late a packet held for the given time was released. Packets released early have a negative error.
+	void Add(std::chrono::nanoseconds error, std::chrono::nanoseconds hold) {
+		if (error > HOLD_CONTROLLER_MAX_OFFSET)
+			return;
+		errorSumNs += (double)error.count();
+		count += 1;
+		minHold = std::min(minHold, hold);
+	}
+};
+
+// Steers the mean hold time error to zero. The pipeline adds its own latency on top of the delay,
+// from the sender's wake-ups, lock waits, and injection, so the sender reports how late every packet was
+// released after its send time, and the controller releases the packets that much earlier.
+// It is an integral controller: at the end of every window the offset moves by a share of the window's mean error.
+// The offset applies to every packet alike, so the order the packets are released in doesn't change.
+// A packet can't be released before it was received, so the offset is never more than the shortest hold of a window,
+// or it would keep growing from an error it can't make up for.
+// The offset and the mean error can be read from any thread, the samples have to be added by one thread at a time.
+class HoldController {
+private:
+	bool _enabled = true;
+	std::atomic<long long> _offsetNs{ 0 };
+	TIME_DATA _windowStart;
+	bool _windowStarted = false;
+	double _windowSumNs = 0;
+	size_t _windowCount = 0;
+	std::chrono::nanoseconds _windowMinHold = std::chrono::nanoseconds::max();
+	// The mean error of the last window, and how many windows there have been.
+	std::atomic<double> _meanErrorNs{ 0 };
+	size_t _adjustments = 0;
+
+	void _adjust(TIME_DATA now) {
+		double meanErrorNs = _windowSumNs / _windowCount;
+		_meanErrorNs = meanErrorNs;
+		std::chrono::nanoseconds offset = Offset() + std::chrono::nanoseconds((long long)(meanErrorNs * HOLD_CONTROLLER_GAIN));
+		_offsetNs = std::max<std::chrono::nanoseconds>(
+			std::chrono::nanoseconds(0), std::min({ offset, _windowMinHold, std::chrono::nanoseconds(HOLD_CONTROLLER_MAX_OFFSET) })
+		).count();
+		_adjustments += 1;
+		_windowStart = now;
+		_windowSumNs = 0;
+		_windowCount = 0;
+		_windowMinHold = std::chrono::nanoseconds::max();
+	}
+
+public:
+	void SetEnabled(bool enabled) {
+		_enabled = enabled;
+		Reset();
+	}
+
+	bool IsEnabled() const {
+		return _enabled;
+	}
+
+	// Starts over from no offset.
+	void Reset() {
+		_offsetNs = 0;
+		_windowStarted = false;
+		_windowSumNs = 0;
+		_windowCount = 0;
+		_windowMinHold = std::chrono::nanoseconds::max();
+		_meanErrorNs = 0;
+		_adjustments = 0;
+	}
+
+	// How much earlier than their send time the packets are released.
+	std::chrono::nanoseconds Offset() const {
+		return std::chrono::nanoseconds(_offsetNs.load(std::memory_order_relaxed));
+	}
+
+	// Adds the samples of the packets released by the given time.
+	void AddSamples(TIME_DATA now, const HOLD_SAMPLES& samples) {
+		if (!_enabled || samples.count == 0)
+			return;
+		_windowMinHold = std::min(_windowMinHold, samples.minHold);
+		if (!_windowStarted) {
+			_windowStart = now;
+			_windowStarted = true;
+		}
+		_windowSumNs += samples.errorSumNs;
+		_windowCount += samples.count;
+		if (now - _windowStart >= HOLD_CONTROLLER_INTERVAL && _windowCount >= HOLD_CONTROLLER_MIN_SAMPLES)
+			_adjust(now);
+	}
+
+	// The mean error of the packets in the last window, with the offset already applied.
+	std::chrono::nanoseconds MeanError() const {
+		return std::chrono::nanoseconds((long long)_meanErrorNs.load(std::memory_order_relaxed));
+	}
+
+	size_t Adjustments() const {
+		return _adjustments;
+	}
+};
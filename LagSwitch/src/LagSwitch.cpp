@@ -6,9 +6,37 @@
 #include <mutex>
 #include <vector>
 #include <list>
+#include <set>
+#include <deque>
+#include <condition_variable>
 #include <iterator>
-#include <Windows.h>
-#include "windivert.h"
+#include <fstream>
+#include <cmath>
+#include <utility>
+#include "Platform.h"
+#include "Logging.h"
+#include "Clock.h"
+#include "LatencyTrace.h"
+#include "ThreadConfig.h"
+#include "PacketRewrite.h"
+#include "PacketCapture.h"
+#include "Benchmarks.h"
+#include "Simulation.h"
+#include "PacketDivert.h"
+#include "LoadGenerator.h"
+#include "SpillQueue.h"
+#include "RuleEngine.h"
+#include "ProcessTracker.h"
+#include "DivertSupervisor.h"
+#include "FaultInjector.h"
+#include "HoldController.h"
+#include "UdpEcho.h"
+#include "RttMonitor.h"
+#include "AsyncIo.h"
+#include "FlowProfiler.h"
+#include "AckCoalescer.h"
+#include "EventLog.h"
+#include "StatsSegment.h"
 
 // The test IP.
 // #define DEBUG_DST_IP "192.168.2.1"
@@ -53,75 +81,26 @@ long long TryStringToLongLong(const std::string & str, bool & success) {
 	}
 }
 
-std::mutex writeMutex;
+double TryStringToDouble(const std::string & str, bool & success) {
+	char* end;
 
-// This is the type of std::cout.
-typedef std::basic_ostream<char, std::char_traits<char> > CoutType;
-// This is the function signature of std::endl.
-typedef CoutType& (*StandardEndLine)(CoutType&);
+	double res = std::strtod(str.c_str(), &end);
 
-class locked_ostream {
-public:
-	template<typename T>
-	const locked_ostream& operator<<(const T& rhs) const {
-		// Delegate the operation to the std::cout stream.
-		std::cout << rhs;
-		// Return this instance by reference.
-		return *this;
-	}
-
-	// Overload for std::endl;
-	const locked_ostream& operator<<(StandardEndLine manipulator) const {
-		// Call the manipulator with the standard output stream.
-		manipulator(std::cout);
-		// Unlock the write mutex.
-		writeMutex.unlock();
-		// Return this instance by reference.
-		return *this;
+	if (!str.empty() && *end == '\0') {
+		success = true;
+		return res;
 	}
-};
-
-class synchronized_ostream {
-public:
-	template<typename T>
-	const locked_ostream& operator<<(const T& rhs) const {
-		// Lock the write mutex.
-		writeMutex.lock();
-		// Delegate the operation to the std::cout stream.
-		std::cout << rhs;
-		// Create a locked ostream object and return it.
-		return locked_ostream();
-	}
-
-	// Overload for std::endl;
-	const locked_ostream& operator<<(StandardEndLine manipulator) const {
-		// Call the manipulator with the standard output stream.
-		manipulator(std::cout);
-		// Unlock the write mutex.
-		writeMutex.unlock();
-		// Create a locked ostream object and return it.
-		return locked_ostream();
-	}
-
-	void NewLine() {
-		// Lock the write mutex.
-		writeMutex.lock();
-		// Write a new line to the standard output.
-		std::cout << std::endl;
-		// Unlock the write mutex.
-		writeMutex.unlock();
+	else {
+		success = false;
+		return 0;
 	}
-};
+}
+
+std::mutex writeMutex;
 
 // This is a more thread-safe version of std::cout. The line should always be ended with std::endl;
 synchronized_ostream sync_cout;
 
-#define SYNC_COUT(x) sync_cout << x << std::endl
-
-#define PRINT_TRACE(x) SYNC_COUT("[TRACE]: " << x)
-#define PRINT_INFO(x) SYNC_COUT("[INFO]: " << x)
-#define PRINT_ERROR(x) SYNC_COUT("[ERROR]: " << x)
-
 #if LOG_THREAD_ACTIVITY
 #define THREAD_TRACE_BASE(x) SYNC_COUT("[THREAD]" x)
 #else
@@ -134,84 +113,757 @@ synchronized_ostream sync_cout;
 
 #define SENDER_SLEEP_TIME std::chrono::milliseconds(SENDER_SLEEP_MS)
 
+// The latency the load test uses unless one is given.
+#define LOAD_TEST_LATENCY_MS 50
+// The most the spill benchmark writes to disk.
+#define SPILL_BENCHMARK_BYTES (2048ull * 1024 * 1024)
+// The amount of rules the rule benchmark classifies packets against.
+#define RULE_BENCHMARK_RULES 1000
+// The size of the memory segments frozen packets are held in.
+#define FREEZE_SEGMENT_BYTES (4 * 1024 * 1024)
+// The most memory frozen packets take unless another cap is given.
+#define FREEZE_DEFAULT_CAP_MB 256
+// The most packets and bytes injected with a single call when releasing frozen packets.
+#define RELEASE_BATCH_PACKETS WINDIVERT_BATCH_MAX
+#define RELEASE_BATCH_BYTES (256 * 1024)
+// How often the sender wakes up while releasing frozen packets at a pace, so they go out in small bursts.
+#define RELEASE_PACE_INTERVAL std::chrono::milliseconds(1)
+// How long the freeze benchmark lets the traffic run before freezing and after the release.
+#define FREEZE_BENCHMARK_MARGIN std::chrono::milliseconds(500)
+// How much further the hold time compensation may release the packets early after the frozen backlog has been sent.
+#define FREEZE_BENCHMARK_MAX_COMPENSATION std::chrono::milliseconds(2)
+// How often the fault benchmark fails the divert's calls, and the seed it picks the failures with.
+#define FAULT_BENCHMARK_TRANSIENT_RATE 0.001
+#define FAULT_BENCHMARK_BAD_PACKET_RATE 0.0002
+#define FAULT_BENCHMARK_HANDLE_LOSS_RATE 0.00005
+#define FAULT_BENCHMARK_SEED 1
+// The injector threads a delayer pool sends with unless another count is given.
+#define POOL_DEFAULT_INJECTORS 2
+// The most profiles the profile benchmark runs in a pool. It also runs fewer to compare the thread counts.
+#define PROFILE_BENCHMARK_PROFILES 64
+// How long the loopback benchmark waits for the last echoes after the latency.
+#define LOOPBACK_BENCHMARK_DRAIN std::chrono::milliseconds(500)
+// How long the load test waits after the last packet is due before stopping the delayer.
+#define LOAD_TEST_DRAIN_TIME std::chrono::milliseconds(SENDER_SLEEP_MS * 3 + 100)
+// How many packets every run of the policy benchmark sends, how many rounds of runs it takes the median ratios of,
+// and how many packets it hands to the path between sends.
+#define POLICY_BENCHMARK_PACKETS 200000
+#define POLICY_BENCHMARK_ROUNDS 21
+#define POLICY_BENCHMARK_BATCH 64
+// The most the specialized path may cost over the pre-policy one, unless the benchmark measures more noise than this.
+#define POLICY_BENCHMARK_MAX_REGRESSION 0.05
+// How many packets every run of the I/O benchmark sends, and how many runs of each I/O mode it takes the median of.
+#define IO_BENCHMARK_PACKETS 500000
+#define IO_BENCHMARK_ROUNDS 5
+// How many packets every run of the event log benchmark sends, how many runs it takes the median of,
+// and the packet rate it reports the cost at.
+#define EVENT_LOG_BENCHMARK_PACKETS 500000
+#define EVENT_LOG_BENCHMARK_ROUNDS 5
+#define EVENT_LOG_BENCHMARK_RATE 100000
+// How many packets every run of the stats benchmark sends, how many runs it takes the median of, how often its reader
+// polls the segment meanwhile, and the name of the segment unless one is given.
+#define STATS_BENCHMARK_PACKETS 500000
+#define STATS_BENCHMARK_ROUNDS 5
+#define STATS_BENCHMARK_POLL_US 100
+#define STATS_BENCHMARK_NAME "LagSwitchStatsBenchmark"
+// How long a deactivation waits for the held packets to drain unless another timeout is given.
+#define DRAIN_DEFAULT_TIMEOUT_MS 2000
+// The latency the drain benchmark holds the packets for unless one is given, and how many profiles its pool runs.
+#define DRAIN_BENCHMARK_LATENCY_MS 500
+#define DRAIN_BENCHMARK_PROFILES 4
+// The bytes a packet list with a weight of 1 may send every round of the fair release order, about one full packet.
+#define RELEASE_QUANTUM_BYTES 1500
+// The packet lists the flows delayed to a target round trip time are spread over by their hash, after the rule queues,
+// so a flow held for less rarely waits for one held for more and the rules' queues keep only their own packets.
+#define TARGET_QUEUE_COUNT 7
+#define PACKET_LIST_COUNT (RULE_QUEUE_COUNT + TARGET_QUEUE_COUNT)
+// The round trip time the target benchmark delays its flows to unless one is given, and how far the median
+// of a flow may be from it.
+#define TARGET_BENCHMARK_RTT_MS 200
+#define TARGET_BENCHMARK_TOLERANCE_MS 5
+
+// The optional parts of the delayer's per-packet path. The path is compiled for every combination of them,
+// and an activated delayer runs the one with only the parts its settings and state use, so a disabled part costs no branch.
+// The packets are scheduled on a replaced clock and may be recorded instead of sent.
+#define POLICY_SIMULATED_CLOCK 0x01
+// The delays are played back from a trace instead of being the fixed latency.
+#define POLICY_TRACE 0x02
+// The packets are checked against the target process, classified by rules, or rewritten.
+#define POLICY_CLASSIFY 0x04
+// The packets due late are spilled to disk.
+#define POLICY_SPILL 0x08
+// The packets are released early by the hold time compensation.
+#define POLICY_COMPENSATION 0x10
+// The released packets are captured or reported to the RTT monitor, or the held packets are profiled.
+#define POLICY_SINK 0x20
+// The delays count from the divert's capture timestamps.
+#define POLICY_CAPTURE_TIME 0x40
+// The packets are frozen, released from a freeze, or drained. Unlike the other parts, this one is switched while
+// the delayer runs, whenever the freeze or the drain starts or ends.
+#define POLICY_HOLD 0x80
+#define POLICY_ALL 0xFF
+
 // Contains the void pointer to the packet, the packet length, and the packet address.
 typedef std::tuple<PVOID, UINT, WINDIVERT_ADDRESS*> PACKET_DATA;
-typedef std::chrono::time_point<std::chrono::steady_clock> TIME_DATA;
-typedef std::pair<PACKET_DATA, TIME_DATA> PACKET_TIME_DATA;
+// The time a packet was received at and the time it should be sent at.
+struct PACKET_TIMES {
+	TIME_DATA received;
+	TIME_DATA send;
+};
+typedef std::pair<PACKET_DATA, PACKET_TIMES> PACKET_TIME_DATA;
+
+// Orders packets by the time they are due.
+struct DueEarlier {
+	bool operator()(const PACKET_TIME_DATA& a, const PACKET_TIME_DATA& b) const {
+		return a.second.send < b.second.send;
+	}
+};
+
+// Orders packets by the time they were received.
+struct ReceivedEarlier {
+	bool operator()(const PACKET_TIME_DATA& a, const PACKET_TIME_DATA& b) const {
+		return a.second.received < b.second.received;
+	}
+};
+
+// The packet counts of a packet list.
+struct QUEUE_COUNTS {
+	size_t received = 0;
+	// The packets taken from the list to be sent, and their bytes.
+	size_t released = 0;
+	UINT64 releasedBytes = 0;
+	size_t buffered = 0;
+};
+
+// The packet counts the logger reports every second.
+struct DELAYER_COUNTS {
+	size_t received = 0;
+	size_t sent = 0;
+	// The packets waiting to be sent.
+	size_t buffered = 0;
+	size_t dropped = 0;
+	// The packets the rules dropped and sent right away.
+	size_t ruleDropped = 0;
+	size_t bypassed = 0;
+	// The hold time compensation and the mean error left after it.
+	std::chrono::nanoseconds compensation{ 0 };
+	std::chrono::nanoseconds holdError{ 0 };
+	// The heaviest flows of the profiler's window, and the window's packets and bytes.
+	std::vector<PROFILER_FLOW> topFlows;
+	PROFILER_COUNTER profiledWindow{};
+	// The pure ACKs replaced by newer ones, and their bytes.
+	size_t coalesced = 0;
+	UINT64 coalescedBytes = 0;
+	// The counts of each packet list. Only counted with rules.
+	QUEUE_COUNTS queues[RULE_QUEUE_COUNT];
+};
+
+// Whether the delayer holds every packet instead of delaying it.
+enum class FreezeState {
+	Off,
+	Frozen,
+	// The frozen packets are being sent. New packets are added behind them until they have all been sent.
+	Releasing
+};
+
+// What the delayer does with the packets it holds when it is deactivated.
+enum class DrainPolicy {
+	// The packets are sent when they are due, as if the delayer had stayed active.
+	Schedule,
+	// The packets are sent right away in batches, at the release rate if one is set, like a frozen backlog.
+	Flush,
+	// The packets are dropped.
+	Drop
+};
+
+inline const char* DrainPolicyName(DrainPolicy policy) {
+	switch (policy) {
+	case DrainPolicy::Schedule: return "schedule";
+	case DrainPolicy::Flush: return "flush";
+	case DrainPolicy::Drop: return "drop";
+	}
+	return "unknown";
+}
+
+// The order the packets that are due at the same time in different packet lists are sent in.
+enum class ReleaseOrder {
+	// In the order they were due, the first list first when they were due at the same time.
+	Due,
+	// The lists with higher weights first. Lists with equal weights go in the order of their numbers.
+	Priority,
+	// Each list gets a share of the bytes sent in proportion to its weight, with deficit round robin.
+	Fair
+};
+
+inline const char* ReleaseOrderName(ReleaseOrder order) {
+	switch (order) {
+	case ReleaseOrder::Due: return "due";
+	case ReleaseOrder::Priority: return "priority";
+	case ReleaseOrder::Fair: return "fair";
+	}
+	return "unknown";
+}
+
+class DelayerPool;
 
 class Delayer {
 private:
+	// A pool runs the delayers added to it on its own threads.
+	friend class DelayerPool;
+
 	bool _initialized;
 
-	HANDLE _winDivertHandle;
-	std::mutex _handleMutex;
+	// The packets are diverted through WinDivert unless another divert is set.
+	WinDivertHandle _winDivert;
+	PacketDivert* _divert = &_winDivert;
+	// Receives with a thread per role, or with the event loop and the engine's operations in flight.
+	IoMode _ioMode = IoMode::Threads;
+	std::unique_ptr<AsyncEngine> _engine;
+	// Batches the sent packets into the engine's sends in the async I/O mode.
+	AsyncSender _asyncSender;
+	// What the packets are sent through: the divert, or the async sender.
+	PacketDivert* _sendTarget = &_winDivert;
+	// Whether the delays count from the driver's capture timestamps instead of from when the receiver gets the packets.
+	bool _useCaptureTime = true;
+	// Releases the packets early by the latency the pipeline adds, measured from the packets it has sent.
+	// A delayer in a pool shares the pool's controller, since its packets go through the pool's threads.
+	HoldController _ownHoldController;
+	HoldController* _holdController = &_ownHoldController;
+	// Measures the round trip times of the flows from the packets the sender releases. Null if they aren't measured.
+	RttMonitor* _rttMonitor = nullptr;
+	// Finds the flows that the most held bytes come from. Guarded by the packet mutex.
+	FlowProfiler _profiler;
+	// Retries the failed calls and reopens the divert when it stops working.
+	// A delayer in a pool shares the pool's supervisor, since it shares the pool's divert.
+	DivertSupervisor _ownSupervisor;
+	DivertSupervisor* _supervisor = &_ownSupervisor;
+	// The error the last send failed with, which the sender recovers from once it has unlocked the packet mutex.
+	bool _sendFaultPending = false;
+	DivertFault _sendFault = DivertFault::Transient;
+	UINT64 _sendFaultGeneration = 0;
+	// The failed sends in a row.
+	UINT _sendFailures = 0;
 
 	std::chrono::milliseconds _latency;
 
-	HANDLE _getHandle() {
-		std::lock_guard<std::mutex> lock(_handleMutex);
-		return _winDivertHandle;
+	// The clock the packets are scheduled with. Replaced by a virtual clock while simulating.
+	SystemClock _systemClock;
+	Clock* _clock = &_systemClock;
+	// Receives the release times while simulating, null otherwise.
+	SimulationRecorder* _recorder = nullptr;
+
+	// Reads the time on the hot path. The system clock is read without going through the clock interface
+	// unless the clock may have been replaced.
+	template <UINT Policies>
+	TIME_DATA _now() {
+		if (Policies & POLICY_SIMULATED_CLOCK)
+			return _clock->Now();
+		return std::chrono::steady_clock::now();
+	}
+
+	// The trace the delays are played back from. Used instead of the fixed latency when open.
+	LatencyTrace _trace;
+	// The time the delayer was activated at. Time-indexed traces are played back from this point.
+	TIME_DATA _activationTime;
+	// The total received packet count at activation. Packet-indexed traces are played back from this point.
+	size_t _activationReceived;
+
+	// Gets the delay of the next received packet.
+	// The caller should lock the packet mutex.
+	template <UINT Policies>
+	std::chrono::microseconds _getDelay(TIME_DATA receiveTime) {
+		if (!(Policies & POLICY_TRACE) || !_trace.IsOpen())
+			return _latency;
+		return _trace.GetDelay(
+			_totalReceived - _activationReceived,
+			std::chrono::duration_cast<std::chrono::microseconds>(receiveTime - _activationTime)
+		);
 	}
 
-	bool _active;
+	// Atomic since the stats publisher reads it.
+	std::atomic<bool> _active{ false };
 
 	std::string _filter;
+	// The local port the filter accepts packets from.
+	int _port;
+
+	// The pool the delayer is active in, and its place in the pool. Null when the delayer runs its own threads.
+	DelayerPool* _pool = nullptr;
+	size_t _poolIndex = 0;
+	// The delayer's own divert, restored when it leaves the pool.
+	PacketDivert* _soloDivert = nullptr;
+
+	// Tells the pool the delayer has packets due at the given time. Does nothing outside a pool.
+	// The caller should lock the packet mutex.
+	void _wake(TIME_DATA due);
+	// Adds the samples of the packets the sender released to the hold time controller.
+	// The caller should lock the packet mutex.
+	void _addHoldSamples(TIME_DATA now, const HOLD_SAMPLES& samples);
 
-	// A list of elements containing the pointers to the packet data and the receive time.
-	// The packet list is always sorted from oldest to newest,
+	// Lists of elements containing the pointers to the packet data and the send time.
+	// Each packet list is always sorted from oldest to newest,
 	// since the most recent packets are appended to the end.
-	std::list<PACKET_TIME_DATA> _packets;
+	// With a trace or rules the send times may be out of order, in which case a packet waits for
+	// the packets in front of it, just like on a real link that doesn't reorder packets.
+	// Packets go to the first list unless a rule puts them in another one, where they don't wait for the first list.
+	// The flows delayed to a target round trip time go to the target lists after the rule queues instead of the first list.
+	std::list<PACKET_TIME_DATA> _queues[PACKET_LIST_COUNT];
+	// How many packets were ever added to each list. Packets only leave a list from the front, so the packets in it
+	// are the last ones added, which tells whether the packet added at a given place is still in the list.
+	UINT64 _queuePushed[PACKET_LIST_COUNT] = {};
+	// The counts of each rule queue since the logger last took them, the target lists counted as the first queue.
+	// Guarded by the packet mutex.
+	QUEUE_COUNTS _queueCounts[RULE_QUEUE_COUNT];
+	// How the due packets of different lists are ordered, the weight of each list, and the lists from the highest
+	// priority to the lowest. The target lists have the first list's weight and rank right after it.
+	ReleaseOrder _releaseOrder = ReleaseOrder::Due;
+	UINT _queueWeights[PACKET_LIST_COUNT];
+	UINT _queueRanks[PACKET_LIST_COUNT];
+
+	// The rule queue a packet list counts as.
+	static UINT _ruleQueue(UINT list) {
+		return list < RULE_QUEUE_COUNT ? list : 0;
+	}
+
+	// Ranks the lists from the highest weight to the lowest, the target lists right after the first list.
+	void _rankQueues() {
+		for (UINT rank = 0; rank < PACKET_LIST_COUNT; ++rank)
+			_queueRanks[rank] = rank == 0 ? 0 : rank <= TARGET_QUEUE_COUNT ? RULE_QUEUE_COUNT + rank - 1 : rank - TARGET_QUEUE_COUNT;
+		std::stable_sort(_queueRanks, _queueRanks + PACKET_LIST_COUNT, [this](UINT a, UINT b) {
+			return _queueWeights[a] > _queueWeights[b];
+		});
+	}
+	// Replaces the queued pure ACKs of a connection with newer ones. Guarded by the packet mutex.
+	AckCoalescer _ackCoalescer;
+	// The due packets a send failed for with an error that can be recovered from, in the order they were due.
+	// They are sent before any other packet once sending works again.
+	std::vector<PACKET_TIME_DATA> _retry;
+	// The bytes of the packets in the lists, for the stats segment. Guarded by the packet mutex.
+	UINT64 _queuedBytes = 0;
 	std::mutex _packetMutex;
 
-	// Gets a vector of packets older than the latency.
+	// Gets the amount of packets in the packet lists and waiting to be sent again.
 	// The caller should lock the packet mutex.
-	std::vector<PACKET_DATA> _getPackets() {
-		SEND_TRACE("Getting packets...");
-		TIME_DATA current_time = std::chrono::steady_clock::now();
-		std::vector<PACKET_DATA> packets;
-		// The packet list iterator.
-		std::list<PACKET_TIME_DATA>::const_iterator elem = _packets.cbegin();
-		// Iterate over the list.
-		while (elem != _packets.end()) {
-			// Check if the packet is older than the given latency.
-			if (current_time - elem->second > _latency) {
-				// If it is, add the packet to the vector.
-				SEND_TRACE("Got packet older than the given latency. Setting data...");
-				packets.emplace_back(elem->first);
-				// Remove the element from the list.
-				elem = _packets.erase(elem);
+	size_t _queuedCount() const {
+		size_t count = _retry.size();
+		for (const std::list<PACKET_TIME_DATA>& queue : _queues)
+			count += queue.size();
+		return count;
+	}
+
+	// The packets due later than the spill time are kept on disk in the spill queue instead of the packet list,
+	// and so are the packets received after them to keep the order. Disabled when zero.
+	// Spilled packets are read back into the packet list once they are due within half the spill time.
+	SpillQueue _spill;
+	std::chrono::milliseconds _spillAfter = std::chrono::milliseconds(0);
+
+	// While frozen nothing is sent, and every received packet is held in memory segments until the release,
+	// up to the freeze cap. The backlog is released in batches, either as fast as possible or at the release rate.
+	SpillQueue _frozen{ FREEZE_SEGMENT_BYTES };
+	std::atomic<FreezeState> _freezeState{ FreezeState::Off };
+	UINT64 _freezeCapBytes = FREEZE_DEFAULT_CAP_MB * 1024ull * 1024;
+	// The release pace in packets per second. Zero releases the packets as fast as they can be injected.
+	double _releaseRate = 0;
+	TIME_DATA _freezeTime;
+	// When the first batch was sent. The pace is kept from this point.
+	TIME_DATA _releaseTime;
+	bool _releaseStarted = false;
+	// The backlog at the release, the packets released since, and the packets dropped for going over the cap.
+	size_t _releaseBacklog = 0;
+	UINT64 _releaseBacklogBytes = 0;
+	UINT64 _releasedCount = 0;
+	size_t _freezeDropped = 0;
+	// The buffers the batches are built in, kept between releases.
+	std::vector<BYTE> _releaseBatch;
+	std::vector<WINDIVERT_ADDRESS> _releaseAddresses;
+	std::vector<INT64> _releaseReceived;
+
+	// What happens to the held packets on deactivation, and the longest the deactivation waits for them to be sent.
+	DrainPolicy _drainPolicy = DrainPolicy::Schedule;
+	std::chrono::milliseconds _drainTimeout = std::chrono::milliseconds(DRAIN_DEFAULT_TIMEOUT_MS);
+	// Set while the held packets drain, so the packets received meanwhile aren't delayed and follow them out.
+	std::atomic<bool> _draining{ false };
+
+	// Starts sending the frozen backlog. The caller should lock the packet mutex.
+	void _startRelease() {
+		_releaseBacklog = _frozen.Count();
+		_releaseBacklogBytes = _frozen.Bytes();
+		_releasedCount = 0;
+		_releaseStarted = false;
+		_freezeState = FreezeState::Releasing;
+		_wake(_clock->Now());
+	}
+
+	// Sends as much of the frozen backlog as the release pace allows, in batches.
+	// If a batch fails, its packets are sent again one at a time with the packets to retry.
+	// The caller should lock the packet mutex.
+	void _releaseFrozen() {
+		TIME_DATA now = _clock->Now();
+		if (!_releaseStarted) {
+			_releaseTime = now;
+			_releaseStarted = true;
+		}
+		UINT64 allowed = _frozen.Count();
+		if (_releaseRate > 0) {
+			UINT64 due = (UINT64)(std::chrono::duration<double>(now - _releaseTime).count() * _releaseRate) + 1;
+			allowed = due > _releasedCount ? std::min<UINT64>(allowed, due - _releasedCount) : 0;
+		}
+		while (allowed > 0) {
+			_releaseBatch.clear();
+			_releaseAddresses.clear();
+			_releaseReceived.clear();
+			while (allowed > 0 && _releaseAddresses.size() < RELEASE_BATCH_PACKETS) {
+				const SPILL_RECORD* record = _frozen.Front();
+				if (!_releaseAddresses.empty() && _releaseBatch.size() + record->length > RELEASE_BATCH_BYTES)
+					break;
+				const BYTE* data = (const BYTE*)(record + 1);
+				_releaseBatch.insert(_releaseBatch.end(), data, data + record->length);
+				_releaseAddresses.push_back(record->address);
+				_releaseReceived.push_back(record->received);
+				_frozen.Pop();
+				allowed -= 1;
 			}
-			else {
-				// If it isn't, return the list.
-				// The rest of the packets in the list will all be newer because of the ordering of the packets.
-				SEND_TRACE("Packet was " << std::chrono::duration_cast<std::chrono::milliseconds>(current_time - elem->second).count() << " ms old.");
-				return packets;
+			UINT count = (UINT)_releaseAddresses.size();
+			UINT64 generation = _supervisor->Generation();
+			UINT sentLength = 0;
+			bool success = _sendTarget->SendBatch(_releaseBatch.data(), (UINT)_releaseBatch.size(), _releaseAddresses.data(), count, &sentLength);
+			DWORD error = GetLastError();
+			if (success)
+				sentLength = (UINT)_releaseBatch.size();
+			_releasedCount += count;
+			// Count and capture the packets that were sent. After a failure, that can be some of them.
+			TIME_DATA released = _clock->Now();
+			const BYTE* packet = _releaseBatch.data();
+			const BYTE* end = packet + _releaseBatch.size();
+			UINT sent = 0;
+			while (sent < count) {
+				UINT length = IpPacketLength(packet, (UINT)(end - packet));
+				if (packet + length > _releaseBatch.data() + sentLength)
+					break;
+				if (_recording()) {
+					_record(
+						packet, length, _releaseAddresses[sent].Outbound, TIME_DATA(TIME_DATA::duration(_releaseReceived[sent])),
+						released, CaptureResult::Sent
+					);
+				}
+				if (_rttMonitor != nullptr && _releaseAddresses[sent].Outbound)
+					_rttMonitor->OnOutbound(packet, length, TIME_DATA(TIME_DATA::duration(_releaseReceived[sent])), released);
+				if (_stats.IsOpen())
+					_stats.RecordHold(released - TIME_DATA(TIME_DATA::duration(_releaseReceived[sent])));
+				packet += length;
+				sent += 1;
+			}
+			_sentCount += sent;
+			_totalSent += sent;
+			if (!success) {
+				_retryBatch(sent, count, packet);
+				// A rejected packet is skipped when the rest are sent again, other errors are recovered from first.
+				DivertFault fault = ClassifySendError(error);
+				if (fault != DivertFault::BadPacket)
+					_deferSendFault(fault, generation, error);
+				return;
+			}
+		}
+		if (_frozen.IsEmpty()) {
+			double releaseMs = std::chrono::duration<double, std::milli>(_clock->Now() - _releaseTime).count();
+			UINT64 receivedDuring = _releasedCount > _releaseBacklog ? _releasedCount - _releaseBacklog : 0;
+			PRINT_INFO(
+				"Released the backlog of " << _releaseBacklog << " packets (" << _releaseBacklogBytes / 1024 << " KB) in "
+				<< releaseMs << " ms, along with " << receivedDuring << " packets received during the release."
+			);
+			_freezeState = FreezeState::Off;
+			_selectHotPath();
+		}
+	}
+
+	// Moves the packets of the release batch that weren't sent, starting from the given packet, to the packets to retry.
+	void _retryBatch(UINT first, UINT count, const BYTE* data) {
+		TIME_DATA now = _clock->Now();
+		const BYTE* end = _releaseBatch.data() + _releaseBatch.size();
+		for (UINT i = first; i < count; ++i) {
+			UINT length = IpPacketLength(data, (UINT)(end - data));
+			byte* packet = new byte[length];
+			std::memcpy(packet, data, length);
+			PACKET_TIMES times{ TIME_DATA(TIME_DATA::duration(_releaseReceived[i])), now };
+			_retry.emplace_back(PACKET_DATA(packet, length, new WINDIVERT_ADDRESS(_releaseAddresses[i])), times);
+			data += length;
+		}
+	}
+
+	// Leaves the error of a failed send for the sender to recover from once it has unlocked the packet mutex.
+	void _deferSendFault(DivertFault fault, UINT64 generation, DWORD error) {
+		SEND_TRACE("Sending failed with error code " << error << " (" << DivertFaultName(fault) << "), retrying.");
+		_sendFaultPending = true;
+		_sendFault = fault;
+		_sendFaultGeneration = generation;
+	}
+
+	// Moves the spilled packets that are due soon to the end of the first packet list.
+	// Everything spilled was received after the packets in the list, so the list stays in order.
+	// The caller should lock the packet mutex.
+	void _readSpilled(TIME_DATA now) {
+		while (!_spill.IsEmpty()) {
+			const SPILL_RECORD* record = _spill.Front();
+			if (record == nullptr)
+				return;
+			TIME_DATA send = TIME_DATA(TIME_DATA::duration(record->send));
+			if (send - now > _spillAfter / 2)
+				return;
+			byte* packet = new byte[record->length];
+			std::memcpy(packet, record + 1, record->length);
+			PACKET_DATA data(packet, record->length, new WINDIVERT_ADDRESS(record->address));
+			PACKET_TIMES times{ TIME_DATA(TIME_DATA::duration(record->received)), send };
+			_spill.Pop();
+			// The packets read back are coalesced like the ones queued directly, in the order they were received.
+			bool coalescing = _ackCoalescer.IsEnabled();
+			if (!coalescing || !_coalesceAck(data, 0))
+				_appendQueued(data, times, 0, coalescing);
+		}
+	}
+
+	// Puts a pure ACK in the place of the last one queued for its connection in the given list, if it only acknowledges
+	// more, keeping that one's send time. Returns false if the packet has to be queued with _appendQueued().
+	// The caller should lock the packet mutex.
+	bool _coalesceAck(const PACKET_DATA& packet, UINT queue) {
+		PACKET_TIME_DATA* queued = (PACKET_TIME_DATA*)_ackCoalescer.Replace(
+			std::get<0>(packet), std::get<1>(packet), queue, _queuePushed[queue] - _queues[queue].size()
+		);
+		if (queued == nullptr)
+			return false;
+		_totalCoalesced += 1;
+		_totalCoalescedBytes += std::get<1>(queued->first);
+		_queuedBytes += std::get<1>(packet);
+		_queuedBytes -= std::get<1>(queued->first);
+		delete[] (byte*)std::get<0>(queued->first);
+		delete std::get<2>(queued->first);
+		queued->first = packet;
+		return true;
+	}
+
+	// Adds a packet to the end of a packet list. The coalescer remembers it if it was checked for coalescing.
+	// The caller should lock the packet mutex.
+	void _appendQueued(const PACKET_DATA& packet, const PACKET_TIMES& times, UINT queue, bool coalescing) {
+		_queues[queue].emplace_back(packet, times);
+		_queuePushed[queue] += 1;
+		_queuedBytes += std::get<1>(packet);
+		if (coalescing)
+			_ackCoalescer.Queued(queue, _queuePushed[queue] - 1, &_queues[queue].back());
+	}
+
+	// Counts a packet taken from a packet list to be sent.
+	// The caller should lock the packet mutex.
+	void _countReleased(UINT queue, const PACKET_TIME_DATA& packet) {
+		_queuedBytes -= std::get<1>(packet.first);
+		_queueCounts[_ruleQueue(queue)].released += 1;
+		_queueCounts[_ruleQueue(queue)].releasedBytes += std::get<1>(packet.first);
+	}
+
+	// Adds the packets of every list that are due by the release time to the vector in the release order.
+	// Each packet takes a constant amount of work, there's no sorting.
+	// The caller should lock the packet mutex.
+	void _getOrderedPackets(TIME_DATA release_time, std::vector<PACKET_TIME_DATA>& packets) {
+		// The first packet in each list that isn't due yet. The packets in front of it are due.
+		std::list<PACKET_TIME_DATA>::iterator dueEnds[PACKET_LIST_COUNT];
+		for (UINT q = 0; q < PACKET_LIST_COUNT; ++q) {
+			dueEnds[q] = _queues[q].begin();
+			while (dueEnds[q] != _queues[q].end() && release_time >= dueEnds[q]->second.send)
+				++dueEnds[q];
+		}
+		if (_releaseOrder == ReleaseOrder::Priority) {
+			for (UINT rank = 0; rank < PACKET_LIST_COUNT; ++rank) {
+				UINT q = _queueRanks[rank];
+				while (_queues[q].begin() != dueEnds[q]) {
+					_countReleased(q, _queues[q].front());
+					packets.emplace_back(_queues[q].front());
+					_queues[q].pop_front();
+				}
+			}
+			return;
+		}
+		// Every round, a list with due packets may send as many bytes as its weight in quanta and what it had left
+		// over from the previous round. A list that runs out of due packets loses what it had left.
+		UINT64 deficits[PACKET_LIST_COUNT] = {};
+		bool pending = true;
+		while (pending) {
+			pending = false;
+			for (UINT q = 0; q < PACKET_LIST_COUNT; ++q) {
+				std::list<PACKET_TIME_DATA>& queue = _queues[q];
+				if (queue.begin() == dueEnds[q])
+					continue;
+				deficits[q] += (UINT64)_queueWeights[q] * RELEASE_QUANTUM_BYTES;
+				while (queue.begin() != dueEnds[q] && std::get<1>(queue.front().first) <= deficits[q]) {
+					deficits[q] -= std::get<1>(queue.front().first);
+					_countReleased(q, queue.front());
+					packets.emplace_back(queue.front());
+					queue.pop_front();
+				}
+				if (queue.begin() == dueEnds[q])
+					deficits[q] = 0;
+				else
+					pending = true;
+			}
+		}
+	}
+
+	// Gets a vector of packets whose send time has passed.
+	// The caller should lock the packet mutex.
+	template <UINT Policies>
+	std::vector<PACKET_TIME_DATA> _getPackets() {
+		SEND_TRACE("Getting packets...");
+		TIME_DATA current_time = _now<Policies>();
+		if (Policies & POLICY_SPILL)
+			_readSpilled(current_time);
+		// The packets are released ahead of their send time by the pipeline's own latency.
+		TIME_DATA release_time = current_time;
+		if (Policies & POLICY_COMPENSATION)
+			release_time += _holdController->Offset();
+		std::vector<PACKET_TIME_DATA> packets;
+		// Only rules put packets in the other lists.
+		if ((Policies & POLICY_CLASSIFY) && _releaseOrder != ReleaseOrder::Due) {
+			_getOrderedPackets(release_time, packets);
+			return packets;
+		}
+		size_t queuesWithPackets = 0;
+		for (UINT q = 0; q < ((Policies & POLICY_CLASSIFY) ? PACKET_LIST_COUNT : 1); ++q) {
+			std::list<PACKET_TIME_DATA>& queue = _queues[q];
+			size_t oldSize = packets.size();
+			// The packet list iterator.
+			std::list<PACKET_TIME_DATA>::const_iterator elem = queue.cbegin();
+			// Iterate over the list.
+			while (elem != queue.end()) {
+				// Check if the packet's send time has passed.
+				if (release_time >= elem->second.send) {
+					// If it has, add the packet to the vector.
+					SEND_TRACE("Got packet whose send time has passed. Setting data...");
+					packets.emplace_back(*elem);
+					if (Policies & POLICY_CLASSIFY)
+						_countReleased(q, *elem);
+					else
+						_queuedBytes -= std::get<1>(elem->first);
+					// Remove the element from the list.
+					elem = queue.erase(elem);
+				}
+				else {
+					// If it hasn't, move on to the next list.
+					// The rest of the packets in the list have to wait for this one because of the ordering of the packets.
+					SEND_TRACE("Packet is due in " << std::chrono::duration_cast<std::chrono::milliseconds>(elem->second.send - current_time).count() << " ms.");
+					break;
+				}
 			}
+			if (packets.size() != oldSize)
+				queuesWithPackets += 1;
 		}
-		// Return the empty vector if no packets were found.
+		// Packets from different lists are sent in the order they were due.
+		if (queuesWithPackets > 1) {
+			std::stable_sort(packets.begin(), packets.end(), DueEarlier());
+		}
+		// Return the vector, which is empty if no packets were found.
 		return packets;
 	}
 
+	// Gets the time the sender next has something to send at. Returns false if nothing is waiting to be sent.
+	// The caller should lock the packet mutex.
+	template <UINT Policies>
+	bool _nextDue(TIME_DATA& due) {
+		TIME_DATA now = _now<Policies>();
+		if ((Policies & POLICY_HOLD) && _freezeState == FreezeState::Frozen)
+			return false;
+		if (!_retry.empty() || ((Policies & POLICY_HOLD) && _freezeState == FreezeState::Releasing && _releaseRate == 0)) {
+			due = now;
+			return true;
+		}
+		bool found = false;
+		if ((Policies & POLICY_HOLD) && _freezeState == FreezeState::Releasing) {
+			due = now + RELEASE_PACE_INTERVAL;
+			found = true;
+		}
+		// Only the front of a list can be due, the rest wait for it.
+		for (UINT q = 0; q < ((Policies & POLICY_CLASSIFY) ? PACKET_LIST_COUNT : 1); ++q) {
+			const std::list<PACKET_TIME_DATA>& queue = _queues[q];
+			if (queue.empty())
+				continue;
+			TIME_DATA release = queue.front().second.send;
+			if (Policies & POLICY_COMPENSATION)
+				release -= _holdController->Offset();
+			if (!found || release < due)
+				due = release;
+			found = true;
+		}
+		// The spilled packets are read back once they are due within half the spill time.
+		if ((Policies & POLICY_SPILL) && !_spill.IsEmpty()) {
+			const SPILL_RECORD* record = _spill.Front();
+			TIME_DATA read = record != nullptr
+				? TIME_DATA(TIME_DATA::duration(record->send)) - _spillAfter / 2 : now + SENDER_SLEEP_TIME;
+			if (!found || read < due)
+				due = read;
+			found = true;
+		}
+		return found;
+	}
+
 	std::thread _receiverThread;
 	std::thread _senderThread;
+	// Replaces the receiver and sender threads in the async I/O mode.
+	std::thread _eventThread;
 
 	bool _shouldDeactivate = false;
 	std::mutex _activationStateMutex;
 
 	size_t _receivedCount;
 	size_t _totalReceived;
+	size_t _sentCount;
+	size_t _totalSent;
 
 	size_t _totalDropped;
 
+	// The header edits applied to every received packet before it is queued.
+	PacketRewriter _rewriter;
+
+	// The rules that decide what is done to each received packet. Packets that match no rule get the latency.
+	RuleEngine _rules;
+	// The packets the rules dropped and sent right away since the last log.
+	size_t _ruleDroppedCount;
+	size_t _bypassedCount;
+
+	// The process whose ports are delayed when set. Packets from other ports are sent on untouched and uncounted.
+	ProcessTracker* _tracker = nullptr;
+
+	// Records every released or dropped packet when open.
+	PacketCapture _capture;
+	// Records when every released or dropped packet was captured and released, and what happened to it, when open.
+	EventLog _eventLog;
+	// Publishes the counts and hold times for other processes when open.
+	StatsSegment _stats;
+
+	bool _recording() const {
+		return _capture.IsOpen() || _eventLog.IsOpen();
+	}
+
+	// Records a released or dropped packet in the capture and the event log, whichever are open.
+	void _record(const void* packet, UINT length, bool outbound, TIME_DATA captured, TIME_DATA released, CaptureResult result) {
+		if (_capture.IsOpen())
+			_capture.Capture(packet, length, outbound, captured, released, result);
+		if (_eventLog.IsOpen())
+			_eventLog.Log(packet, length, captured, released, result);
+	}
+
+	// The scheduling settings of the receiver, sender, and logger threads.
+	THREAD_CONFIG _receiverConfig;
+	THREAD_CONFIG _senderConfig;
+	THREAD_CONFIG _loggerConfig;
+
 	void _receiverLoop() {
-		static bool recalibrating = false;
-		static UINT oldSize = MAX_PACKET_LENGTH;
+		bool recalibrating = false;
+		UINT oldSize = MAX_PACKET_LENGTH;
+		ScopedThreadConfig threadConfig(_receiverConfig, "receiver");
 		PRINT_TRACE("Receiver loop started...");
 		UINT currentSize = MAX_PACKET_LENGTH;
 		PVOID currentPacket;
 		WINDIVERT_ADDRESS * currentAddress;
 		UINT received;
 		bool success = false;
+		// The failed receives in a row.
+		UINT failures = 0;
 		while (true) {
 			RECV_TRACE("Checking activation state...");
 			// Lock the activation state mutex for the duration of the deactivation check.
@@ -232,8 +884,8 @@ private:
 			RECV_TRACE("Created address buffer at address " << currentAddress << ".");
 			RECV_TRACE("Receiving next packet...");
 			// Receive the next packet in the queue.
-			success = WinDivertRecv(
-				_getHandle(),
+			UINT64 generation = _supervisor->Generation();
+			success = _divert->Recv(
 				currentPacket,
 				currentSize,
 				&received,
@@ -243,15 +895,15 @@ private:
 				PRINT_INFO("Tried to get packet with a buffer size of " << currentSize << " bytes...");
 			// Check for errors.
 			if (!success) {
-				// Add this packet to the dropped count.
-				{
-					std::lock_guard<std::mutex> lock(_packetMutex);
-					_totalDropped += 1;
-				}
 				DWORD error = GetLastError();
 				// If the last error was ERROR_INSUFFICIENT_BUFFER,
 				// set the current packet size to the received size and try again.
 				if (error == ERROR_INSUFFICIENT_BUFFER) {
+					// Add this packet to the dropped count.
+					{
+						std::lock_guard<std::mutex> lock(_packetMutex);
+						_totalDropped += 1;
+					}
 					if (!recalibrating) {
 						PRINT_INFO("Recalibrating packet size...");
 						oldSize = currentSize;
@@ -260,93 +912,315 @@ private:
 					currentSize *= 2;
 					PRINT_TRACE("Changed packet size to " << currentSize << " bytes.");
 					// Delete the old packet and address heap objects.
-					delete currentPacket;
+					delete[] (byte*)currentPacket;
 					delete currentAddress;
 					// Try again.
 					continue;
 				}
-				// Else if the error was ERROR_NO_DATA, close this thread and print the error.
-				else if (error == ERROR_NO_DATA) {
-					PRINT_ERROR("Encountered ERROR_NO_DATA, closing receiver thread.");
-					return;
-				}
-				else {
-					PRINT_ERROR("WinDivertRecv() failed with error code " << error << ". Closing the receiver thread.");
-					return;
+				delete[] (byte*)currentPacket;
+				delete currentAddress;
+				DivertFault fault = ClassifyRecvError(error);
+				// The handle is shut down when deactivating, in which case the check above closes the thread.
+				if (fault == DivertFault::Shutdown) {
+					std::lock_guard<std::mutex> lock(_activationStateMutex);
+					if (_shouldDeactivate)
+						continue;
 				}
+				RECV_TRACE("WinDivertRecv() failed with error code " << error << " (" << DivertFaultName(fault) << "), recovering.");
+				// Wait or reopen the handle, then try again. Nothing was received, so nothing was lost.
+				_supervisor->Recover(fault, generation, failures);
+				continue;
 			}
+			failures = 0;
 			RECV_TRACE("Received a packet successfully.");
 			if (recalibrating) {
 				PRINT_INFO("Recalibrated packet size:\nOld size: " << oldSize << "\nNew size: " << received);
 				currentSize = received;
 				recalibrating = false;
 			}
-			// Add the received packet to the packet list and increment the received packet counter.
+			(this->*_path().processReceived)(currentPacket, received, currentAddress);
+		}
+	}
+
+	// Handles a received packet: sends it on if it isn't the target's, classifies and rewrites it, and queues it.
+	// Takes over the packet and address buffers.
+	template <UINT Policies>
+	void _processReceived(PVOID currentPacket, UINT received, WINDIVERT_ADDRESS* currentAddress) {
+		// The delay counts from when the driver captured the packet, so the time it waited in the driver's queue
+		// and for the receiver is part of the latency instead of being added to it.
+		// The receiver stamps the packet itself, before waiting for the packet mutex, if there is no capture time.
+		TIME_DATA receiveTime = _now<Policies>();
+		TIME_DATA captureTime;
+		if ((Policies & POLICY_CAPTURE_TIME) && _useCaptureTime && _divert->CaptureTime(*currentAddress, captureTime) && captureTime < receiveTime)
+			receiveTime = captureTime;
+		if (!(Policies & POLICY_CLASSIFY)) {
+			_queuePacket<Policies>(PACKET_DATA(currentPacket, received, currentAddress), receiveTime);
+			return;
+		}
+		// The headers are parsed once for the tracker, the rules, and the target round trip time.
+		PACKET_HEADERS headers;
+		bool parsed = ParsePacketHeaders(currentPacket, received, headers);
+		// The packets of other processes are sent on as they are.
+		if (_tracker != nullptr && !(parsed && _tracker->OwnsPacket(headers))) {
+			_bypassPacket(PACKET_DATA(currentPacket, received, currentAddress), false);
+			return;
+		}
+		// Classify the packet before it is rewritten, so the rules see it as it was sent.
+		const RULE_ACTION* action = parsed ? _rules.Classify(headers, received) : nullptr;
+		if (action != nullptr && action->type == RuleActionType::Drop) {
+			RECV_TRACE("The packet matched a drop rule, dropping it.");
+			if ((Policies & POLICY_SINK) && _recording()) {
+				TIME_DATA now = _clock->Now();
+				_record(currentPacket, received, currentAddress->Outbound, now, now, CaptureResult::RuleDropped);
+			}
+			delete[] (byte*)currentPacket;
+			delete currentAddress;
 			std::lock_guard<std::mutex> lock(_packetMutex);
-			_packets.emplace_back(
-				PACKET_DATA(currentPacket, received, currentAddress),
-				std::chrono::steady_clock::now()
-			);
+			_ruleDroppedCount += 1;
+			return;
+		}
+		// A packet no rule matched is held just long enough for its flow to reach the target round trip time, once the flow
+		// has been measured. Every flow waits in the target list its hash picks, so a flow held for less rarely waits for one held for more.
+		RULE_ACTION targetAction;
+		UINT64 flowHash;
+		if (action == nullptr && _rttMonitor != nullptr && parsed && _rttMonitor->TargetDelay(headers, targetAction.delay, flowHash)) {
+			targetAction.type = RuleActionType::Delay;
+			targetAction.queue = RULE_QUEUE_COUNT + (UINT)(flowHash % TARGET_QUEUE_COUNT);
+			action = &targetAction;
+		}
+		// Rewrite the packet before queueing it, so the sender only has to inject it.
+		if (!_rewriter.IsEmpty() && !_rewriter.Apply(currentPacket, received, currentAddress)) {
+			RECV_TRACE("The packet's TTL ran out, dropping it.");
+			if ((Policies & POLICY_SINK) && _recording()) {
+				TIME_DATA now = _clock->Now();
+				_record(currentPacket, received, currentAddress->Outbound, now, now, CaptureResult::TtlExpired);
+			}
+			delete[] (byte*)currentPacket;
+			delete currentAddress;
+			std::lock_guard<std::mutex> lock(_packetMutex);
+			_totalDropped += 1;
+			return;
+		}
+		if (action != nullptr && action->type == RuleActionType::Bypass) {
+			_bypassPacket(PACKET_DATA(currentPacket, received, currentAddress), true);
+			return;
+		}
+		_queuePacket<Policies>(PACKET_DATA(currentPacket, received, currentAddress), receiveTime, action);
+		RECV_TRACE("Added the packet to the send buffer and updated packet counts.");
+	}
+
+	// Sends a packet right away. Packets a bypass rule matched are counted as received and sent and captured,
+	// the packets of processes that aren't targeted are not.
+	// The packet mutex is held while sending, so the packet is never sent at the same time as the sender's packets.
+	// A packet the divert rejects is dropped. After any other error the packet is left for the sender to retry,
+	// and it is counted like a delayed packet from then on.
+	void _bypassPacket(const PACKET_DATA& packet, bool counted) {
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		// A later ACK of the connection mustn't take the place of an ACK queued before this packet.
+		if (_ackCoalescer.IsEnabled())
+			_ackCoalescer.Forget(std::get<0>(packet), std::get<1>(packet));
+		bool success = _sendTarget->Send(std::get<0>(packet), std::get<1>(packet), std::get<2>(packet));
+		DWORD error = GetLastError();
+		TIME_DATA now = _clock->Now();
+		if (!success && ClassifySendError(error) != DivertFault::BadPacket) {
 			_receivedCount += 1;
 			_totalReceived += 1;
-			RECV_TRACE("Added the packet to the send buffer and updated packet counts.");
+			_retry.emplace_back(packet, PACKET_TIMES{ now, now });
+			_wake(now);
+			return;
+		}
+		if (counted && _recording()) {
+			_record(
+				std::get<0>(packet), std::get<1>(packet), std::get<2>(packet)->Outbound,
+				now, now, success ? CaptureResult::Sent : CaptureResult::SendFailed
+			);
+		}
+		delete[] (byte*)std::get<0>(packet);
+		delete std::get<2>(packet);
+		if (!success) {
+			_totalDropped += 1;
+			_supervisor->CountSkipped();
+			RECV_TRACE("WinDivertSend() rejected a bypassed packet with error code " << error << ", dropping it.");
+			return;
 		}
+		if (!counted)
+			return;
+		_receivedCount += 1;
+		_totalReceived += 1;
+		_sentCount += 1;
+		_totalSent += 1;
+		_bypassedCount += 1;
 	}
 
-	size_t _sentCount;
-	size_t _totalSent;
+	// Adds a received packet to its packet list and increments the received packet counter.
+	// The packet's delay counts from the given receive time.
+	// The rule action decides the delay and the list, without one the packet gets the latency in the first list.
+	template <UINT Policies>
+	void _queuePacket(const PACKET_DATA& packet, TIME_DATA receiveTime, const RULE_ACTION* action = nullptr) {
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		std::chrono::microseconds delay = (Policies & POLICY_CLASSIFY) && action != nullptr && action->type == RuleActionType::Delay
+			? action->delay : _getDelay<Policies>(receiveTime);
+		if ((Policies & POLICY_HOLD) && _draining)
+			delay = std::chrono::microseconds(0);
+		UINT queue = (Policies & POLICY_CLASSIFY) && action != nullptr ? action->queue : 0;
+		PACKET_TIMES times{ receiveTime, receiveTime + delay };
+		_receivedCount += 1;
+		_totalReceived += 1;
+		if (Policies & POLICY_CLASSIFY)
+			_queueCounts[_ruleQueue(queue)].received += 1;
+		if ((Policies & POLICY_SINK) && _profiler.IsEnabled())
+			_profiler.Add(std::get<0>(packet), std::get<1>(packet), receiveTime);
+		// The packets held outside the lists, and the ones sent right away, make the coalescer forget their connection's ACK.
+		bool coalescing = (Policies & POLICY_CLASSIFY) && _ackCoalescer.IsEnabled();
+		// Frozen packets are held until the release, behind the packets that are already held.
+		// A packet that doesn't fit under the cap isn't buffered, so the logger counts it as dropped.
+		if ((Policies & POLICY_HOLD) && _freezeState != FreezeState::Off) {
+			if (coalescing)
+				_ackCoalescer.Forget(std::get<0>(packet), std::get<1>(packet));
+			if (_frozen.Bytes() + std::get<1>(packet) > _freezeCapBytes || !_frozen.Push(
+				std::get<0>(packet), std::get<1>(packet), std::get<2>(packet),
+				receiveTime.time_since_epoch().count(), times.send.time_since_epoch().count()
+			))
+				_freezeDropped += 1;
+			delete[] (byte*)std::get<0>(packet);
+			delete std::get<2>(packet);
+			return;
+		}
+		// Only the first list spills.
+		// A packet that couldn't be spilled was received but never buffered, so the logger already counts it as dropped.
+		if ((Policies & POLICY_SPILL) && queue == 0 && _spillAfter.count() > 0 && (!_spill.IsEmpty() || times.send - receiveTime > _spillAfter)) {
+			bool wasEmpty = _spill.IsEmpty();
+			if (coalescing)
+				_ackCoalescer.Forget(std::get<0>(packet), std::get<1>(packet));
+			// The packet data is copied to the spill file, so the buffers can be freed right away.
+			_spill.Push(
+				std::get<0>(packet), std::get<1>(packet), std::get<2>(packet),
+				receiveTime.time_since_epoch().count(), times.send.time_since_epoch().count()
+			);
+			delete[] (byte*)std::get<0>(packet);
+			delete std::get<2>(packet);
+			if (wasEmpty)
+				_wake(times.send - _spillAfter / 2);
+			return;
+		}
+		// A pure ACK that only acknowledges more than the last one queued for its connection takes that one's place,
+		// keeping its send time.
+		if (coalescing && _coalesceAck(packet, queue))
+			return;
+		_appendQueued(packet, times, queue, coalescing);
+		// A packet behind others in its list is sent after them, so only a new front can be due sooner.
+		if (_queues[queue].size() == 1)
+			_wake((Policies & POLICY_COMPENSATION) ? times.send - _holdController->Offset() : times.send);
+	}
 
-	void _senderLoop() {
-		PRINT_TRACE("Sender loop started...");
+
+	// Sends the packets whose send time has passed, after the packets a failed send left to retry.
+	// A packet the divert rejects is skipped. After any other error, the packet and the ones after it are kept
+	// to be retried, and the sender recovers from the error once it has unlocked the packet mutex.
+	template <UINT Policies>
+	void _sendPackets() {
 		bool success = false;
-		while (true) {
-			SEND_TRACE("Locking packet mutex...");
-			{ // This starts the block where the packet mutex is locked.
-				std::lock_guard<std::mutex> lock(_packetMutex);
-				// Get the packets to send.
-				std::vector<PACKET_DATA> packets = _getPackets();
-				SEND_TRACE("Got " << packets.size() << " packets to send.");
-				// Loop through the packets and send each one.
-				for (size_t i = 0; i < packets.size(); ++i) {
-					SEND_TRACE("Sending the " << i << ". packet.");
-					// Send the packet.
-					success = WinDivertSend(
-						_winDivertHandle, // The WinDivert handle.
-						std::get<0>(packets[i]), // The pointer to the packet.
-						std::get<1>(packets[i]), // The length of the packet.
-						NULL, // The amount of bytes injected. NULL because this is not required.
-						std::get<2>(packets[i]) // The address of the injected packet.
-					);
-					
-					// Check errors.
-					if (!success) {
-						_totalDropped += 1;
-						DWORD error = GetLastError();
-
-						if (error = ERROR_INVALID_PARAMETER) {
-							PRINT_ERROR("WinDivertSend() failed from an invalid parameter. Closing the sender thread.");
-							return;
-						}
-						else {
-							PRINT_ERROR("WinDivertSend() failed with error code " << error << ". Closing the sender thread.");
-							return;
-						}
-					}
+		SEND_TRACE("Locking packet mutex...");
+		// The packet mutex is locked for the whole function.
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		// Nothing is sent while frozen.
+		if ((Policies & POLICY_HOLD) && _freezeState == FreezeState::Frozen)
+			return;
+		// Get the packets to send.
+		std::vector<PACKET_TIME_DATA> packets = _getPackets<Policies>();
+		// The controller only learns from the packets released on schedule. The packets sent behind a frozen backlog,
+		// while draining, or while recovering from a send error are late for reasons of their own.
+		bool sampled = (Policies & POLICY_COMPENSATION) && (!(Policies & POLICY_HOLD) || (_freezeState == FreezeState::Off && !_draining))
+			&& _retry.empty();
+		HOLD_SAMPLES samples;
+		if (!_retry.empty()) {
+			packets.insert(packets.begin(), _retry.begin(), _retry.end());
+			_retry.clear();
+		}
+		SEND_TRACE("Got " << packets.size() << " packets to send.");
+		UINT64 generation = _supervisor->Generation();
+		// Loop through the packets and send each one.
+		for (size_t i = 0; i < packets.size(); ++i) {
+			const PACKET_DATA& packet = packets[i].first;
+			SEND_TRACE("Sending the " << i << ". packet.");
+			// Send the packet. Simulated packets only have their release time recorded.
+			if ((Policies & POLICY_SIMULATED_CLOCK) && _recorder != nullptr) {
+				_recorder->Record(packets[i].second.received, packets[i].second.send, _clock->Now());
+				success = true;
+			}
+			else
+				success = _sendTarget->Send(
+					std::get<0>(packet), // The pointer to the packet.
+					std::get<1>(packet), // The length of the packet.
+					std::get<2>(packet) // The address of the injected packet.
+				);
+			TIME_DATA sentTime = _now<Policies>();
+			if (sampled && success)
+				samples.Add(sentTime - packets[i].second.send, packets[i].second.send - packets[i].second.received);
+
+			// Check errors.
+			if (!success) {
+				DWORD error = GetLastError();
+				DivertFault fault = ClassifySendError(error);
+				if (fault != DivertFault::BadPacket) {
+					// Keep this packet and the ones after it in order until the error has been recovered from.
+					_retry.assign(packets.begin() + i, packets.end());
+					_deferSendFault(fault, generation, error);
+					return;
+				}
+				// The packet was received but is never sent, so the logger counts it as dropped.
+				SEND_TRACE("WinDivertSend() rejected a packet with error code " << error << ", skipping it.");
+				_supervisor->CountSkipped();
+			}
 
-					SEND_TRACE("Packet sent successfully, deleting packet data.");
+			// Record the packet and what happened to it.
+			if ((Policies & POLICY_SINK) && _recording()) {
+				_record(
+					std::get<0>(packet), std::get<1>(packet), std::get<2>(packet)->Outbound,
+					packets[i].second.received, sentTime,
+					success ? CaptureResult::Sent : CaptureResult::SendFailed
+				);
+			}
+			if ((Policies & POLICY_SINK) && success && _rttMonitor != nullptr && _recorder == nullptr && std::get<2>(packet)->Outbound)
+				_rttMonitor->OnOutbound(std::get<0>(packet), std::get<1>(packet), packets[i].second.received, sentTime);
+			if ((Policies & POLICY_SINK) && success && _stats.IsOpen())
+				_stats.RecordHold(sentTime - packets[i].second.received);
 
-					// Delete the packet and address objects.
-					delete std::get<0>(packets[i]);
-					delete std::get<2>(packets[i]);
+			SEND_TRACE("Packet handled, deleting packet data.");
 
-					// Update the packet counters.
-					_sentCount += 1;
-					_totalSent += 1;
+			// Delete the packet and address objects.
+			delete[] (byte*)std::get<0>(packet);
+			delete std::get<2>(packet);
 
-					SEND_TRACE("Packet data deleted and packet counters updated.");
-				}
-				SEND_TRACE("Unlocking packet mutex.");
-			} // The packet mutex is unlocked here.
+			if (!success)
+				continue;
+
+			// Update the packet counters.
+			_sentCount += 1;
+			_totalSent += 1;
+			_sendFailures = 0;
+
+			SEND_TRACE("Packet data deleted and packet counters updated.");
+		}
+		if (samples.count != 0)
+			_addHoldSamples(_now<Policies>(), samples);
+		// The frozen packets are released after the packets that were held before the freeze.
+		if ((Policies & POLICY_HOLD) && _freezeState == FreezeState::Releasing)
+			_releaseFrozen();
+		SEND_TRACE("Unlocking packet mutex.");
+	}
+
+	void _senderLoop() {
+		ScopedThreadConfig threadConfig(_senderConfig, "sender");
+		PRINT_TRACE("Sender loop started...");
+		while (true) {
+			(this->*_path().sendPackets)();
+			// Recover from a failed send with the packet mutex unlocked, so the receiver keeps queueing meanwhile.
+			// If the delayer is deactivating, this returns right away and the check below closes the thread.
+			if (_sendFaultPending) {
+				_sendFaultPending = false;
+				_supervisor->Recover(_sendFault, _sendFaultGeneration, _sendFailures);
+			}
 			// Lock the activation state mutex for the duration of the deactivation check.
 			SEND_TRACE("Checking activation state.");
 			{
@@ -360,8 +1234,162 @@ private:
 			}
 			SEND_TRACE("Sleeping for the predefined time.");
 			// Sleep for the predefined amount before checking again.
-			std::this_thread::sleep_for(SENDER_SLEEP_TIME);
+			// A paced release wakes up more often, so the released packets go out in small bursts.
+			_clock->SleepFor(_freezeState == FreezeState::Releasing && _releaseRate > 0 ? RELEASE_PACE_INTERVAL : SENDER_SLEEP_TIME);
+		}
+	}
+
+	// Starts a receive in the current generation of the handle.
+	void _postRecv(ASYNC_IO* io) {
+		io->generation = _supervisor->Generation();
+		_engine->PostRecv(io);
+	}
+
+	// Handles a batch the engine failed to send. Its packets were counted as sent when they were batched,
+	// so the ones that didn't go out are sent again one at a time, and the ones that still fail are handled like
+	// in the sender: a rejected packet is skipped, and after any other error the rest are retried first once
+	// the error is recovered from. The failed batches are handled in the order they were sent in, and once one
+	// is left to retry, the packets of the next ones are retried after it without trying to send them.
+	// The caller should lock the packet mutex.
+	void _recoverAsyncSend(const ASYNC_IO* io) {
+		UINT64 generation = _supervisor->Generation();
+		TIME_DATA now = _clock->Now();
+		const BYTE* packet = io->buffer.data();
+		const BYTE* end = packet + io->length;
+		bool sending = _retry.empty();
+		size_t unsent = 0;
+		for (UINT i = 0; i < io->count; ++i) {
+			UINT length = IpPacketLength(packet, (UINT)(end - packet));
+			if (length == 0)
+				break;
+			// The packets that went out before the batch failed aren't sent again.
+			if ((UINT)(packet - io->buffer.data()) + length <= io->sent) {
+				packet += length;
+				continue;
+			}
+			if (sending) {
+				bool success = _divert->Send(packet, length, &io->addresses[i]);
+				DWORD error = GetLastError();
+				DivertFault fault = ClassifySendError(error);
+				if (success || fault == DivertFault::BadPacket) {
+					if (!success) {
+						SEND_TRACE("WinDivertSend() rejected a packet with error code " << error << ", skipping it.");
+						_supervisor->CountSkipped();
+						unsent += 1;
+					}
+					packet += length;
+					continue;
+				}
+				_deferSendFault(fault, generation, error);
+				sending = false;
+			}
+			byte* copy = new byte[length];
+			std::memcpy(copy, packet, length);
+			_retry.emplace_back(PACKET_DATA(copy, length, new WINDIVERT_ADDRESS(io->addresses[i])), PACKET_TIMES{ now, now });
+			unsent += 1;
+			packet += length;
+		}
+		_totalSent -= unsent;
+		_sentCount -= std::min(_sentCount, unsent);
+	}
+
+	// Handles a completed receive or send. Received packets are queued and the receive is started again.
+	// A send already collected while the async sender waited for a free batch isn't counted again.
+	void _completeAsync(ASYNC_IO* io, bool collected, UINT& failures) {
+		if (io->op == AsyncOp::Send) {
+			if (!collected)
+				_asyncSender.Collected();
+			if (!io->success) {
+				std::lock_guard<std::mutex> lock(_packetMutex);
+				_recoverAsyncSend(io);
+			}
+			_asyncSender.Release(io);
+			return;
+		}
+		if (!io->success) {
+			DivertFault fault = ClassifyRecvError(io->error);
+			// The handle is shut down when deactivating, and the receive isn't started again.
+			if (fault == DivertFault::Shutdown) {
+				std::lock_guard<std::mutex> lock(_activationStateMutex);
+				if (_shouldDeactivate)
+					return;
+			}
+			RECV_TRACE("WinDivertRecvEx() failed with error code " << io->error << " (" << DivertFaultName(fault) << "), recovering.");
+			// A reopened handle has to be attached to the engine before receiving from it.
+			_supervisor->Recover(fault, io->generation, failures);
+			_engine->Attach();
+			_postRecv(io);
+			return;
+		}
+		failures = 0;
+		// The packets are copied out, so the buffer can receive again right away.
+		const BYTE* packet = io->buffer.data();
+		const BYTE* end = packet + io->length;
+		for (UINT i = 0; i < io->count; ++i) {
+			UINT length = IpPacketLength(packet, (UINT)(end - packet));
+			if (length == 0)
+				break;
+			byte* copy = new byte[length];
+			std::memcpy(copy, packet, length);
+			(this->*_path().processReceived)(copy, length, new WINDIVERT_ADDRESS(io->addresses[i]));
+			packet += length;
+		}
+		_postRecv(io);
+	}
+
+	// Receives, schedules, and sends the packets on a single thread in the async I/O mode.
+	// Several receives are kept in flight, and the sent packets are batched into sends that are in flight meanwhile.
+	// The thread waits for the next completion or until the next packet is due, whichever is first,
+	// so the packets are sent when they are due instead of on the sender's next wake-up.
+	void _eventLoop() {
+		ScopedThreadConfig threadConfig(_receiverConfig, "event loop");
+		PRINT_TRACE("Event loop started...");
+		std::vector<std::unique_ptr<ASYNC_IO>> recvs;
+		for (UINT i = 0; i < ASYNC_RECV_DEPTH; ++i) {
+			recvs.emplace_back(new ASYNC_IO());
+			_postRecv(recvs.back().get());
+		}
+		std::vector<ASYNC_IO*> completed(ASYNC_RECV_DEPTH + ASYNC_SEND_DEPTH);
+		std::vector<ASYNC_IO*> deferred;
+		// The failed receives in a row.
+		UINT failures = 0;
+		while (true) {
+			{
+				std::lock_guard<std::mutex> lock(_activationStateMutex);
+				if (_shouldDeactivate) {
+					PRINT_INFO("The event loop thread is closing.");
+					break;
+				}
+			}
+			// Wake up for the next due packet, and at least as often as the sender would.
+			TIME_DATA deadline = _clock->Now() + SENDER_SLEEP_TIME;
+			{
+				std::lock_guard<std::mutex> lock(_packetMutex);
+				TIME_DATA due;
+				if ((this->*_path().nextDue)(due) && due < deadline)
+					deadline = due;
+			}
+			UINT count = _engine->Wait(completed.data(), (UINT)completed.size(), deadline);
+			for (UINT i = 0; i < count; ++i)
+				_completeAsync(completed[i], false, failures);
+			(this->*_path().sendPackets)();
+			_asyncSender.Flush();
+			// Sending may have waited for a free batch and collected other completions meanwhile.
+			do {
+				deferred.clear();
+				_asyncSender.TakeDeferred(deferred);
+				for (ASYNC_IO* io : deferred)
+					_completeAsync(io, true, failures);
+			} while (!deferred.empty());
+			if (_sendFaultPending) {
+				_sendFaultPending = false;
+				_supervisor->Recover(_sendFault, _sendFaultGeneration, _sendFailures);
+				_engine->Attach();
+			}
 		}
+		// The operations still in flight write to the buffers until they end, so they are waited for before freeing them.
+		_asyncSender.Flush();
+		_engine->Drain();
 	}
 
 	// Sleeps for a second and returns false if the thread should terminate.
@@ -385,38 +1413,145 @@ private:
 
 	std::thread _loggerThread;
 
+	// The dropped and missed capture counts the logger has already reported.
+	unsigned long _prevDropped = 0;
+	UINT64 _capturePrevMissed = 0;
+	UINT64 _eventLogPrevMissed = 0;
+	// The pure ACKs replaced by newer ones and their bytes, and the amounts the logger has already reported.
+	size_t _totalCoalesced = 0;
+	UINT64 _totalCoalescedBytes = 0;
+	size_t _coalescePrevPackets = 0;
+	UINT64 _coalescePrevBytes = 0;
+
+	// Whether any packet list but the first one had packets in the counts.
+	static bool _usesQueues(const DELAYER_COUNTS& counts) {
+		for (UINT q = 1; q < RULE_QUEUE_COUNT; ++q) {
+			if (counts.queues[q].received != 0 || counts.queues[q].released != 0 || counts.queues[q].buffered != 0)
+				return true;
+		}
+		return false;
+	}
+
+	// Gets the packet counts since the last call and resets them.
+	DELAYER_COUNTS _takeCounts() {
+		DELAYER_COUNTS counts;
+		// Lock the packet mutex for the duration of this block.
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		counts.received = _receivedCount;
+		_receivedCount = 0;
+		counts.sent = _sentCount;
+		_sentCount = 0;
+		counts.buffered = _heldCount();
+		// A coalesced ACK was received but is sent as part of the newer one.
+		counts.dropped = _totalReceived - _totalSent - counts.buffered - _prevDropped + _totalDropped - _totalCoalesced;
+		_prevDropped += counts.dropped;
+		counts.coalesced = _totalCoalesced - _coalescePrevPackets;
+		counts.coalescedBytes = _totalCoalescedBytes - _coalescePrevBytes;
+		_coalescePrevPackets = _totalCoalesced;
+		_coalescePrevBytes = _totalCoalescedBytes;
+		counts.ruleDropped = _ruleDroppedCount;
+		_ruleDroppedCount = 0;
+		counts.bypassed = _bypassedCount;
+		_bypassedCount = 0;
+		counts.compensation = _holdController->Offset();
+		counts.holdError = _holdController->MeanError();
+		if (_profiler.IsEnabled())
+			_profiler.Top(PROFILER_LOG_FLOWS, counts.topFlows, counts.profiledWindow);
+		for (UINT q = 0; q < RULE_QUEUE_COUNT; ++q) {
+			counts.queues[q] = _queueCounts[q];
+			_queueCounts[q] = QUEUE_COUNTS();
+		}
+		for (UINT q = 0; q < PACKET_LIST_COUNT; ++q)
+			counts.queues[_ruleQueue(q)].buffered += _queues[q].size();
+		return counts;
+	}
+
+	// Fills a snapshot for the stats segment with the totals and what is held now. Unlike the logger's counts,
+	// nothing is reset, so any number of readers can take differences. Called on the stats publisher thread.
+	void _collectStats(STATS_SNAPSHOT& snapshot) {
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		snapshot.active = _active ? 1 : 0;
+		snapshot.frozen = _freezeState != FreezeState::Off ? 1 : 0;
+		snapshot.received = _totalReceived;
+		snapshot.sent = _totalSent;
+		snapshot.bufferedPackets = _heldCount();
+		// Like the logger's count, summed over every second so far.
+		snapshot.dropped = _totalReceived - _totalSent - snapshot.bufferedPackets + _totalDropped - _totalCoalesced;
+		snapshot.coalesced = _totalCoalesced;
+		snapshot.bufferedBytes = _queuedBytes + _spill.Bytes() + _frozen.Bytes();
+		for (const PACKET_TIME_DATA& packet : _retry)
+			snapshot.bufferedBytes += std::get<1>(packet.first);
+		for (UINT q = 0; q < RULE_QUEUE_COUNT; ++q)
+			snapshot.queuePackets[q] = 0;
+		for (UINT q = 0; q < PACKET_LIST_COUNT; ++q)
+			snapshot.queuePackets[_ruleQueue(q)] += _queues[q].size();
+		snapshot.latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(_latency).count();
+		snapshot.compensationUs = std::chrono::duration_cast<std::chrono::microseconds>(_holdController->Offset()).count();
+		snapshot.holdErrorUs = std::chrono::duration_cast<std::chrono::microseconds>(_holdController->MeanError()).count();
+	}
+
 	// Logs information every second when the delayer is active.
 	void _loggingLoop() {
-		static unsigned long prevDropped = 0;
+		ScopedThreadConfig threadConfig(_loggerConfig, "logger");
 		PRINT_TRACE("Logging loop started...");
-		// The amount of received packets.
-		unsigned int received;
-		// The amount of sent packets.
-		unsigned int sent;
-		// The amount of packets in the buffer waiting to be sent.
-		size_t buffered;
-		size_t dropped;
 		while (true) {
 			{
-				{
-					// Lock the packet mutex for the duration of this block.
-					std::lock_guard<std::mutex> lock(_packetMutex);
-					received = _receivedCount;
-					_receivedCount = 0;
-					sent = _sentCount;
-					_sentCount = 0;
-					buffered = _packets.size();
-					dropped = _totalReceived - _totalSent - buffered - prevDropped + _totalDropped;
-					prevDropped += dropped;
-					// PRINT_INFO("total recv: " << _totalReceived << ", total sent: " << _totalSent << ", total dropped: " << _totalDropped << ", prev dropped: " << prevDropped);
-				}
+				DELAYER_COUNTS counts = _takeCounts();
 
 				// Log the data.
 				// In a normal situation, received = sent + buffered.
-				if (dropped == 0)
-					PRINT_INFO("Received: " << received << ", sent: " << sent << ", buffered: " << buffered << ".");
+				if (counts.dropped == 0)
+					PRINT_INFO("Received: " << counts.received << ", sent: " << counts.sent << ", buffered: " << counts.buffered << ".");
 				else {
-					PRINT_ERROR("Dropped: " << dropped << "! Received: " << received << ", sent: " << sent << ", buffered: " << buffered << ".");
+					PRINT_ERROR(
+						"Dropped: " << counts.dropped << "! Received: " << counts.received << ", sent: " << counts.sent
+						<< ", buffered: " << counts.buffered << "."
+					);
+				}
+				if (_holdController->IsEnabled() && counts.sent != 0) {
+					PRINT_INFO(
+						"Releasing " << counts.compensation.count() / 1e6 << " ms early for a mean hold time error of "
+						<< counts.holdError.count() / 1e6 << " ms."
+					);
+				}
+				// Every coalesced ACK is a packet less to inject.
+				if (counts.coalesced != 0) {
+					PRINT_INFO(
+						"Coalesced " << counts.coalesced << " pure ACKs (" << counts.coalescedBytes / 1024 << " KB), injecting "
+						<< counts.sent << " packets instead of " << counts.sent + counts.coalesced << "."
+					);
+				}
+				if (!_rules.IsEmpty() && (counts.ruleDropped != 0 || counts.bypassed != 0))
+					PRINT_INFO("Rules dropped " << counts.ruleDropped << " and bypassed " << counts.bypassed << " of the received packets.");
+				// The lists are only worth reporting once rules put packets in more than the first one.
+				if (_usesQueues(counts)) {
+					std::ostringstream queues;
+					for (UINT q = 0; q < RULE_QUEUE_COUNT; ++q) {
+						const QUEUE_COUNTS& queue = counts.queues[q];
+						if (queue.received == 0 && queue.released == 0 && queue.buffered == 0)
+							continue;
+						queues << (queues.tellp() == 0 ? "" : ", ") << "queue " << q << " received " << queue.received << ", released "
+							<< queue.released << " (" << queue.releasedBytes / 1024 << " KB), buffered " << queue.buffered;
+					}
+					PRINT_INFO("Release order " << ReleaseOrderName(_releaseOrder) << ": " << queues.str() << ".");
+				}
+				// The flows most of the held bytes came from lately, so a growing buffer can be told apart from its cause.
+				if (!counts.topFlows.empty() && counts.received != 0) {
+					std::ostringstream flows;
+					for (size_t i = 0; i < counts.topFlows.size(); ++i) {
+						flows << (i == 0 ? "" : ", ") << FlowProfiler::FormatFlow(counts.topFlows[i].key) << " "
+							<< std::fixed << std::setprecision(1) << 100.0 * counts.topFlows[i].bytes / counts.profiledWindow.bytes << " %";
+					}
+					PRINT_INFO("Heaviest flows: " << flows.str() << ".");
+				}
+				// Report packets the capture writer couldn't keep up with.
+				if (_capture.IsOpen() && _capture.Missed() != _capturePrevMissed) {
+					PRINT_ERROR("The capture writer fell behind, " << _capture.Missed() - _capturePrevMissed << " packets were left out of the capture.");
+					_capturePrevMissed = _capture.Missed();
+				}
+				if (_eventLog.IsOpen() && _eventLog.Missed() != _eventLogPrevMissed) {
+					PRINT_ERROR("The event log fell behind, " << _eventLog.Missed() - _eventLogPrevMissed << " packets were left out of the event log.");
+					_eventLogPrevMissed = _eventLog.Missed();
 				}
 			}
 			// Wait for a second between logs.
@@ -428,12 +1563,76 @@ private:
 		}
 	}
 
-	// Starts the receiver, sender, and logger threads.
+	// The per-packet functions compiled for a combination of policies.
+	struct HOT_PATH {
+		void (Delayer::*processReceived)(PVOID, UINT, WINDIVERT_ADDRESS*);
+		void (Delayer::*queuePacket)(const PACKET_DATA&, TIME_DATA, const RULE_ACTION*);
+		void (Delayer::*sendPackets)();
+		bool (Delayer::*nextDue)(TIME_DATA&);
+	};
+
+	// The functions of the policies the delayer was last activated or simulated with, or that its freeze or drain
+	// switched to. Read by the threads for every packet or batch, and only switched with the packet mutex locked.
+	std::atomic<const HOT_PATH*> _hotPath{ nullptr };
+	// Whether the functions compiled for only the policies in use run. Otherwise the ones compiled with every policy do,
+	// checking at runtime whether each is in use.
+	bool _specialize = true;
+
+	template <UINT... Policies>
+	static const HOT_PATH* _hotPaths(std::integer_sequence<UINT, Policies...>) {
+		static const HOT_PATH hotPaths[] = { {
+			&Delayer::_processReceived<Policies>, &Delayer::_queuePacket<Policies>,
+			&Delayer::_sendPackets<Policies>, &Delayer::_nextDue<Policies>
+		}... };
+		return hotPaths;
+	}
+
+	// The functions the threads run now.
+	const HOT_PATH& _path() const {
+		return *_hotPath.load(std::memory_order_acquire);
+	}
+
+	// Picks the functions compiled for the policies the current settings and state use.
+	// The settings can't change while the delayer is running, but the freeze and the drain can, and they switch
+	// the functions with the packet mutex locked. A thread that already started on a packet or a batch with
+	// the functions from before finishes it as if it came just before the switch, which it did.
+	void _selectHotPath() {
+		UINT policies = POLICY_ALL;
+		if (_specialize) {
+			policies = 0;
+			if (_clock != &_systemClock || _recorder != nullptr)
+				policies |= POLICY_SIMULATED_CLOCK;
+			if (_trace.IsOpen())
+				policies |= POLICY_TRACE;
+			if (_tracker != nullptr || !_rules.IsEmpty() || !_rewriter.IsEmpty() || _ackCoalescer.IsEnabled() || (_rttMonitor != nullptr && _rttMonitor->HasTarget()))
+				policies |= POLICY_CLASSIFY;
+			if (_spillAfter.count() > 0)
+				policies |= POLICY_SPILL;
+			if (_holdController->IsEnabled())
+				policies |= POLICY_COMPENSATION;
+			if (_recording() || _rttMonitor != nullptr || _profiler.IsEnabled() || _stats.IsOpen())
+				policies |= POLICY_SINK;
+			if (_useCaptureTime && _divert->HasCaptureTime())
+				policies |= POLICY_CAPTURE_TIME;
+			if (_freezeState != FreezeState::Off || _draining)
+				policies |= POLICY_HOLD;
+		}
+		_hotPath.store(&_hotPaths(std::make_integer_sequence<UINT, POLICY_ALL + 1>())[policies], std::memory_order_release);
+		PRINT_TRACE("Running the packet path compiled for the policies 0x" << std::hex << policies << std::dec << ".");
+	}
+
+	// Starts the receiver, sender, and logger threads, or the event loop and logger threads in the async I/O mode.
 	void _startThreads() {
-		PRINT_TRACE("Starting receiver thread...");
-		_receiverThread = std::thread(&Delayer::_receiverLoop, this);
-		PRINT_TRACE("Starting sender thread...");
-		_senderThread = std::thread(&Delayer::_senderLoop, this);
+		if (_ioMode == IoMode::Async) {
+			PRINT_TRACE("Starting event loop thread...");
+			_eventThread = std::thread(&Delayer::_eventLoop, this);
+		}
+		else {
+			PRINT_TRACE("Starting receiver thread...");
+			_receiverThread = std::thread(&Delayer::_receiverLoop, this);
+			PRINT_TRACE("Starting sender thread...");
+			_senderThread = std::thread(&Delayer::_senderLoop, this);
+		}
 		PRINT_TRACE("Starting logger thread...");
 		_loggerThread = std::thread(&Delayer::_loggingLoop, this);
 	}
@@ -448,19 +1647,27 @@ private:
 			_shouldDeactivate = true;
 		}
 		PRINT_TRACE("Deactivation flag set successfully.");
+		// Stop reopening the handle, so the handle shut down here is the last one.
+		_supervisor->Stop();
 		PRINT_TRACE("Shutting down the WinDivert handle.");
-		bool success = WinDivertShutdown(_winDivertHandle, WINDIVERT_SHUTDOWN_RECV);
+		bool success = _divert->Shutdown();
 		// If there was an error, show it.
 		if (!success) {
 			DWORD error = GetLastError();
 			PRINT_ERROR("WinDivertShutdown() failed with error code " << error << ".");
 		}
 		PRINT_TRACE("Joining threads...");
-		// Wait for the receiver, sender, and logger threads to close.
-		_receiverThread.join();
-		PRINT_TRACE("Receiver thread joined.");
-		_senderThread.join();
-		PRINT_TRACE("Sender thread joined.");
+		// Wait for the receiver, sender, and logger threads, or the event loop thread, to close.
+		if (_eventThread.joinable()) {
+			_eventThread.join();
+			PRINT_TRACE("Event loop thread joined.");
+		}
+		else {
+			_receiverThread.join();
+			PRINT_TRACE("Receiver thread joined.");
+			_senderThread.join();
+			PRINT_TRACE("Sender thread joined.");
+		}
 		_loggerThread.join();
 		PRINT_TRACE("Logger thread joined.");
 		PRINT_TRACE("Resetting the deactivation flag.");
@@ -468,9 +1675,220 @@ private:
 		PRINT_TRACE("Threads closed successfully.");
 	}
 
+	// Gets the amount of packets held anywhere: in the lists, to retry, spilled, or frozen.
+	// The caller should lock the packet mutex.
+	size_t _heldCount() const {
+		return _queuedCount() + _spill.Count() + _frozen.Count();
+	}
+
+	// Takes the packets in the lists and the packets to retry, in the order they were received.
+	// Each list is already in that order. The caller should lock the packet mutex.
+	std::vector<PACKET_TIME_DATA> _takeQueued() {
+		std::vector<PACKET_TIME_DATA> packets(_retry.begin(), _retry.end());
+		_retry.clear();
+		for (std::list<PACKET_TIME_DATA>& queue : _queues) {
+			packets.insert(packets.end(), queue.begin(), queue.end());
+			queue.clear();
+		}
+		_queuedBytes = 0;
+		std::stable_sort(packets.begin(), packets.end(), ReceivedEarlier());
+		return packets;
+	}
+
+	// Whether a packet received at or before the given time is still in the lists or the spill queue.
+	// The lists and the spill queue are each in the order the packets were received.
+	// The caller should lock the packet mutex.
+	bool _queuedReceivedBefore(TIME_DATA mark) {
+		for (const std::list<PACKET_TIME_DATA>& queue : _queues) {
+			if (!queue.empty() && queue.front().second.received <= mark)
+				return true;
+		}
+		if (_spill.IsEmpty())
+			return false;
+		const SPILL_RECORD* record = _spill.Front();
+		return record == nullptr || record->received <= mark.time_since_epoch().count();
+	}
+
+	// Whether a packet received at or before the given time is still held.
+	// The caller should lock the packet mutex.
+	bool _holdsReceivedBefore(TIME_DATA mark) {
+		for (const PACKET_TIME_DATA& packet : _retry) {
+			if (packet.second.received <= mark)
+				return true;
+		}
+		if (_queuedReceivedBefore(mark))
+			return true;
+		if (_frozen.IsEmpty())
+			return false;
+		const SPILL_RECORD* record = _frozen.Front();
+		return record == nullptr || record->received <= mark.time_since_epoch().count();
+	}
+
+	// Moves every held packet to the frozen backlog in the order they were received, ahead of the packets that were
+	// already frozen, and starts releasing it, so the packets are sent right away in batches.
+	// Returns the packets that couldn't be moved and were dropped. The caller should lock the packet mutex.
+	size_t _flushToBacklog() {
+		SpillQueue backlog{ FREEZE_SEGMENT_BYTES };
+		size_t dropped = 0;
+		for (const PACKET_TIME_DATA& packet : _takeQueued()) {
+			if (!backlog.Push(
+				std::get<0>(packet.first), std::get<1>(packet.first), std::get<2>(packet.first),
+				packet.second.received.time_since_epoch().count(), packet.second.send.time_since_epoch().count()
+			))
+				dropped += 1;
+			delete[] (byte*)std::get<0>(packet.first);
+			delete std::get<2>(packet.first);
+		}
+		// Everything spilled was received after the lists, and everything frozen after that.
+		for (SpillQueue* held : { &_spill, &_frozen }) {
+			while (!held->IsEmpty()) {
+				const SPILL_RECORD* record = held->Front();
+				if (record == nullptr) {
+					dropped += held->Count();
+					held->Clear();
+					break;
+				}
+				if (!backlog.Push(record + 1, record->length, &record->address, record->received, record->send))
+					dropped += 1;
+				held->Pop();
+			}
+		}
+		_frozen = std::move(backlog);
+		_startRelease();
+		return dropped;
+	}
+
+	// The port a pooled delayer's messages name, since a pool logs for all its delayers.
+	std::string _poolPort() const {
+		return _pool != nullptr ? " on port " + std::to_string(_port) : "";
+	}
+
+	// Starts sending the held packets by the drain policy while the threads still run. The packets received from now on
+	// aren't delayed, so they follow the held ones out. Returns the packets held.
+	size_t _startDrain() {
+		size_t held;
+		{
+			std::lock_guard<std::mutex> lock(_packetMutex);
+			held = _heldCount();
+			if (held == 0 || _drainPolicy == DrainPolicy::Drop)
+				return held;
+			_draining = true;
+			if (_drainPolicy == DrainPolicy::Flush) {
+				size_t dropped = _flushToBacklog();
+				if (dropped != 0)
+					PRINT_ERROR("Couldn't buffer " << dropped << " held packets" << _poolPort() << " for the flush, dropping them.");
+			}
+			// A frozen backlog is released before the packets due on schedule.
+			else if (_freezeState == FreezeState::Frozen)
+				_startRelease();
+			_selectHotPath();
+		}
+		PRINT_INFO(
+			"Draining " << held << " held packets" << _poolPort() << " "
+			<< (_drainPolicy == DrainPolicy::Flush ? "right away" : "on schedule")
+			<< " for up to " << _drainTimeout.count() << " ms..."
+		);
+		return held;
+	}
+
+	// Waits until every packet received at or before the given time has been sent or the drain timeout has passed
+	// since then. Returns right away if the drain wasn't started.
+	void _awaitDrain(TIME_DATA mark) {
+		while (_clock->Now() - mark < _drainTimeout) {
+			{
+				std::lock_guard<std::mutex> lock(_packetMutex);
+				if (!_draining || !_holdsReceivedBefore(mark))
+					break;
+				// A packet the receiver was already queueing when the flush started missed it and waits in its list,
+				// so it is flushed once the packets received before it have been released.
+				if (_drainPolicy == DrainPolicy::Flush && _freezeState == FreezeState::Off && _queuedReceivedBefore(mark)) {
+					size_t dropped = _flushToBacklog();
+					if (dropped != 0)
+						PRINT_ERROR("Couldn't buffer " << dropped << " held packets" << _poolPort() << " for the flush, dropping them.");
+				}
+			}
+			_clock->SleepFor(RELEASE_PACE_INTERVAL);
+		}
+	}
+
+	// Sends the held packets by the drain policy while the threads still run, and waits until every packet received
+	// at or before the given time has been sent or the drain timeout has passed. Returns the packets held at the given time.
+	size_t _drain(TIME_DATA mark) {
+		size_t held = _startDrain();
+		_awaitDrain(mark);
+		return held;
+	}
+
+	// Frees what the stopped threads didn't send of a drain started at the given time, and reports the drain.
+	// The packets that came in behind the drained ones are sent now.
+	void _finishDrain(TIME_DATA mark, size_t held) {
+		_draining = false;
+		size_t heldDropped, laterSent, laterDropped;
+		_clearHeld(mark, _drainPolicy != DrainPolicy::Drop, heldDropped, laterSent, laterDropped);
+		if (_drainPolicy == DrainPolicy::Drop) {
+			if (heldDropped + laterDropped != 0)
+				PRINT_INFO("Dropped " << heldDropped + laterDropped << " held packets" << _poolPort() << " on deactivation.");
+		}
+		else {
+			if (held != 0) {
+				double drainMs = std::chrono::duration<double, std::milli>(_clock->Now() - mark).count();
+				PRINT_INFO(
+					"Drained " << held << " held packets" << _poolPort() << " (" << DrainPolicyName(_drainPolicy) << ") in "
+					<< drainMs << " ms: " << held - heldDropped << " sent and " << heldDropped << " dropped at the timeout. "
+					<< laterSent << " packets received during the drain were sent after them."
+				);
+			}
+			if (laterDropped != 0)
+				PRINT_ERROR("Dropped " << laterDropped << " packets" << _poolPort() << " received during the deactivation.");
+		}
+	}
+
+	// Empties the packet lists, the packets to retry, and the spilled and frozen packets once the threads have stopped.
+	// The packets received after the given time were only queued behind the drained ones, so they are sent if sendLater
+	// is set. Every other packet is dropped. Counts the held packets dropped, and the later packets sent and dropped.
+	// The dropped packets are counted as reported, so the logger doesn't report them on the next activation.
+	void _clearHeld(TIME_DATA mark, bool sendLater, size_t& heldDropped, size_t& laterSent, size_t& laterDropped) {
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		heldDropped = 0;
+		laterSent = 0;
+		laterDropped = 0;
+		INT64 markTicks = mark.time_since_epoch().count();
+		auto handle = [&](const void* packet, UINT length, const WINDIVERT_ADDRESS* address, INT64 received) {
+			if (received <= markTicks)
+				heldDropped += 1;
+			else if (sendLater && _divert->Send(packet, length, address))
+				laterSent += 1;
+			else
+				laterDropped += 1;
+		};
+		for (const PACKET_TIME_DATA& packet : _takeQueued()) {
+			handle(std::get<0>(packet.first), std::get<1>(packet.first), std::get<2>(packet.first), packet.second.received.time_since_epoch().count());
+			delete[] (byte*)std::get<0>(packet.first);
+			delete std::get<2>(packet.first);
+		}
+		for (SpillQueue* held : { &_spill, &_frozen }) {
+			while (!held->IsEmpty()) {
+				const SPILL_RECORD* record = held->Front();
+				if (record == nullptr) {
+					heldDropped += held->Count();
+					held->Clear();
+					break;
+				}
+				handle(record + 1, record->length, &record->address, record->received);
+				held->Pop();
+			}
+		}
+		_freezeState = FreezeState::Off;
+		_totalSent += laterSent;
+		_prevDropped += heldDropped + laterDropped;
+	}
+
 public:
 	Delayer() {
 		_initialized = false;
+		for (UINT q = 0; q < PACKET_LIST_COUNT; ++q)
+			_queueWeights[q] = 1;
+		_rankQueues();
 	}
 
 	void Init(int port, long long latency) {
@@ -479,16 +1897,419 @@ public:
 		_totalReceived = 0;
 		_sentCount = 0;
 		_totalSent = 0;
+		_totalDropped = 0;
+		_ruleDroppedCount = 0;
+		_bypassedCount = 0;
+		_totalCoalesced = 0;
+		_totalCoalescedBytes = 0;
+		_coalescePrevPackets = 0;
+		_coalescePrevBytes = 0;
+		for (UINT q = 0; q < RULE_QUEUE_COUNT; ++q)
+			_queueCounts[q] = QUEUE_COUNTS();
 		_latency = std::chrono::milliseconds(latency);
 		_active = false;
+		_port = port;
 		// Create a filter that accepts outbound packets from the given local port.
 		_filter = SET_FILTER(port);
 		PRINT_TRACE("Set filter \"" << _filter << "\".");
-		// Initialize the packet list.
-		_packets = std::list<PACKET_TIME_DATA>();
+		// Initialize the packet lists.
+		for (std::list<PACKET_TIME_DATA>& queue : _queues)
+			queue = std::list<PACKET_TIME_DATA>();
+		_queuedBytes = 0;
+		_retry.clear();
 		_initialized = true;
 	}
 
+	// Sets the scheduling settings the threads apply when they start.
+	// Unless the logger has its own affinity, it is kept off the CPUs the receiver and sender are pinned to.
+	void SetThreadConfigs(const THREAD_CONFIG& receiver, const THREAD_CONFIG& sender, const THREAD_CONFIG& logger) {
+		_receiverConfig = receiver;
+		_senderConfig = sender;
+		_loggerConfig = logger;
+		uint64_t dataPlaneMask = receiver.affinityMask | sender.affinityMask;
+		if (logger.affinityMask == 0 && dataPlaneMask != 0) {
+			_loggerConfig.affinityMask = GetProcessCpuMask() & ~dataPlaneMask;
+			if (_loggerConfig.affinityMask == 0)
+				PRINT_INFO("The receiver and sender use every CPU, so the logger can't be kept off them.");
+			else
+				PRINT_TRACE("Keeping the logger on the CPU mask 0x" << std::hex << _loggerConfig.affinityMask << std::dec << ".");
+		}
+	}
+
+	// Receives and injects the packets through the given divert instead of WinDivert. Null restores WinDivert.
+	bool SetDivert(PacketDivert* divert) {
+		if (_active) {
+			PRINT_ERROR("The divert can't be changed while the delayer is active.");
+			return false;
+		}
+		_divert = divert != nullptr ? divert : &_winDivert;
+		return true;
+	}
+
+	// Reports the outbound packets to the monitor as they are released, with the times they were received and released at,
+	// so it measures the round trip times with and without the added latency. Null stops reporting them.
+	bool SetRttMonitor(RttMonitor* monitor) {
+		if (_active) {
+			PRINT_ERROR("The RTT monitor can't be changed while the delayer is active.");
+			return false;
+		}
+		_rttMonitor = monitor;
+		return true;
+	}
+
+	// Profiles the held packets by flow over a sliding window of the given length. Zero stops profiling.
+	bool SetFlowProfile(std::chrono::seconds window) {
+		if (_active) {
+			PRINT_ERROR("The flow profile can't be changed while the delayer is active.");
+			return false;
+		}
+		_profiler.SetWindow(window);
+		return true;
+	}
+
+	// Prints the heaviest flows of the profile's window.
+	void PrintTopFlows() {
+		if (!_profiler.IsEnabled()) {
+			PRINT_INFO("The flows aren't profiled, start with --top-flows to profile them.");
+			return;
+		}
+		std::vector<PROFILER_FLOW> flows;
+		PROFILER_COUNTER window;
+		{
+			std::lock_guard<std::mutex> lock(_packetMutex);
+			_profiler.Top(PROFILER_TOP_FLOWS, flows, window);
+		}
+		FlowProfiler::PrintTop(flows, window, _profiler.Window());
+	}
+
+	// Keeps the packets that are due later than the given time in spill files in the given directory
+	// instead of memory. Zero disables spilling.
+	bool SetSpill(std::chrono::milliseconds after, const std::string& directory) {
+		if (_active) {
+			PRINT_ERROR("Spilling can't be changed while the delayer is active.");
+			return false;
+		}
+		_spillAfter = after;
+		_spill.SetDirectory(directory);
+		return true;
+	}
+
+	// Sets the most memory the frozen packets can take, and the rate in packets per second they are released at.
+	// A zero rate releases them as fast as they can be injected.
+	bool SetFreeze(UINT64 capBytes, double releaseRate) {
+		if (_active) {
+			PRINT_ERROR("The freeze settings can't be changed while the delayer is active.");
+			return false;
+		}
+		_freezeCapBytes = capBytes;
+		_releaseRate = releaseRate;
+		return true;
+	}
+
+	// Sets what happens to the held packets when the delayer is deactivated, and the longest the deactivation waits for
+	// them to be sent. The packets still held at the timeout are dropped.
+	bool SetDrain(DrainPolicy policy, std::chrono::milliseconds timeout) {
+		if (_active) {
+			PRINT_ERROR("The drain settings can't be changed while the delayer is active.");
+			return false;
+		}
+		_drainPolicy = policy;
+		_drainTimeout = timeout;
+		return true;
+	}
+
+	// Replaces a queued pure TCP ACK with a newer one of the same connection that only acknowledges more.
+	bool SetAckCoalescing(bool enabled) {
+		if (_active) {
+			PRINT_ERROR("The ACK coalescing can't be changed while the delayer is active.");
+			return false;
+		}
+		_ackCoalescer.SetEnabled(enabled);
+		return true;
+	}
+
+	// Sets the order the packets due at the same time in different packet lists are sent in, and the weight of each list.
+	// Lists without a weight get a weight of 1.
+	bool SetReleaseOrder(ReleaseOrder order, const std::vector<UINT>& weights) {
+		if (_active) {
+			PRINT_ERROR("The release order can't be changed while the delayer is active.");
+			return false;
+		}
+		if (weights.size() > RULE_QUEUE_COUNT) {
+			PRINT_ERROR("There are only " << RULE_QUEUE_COUNT << " packet lists to weigh.");
+			return false;
+		}
+		for (UINT q = 0; q < RULE_QUEUE_COUNT; ++q) {
+			if (q < weights.size() && weights[q] == 0) {
+				PRINT_ERROR("The weight of a packet list must be at least 1.");
+				return false;
+			}
+		}
+		for (UINT q = 0; q < PACKET_LIST_COUNT; ++q) {
+			UINT rule = _ruleQueue(q);
+			_queueWeights[q] = rule < weights.size() ? weights[rule] : 1;
+		}
+		_rankQueues();
+		_releaseOrder = order;
+		return true;
+	}
+
+	// Stops sending and holds every received packet until Release() is called.
+	// Freezing again while the backlog is being released holds the rest of it too.
+	bool Freeze() {
+		if (!_active) {
+			PRINT_ERROR("The delayer must be active to freeze.");
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		if (_freezeState == FreezeState::Frozen)
+			return true;
+		if (_freezeState == FreezeState::Off) {
+			_freezeTime = _clock->Now();
+			_freezeDropped = 0;
+		}
+		_freezeState = FreezeState::Frozen;
+		_selectHotPath();
+		PRINT_INFO("Frozen, holding every packet.");
+		return true;
+	}
+
+	// Starts sending the frozen packets in the order they were received. New packets are held behind them
+	// until the backlog has been sent.
+	bool Release() {
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		if (_freezeState != FreezeState::Frozen)
+			return false;
+		_startRelease();
+		double heldMs = std::chrono::duration<double, std::milli>(_clock->Now() - _freezeTime).count();
+		PRINT_INFO(
+			"Releasing " << _releaseBacklog << " packets (" << _releaseBacklogBytes / 1024 << " KB) held for " << heldMs << " ms"
+			<< (_releaseRate > 0 ? " at " + std::to_string((long long)_releaseRate) + " packets per second" : "") << "."
+		);
+		if (_freezeDropped != 0)
+			PRINT_ERROR("Dropped " << _freezeDropped << " packets that didn't fit under the freeze cap.");
+		return true;
+	}
+
+	// Whether packets are being held or the backlog is still being released.
+	bool IsFrozen() {
+		return _freezeState != FreezeState::Off;
+	}
+
+	// How much earlier than their send time the hold time compensation releases the packets.
+	std::chrono::nanoseconds Compensation() {
+		std::lock_guard<std::mutex> lock(_packetMutex);
+		return _holdController->Offset();
+	}
+
+	// Turns the hold time compensation on or off. It is on by default.
+	bool SetCompensation(bool enabled) {
+		if (_active) {
+			PRINT_ERROR("The hold time compensation can't be changed while the delayer is active.");
+			return false;
+		}
+		_ownHoldController.SetEnabled(enabled);
+		return true;
+	}
+
+	// Receives and sends with the receiver and sender threads, which is the default, or with the event loop.
+	bool SetIoMode(IoMode mode) {
+		if (_active) {
+			PRINT_ERROR("The I/O mode can't be changed while the delayer is active.");
+			return false;
+		}
+		_ioMode = mode;
+		return true;
+	}
+
+	// Runs the packet path compiled for only the policies the settings use, which is the default.
+	// Disabled, the path compiled with every policy runs and checks at runtime whether each is in use.
+	bool SetSpecialization(bool enabled) {
+		if (_active) {
+			PRINT_ERROR("The specialization can't be changed while the delayer is active.");
+			return false;
+		}
+		_specialize = enabled;
+		return true;
+	}
+
+	// Counts the delays from when the receiver gets the packets instead of from the driver's capture timestamps.
+	void SetStampOnReceive(bool stampOnReceive) {
+		_useCaptureTime = !stampOnReceive;
+	}
+
+	// Sets the header edits applied to the packets.
+	void SetRewriter(const PacketRewriter& rewriter) {
+		_rewriter = rewriter;
+	}
+
+	// Delays the packets from the ports of the tracked process instead of the port given to Init.
+	// The tracker keeps its ports up to date while the delayer is active, so the filter never has to change.
+	bool SetProcessTarget(ProcessTracker* tracker) {
+		if (_active) {
+			PRINT_ERROR("The target process can't be changed while the delayer is active.");
+			return false;
+		}
+		_tracker = tracker;
+		if (tracker != nullptr)
+			_filter = PROCESS_FILTER;
+		return true;
+	}
+
+	// Sets the rules that classify the packets. The rules must be compiled.
+	bool SetRules(const RuleEngine& rules) {
+		if (_active) {
+			PRINT_ERROR("The rules can't be changed while the delayer is active.");
+			return false;
+		}
+		_rules = rules;
+		return true;
+	}
+
+	// Starts recording the released and dropped packets to a pcapng file, rotating it at the given size.
+	// The capture runs until the delayer is destroyed. The writer thread shares the logger's scheduling settings.
+	bool StartCapture(const std::string& path, UINT64 rotateBytes) {
+		if (_active) {
+			PRINT_ERROR("The capture can't be started while the delayer is active.");
+			return false;
+		}
+		if (!_capture.Open(path, rotateBytes, _loggerConfig))
+			return false;
+		PRINT_INFO("Capturing the delayed packets to \"" << path << "\".");
+		return true;
+	}
+
+	// Starts logging when every released or dropped packet was captured and released, its length and flow, and what
+	// happened to it. The log runs until the delayer is destroyed. The flusher thread shares the logger's scheduling settings.
+	bool StartEventLog(const std::string& path) {
+		if (_active) {
+			PRINT_ERROR("The event log can't be started while the delayer is active.");
+			return false;
+		}
+		if (!_eventLog.Open(path, _loggerConfig))
+			return false;
+		PRINT_INFO("Logging the packet events to \"" << path << "\".");
+		return true;
+	}
+
+	// Starts publishing the counts, what is held, and the hold time percentiles in the named shared memory segment
+	// every 50 ms until the delayer is destroyed. The publisher thread shares the logger's scheduling settings.
+	bool StartStats(const std::string& name) {
+		if (_active) {
+			PRINT_ERROR("The stats segment can't be started while the delayer is active.");
+			return false;
+		}
+		return _stats.Open(name, _loggerConfig, [this](STATS_SNAPSHOT& snapshot) { _collectStats(snapshot); });
+	}
+
+	// Plays the packet delays back from the given trace file instead of using the fixed latency.
+	bool LoadTrace(const std::string& path, TraceMode mode, bool loop, double speed) {
+		if (_active) {
+			PRINT_ERROR("The trace can't be changed while the delayer is active.");
+			return false;
+		}
+		PRINT_TRACE("Loading latency trace \"" << path << "\".");
+		if (!_trace.Open(path)) {
+			PRINT_ERROR("Could not load the latency trace \"" << path << "\": " << _trace.Error());
+			return false;
+		}
+		_trace.SetPlayback(mode, loop, speed);
+		if (mode == TraceMode::Time && _trace.IntervalUs() == 0)
+			PRINT_ERROR("The trace has no sample interval, playing it back by packet instead.");
+		PRINT_INFO(
+			"Loaded a latency trace of " << _trace.SampleCount() << " samples"
+			<< " (" << (mode == TraceMode::Time ? "by time" : "by packet")
+			<< (loop ? ", looping" : "") << ", speed " << speed << "x)."
+		);
+		return true;
+	}
+
+	// Runs the given number of evenly spaced packets through the scheduling on a virtual clock
+	// instead of capturing them, with the sender waking up every SENDER_SLEEP_MS like it does when active.
+	// Time jumps straight to the next arrival or wake-up, so the run takes only as long as the bookkeeping,
+	// and the same settings always give the same release times. Nothing is sent, the releases are recorded instead.
+	bool Simulate(UINT64 packetCount, double packetsPerSecond, SimulationRecorder& recorder) {
+		if (!_initialized) {
+			PRINT_ERROR("The delayer must be initialized with the Init(...) function before simulating.");
+			return false;
+		}
+		if (_active) {
+			PRINT_ERROR("The delayer can't be simulated while it is active.");
+			return false;
+		}
+
+		VirtualClock clock;
+		_clock = &clock;
+		_recorder = &recorder;
+		_selectHotPath();
+		recorder.Start(clock.Now());
+		_holdController->Reset();
+		_activationTime = clock.Now();
+		_activationReceived = _totalReceived;
+
+		TIME_DATA start = clock.Now();
+		TIME_DATA wakeUp = start;
+		UINT64 generated = 0;
+		while (generated < packetCount || _queuedCount() != 0 || !_spill.IsEmpty()) {
+			// Queue the packets that arrive before the sender wakes up.
+			while (generated < packetCount) {
+				TIME_DATA arrival = start + std::chrono::nanoseconds((long long)(generated * 1e9 / packetsPerSecond));
+				if (arrival > wakeUp)
+					break;
+				clock.AdvanceTo(arrival);
+				(this->*_path().queuePacket)(PACKET_DATA(nullptr, 0, nullptr), clock.Now(), nullptr);
+				generated += 1;
+			}
+			// Sleep until the sender wakes up and let it send.
+			clock.SleepUntil(wakeUp);
+			(this->*_path().sendPackets)();
+			wakeUp = clock.Now() + SENDER_SLEEP_TIME;
+		}
+
+		_recorder = nullptr;
+		_clock = &_systemClock;
+		return true;
+	}
+
+	// Hands copies of a packet to the packet path on the calling thread, and sends the due packets to the divert after
+	// every batch, without the threads and their waits. Returns the nanoseconds a packet took, or a negative value
+	// if the delayer couldn't be measured. The baseline is the path as it was before the policies: the functions
+	// that check every part at runtime, called directly. Otherwise the path the settings select runs, through
+	// the function table like the threads run it.
+	double MeasurePacketPath(const std::vector<BYTE>& packet, const WINDIVERT_ADDRESS& address, UINT64 count, bool baseline) {
+		if (!_initialized || _active) {
+			PRINT_ERROR("The delayer must be initialized and inactive to measure its packet path.");
+			return -1;
+		}
+		_sendTarget = _divert;
+		_selectHotPath();
+		_holdController->Reset();
+		_activationTime = _clock->Now();
+		_activationReceived = _totalReceived;
+
+		auto start = std::chrono::steady_clock::now();
+		for (UINT64 i = 0; i < count; ++i) {
+			byte* copy = new byte[packet.size()];
+			std::memcpy(copy, packet.data(), packet.size());
+			if (baseline)
+				_processReceived<POLICY_ALL>(copy, (UINT)packet.size(), new WINDIVERT_ADDRESS(address));
+			else
+				(this->*_path().processReceived)(copy, (UINT)packet.size(), new WINDIVERT_ADDRESS(address));
+			if ((i + 1) % POLICY_BENCHMARK_BATCH != 0 && i + 1 != count)
+				continue;
+			if (baseline)
+				_sendPackets<POLICY_ALL>();
+			else
+				(this->*_path().sendPackets)();
+		}
+		auto end = std::chrono::steady_clock::now();
+		if (_queuedCount() != 0) {
+			PRINT_ERROR(_queuedCount() << " packets weren't due by the end of the measurement, it needs a latency of 0.");
+			return -1;
+		}
+		return std::chrono::duration<double, std::nano>(end - start).count() / count;
+	}
+
 	~Delayer() {
 		PRINT_TRACE("Delayer destructor called.");
 		if (_active) {
@@ -496,6 +2317,10 @@ public:
 			if (!Deactivate())
 				PROMPT_CONTINUE
 		}
+		// Write the rest of the capture and the event log after the threads have stopped adding to them.
+		_capture.Close();
+		_eventLog.Close();
+		_stats.Close();
 	}
 
 	bool Activate() {
@@ -513,11 +2338,8 @@ public:
 
 		PRINT_TRACE("Opening a WinDivert handle.");
 
-		// Get the WinDivert handle.
-		_winDivertHandle = WinDivertOpen(_filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, 0);
-
-		// Check that the operation was successful.
-		if (_winDivertHandle == INVALID_HANDLE_VALUE) {
+		// Open the WinDivert handle, or the divert that replaces it, and check that the operation was successful.
+		if (!_divert->Open(_filter)) {
 			// Get the error code if not.
 			DWORD error = GetLastError();
 
@@ -536,8 +2358,31 @@ public:
 
 		PRINT_TRACE("WinDivert handle opened successfully.");
 
+		_sendTarget = _divert;
+		if (_ioMode == IoMode::Async) {
+			_engine = CreateAsyncEngine(_divert);
+			if (!_engine->Attach()) {
+				_divert->Close();
+				return false;
+			}
+			_asyncSender.Reset(_engine.get(), _divert);
+			_sendTarget = &_asyncSender;
+		}
+
+		_supervisor->Start(_divert, _filter);
+		_holdController->Reset();
+		_sendFaultPending = false;
+		_sendFailures = 0;
+
+		// Traces start over on every activation.
+		_activationTime = _clock->Now();
+		_activationReceived = _totalReceived;
+
 		// Start the receiver and sender threads.
+		_selectHotPath();
 		_startThreads();
+		if (_rttMonitor != nullptr)
+			_rttMonitor->SetFedByDelayer(true);
 
 		PRINT_INFO("Delayer activated.");
 
@@ -558,13 +2403,36 @@ public:
 			return false;
 		}
 
-		// Close the threads.
+		// A pooled delayer runs on the pool's threads, which stop with the pool.
+		if (_pool != nullptr) {
+			PRINT_ERROR("The delayer is active in a pool, deactivate the pool instead.");
+			return false;
+		}
+
+		// Drain the held packets while the threads still run, then close the threads.
+		TIME_DATA drainStart = _clock->Now();
+		size_t held = _drain(drainStart);
 		_closeThreads();
+		if (_rttMonitor != nullptr)
+			_rttMonitor->SetFedByDelayer(false);
+
+		if (_supervisor->Retried() != 0 || _supervisor->Skipped() != 0 || _supervisor->Reopens() != 0) {
+			PRINT_INFO(
+				"Retried " << _supervisor->Retried() << " failed calls, skipped " << _supervisor->Skipped()
+				<< " rejected packets, and reopened the WinDivert handle " << _supervisor->Reopens() << " times."
+			);
+		}
+
+		// Whatever the threads didn't send is freed.
+		_finishDrain(drainStart, held);
 
 		PRINT_TRACE("Closing the WinDivert handle...");
 
 		// Close the WinDivert handle.
-		bool success = WinDivertClose(_winDivertHandle);
+		bool success = _divert->Close();
+		// The event loop has drained the engine, so its completion port can go with the handle.
+		_engine.reset();
+		_sendTarget = _divert;
 
 		// Check for errors.
 		if (!success) {
@@ -586,7 +2454,494 @@ public:
 	}
 };
 
-Delayer delayer;
+// Runs many delayers on one set of threads: a receiver, a scheduler, a fixed amount of injectors, and a logger,
+// however many delayers there are. Every delayer keeps its own latency, trace, rules, and packet lists.
+// The receiver gets the packets of every delayer through a single divert and hands each one to the delayer of
+// its source port. The scheduler keeps the time each delayer next has packets due at, and passes the delayers
+// that are due to the injectors, which send their packets. A delayer is only handled by one injector at a time,
+// so its packets stay in order.
+// The delayer's packet mutex is always locked before the pool's mutex.
+class DelayerPool {
+private:
+	// The delayers schedule themselves when packets are queued.
+	friend class Delayer;
+
+	WinDivertHandle _winDivert;
+	PacketDivert* _divert = &_winDivert;
+	DivertSupervisor _supervisor;
+	std::string _filter;
+	bool _active = false;
+
+	std::vector<Delayer*> _delayers;
+	// The index of the delayer of every local port, or -1 for the ports no delayer has.
+	std::vector<int> _portDelayers = std::vector<int>(65536, -1);
+	UINT _injectorCount;
+
+	std::mutex _mutex;
+	// Signaled when a delayer is due sooner than the scheduler is waiting for, and when stopping.
+	std::condition_variable _scheduleChanged;
+	// Signaled when a delayer is ready for an injector, and when stopping.
+	std::condition_variable _readyChanged;
+	// Signaled when stopping, so the logger doesn't wait out its second.
+	std::condition_variable _stopped;
+	// The delayers that have packets waiting, by the time the next one is due.
+	std::set<std::pair<TIME_DATA, size_t>> _deadlines;
+	// The time every delayer is in the deadlines with, and whether it is in them.
+	std::vector<TIME_DATA> _due;
+	std::vector<bool> _scheduled;
+	// Whether every delayer is waiting for an injector or being handled by one. A busy delayer isn't scheduled,
+	// its injector schedules it again once it has sent its packets.
+	std::vector<bool> _busy;
+	std::deque<size_t> _ready;
+	bool _stopping = false;
+
+	// The delayers' packets all go through the same threads, so the delayers that compensate for them share a controller,
+	// which learns from all their packets instead of each delayer from its few. The injectors add their samples
+	// with the hold mutex locked, which is locked after the delayer's packet mutex.
+	HoldController _holdController;
+	std::mutex _holdMutex;
+
+	// The packets from ports no delayer has, which are sent on as they are, and the packets that didn't fit
+	// the receive buffer.
+	std::atomic<UINT64> _passed{ 0 };
+	std::atomic<UINT64> _dropped{ 0 };
+
+	std::thread _receiverThread;
+	std::thread _schedulerThread;
+	std::vector<std::thread> _injectorThreads;
+	std::thread _loggerThread;
+
+	THREAD_CONFIG _receiverConfig;
+	THREAD_CONFIG _senderConfig;
+	THREAD_CONFIG _loggerConfig;
+
+	// Puts a delayer that is due at the given time in the deadlines, or straight in the ready list if it is due now.
+	// The caller should lock the pool mutex.
+	void _scheduleLocked(size_t index, TIME_DATA due) {
+		if (_busy[index])
+			return;
+		if (_scheduled[index]) {
+			if (_due[index] <= due)
+				return;
+			_deadlines.erase(std::make_pair(_due[index], index));
+			_scheduled[index] = false;
+		}
+		if (due <= _delayers[index]->_clock->Now()) {
+			_busy[index] = true;
+			_ready.push_back(index);
+			_readyChanged.notify_one();
+			return;
+		}
+		bool first = _deadlines.empty() || due < _deadlines.begin()->first;
+		_deadlines.insert(std::make_pair(due, index));
+		_due[index] = due;
+		_scheduled[index] = true;
+		// The scheduler only has to wake up sooner if this is now the first deadline.
+		if (first)
+			_scheduleChanged.notify_one();
+	}
+
+	// Schedules a delayer that has packets due at the given time.
+	// The caller should lock the delayer's packet mutex.
+	void _schedule(size_t index, TIME_DATA due) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_scheduleLocked(index, due);
+	}
+
+	// Gets the delayer of a received packet from its source port. Returns -1 if no delayer has the port.
+	int _route(PVOID packet, UINT length) const {
+		PACKET_HEADERS headers;
+		if (!ParsePacketHeaders(packet, length, headers) || headers.transport == nullptr)
+			return -1;
+		if (headers.protocol != IP_PROTOCOL_TCP && headers.protocol != IP_PROTOCOL_UDP)
+			return -1;
+		return _portDelayers[ReadNet16(headers.transport + SRC_PORT_OFFSET)];
+	}
+
+	void _receiverLoop() {
+		ScopedThreadConfig threadConfig(_receiverConfig, "receiver");
+		PRINT_TRACE("Pool receiver loop started...");
+		std::vector<BYTE> buffer(WINDIVERT_MTU_MAX);
+		WINDIVERT_ADDRESS address;
+		UINT received;
+		// The failed receives in a row.
+		UINT failures = 0;
+		while (true) {
+			UINT64 generation = _supervisor.Generation();
+			if (!_divert->Recv(buffer.data(), (UINT)buffer.size(), &received, &address)) {
+				DWORD error = GetLastError();
+				if (error == ERROR_INSUFFICIENT_BUFFER) {
+					_dropped += 1;
+					continue;
+				}
+				DivertFault fault = ClassifyRecvError(error);
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (_stopping) {
+						PRINT_INFO("The pool receiver thread is closing.");
+						return;
+					}
+				}
+				RECV_TRACE("WinDivertRecv() failed with error code " << error << " (" << DivertFaultName(fault) << "), recovering.");
+				_supervisor.Recover(fault, generation, failures);
+				continue;
+			}
+			failures = 0;
+			int index = _route(buffer.data(), received);
+			if (index < 0) {
+				// The filter only lets the delayers' ports through, but a packet can't always be told apart by them.
+				_divert->Send(buffer.data(), received, &address);
+				_passed += 1;
+				continue;
+			}
+			// The delayer takes over the buffers, so they are copied from the receive buffer.
+			byte* packet = new byte[received];
+			std::memcpy(packet, buffer.data(), received);
+			Delayer* delayer = _delayers[index];
+			(delayer->*delayer->_path().processReceived)(packet, received, new WINDIVERT_ADDRESS(address));
+		}
+	}
+
+	// Moves the delayers that are due to the ready list for the injectors.
+	void _schedulerLoop() {
+		ScopedThreadConfig threadConfig(_senderConfig, "scheduler");
+		PRINT_TRACE("Pool scheduler loop started...");
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (!_stopping) {
+			if (_deadlines.empty()) {
+				_scheduleChanged.wait(lock);
+				continue;
+			}
+			// The deadlines are in the time of the delayers' clocks, so the scheduler waits for as long as the first one is away on it.
+			TIME_DATA first = _deadlines.begin()->first;
+			TIME_DATA now = _delayers[_deadlines.begin()->second]->_clock->Now();
+			if (first > now) {
+				_scheduleChanged.wait_for(lock, first - now);
+				continue;
+			}
+			while (!_deadlines.empty() && _deadlines.begin()->first <= _delayers[_deadlines.begin()->second]->_clock->Now()) {
+				size_t index = _deadlines.begin()->second;
+				_deadlines.erase(_deadlines.begin());
+				_scheduled[index] = false;
+				_busy[index] = true;
+				_ready.push_back(index);
+			}
+			_readyChanged.notify_all();
+		}
+		PRINT_INFO("The pool scheduler thread is closing.");
+	}
+
+	// Sends the packets of the delayers that are due, and schedules each one again for its next packet.
+	void _injectorLoop() {
+		ScopedThreadConfig threadConfig(_senderConfig, "injector");
+		PRINT_TRACE("Pool injector loop started...");
+		while (true) {
+			size_t index;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_readyChanged.wait(lock, [this]() { return _stopping || !_ready.empty(); });
+				if (_stopping)
+					break;
+				index = _ready.front();
+				_ready.pop_front();
+			}
+			Delayer& delayer = *_delayers[index];
+			(delayer.*delayer._path().sendPackets)();
+			// Recover from a failed send with the packet mutex unlocked, so the receiver keeps queueing meanwhile.
+			if (delayer._sendFaultPending) {
+				delayer._sendFaultPending = false;
+				_supervisor.Recover(delayer._sendFault, delayer._sendFaultGeneration, delayer._sendFailures);
+			}
+			// The next due time is found and scheduled under the packet mutex, so a packet the receiver queues
+			// is either seen here or schedules the delayer itself once it is no longer busy.
+			std::lock_guard<std::mutex> packetLock(delayer._packetMutex);
+			TIME_DATA due;
+			bool hasDue = (delayer.*delayer._path().nextDue)(due);
+			std::lock_guard<std::mutex> lock(_mutex);
+			_busy[index] = false;
+			if (hasDue)
+				_scheduleLocked(index, due);
+		}
+		PRINT_INFO("The pool injector thread is closing.");
+	}
+
+	// Logs the totals of every delayer every second.
+	void _loggingLoop() {
+		ScopedThreadConfig threadConfig(_loggerConfig, "logger");
+		PRINT_TRACE("Pool logging loop started...");
+		UINT64 prevPassed = 0;
+		UINT64 prevDropped = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (_stopped.wait_for(lock, std::chrono::seconds(1), [this]() { return _stopping; }))
+					break;
+			}
+			DELAYER_COUNTS total;
+			bool compensated = false;
+			for (Delayer* delayer : _delayers) {
+				DELAYER_COUNTS counts = delayer->_takeCounts();
+				total.received += counts.received;
+				total.sent += counts.sent;
+				total.buffered += counts.buffered;
+				total.dropped += counts.dropped;
+				if (delayer->_holdController == &_holdController && counts.sent != 0)
+					compensated = true;
+			}
+			UINT64 dropped = _dropped;
+			total.dropped += dropped - prevDropped;
+			prevDropped = dropped;
+			UINT64 passed = _passed;
+			if (total.dropped == 0) {
+				PRINT_INFO(
+					_delayers.size() << " profiles. Received: " << total.received << ", sent: " << total.sent
+					<< ", buffered: " << total.buffered << "."
+				);
+			}
+			else {
+				PRINT_ERROR(
+					"Dropped: " << total.dropped << "! " << _delayers.size() << " profiles. Received: " << total.received
+					<< ", sent: " << total.sent << ", buffered: " << total.buffered << "."
+				);
+			}
+			if (compensated) {
+				PRINT_INFO(
+					"Releasing " << _holdController.Offset().count() / 1e6 << " ms early for a mean hold time error of "
+					<< _holdController.MeanError().count() / 1e6 << " ms."
+				);
+			}
+			if (passed != prevPassed) {
+				PRINT_INFO("Sent on " << passed - prevPassed << " packets from ports without a profile.");
+				prevPassed = passed;
+			}
+		}
+		PRINT_INFO("The pool logger thread is closing.");
+	}
+
+public:
+	// Creates a pool that sends the packets with the given amount of injector threads.
+	explicit DelayerPool(UINT injectors) : _injectorCount(std::max<UINT>(injectors, 1)) {}
+
+	~DelayerPool() {
+		if (_active)
+			Deactivate();
+	}
+
+	DelayerPool(const DelayerPool&) = delete;
+	DelayerPool& operator=(const DelayerPool&) = delete;
+
+	// Sets the scheduling settings of the receiver, of the scheduler and injectors, and of the logger.
+	void SetThreadConfigs(const THREAD_CONFIG& receiver, const THREAD_CONFIG& sender, const THREAD_CONFIG& logger) {
+		_receiverConfig = receiver;
+		_senderConfig = sender;
+		_loggerConfig = logger;
+		uint64_t dataPlaneMask = receiver.affinityMask | sender.affinityMask;
+		if (logger.affinityMask == 0 && dataPlaneMask != 0)
+			_loggerConfig.affinityMask = GetProcessCpuMask() & ~dataPlaneMask;
+	}
+
+	// Receives and injects the packets through the given divert instead of WinDivert. Null restores WinDivert.
+	bool SetDivert(PacketDivert* divert) {
+		if (_active) {
+			PRINT_ERROR("The divert can't be changed while the pool is active.");
+			return false;
+		}
+		_divert = divert != nullptr ? divert : &_winDivert;
+		return true;
+	}
+
+	// Adds an initialized delayer, which delays the packets from the port it was initialized with.
+	// The delayer must stay alive as long as the pool.
+	bool Add(Delayer& delayer) {
+		if (_active) {
+			PRINT_ERROR("Delayers can't be added while the pool is active.");
+			return false;
+		}
+		if (!delayer._initialized || delayer._active) {
+			PRINT_ERROR("A delayer must be initialized and inactive to be added to a pool.");
+			return false;
+		}
+		if (delayer._tracker != nullptr) {
+			PRINT_ERROR("A delayer that targets a process can't be added to a pool.");
+			return false;
+		}
+		if (delayer._port < 0 || delayer._port > 65535 || _portDelayers[delayer._port] != -1) {
+			PRINT_ERROR("The port " << delayer._port << " is invalid or already has a delayer in the pool.");
+			return false;
+		}
+		_portDelayers[delayer._port] = (int)_delayers.size();
+		_delayers.push_back(&delayer);
+		return true;
+	}
+
+	// Gets the amount of threads the pool runs while active.
+	size_t ThreadCount() const {
+		return 3 + _injectorCount;
+	}
+
+	bool Activate() {
+		if (_active) {
+			SYNC_COUT("The pool is already active.");
+			return false;
+		}
+		if (_delayers.empty()) {
+			PRINT_ERROR("The pool has no delayers.");
+			return false;
+		}
+		_filter = "outbound and (";
+		for (size_t i = 0; i < _delayers.size(); ++i)
+			_filter += (i == 0 ? "localPort == " : " or localPort == ") + std::to_string(_delayers[i]->_port);
+		_filter += ")";
+		PRINT_TRACE("Set filter \"" << _filter << "\".");
+		if (!_divert->Open(_filter)) {
+			DWORD error = GetLastError();
+			if (error == ERROR_ACCESS_DENIED) {
+				PRINT_ERROR(
+					"This program has to be run with administrator privileges "
+					"since it has to install the WinDivert drivers."
+				);
+				return false;
+			}
+			PRINT_ERROR("WinDivertOpen() failed with error code " << error << ".");
+			return false;
+		}
+		_supervisor.Start(_divert, _filter);
+		_holdController.Reset();
+
+		// The delayers send through the pool's divert and recover through its supervisor while they are in it.
+		for (size_t i = 0; i < _delayers.size(); ++i) {
+			Delayer& delayer = *_delayers[i];
+			delayer._soloDivert = delayer._divert;
+			delayer._divert = _divert;
+			// The pool's threads send directly, whatever I/O mode the delayer runs its own threads in.
+			delayer._sendTarget = _divert;
+			delayer._supervisor = &_supervisor;
+			delayer._pool = this;
+			delayer._poolIndex = i;
+			if (delayer._ownHoldController.IsEnabled())
+				delayer._holdController = &_holdController;
+			delayer._sendFaultPending = false;
+			delayer._sendFailures = 0;
+			delayer._activationTime = delayer._clock->Now();
+			delayer._activationReceived = delayer._totalReceived;
+			delayer._selectHotPath();
+			delayer._active = true;
+		}
+		_deadlines.clear();
+		_due.assign(_delayers.size(), TIME_DATA());
+		_scheduled.assign(_delayers.size(), false);
+		_busy.assign(_delayers.size(), false);
+		_ready.clear();
+		_stopping = false;
+		_passed = 0;
+		_dropped = 0;
+		// Schedule the packets the delayers still held from before.
+		for (size_t i = 0; i < _delayers.size(); ++i) {
+			std::lock_guard<std::mutex> lock(_delayers[i]->_packetMutex);
+			TIME_DATA due;
+			if ((_delayers[i]->*_delayers[i]->_path().nextDue)(due))
+				_schedule(i, due);
+		}
+
+		_receiverThread = std::thread(&DelayerPool::_receiverLoop, this);
+		_schedulerThread = std::thread(&DelayerPool::_schedulerLoop, this);
+		for (UINT i = 0; i < _injectorCount; ++i)
+			_injectorThreads.emplace_back(&DelayerPool::_injectorLoop, this);
+		_loggerThread = std::thread(&DelayerPool::_loggingLoop, this);
+
+		PRINT_INFO("Delayer pool of " << _delayers.size() << " profiles activated with " << ThreadCount() << " threads.");
+		_active = true;
+		return true;
+	}
+
+	bool Deactivate() {
+		if (!_active) {
+			SYNC_COUT("The pool is already deactivated.");
+			return false;
+		}
+		// Every delayer drains its held packets by its own policy and timeout while the threads still run.
+		// The drains run at the same time, so the pool waits for the longest one instead of all of them in turn.
+		std::vector<TIME_DATA> drainStarts;
+		std::vector<size_t> held;
+		for (Delayer* delayer : _delayers) {
+			drainStarts.push_back(delayer->_clock->Now());
+			held.push_back(delayer->_startDrain());
+		}
+		for (size_t i = 0; i < _delayers.size(); ++i)
+			_delayers[i]->_awaitDrain(drainStarts[i]);
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_scheduleChanged.notify_all();
+		_readyChanged.notify_all();
+		_stopped.notify_all();
+		// Stop reopening the handle, so the handle shut down here is the last one.
+		_supervisor.Stop();
+		if (!_divert->Shutdown()) {
+			DWORD error = GetLastError();
+			PRINT_ERROR("WinDivertShutdown() failed with error code " << error << ".");
+		}
+		_receiverThread.join();
+		_schedulerThread.join();
+		for (std::thread& thread : _injectorThreads)
+			thread.join();
+		_injectorThreads.clear();
+		_loggerThread.join();
+
+		if (_supervisor.Retried() != 0 || _supervisor.Skipped() != 0 || _supervisor.Reopens() != 0) {
+			PRINT_INFO(
+				"Retried " << _supervisor.Retried() << " failed calls, skipped " << _supervisor.Skipped()
+				<< " rejected packets, and reopened the WinDivert handle " << _supervisor.Reopens() << " times."
+			);
+		}
+		for (size_t i = 0; i < _delayers.size(); ++i) {
+			Delayer* delayer = _delayers[i];
+			// Whatever the threads didn't send is freed. It still sends through the pool's divert.
+			delayer->_finishDrain(drainStarts[i], held[i]);
+			std::lock_guard<std::mutex> lock(delayer->_packetMutex);
+			delayer->_divert = delayer->_soloDivert;
+			delayer->_supervisor = &delayer->_ownSupervisor;
+			delayer->_holdController = &delayer->_ownHoldController;
+			delayer->_pool = nullptr;
+			delayer->_active = false;
+		}
+
+		bool success = _divert->Close();
+		if (!success) {
+			DWORD error = GetLastError();
+			PRINT_ERROR("WinDivertClose() failed with error code " << error << ".");
+		}
+		PRINT_INFO("Delayer pool deactivated.");
+		_active = false;
+		return success;
+	}
+
+	bool IsActive() const {
+		return _active;
+	}
+};
+
+void Delayer::_wake(TIME_DATA due) {
+	if (_pool != nullptr)
+		_pool->_schedule(_poolIndex, due);
+}
+
+void Delayer::_addHoldSamples(TIME_DATA now, const HOLD_SAMPLES& samples) {
+	if (_holdController == &_ownHoldController) {
+		_holdController->AddSamples(now, samples);
+		return;
+	}
+	// The pool's injectors add the samples of their delayers at the same time.
+	std::lock_guard<std::mutex> lock(_pool->_holdMutex);
+	_holdController->AddSamples(now, samples);
+}
+
+// Declared before the delayer so it is destroyed after the delayer's threads have stopped using it.
+ProcessTracker processTracker;
+RttMonitor rttMonitor;
+
+Delayer delayer;
 
 #define INPUT_SLEEP_TIME std::chrono::milliseconds(INPUT_SLEEP_MS)
 
@@ -603,12 +2958,32 @@ void Close() {
 	shouldClose = true;
 }
 
+#ifdef _WIN32
 namespace ShortcutWaiter {
+	// If set, the delayer stays active and the shortcut freezes it while held instead of toggling it.
+	bool freezeMode = false;
+	// If set, the shortcut toggles this pool of delayers instead of the delayer.
+	DelayerPool* pool = nullptr;
+
 	// This should return true if the shortcut to activate the delayer is pressed.
 	bool TogglePressed() {
 		return GetKeyState(VK_F8) & 0x8000;
 	}
 
+	// This should return true if the shortcut to print the heaviest flows is pressed.
+	bool ReportPressed() {
+		return GetKeyState(VK_F9) & 0x8000;
+	}
+
+	bool ShouldReport() {
+		static bool lastState = false;
+		bool currentState = ReportPressed();
+		if (currentState == lastState)
+			return false;
+		lastState = currentState;
+		return currentState;
+	}
+
 	bool ShouldToggle() {
 		static bool lastState = false;
 		bool currentState = TogglePressed();
@@ -620,8 +2995,29 @@ namespace ShortcutWaiter {
 	}
 
 	void TestShortcuts() {
+		if (ShouldReport() && pool == nullptr)
+			delayer.PrintTopFlows();
+		if (freezeMode) {
+			static bool frozen = false;
+			bool pressed = TogglePressed();
+			if (pressed == frozen)
+				return;
+			PRINT_TRACE("Freeze key state changed to " << pressed << ".");
+			frozen = pressed;
+			if (pressed)
+				delayer.Freeze();
+			else
+				delayer.Release();
+			return;
+		}
 		if (ShouldToggle()) {
-			if (delayer.IsActive())
+			if (pool != nullptr) {
+				if (pool->IsActive())
+					pool->Deactivate();
+				else
+					pool->Activate();
+			}
+			else if (delayer.IsActive())
 				delayer.Deactivate();
 			else
 				delayer.Activate();
@@ -642,44 +3038,806 @@ namespace ShortcutWaiter {
 			// Sleep for the input sleep time between checks.
 			std::this_thread::sleep_for(INPUT_SLEEP_TIME);
 		}
-	}
-};
-
-long long PromptPositiveNum(const char * message) {
-	long long input;
-	std::string inputString;
-
-	// Loop until the user gives an input of the correct format (non-zero natural number).
-	while (true) {
-		sync_cout << message;
-
-		// Get the user input.
-		std::getline(std::cin, inputString);
-		sync_cout << std::endl;
-
-		bool success;
-		// If the input string is empty, it is not a number.
-		if (inputString == "")
-			success = false;
-		else
-			// Try to parse the user input as an integer.
-			input = TryStringToLongLong(inputString, success);
-
-		if (success) {
-			// If the parse was successful, test that the input number is greater than zero.
-			if (input > 0)
-				break;
-			else
-				SYNC_COUT("Please enter a number that's greater than 0.");
+	}
+};
+#endif
+
+long long PromptPositiveNum(const char * message) {
+	long long input;
+	std::string inputString;
+
+	// Loop until the user gives an input of the correct format (non-zero natural number).
+	while (true) {
+		sync_cout << message;
+
+		// Get the user input.
+		std::getline(std::cin, inputString);
+		sync_cout << std::endl;
+
+		bool success;
+		// If the input string is empty, it is not a number.
+		if (inputString == "")
+			success = false;
+		else
+			// Try to parse the user input as an integer.
+			input = TryStringToLongLong(inputString, success);
+
+		if (success) {
+			// If the parse was successful, test that the input number is greater than zero.
+			if (input > 0)
+				break;
+			else
+				SYNC_COUT("Please enter a number that's greater than 0.");
+		}
+		else
+			// If the parse was unsuccessful, prompt the user for an integer.
+			SYNC_COUT("Please enter an integer.");
+	}
+
+	return input;
+}
+
+// The options given on the command line.
+// A port and the latency its packets are delayed by in a pool.
+struct PORT_PROFILE {
+	int port;
+	long long latency;
+};
+
+struct Options {
+	// If set, the CSV file is converted into a trace file and the program exits.
+	std::string convertCsvPath;
+	std::string convertTracePath;
+	double convertIntervalMs = 1.0;
+
+	// If set, the event log is summarized, and written to the CSV file if one is given, and the program exits.
+	std::string readEventsPath;
+	std::string readEventsCsvPath;
+
+	// If set, the statistics published in the named segment are printed this many times a second apart, and the program exits.
+	std::string readStatsName;
+	long long readStatsCount = 1;
+
+	// If set, the delays are played back from this trace file instead of prompting for the latency.
+	std::string tracePath;
+	TraceMode traceMode = TraceMode::Packet;
+	bool traceLoop = false;
+	double traceSpeed = 1.0;
+
+	// The fixed latency in milliseconds. If 0, the user is prompted for it unless a trace is given.
+	long long latency = 0;
+
+	// If set, the ports of this process ID or executable name are delayed instead of prompting for a port.
+	std::string process;
+
+	// If set, the delays count from when the receiver gets the packets instead of from the capture timestamps.
+	bool stampOnReceive = false;
+	// If set, the packets aren't released early to make up for the latency the delayer adds.
+	bool noCompensation = false;
+
+	// If set, the held packets are profiled by flow over a window of this many seconds.
+	long long topFlowsWindow = 0;
+
+	// If set, the round trip times of the flows are measured and logged.
+	bool measureRtt = false;
+	RTT_UDP_KEY rttUdpKey;
+	// If set, every measured flow is delayed to this round trip time in milliseconds instead of by the latency.
+	long long targetRttMs = 0;
+
+	PacketRewriter rewriter;
+
+	// The rules that classify the packets, compiled once the options are parsed.
+	RuleEngine rules;
+
+	// If set, the packets due later than this are spilled to files in the spill directory.
+	long long spillAfterMs = 0;
+	std::string spillDirectory;
+
+	// If set, the delayer is activated right away and the shortcut holds the packets while pressed.
+	bool freeze = false;
+	long long freezeCapMb = FREEZE_DEFAULT_CAP_MB;
+	// The rate the held packets are released at. Zero releases them as fast as possible.
+	double releaseRate = 0;
+
+	// How the delayer receives and sends the packets.
+	IoMode ioMode = IoMode::Threads;
+
+	// If set, a queued pure TCP ACK is replaced by a newer one of the same connection.
+	bool coalesceAcks = false;
+
+	// What happens to the held packets on deactivation, and the longest the deactivation waits for them.
+	DrainPolicy drainPolicy = DrainPolicy::Schedule;
+	long long drainTimeoutMs = DRAIN_DEFAULT_TIMEOUT_MS;
+
+	// The order the packets due at the same time in different rule queues are sent in, and the weight of each queue.
+	ReleaseOrder releaseOrder = ReleaseOrder::Due;
+	std::vector<UINT> queueWeights = std::vector<UINT>(RULE_QUEUE_COUNT, 1);
+
+	// If set, the port of every profile is delayed by its latency by a delayer in a pool, instead of prompting for a port.
+	std::vector<PORT_PROFILE> profiles;
+	// The injector threads a pool of delayers sends with.
+	long long injectors = POOL_DEFAULT_INJECTORS;
+
+	// If set, the delayed packets are captured to this pcapng file.
+	std::string capturePath;
+	long long captureRotateMb = 0;
+
+	// If set, the released and dropped packets are logged to this event log file.
+	std::string eventLogPath;
+	// If set, the statistics are published in the shared memory segment with this name.
+	std::string statsName;
+
+	THREAD_CONFIG receiverThread;
+	THREAD_CONFIG senderThread;
+	THREAD_CONFIG loggerThread;
+
+	// If set, this many packets are run through a simulation at the given rate and the program exits.
+	long long simulatePackets = 0;
+	double simulateRate = 0;
+	// If set, the simulated release times are written to this CSV file.
+	std::string simulateCsvPath;
+
+	// If set, the load generator searches for the highest sustainable packet rate and the program exits.
+	bool loadTest = false;
+	LOAD_PROFILE loadProfile;
+	LOAD_THRESHOLDS loadThresholds;
+
+	// If set, the named benchmark is run and the program exits.
+	std::string benchmark;
+	long long benchmarkSeconds = 5;
+	// If set, the benchmarks that produce a report write it to this file.
+	std::string reportPath;
+};
+
+void PrintUsage() {
+	SYNC_COUT(
+		"Usage: LagSwitch [options]\n"
+		"  --latency <ms>              Use the given latency instead of prompting for it.\n"
+		"  --process <pid|name>        Delay the ports of a process instead of prompting for a port. The ports\n"
+		"                              are tracked as the process opens and closes sockets.\n"
+		"  --stamp-on-receive          Count the delays from when the packets are received instead of from when\n"
+		"                              the driver captured them.\n"
+		"  --no-compensation           Don't release the packets early by the latency the delayer itself adds.\n"
+		"  --top-flows [seconds]       Find the flows that send the most of the held bytes over a sliding window\n"
+		"                              (default 10 s). The heaviest are logged every second, and F9 lists them.\n"
+		"  --measure-rtt               Measure the round trip times of the TCP flows from their ACKs, without and\n"
+		"                              with the added latency, and log them every second.\n"
+		"  --rtt-udp-key <offset>:<length>\n"
+		"                              Also measure UDP flows, pairing a request and its response by the 1 to 8\n"
+		"                              payload bytes at the offset, like a sequence number both carry.\n"
+		"  --target-rtt <ms>           Measure the round trip times and delay every flow by only as much as brings it\n"
+		"                              to the given round trip time. Flows get the --latency until they are measured.\n"
+		"  --trace <file>              Play the delays back from a latency trace file.\n"
+		"  --trace-mode <packet|time>  Index the trace by packet count (default) or by time since activation.\n"
+		"  --trace-loop                Start the trace over when it ends instead of repeating the last sample.\n"
+		"  --trace-speed <factor>      Step through the trace faster or slower than recorded.\n"
+		"  --convert-trace <csv> <file> [interval ms]\n"
+		"                              Convert a CSV file of \"rtt_ms\" or \"time_ms,rtt_ms\" rows into a trace file\n"
+		"                              and exit. Timestamped rows are resampled to the interval (default 1 ms).\n"
+		"  --rewrite <edit>            Edit the held packets. Can be given several times. The edits are:\n"
+		"                                dst-addr=<IPv4 address>, dst-port=<port>, max-ttl=<ttl>,\n"
+		"                                decrement-ttl, and dscp=<0-63>.\n"
+		"  --rewrite-checksums <incremental|full>\n"
+		"                              Adjust the checksums for the changed fields (default) or recalculate them.\n"
+		"  --rule <rule>               Classify the packets with a rule. Can be given several times, and the first\n"
+		"                              matching rule applies. A rule is a comma separated list of matches:\n"
+		"                                tcp, udp, icmp, proto=<number>, src-port=<range>, dst-port=<range>,\n"
+		"                                src-addr=<IPv4 range>, dst-addr=<IPv4 range>, size=<range>,\n"
+		"                                dscp=<range>, +<TCP flag> and -<TCP flag> for fin, syn, rst, psh,\n"
+		"                                ack, or urg,\n"
+		"                              and actions: delay=<ms>, bypass, drop, and queue=<1-7>. Ranges are written\n"
+		"                              like 27015 or 27015-27030, IPv4 ranges like 10.0.0.0/8 or 10.0.0.1-10.0.0.9.\n"
+		"  --rules <file>              Read rules from a file with a rule on each line.\n"
+		"  --spill-after <ms>          Keep the packets due later than this on disk instead of in memory.\n"
+		"  --spill-dir <directory>     Create the spill files in the directory instead of the working directory.\n"
+		"  --freeze                    Pass the packets through, or delay them by --latency, and hold every packet\n"
+		"                              while the shortcut is held down. The held packets are sent on release.\n"
+		"  --freeze-cap <MB>           The most memory the held packets may take (default 256). Packets that\n"
+		"                              don't fit are dropped.\n"
+		"  --release-rate <pps>        Send the held packets at this rate instead of as fast as possible.\n"
+		"  --io <threads|async>        Receive and send with a thread each (default), or keep several receives and\n"
+		"                              sends in flight on a single event loop thread.\n"
+		"  --coalesce-acks             Replace a held pure TCP ACK with a newer one of the same connection that only\n"
+		"                              acknowledges more, keeping the older one's send time.\n"
+		"  --drain <schedule|flush|drop>\n"
+		"                              What happens to the held packets on deactivation: sent when they are due\n"
+		"                              (default), sent right away at the --release-rate, or dropped.\n"
+		"  --drain-timeout <ms>        The longest a deactivation waits for the held packets (default 2000).\n"
+		"                              The packets still held then are dropped.\n"
+		"  --release-order <due|priority|fair>\n"
+		"                              How the packets due at the same time in different rule queues are sent: in\n"
+		"                              the order they were due (default), the queues with higher weights first, or\n"
+		"                              in shares of the bytes in proportion to the weights.\n"
+		"  --queue-weight <queue>=<weight>\n"
+		"                              The weight of a rule queue from 0 to 7 (default 1). Can be given several times.\n"
+		"  --profile <port>:<ms>       Delay the packets from the port by the latency with a delayer in a pool,\n"
+		"                              instead of prompting for a port. Can be given several times, and the\n"
+		"                              shortcut toggles the whole pool.\n"
+		"  --injectors <n>             The threads a pool of delayers sends with (default 2).\n"
+		"  --capture <file>            Capture every released or dropped packet to a pcapng file.\n"
+		"  --capture-rotate <MB>       Start a new capture file when the current one reaches the size.\n"
+		"  --event-log <file>          Log the capture and release time, length, flow hash, and fate of every\n"
+		"                              released or dropped packet to a compact binary file.\n"
+		"  --read-events <file> [csv]  Summarize an event log, and write its events to a CSV file if one is given,\n"
+		"                              then exit.\n"
+		"  --stats-shm [name]          Publish the counts, the held packets and bytes, and the hold time percentiles\n"
+		"                              every 50 ms in a shared memory segment (default \"" STATS_DEFAULT_NAME "\").\n"
+		"  --read-stats [name] [count] Print the statistics another instance publishes, count times a second apart\n"
+		"                              (default once), then exit.\n"
+		"  --<receiver|sender|logger>-cpus <list>\n"
+		"                              Pin the thread to the given CPUs, e.g. \"2,4-5\". The logger is kept off\n"
+		"                              the receiver and sender CPUs unless given its own.\n"
+		"  --<receiver|sender|logger>-priority <lowest|below-normal|normal|above-normal|highest|time-critical>\n"
+		"                              Set the thread priority. On Linux, highest and time-critical use SCHED_FIFO.\n"
+		"  --mmcss                     Register the receiver and sender threads with MMCSS.\n"
+		"  --simulate <packets> <packets per second>\n"
+		"                              Run the packets through the latency or trace on simulated time and\n"
+		"                              summarize how late they were released, then exit.\n"
+		"  --simulate-csv <file>       Write the simulated receive, send, and release times to a CSV file.\n"
+		"  --load-test                 Find the highest packet rate that stays within the loss and hold time error\n"
+		"                              limits by running generated traffic through the delayer, then exit.\n"
+		"  --load-rate <pps>           The rate to start the search from (default 10000).\n"
+		"  --load-sizes <list>         The generated packet sizes, picked at random, e.g. \"64,64,1400\".\n"
+		"  --load-flows <n>            The amount of generated flows (default 16).\n"
+		"  --load-burst <n>            Generate the packets in bursts of n (default 1).\n"
+		"  --load-duration <seconds>   How long each rate is run for (default 2).\n"
+		"  --load-max-loss <percent>   The most packets a sustainable rate may lose (default 0.1).\n"
+		"  --load-max-error <ms>       The highest p99 hold time error a sustainable rate may have (default 15).\n"
+		"  --benchmark <name> [seconds]\n"
+		"                              Run a benchmark and exit. Available benchmarks:\n"
+		"                                jitter: sender wake-up lateness with and without the sender thread\n"
+		"                                        settings while every CPU is busy.\n"
+		"                                checksum: the cost of rewriting packets and calculating checksums.\n"
+		"                                rules: the cost of classifying a packet against 1000 rules.\n"
+		"                                spill: how fast packets are spilled to disk and read back, in the\n"
+		"                                       --spill-dir directory.\n"
+		"                                capture: the cost of capturing 50k packets per second, written to\n"
+		"                                         the --capture file (default benchmark.pcapng).\n"
+		"                                freeze: freezes generated --load-rate traffic delayed by the --latency\n"
+		"                                        for the given time, releases it at the --release-rate, and\n"
+		"                                        checks that the backlog didn't move the compensation.\n"
+		"                                faults: runs --load-rate traffic through a divert that fails at random\n"
+		"                                        and checks that no held packet is lost.\n"
+		"                                compensation: the hold time error at several loads with and without\n"
+		"                                              the compensation.\n"
+		"                                profiles: splits --load-rate traffic between 1, 8, and 64 delayers\n"
+		"                                          with their own latencies in a pool of --injectors threads.\n"
+		"                                loopback: the round trip time a UDP echo client sees through the\n"
+		"                                          delayer at several rates and latencies, against a direct\n"
+		"                                          path. Fails if a run goes over the --load-max-* limits.\n"
+		"                                policies: the cost of a packet on the packet path compiled for the\n"
+		"                                          default settings against the pre-policy one.\n"
+		"                                io: the packets per second the receiver and sender threads and the\n"
+		"                                        event loop move, and their hold time error at --load-rate.\n"
+		"                                acks: the packets injected for bulk download ACKs mixed with game\n"
+		"                                      traffic at --load-rate, with and without --coalesce-acks, and\n"
+		"                                      with it while spilling after --spill-after.\n"
+		"                                drain: deactivates a delayer and then a pool holding --load-rate traffic\n"
+		"                                       with every --drain policy and checks that no held packet is lost.\n"
+		"                                events: the cost of the --event-log (default benchmark.events) on\n"
+		"                                        the packet path, and the events read back from it.\n"
+		"                                stats: the cost of the --stats-shm on the packet path while a reader\n"
+		"                                       polls it, and the cost and consistency of the reads.\n"
+		"                                qos: how long game packets due together with bursts of bulk packets\n"
+		"                                     wait for them with every --release-order.\n"
+		"                                flows: the cost and accuracy of the flow profile with 50k generated\n"
+		"                                       flows whose ranking changes halfway.\n"
+		"                                rtt: the cost and accuracy of the RTT measurement with simulated\n"
+		"                                     TCP flows, more of them than the flow table holds.\n"
+		"                                target: the round trip times of UDP flows with different base round\n"
+		"                                        trip times delayed to the --target-rtt (default 200 ms).\n"
+		"  --report <file>             Also write the loopback benchmark's report to a file."
+	);
+}
+
+// Parses the command line options. Returns false if they were invalid.
+bool ParseOptions(int argc, char* argv[], Options & options) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		// The thread the option applies to if it is a thread option.
+		THREAD_CONFIG * thread = nullptr;
+		if (arg.compare(0, 11, "--receiver-") == 0)
+			thread = &options.receiverThread;
+		else if (arg.compare(0, 9, "--sender-") == 0)
+			thread = &options.senderThread;
+		else if (arg.compare(0, 9, "--logger-") == 0)
+			thread = &options.loggerThread;
+		// Whether or not the option has the given amount of arguments after it.
+		auto hasArgs = [&](int count) {
+			if (i + count < argc)
+				return true;
+			PRINT_ERROR("The option " << arg << " requires " << count << " argument(s).");
+			return false;
+		};
+		bool success = true;
+
+		if (arg == "--latency") {
+			if (!hasArgs(1))
+				return false;
+			options.latency = TryStringToLongLong(argv[++i], success);
+			if (!success || options.latency <= 0) {
+				PRINT_ERROR("The latency must be a number of milliseconds greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--process") {
+			if (!hasArgs(1))
+				return false;
+			options.process = argv[++i];
+		}
+		else if (arg == "--stamp-on-receive") {
+			options.stampOnReceive = true;
+		}
+		else if (arg == "--no-compensation") {
+			options.noCompensation = true;
+		}
+		else if (arg == "--trace") {
+			if (!hasArgs(1))
+				return false;
+			options.tracePath = argv[++i];
+		}
+		else if (arg == "--trace-mode") {
+			if (!hasArgs(1))
+				return false;
+			std::string mode = argv[++i];
+			if (mode == "packet")
+				options.traceMode = TraceMode::Packet;
+			else if (mode == "time")
+				options.traceMode = TraceMode::Time;
+			else {
+				PRINT_ERROR("Unknown trace mode \"" << mode << "\".");
+				return false;
+			}
+		}
+		else if (arg == "--trace-loop") {
+			options.traceLoop = true;
+		}
+		else if (arg == "--trace-speed") {
+			if (!hasArgs(1))
+				return false;
+			options.traceSpeed = TryStringToDouble(argv[++i], success);
+			if (!success || options.traceSpeed <= 0) {
+				PRINT_ERROR("The trace speed must be a number greater than 0.");
+				return false;
+			}
+		}
+		else if (thread != nullptr && arg.size() > 5 && arg.compare(arg.size() - 5, 5, "-cpus") == 0) {
+			if (!hasArgs(1))
+				return false;
+			if (!ParseCpuList(argv[++i], thread->affinityMask)) {
+				PRINT_ERROR("Invalid CPU list \"" << argv[i] << "\" for " << arg << ".");
+				return false;
+			}
+		}
+		else if (thread != nullptr && arg.size() > 9 && arg.compare(arg.size() - 9, 9, "-priority") == 0) {
+			if (!hasArgs(1))
+				return false;
+			if (!ParseThreadPriority(argv[++i], thread->priority)) {
+				PRINT_ERROR("Unknown thread priority \"" << argv[i] << "\" for " << arg << ".");
+				return false;
+			}
+		}
+		else if (arg == "--rewrite") {
+			if (!hasArgs(1))
+				return false;
+			std::string edit = argv[++i];
+			size_t separator = edit.find('=');
+			std::string field = edit.substr(0, separator);
+			std::string value = separator == std::string::npos ? "" : edit.substr(separator + 1);
+			long long number = TryStringToLongLong(value, success);
+			UINT32 address;
+			if (field == "dst-addr" && ParseIPv4(value, address))
+				options.rewriter.AddEdit(RewriteField::DstAddr, address);
+			else if (field == "dst-port" && success && number > 0 && number <= 65535)
+				options.rewriter.AddEdit(RewriteField::DstPort, (UINT32)number);
+			else if (field == "max-ttl" && success && number > 0 && number <= 255)
+				options.rewriter.AddEdit(RewriteField::MaxTtl, (UINT32)number);
+			else if (field == "decrement-ttl" && value.empty())
+				options.rewriter.AddEdit(RewriteField::DecrementTtl, 0);
+			else if (field == "dscp" && success && number >= 0 && number <= 63)
+				options.rewriter.AddEdit(RewriteField::Dscp, (UINT32)number);
+			else {
+				PRINT_ERROR("Invalid rewrite \"" << edit << "\".");
+				return false;
+			}
+		}
+		else if (arg == "--rewrite-checksums") {
+			if (!hasArgs(1))
+				return false;
+			std::string mode = argv[++i];
+			if (mode == "incremental")
+				options.rewriter.SetChecksumMode(ChecksumMode::Incremental);
+			else if (mode == "full")
+				options.rewriter.SetChecksumMode(ChecksumMode::Full);
+			else {
+				PRINT_ERROR("Unknown checksum mode \"" << mode << "\".");
+				return false;
+			}
+		}
+		else if (arg == "--rule") {
+			if (!hasArgs(1))
+				return false;
+			PACKET_RULE rule;
+			std::string error;
+			if (!ParseRule(argv[++i], rule, error)) {
+				PRINT_ERROR("Invalid rule \"" << argv[i] << "\": " << error);
+				return false;
+			}
+			options.rules.AddRule(rule);
+		}
+		else if (arg == "--rules") {
+			if (!hasArgs(1))
+				return false;
+			std::string error;
+			if (!options.rules.LoadFile(argv[++i], error)) {
+				PRINT_ERROR("Could not load the rules: " << error);
+				return false;
+			}
+		}
+		else if (arg == "--spill-after") {
+			if (!hasArgs(1))
+				return false;
+			options.spillAfterMs = TryStringToLongLong(argv[++i], success);
+			if (!success || options.spillAfterMs <= 0) {
+				PRINT_ERROR("The spill time must be a number of milliseconds greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--freeze") {
+			options.freeze = true;
+		}
+		else if (arg == "--freeze-cap") {
+			if (!hasArgs(1))
+				return false;
+			options.freezeCapMb = TryStringToLongLong(argv[++i], success);
+			if (!success || options.freezeCapMb <= 0) {
+				PRINT_ERROR("The freeze cap must be a number of megabytes greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--release-rate") {
+			if (!hasArgs(1))
+				return false;
+			options.releaseRate = TryStringToDouble(argv[++i], success);
+			if (!success || options.releaseRate <= 0) {
+				PRINT_ERROR("The release rate must be a number of packets per second greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--top-flows") {
+			options.topFlowsWindow = PROFILER_DEFAULT_WINDOW_S;
+			// The window is optional.
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				options.topFlowsWindow = TryStringToLongLong(argv[++i], success);
+				if (!success || options.topFlowsWindow <= 0) {
+					PRINT_ERROR("The flow profile window must be a number of seconds greater than 0.");
+					return false;
+				}
+			}
+		}
+		else if (arg == "--measure-rtt")
+			options.measureRtt = true;
+		else if (arg == "--rtt-udp-key") {
+			if (!hasArgs(1))
+				return false;
+			std::string key = argv[++i];
+			size_t separator = key.find(':');
+			bool valid = separator != std::string::npos;
+			long long offset = valid ? TryStringToLongLong(key.substr(0, separator), success) : 0;
+			valid = valid && success && offset >= 0 && offset < WINDIVERT_MTU_MAX;
+			long long length = valid ? TryStringToLongLong(key.substr(separator + 1), success) : 0;
+			if (!valid || !success || length < 1 || length > 8) {
+				PRINT_ERROR("The UDP key must be written as <offset>:<length>, with a length between 1 and 8 bytes.");
+				return false;
+			}
+			options.rttUdpKey.offset = (UINT)offset;
+			options.rttUdpKey.length = (UINT)length;
+			options.measureRtt = true;
+		}
+		else if (arg == "--target-rtt") {
+			if (!hasArgs(1))
+				return false;
+			options.targetRttMs = TryStringToLongLong(argv[++i], success);
+			if (!success || options.targetRttMs <= 0) {
+				PRINT_ERROR("The target round trip time must be a number of milliseconds greater than 0.");
+				return false;
+			}
+			options.measureRtt = true;
+		}
+		else if (arg == "--io") {
+			if (!hasArgs(1))
+				return false;
+			std::string mode = argv[++i];
+			if (mode == "threads")
+				options.ioMode = IoMode::Threads;
+			else if (mode == "async")
+				options.ioMode = IoMode::Async;
+			else {
+				PRINT_ERROR("Unknown I/O mode \"" << mode << "\".");
+				return false;
+			}
+		}
+		else if (arg == "--coalesce-acks")
+			options.coalesceAcks = true;
+		else if (arg == "--drain") {
+			if (!hasArgs(1))
+				return false;
+			std::string policy = argv[++i];
+			if (policy == "schedule")
+				options.drainPolicy = DrainPolicy::Schedule;
+			else if (policy == "flush")
+				options.drainPolicy = DrainPolicy::Flush;
+			else if (policy == "drop")
+				options.drainPolicy = DrainPolicy::Drop;
+			else {
+				PRINT_ERROR("Unknown drain policy \"" << policy << "\".");
+				return false;
+			}
+		}
+		else if (arg == "--drain-timeout") {
+			if (!hasArgs(1))
+				return false;
+			options.drainTimeoutMs = TryStringToLongLong(argv[++i], success);
+			if (!success || options.drainTimeoutMs < 0) {
+				PRINT_ERROR("The drain timeout must be a number of milliseconds of at least 0.");
+				return false;
+			}
+		}
+		else if (arg == "--release-order") {
+			if (!hasArgs(1))
+				return false;
+			std::string order = argv[++i];
+			if (order == "due")
+				options.releaseOrder = ReleaseOrder::Due;
+			else if (order == "priority")
+				options.releaseOrder = ReleaseOrder::Priority;
+			else if (order == "fair")
+				options.releaseOrder = ReleaseOrder::Fair;
+			else {
+				PRINT_ERROR("Unknown release order \"" << order << "\".");
+				return false;
+			}
+		}
+		else if (arg == "--queue-weight") {
+			if (!hasArgs(1))
+				return false;
+			std::string weight = argv[++i];
+			size_t separator = weight.find('=');
+			long long queue = separator == std::string::npos ? -1 : TryStringToLongLong(weight.substr(0, separator), success);
+			if (separator == std::string::npos || !success || queue < 0 || queue >= RULE_QUEUE_COUNT) {
+				PRINT_ERROR("The queue of a weight must be a number from 0 to " << RULE_QUEUE_COUNT - 1 << ".");
+				return false;
+			}
+			long long value = TryStringToLongLong(weight.substr(separator + 1), success);
+			if (!success || value < 1 || value > 1000) {
+				PRINT_ERROR("The weight of a queue must be a number between 1 and 1000.");
+				return false;
+			}
+			options.queueWeights[(size_t)queue] = (UINT)value;
+		}
+		else if (arg == "--profile") {
+			if (!hasArgs(1))
+				return false;
+			std::string profile = argv[++i];
+			size_t separator = profile.find(':');
+			long long port = separator == std::string::npos ? -1 : TryStringToLongLong(profile.substr(0, separator), success);
+			if (separator == std::string::npos || !success || port <= 0 || port > 65535) {
+				PRINT_ERROR("The port of a profile must be a number from 1 to 65535.");
+				return false;
+			}
+			long long latency = TryStringToLongLong(profile.substr(separator + 1), success);
+			if (!success || latency <= 0) {
+				PRINT_ERROR("The latency of a profile must be a number of milliseconds greater than 0.");
+				return false;
+			}
+			options.profiles.push_back(PORT_PROFILE{ (int)port, latency });
+		}
+		else if (arg == "--injectors") {
+			if (!hasArgs(1))
+				return false;
+			options.injectors = TryStringToLongLong(argv[++i], success);
+			if (!success || options.injectors <= 0 || options.injectors > 64) {
+				PRINT_ERROR("The injector count must be a number between 1 and 64.");
+				return false;
+			}
+		}
+		else if (arg == "--spill-dir") {
+			if (!hasArgs(1))
+				return false;
+			options.spillDirectory = argv[++i];
+		}
+		else if (arg == "--report") {
+			if (!hasArgs(1))
+				return false;
+			options.reportPath = argv[++i];
+		}
+		else if (arg == "--capture") {
+			if (!hasArgs(1))
+				return false;
+			options.capturePath = argv[++i];
+		}
+		else if (arg == "--capture-rotate") {
+			if (!hasArgs(1))
+				return false;
+			options.captureRotateMb = TryStringToLongLong(argv[++i], success);
+			if (!success || options.captureRotateMb <= 0) {
+				PRINT_ERROR("The capture rotation size must be a number of megabytes greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--event-log") {
+			if (!hasArgs(1))
+				return false;
+			options.eventLogPath = argv[++i];
+		}
+		else if (arg == "--read-events") {
+			if (!hasArgs(1))
+				return false;
+			options.readEventsPath = argv[++i];
+			// The CSV file is optional.
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				options.readEventsCsvPath = argv[++i];
+		}
+		else if (arg == "--stats-shm") {
+			options.statsName = STATS_DEFAULT_NAME;
+			// The name is optional.
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				options.statsName = argv[++i];
+		}
+		else if (arg == "--read-stats") {
+			options.readStatsName = STATS_DEFAULT_NAME;
+			// The name and the count are optional.
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				options.readStatsName = argv[++i];
+				if (i + 1 < argc && argv[i + 1][0] != '-') {
+					options.readStatsCount = TryStringToLongLong(argv[++i], success);
+					if (!success || options.readStatsCount <= 0) {
+						PRINT_ERROR("The stats read count must be a number greater than 0.");
+						return false;
+					}
+				}
+			}
+		}
+		else if (arg == "--mmcss") {
+			options.receiverThread.mmcss = true;
+			options.senderThread.mmcss = true;
+		}
+		else if (arg == "--benchmark") {
+			if (!hasArgs(1))
+				return false;
+			options.benchmark = argv[++i];
+			// The duration is optional.
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				options.benchmarkSeconds = TryStringToLongLong(argv[++i], success);
+				if (!success || options.benchmarkSeconds <= 0) {
+					PRINT_ERROR("The benchmark duration must be a number of seconds greater than 0.");
+					return false;
+				}
+			}
+		}
+		else if (arg == "--simulate") {
+			if (!hasArgs(2))
+				return false;
+			options.simulatePackets = TryStringToLongLong(argv[++i], success);
+			if (!success || options.simulatePackets <= 0) {
+				PRINT_ERROR("The simulated packet count must be a number greater than 0.");
+				return false;
+			}
+			options.simulateRate = TryStringToDouble(argv[++i], success);
+			if (!success || options.simulateRate <= 0) {
+				PRINT_ERROR("The simulated packet rate must be a number greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--simulate-csv") {
+			if (!hasArgs(1))
+				return false;
+			options.simulateCsvPath = argv[++i];
+		}
+		else if (arg == "--load-test") {
+			options.loadTest = true;
+		}
+		else if (arg == "--load-rate") {
+			if (!hasArgs(1))
+				return false;
+			options.loadProfile.packetsPerSecond = TryStringToDouble(argv[++i], success);
+			if (!success || options.loadProfile.packetsPerSecond <= 0) {
+				PRINT_ERROR("The load rate must be a number of packets per second greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--load-sizes") {
+			if (!hasArgs(1))
+				return false;
+			std::string list = argv[++i];
+			options.loadProfile.sizes.clear();
+			size_t start = 0;
+			while (start <= list.size()) {
+				size_t end = list.find(',', start);
+				if (end == std::string::npos)
+					end = list.size();
+				long long size = TryStringToLongLong(list.substr(start, end - start), success);
+				if (!success || size < LOAD_MIN_PACKET_LENGTH || size > 0xFFFF) {
+					PRINT_ERROR("The load packet sizes must be between " << LOAD_MIN_PACKET_LENGTH << " and 65535 bytes.");
+					return false;
+				}
+				options.loadProfile.sizes.push_back((UINT)size);
+				start = end + 1;
+			}
+		}
+		else if (arg == "--load-flows" || arg == "--load-burst") {
+			if (!hasArgs(1))
+				return false;
+			long long count = TryStringToLongLong(argv[++i], success);
+			if (!success || count <= 0 || count > 65535) {
+				PRINT_ERROR("The option " << arg << " requires a number between 1 and 65535.");
+				return false;
+			}
+			(arg == "--load-flows" ? options.loadProfile.flows : options.loadProfile.burst) = (UINT)count;
+		}
+		else if (arg == "--load-duration") {
+			if (!hasArgs(1))
+				return false;
+			double seconds = TryStringToDouble(argv[++i], success);
+			if (!success || seconds <= 0) {
+				PRINT_ERROR("The load duration must be a number of seconds greater than 0.");
+				return false;
+			}
+			options.loadProfile.duration = std::chrono::milliseconds((long long)(seconds * 1000));
+		}
+		else if (arg == "--load-max-loss") {
+			if (!hasArgs(1))
+				return false;
+			options.loadThresholds.maxLossPercent = TryStringToDouble(argv[++i], success);
+			if (!success || options.loadThresholds.maxLossPercent < 0) {
+				PRINT_ERROR("The maximum loss must be a percentage of at least 0.");
+				return false;
+			}
+		}
+		else if (arg == "--load-max-error") {
+			if (!hasArgs(1))
+				return false;
+			options.loadThresholds.maxHoldErrorMs = TryStringToDouble(argv[++i], success);
+			if (!success || options.loadThresholds.maxHoldErrorMs <= 0) {
+				PRINT_ERROR("The maximum hold time error must be a number of milliseconds greater than 0.");
+				return false;
+			}
+		}
+		else if (arg == "--convert-trace") {
+			if (!hasArgs(2))
+				return false;
+			options.convertCsvPath = argv[++i];
+			options.convertTracePath = argv[++i];
+			// The interval is optional.
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				options.convertIntervalMs = TryStringToDouble(argv[++i], success);
+				if (!success || options.convertIntervalMs <= 0) {
+					PRINT_ERROR("The trace interval must be a number greater than 0.");
+					return false;
+				}
+			}
+		}
+		else {
+			PRINT_ERROR("Unknown option \"" << arg << "\".");
+			return false;
 		}
-		else
-			// If the parse was unsuccessful, prompt the user for an integer.
-			SYNC_COUT("Please enter an integer.");
 	}
-
-	return input;
+	// The delayers of a pool share its divert and threads, so they can't target a process, freeze, measure or target round trip times,
+	// receive and send with I/O of their own, or write files of their own.
+	if (!options.profiles.empty() && (!options.process.empty() || options.freeze || options.releaseRate != 0 || options.measureRtt
+		|| options.ioMode != IoMode::Threads || options.topFlowsWindow != 0
+		|| !options.capturePath.empty() || !options.eventLogPath.empty() || !options.statsName.empty())) {
+		PRINT_ERROR(
+			"--profile can't be combined with --process, --freeze, --release-rate, --measure-rtt, --rtt-udp-key, --target-rtt, --io async, "
+			"--top-flows, --capture, --event-log, or --stats-shm."
+		);
+		return false;
+	}
+	options.rules.Compile();
+	return true;
 }
 
+#ifdef _WIN32
 // The twelve notes: C, C#, D, D#, E, F, F#, G, G#, A, A#, and B.
 enum class Note : int {
 	C      = -9,
@@ -798,23 +3956,855 @@ BOOL WINAPI CtrlHandler(DWORD fwdCtrlType) {
 		return false;
 	}
 }
+#endif
 
-int main() {
-	// Prompt the user for the port(s).
-	int port = (int)PromptPositiveNum("Please enter the port the application uses to send network packets: ");
-	long long latency = PromptPositiveNum("Please enter the desired latency (ms): ");
+// Runs generated traffic through a delayer with the --latency (50 ms by default), freezes it for the given time, and releases it.
+// The delayer reports the backlog and how long the release took, and the generator how many packets
+// were lost or reordered. Returns false if there was no hold time compensation to check before the freeze,
+// or if the late backlog moved it.
+bool RunFreezeBenchmark(const Options& options, std::chrono::milliseconds frozen) {
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	LOAD_PROFILE profile = options.loadProfile;
+	profile.duration = FREEZE_BENCHMARK_MARGIN + frozen + FREEZE_BENCHMARK_MARGIN;
+	LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+	Delayer benchmarkDelayer;
+	benchmarkDelayer.Init(0, latency);
+	benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+	benchmarkDelayer.SetFreeze((UINT64)options.freezeCapMb * 1024 * 1024, options.releaseRate);
+	benchmarkDelayer.SetIoMode(options.ioMode);
+	benchmarkDelayer.SetDivert(&generator);
+	PRINT_INFO(
+		"Freezing " << profile.packetsPerSecond << " packets per second for " << frozen.count() << " ms, releasing them "
+		<< (options.releaseRate > 0 ? "at " + std::to_string((long long)options.releaseRate) + " packets per second." : "as fast as possible.")
+	);
+	if (!benchmarkDelayer.Activate())
+		return false;
+	auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_until(start + FREEZE_BENCHMARK_MARGIN);
+	std::chrono::nanoseconds before = benchmarkDelayer.Compensation();
+	benchmarkDelayer.Freeze();
+	std::this_thread::sleep_until(start + FREEZE_BENCHMARK_MARGIN + frozen);
+	benchmarkDelayer.Release();
+	// Let the generator finish and the backlog be sent before stopping.
+	while (benchmarkDelayer.IsFrozen() || std::chrono::steady_clock::now() < start + profile.duration)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	std::this_thread::sleep_for(LOAD_TEST_DRAIN_TIME);
+	std::chrono::nanoseconds after = benchmarkDelayer.Compensation();
+	benchmarkDelayer.Deactivate();
 
-	// Register the control handler.
-	if (SetConsoleCtrlHandler(CtrlHandler, TRUE))
-		PRINT_TRACE("The control handler was registered.");
-	else {
-		PRINT_ERROR("Could not set control handler.");
-		return EXIT_FAILURE;
+	LOAD_RESULT result = generator.Result();
+	PRINT_INFO(
+		"Generated " << result.generated << " packets and received " << result.released << " back, "
+		<< result.lossPercent << " % lost (" << result.queueDropped << " in the driver queue) and "
+		<< result.reordered << " reordered. The packets were released " << before.count() / 1e6 << " ms early before the freeze and "
+		<< after.count() / 1e6 << " ms early after the release."
+	);
+	// Without a compensation before the freeze, there is nothing the backlog could have moved.
+	if (before.count() == 0) {
+		PRINT_ERROR("The hold time compensation was off or hadn't started before the freeze.");
+		return false;
+	}
+	// The backlog is late because it was frozen, which the compensation mustn't try to make up for.
+	if (after - before > FREEZE_BENCHMARK_MAX_COMPENSATION) {
+		PRINT_ERROR("The frozen backlog moved the hold time compensation from " << before.count() / 1e6 << " to " << after.count() / 1e6 << " ms.");
+		return false;
 	}
+	return true;
+}
 
-	// Initialize the delayer with the given port.
-	delayer.Init(port, latency);
+// Runs the pure ACKs of bulk downloads mixed with game traffic at --load-rate through a delayer with the --latency
+// (50 ms by default) for the given time, without and with the ACK coalescing, and then with the coalescing while the
+// packets spill after --spill-after (half the latency by default), so the ACKs read back are coalesced.
+// Compares the packets and bytes injected every second.
+// Returns false if a run lost a packet that must be sent or moved an acknowledgment backwards.
+bool RunAckBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	struct RUN {
+		const char* name;
+		bool coalesce;
+		bool spill;
+	};
+	const RUN runs[] = {
+		{ "not coalesced", false, false },
+		{ "coalesced", true, false },
+		{ "coalesced and spilled", true, true }
+	};
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	long long spillAfter = options.spillAfterMs != 0 ? options.spillAfterMs : std::max<long long>(latency / 2, 1);
+	double rate = options.loadProfile.packetsPerSecond;
+	double seconds = std::chrono::duration<double>(duration).count();
+	UINT64 plainSends = 0;
+	bool success = true;
+	PRINT_INFO(
+		"Running " << rate << " packets per second of " << ACK_BENCHMARK_CONNECTIONS << " bulk downloads' ACKs and game traffic for "
+		<< duration.count() << " ms with a latency of " << latency << " ms..."
+	);
+	for (const RUN& run : runs) {
+		AckStreamDivert divert(rate, duration);
+		Delayer benchmarkDelayer;
+		benchmarkDelayer.Init(0, latency);
+		benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+		benchmarkDelayer.SetIoMode(options.ioMode);
+		benchmarkDelayer.SetAckCoalescing(run.coalesce);
+		if (run.spill)
+			benchmarkDelayer.SetSpill(std::chrono::milliseconds(spillAfter), options.spillDirectory);
+		benchmarkDelayer.SetDivert(&divert);
+		if (!benchmarkDelayer.Activate())
+			return false;
+		std::this_thread::sleep_for(duration + std::chrono::milliseconds(latency) + LOAD_TEST_DRAIN_TIME);
+		benchmarkDelayer.Deactivate();
+
+		const char* name = run.name;
+		PRINT_INFO(
+			"ACKs " << name << ": generated " << divert.Generated() << " packets, injected " << divert.SendCalls() / seconds
+			<< " packets (" << divert.SentBytes() / seconds / 1024 << " KB) per second."
+		);
+		if (!run.coalesce)
+			plainSends = divert.SendCalls();
+		else if (plainSends != 0)
+			PRINT_INFO("The coalescing saved " << 100.0 * (plainSends - std::min(plainSends, divert.SendCalls())) / plainSends << " % of the injected packets.");
+		for (AckStreamKind kind : { AckStreamKind::Duplicate, AckStreamKind::Sack, AckStreamKind::Game }) {
+			if (divert.Sent(kind) != divert.Generated(kind)) {
+				PRINT_ERROR("ACKs " << name << ": sent " << divert.Sent(kind) << " of the " << divert.Generated(kind) << " packets that must be kept.");
+				success = false;
+			}
+		}
+		if (divert.WindowChanges() != divert.Generated(AckStreamKind::Window)) {
+			PRINT_ERROR("ACKs " << name << ": sent " << divert.WindowChanges() << " of the " << divert.Generated(AckStreamKind::Window) << " window changes.");
+			success = false;
+		}
+		if (divert.Regressions() != 0 || divert.StaleConnections() != 0) {
+			PRINT_ERROR(
+				"ACKs " << name << ": " << divert.Regressions() << " acknowledgments went backwards and "
+				<< divert.StaleConnections() << " connections didn't get their last one."
+			);
+			success = false;
+		}
+	}
+	return success;
+}
+
+// Runs bursts of bulk packets with a few game packets behind them through a delayer with the --latency (50 ms by default)
+// for the given time, once with every release order. A rule puts the game packets in queue 1, which weighs 8 times
+// more than the bulk packets' queue. Returns false if a packet was lost or the game packets weren't released sooner
+// with the priority order than in the order they were due.
+bool RunQosBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	RuleEngine rules;
+	PACKET_RULE rule;
+	std::string error;
+	ParseRule("dscp=" + std::to_string(FLOOD_GAME_DSCP) + ",queue=1", rule, error);
+	rules.AddRule(rule);
+	rules.Compile();
+	std::vector<UINT> weights(RULE_QUEUE_COUNT, 1);
+	weights[1] = 8;
+	PRINT_INFO(
+		"Running bursts of " << FLOOD_BULK_PACKETS << " bulk and " << FLOOD_GAME_PACKETS << " game packets every " << FLOOD_PERIOD_MS
+		<< " ms for " << duration.count() << " ms with a latency of " << latency << " ms..."
+	);
+	bool success = true;
+	double dueP99 = 0;
+	double priorityP99 = 0;
+	PrintSummaryHeader("us after the burst");
+	for (ReleaseOrder order : { ReleaseOrder::Due, ReleaseOrder::Priority, ReleaseOrder::Fair }) {
+		FloodDivert divert(duration);
+		Delayer benchmarkDelayer;
+		benchmarkDelayer.Init(0, latency);
+		benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+		benchmarkDelayer.SetIoMode(options.ioMode);
+		benchmarkDelayer.SetRules(rules);
+		benchmarkDelayer.SetReleaseOrder(order, weights);
+		benchmarkDelayer.SetDivert(&divert);
+		if (!benchmarkDelayer.Activate())
+			return false;
+		std::this_thread::sleep_for(duration + std::chrono::milliseconds(latency) + LOAD_TEST_DRAIN_TIME);
+		benchmarkDelayer.Deactivate();
+
+		for (bool game : { true, false }) {
+			LATENCY_SUMMARY summary = divert.ReleaseDelay(game);
+			PrintSummaryRow(std::string(ReleaseOrderName(order)) + (game ? ", game" : ", bulk"), summary);
+			if (summary.count != divert.Generated(game)) {
+				PRINT_ERROR(
+					"Release order " << ReleaseOrderName(order) << ": sent " << summary.count << " of the "
+					<< divert.Generated(game) << (game ? " game" : " bulk") << " packets."
+				);
+				success = false;
+			}
+			if (game && order == ReleaseOrder::Due)
+				dueP99 = summary.p99;
+			else if (game && order == ReleaseOrder::Priority)
+				priorityP99 = summary.p99;
+		}
+	}
+	if (priorityP99 >= dueP99) {
+		PRINT_ERROR("The game packets weren't released sooner with the priority order than in the order they were due.");
+		success = false;
+	}
+	return success;
+}
+
+// Runs UDP flows with base round trip times of 10 to 140 ms through a delayer in target mode for the given time, with the
+// --target-rtt (200 ms by default). The flow with the longest base round trip time gets a shorter one a third of the way in.
+// Returns false if a packet wasn't answered or the median round trip time of a flow in the last third was off the target
+// by more than the tolerance.
+bool RunTargetRttBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	std::chrono::milliseconds target(options.targetRttMs != 0 ? options.targetRttMs : TARGET_BENCHMARK_RTT_MS);
+	const std::vector<long long> bases = { 10, 40, 90, 140 };
+	const long long changedBase = 60;
+	EchoDivert divert(duration, (UINT)bases.size());
+	for (size_t i = 0; i < bases.size(); ++i)
+		divert.SetBaseRtt((UINT)i, std::chrono::milliseconds(bases[i]));
+	EchoAnswerDivert answers(divert);
+	RttMonitor monitor;
+	RTT_UDP_KEY key;
+	key.offset = 0;
+	key.length = 8;
+	monitor.SetUdpKey(key);
+	monitor.SetTarget(target);
+	monitor.SetDivert(&answers);
+	Delayer benchmarkDelayer;
+	benchmarkDelayer.Init(0, options.latency);
+	benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+	benchmarkDelayer.SetIoMode(options.ioMode);
+	benchmarkDelayer.SetRttMonitor(&monitor);
+	benchmarkDelayer.SetDivert(&divert);
+	PRINT_INFO(
+		"Running " << bases.size() << " flows with a packet every " << ECHO_PERIOD_MS << " ms for " << duration.count()
+		<< " ms with a target round trip time of " << target.count() << " ms..."
+	);
+	if (!monitor.Start("udp"))
+		return false;
+	if (!benchmarkDelayer.Activate()) {
+		monitor.Stop();
+		return false;
+	}
+	std::this_thread::sleep_for(duration / 3);
+	divert.SetBaseRtt((UINT)(bases.size() - 1), std::chrono::milliseconds(changedBase));
+	std::this_thread::sleep_for(duration - duration / 3 + target + LOAD_TEST_DRAIN_TIME);
+	benchmarkDelayer.Deactivate();
+	monitor.Stop();
+
+	bool success = true;
+	PrintSummaryHeader("us round trip");
+	for (UINT flow = 0; flow < bases.size(); ++flow) {
+		size_t answered;
+		LATENCY_SUMMARY summary = divert.RoundTrips(flow, duration * 2 / 3, answered);
+		long long base = flow + 1 == bases.size() ? changedBase : bases[flow];
+		PrintSummaryRow("flow " + std::to_string(flow) + ", base " + std::to_string(base) + " ms", summary);
+		if (answered != divert.Generated(flow)) {
+			PRINT_ERROR("Flow " << flow << ": answered " << answered << " of the " << divert.Generated(flow) << " packets.");
+			success = false;
+		}
+		double error = std::abs(summary.p50 / 1000 - target.count());
+		if (summary.count == 0 || error > TARGET_BENCHMARK_TOLERANCE_MS) {
+			PRINT_ERROR("Flow " << flow << ": the median round trip time was " << summary.p50 / 1000 << " ms instead of " << target.count() << " ms.");
+			success = false;
+		}
+	}
+	return success;
+}
+
+// Runs generated traffic through a delayer for the given time and deactivates it while it holds the packets of the
+// last latency, once with every drain policy, and then the same through a pool whose delayers each take a flow.
+// Reports how long each deactivation took and how many of the held packets were sent.
+// Returns false if a policy that sends the held packets lost any of them.
+bool RunDrainBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	long long latency = options.latency != 0 ? options.latency : DRAIN_BENCHMARK_LATENCY_MS;
+	bool success = true;
+	for (bool pooled : { false, true }) {
+		for (DrainPolicy policy : { DrainPolicy::Schedule, DrainPolicy::Flush, DrainPolicy::Drop }) {
+			UINT delayerCount = pooled ? DRAIN_BENCHMARK_PROFILES : 1;
+			LOAD_PROFILE profile = options.loadProfile;
+			profile.duration = duration;
+			if (pooled)
+				profile.flows = delayerCount;
+			LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+			// The pool's delayers send their flows at the same time, so only the order within each flow is checked.
+			if (pooled)
+				generator.SetFlowLatencies(std::vector<std::chrono::microseconds>(delayerCount, std::chrono::milliseconds(latency)));
+			// The delayers are declared before the pool, so the pool is deactivated before they are destroyed.
+			std::vector<std::unique_ptr<Delayer>> delayers;
+			DelayerPool pool((UINT)options.injectors);
+			pool.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+			pool.SetDivert(&generator);
+			for (UINT i = 0; i < delayerCount; ++i) {
+				delayers.emplace_back(new Delayer());
+				Delayer& benchmarkDelayer = *delayers.back();
+				benchmarkDelayer.Init(pooled ? LOAD_FIRST_PORT + i : 0, latency);
+				benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+				benchmarkDelayer.SetFreeze((UINT64)options.freezeCapMb * 1024 * 1024, options.releaseRate);
+				benchmarkDelayer.SetIoMode(options.ioMode);
+				benchmarkDelayer.SetDrain(policy, std::chrono::milliseconds(options.drainTimeoutMs));
+				if (pooled && !pool.Add(benchmarkDelayer))
+					return false;
+				if (!pooled)
+					benchmarkDelayer.SetDivert(&generator);
+			}
+			if (!(pooled ? pool.Activate() : delayers.front()->Activate()))
+				return false;
+			std::this_thread::sleep_for(duration);
+			auto start = std::chrono::steady_clock::now();
+			if (pooled)
+				pool.Deactivate();
+			else
+				delayers.front()->Deactivate();
+			double deactivationMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			LOAD_RESULT result = generator.Result();
+			// The packets the emulated driver dropped never reached the delayer.
+			UINT64 held = result.generated - result.queueDropped;
+			UINT64 lost = held - std::min(held, result.released);
+			std::string name = std::string(DrainPolicyName(policy)) + (pooled ? " in a pool of " + std::to_string(delayerCount) + " profiles" : "");
+			PRINT_INFO(
+				"Drain policy " << name << ": deactivated in " << deactivationMs << " ms, sent "
+				<< result.released << " of " << held << " packets, " << lost << " lost and " << result.reordered << " reordered."
+			);
+			if (policy != DrainPolicy::Drop && lost != 0) {
+				PRINT_ERROR(lost << " held packets were lost with the drain policy " << name << ".");
+				success = false;
+			}
+		}
+	}
+	return success;
+}
+
+// Runs generated traffic at several loads through a delayer with and without the hold time compensation,
+// each for the given time, and compares how much longer than the latency the packets were held.
+void RunCompensationBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	struct LOAD {
+		const char* name;
+		double packetsPerSecond;
+		UINT burst;
+	};
+	const LOAD loads[] = {
+		{ "1k pps", 1000, 1 },
+		{ "50k pps", 50000, 1 },
+		{ "300k pps", 300000, 1 },
+		{ "100k pps x256 bursts", 100000, 256 }
+	};
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	// The table is printed at the end, so the delayers' logs don't break it up.
+	std::vector<std::pair<std::string, LATENCY_SUMMARY>> rows;
+	for (const LOAD& load : loads) {
+		for (bool compensate : { false, true }) {
+			LOAD_PROFILE profile = options.loadProfile;
+			profile.packetsPerSecond = load.packetsPerSecond;
+			profile.burst = load.burst;
+			profile.duration = duration;
+			LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+			Delayer benchmarkDelayer;
+			benchmarkDelayer.Init(0, latency);
+			benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+			benchmarkDelayer.SetCompensation(compensate);
+			benchmarkDelayer.SetIoMode(options.ioMode);
+			benchmarkDelayer.SetDivert(&generator);
+			if (!benchmarkDelayer.Activate())
+				return;
+			std::this_thread::sleep_for(profile.duration + std::chrono::milliseconds(latency) + LOAD_TEST_DRAIN_TIME);
+			benchmarkDelayer.Deactivate();
+			rows.emplace_back(std::string(load.name) + (compensate ? ", compensated" : ""), generator.Result().holdError);
+		}
+	}
+	PrintSummaryHeader("us hold time error");
+	for (std::pair<std::string, LATENCY_SUMMARY>& row : rows)
+		PrintSummaryRow(row.first, row.second);
+}
+
+// Runs generated traffic split into flows through a pool with a delayer for every flow, each with its own latency,
+// for 1, 8, and PROFILE_BENCHMARK_PROFILES flows at the same total rate, each for the given time.
+// Compares the threads the pool runs with the threads as many separate delayers would, and reports the hold time
+// error, the loss, and the packets reordered within their flow.
+void RunProfileBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	// The table is printed at the end, so the pool's logs don't break it up.
+	std::vector<std::pair<std::string, LATENCY_SUMMARY>> rows;
+	std::vector<std::string> notes;
+	for (UINT profiles : { 1u, 8u, (UINT)PROFILE_BENCHMARK_PROFILES }) {
+		LOAD_PROFILE profile = options.loadProfile;
+		profile.flows = profiles;
+		profile.duration = duration;
+		LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+		// Every profile delays its flow by a millisecond more than the one before.
+		std::vector<std::chrono::microseconds> latencies;
+		// The delayers are declared before the pool, so the pool is deactivated before they are destroyed.
+		std::vector<std::unique_ptr<Delayer>> delayers;
+		DelayerPool pool((UINT)options.injectors);
+		pool.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+		pool.SetDivert(&generator);
+		for (UINT i = 0; i < profiles; ++i) {
+			delayers.emplace_back(new Delayer());
+			delayers.back()->Init(LOAD_FIRST_PORT + i, latency + i);
+			if (!pool.Add(*delayers.back()))
+				return;
+			latencies.push_back(std::chrono::milliseconds(latency + i));
+		}
+		generator.SetFlowLatencies(latencies);
+		if (!pool.Activate())
+			return;
+		std::this_thread::sleep_for(profile.duration + latencies.back() + LOAD_TEST_DRAIN_TIME);
+		pool.Deactivate();
+
+		LOAD_RESULT result = generator.Result();
+		std::string name = std::to_string(profiles) + " profiles, " + std::to_string(pool.ThreadCount()) + " threads";
+		rows.emplace_back(name, result.holdError);
+		std::ostringstream note;
+		note << name << " (" << profiles * 3 << " as separate delayers): " << std::fixed << std::setprecision(3)
+			<< result.lossPercent << " % lost, " << result.reordered << " reordered within their flow.";
+		notes.push_back(note.str());
+	}
+	PrintSummaryHeader("us hold time error");
+	for (std::pair<std::string, LATENCY_SUMMARY>& row : rows)
+		PrintSummaryRow(row.first, row.second);
+	for (const std::string& note : notes)
+		SYNC_COUT(note);
+}
+
+// Runs generated traffic through a delayer whose divert fails at random, and checks that every packet
+// the delayer received was sent on in order, apart from the ones the divert rejected on purpose.
+// Returns false if a held packet was lost.
+bool RunFaultBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	LOAD_PROFILE profile = options.loadProfile;
+	profile.duration = duration;
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+	FAULT_RATES rates;
+	rates.transient = FAULT_BENCHMARK_TRANSIENT_RATE;
+	rates.badPacket = FAULT_BENCHMARK_BAD_PACKET_RATE;
+	rates.handleLoss = FAULT_BENCHMARK_HANDLE_LOSS_RATE;
+	FaultInjector injector(&generator, rates, FAULT_BENCHMARK_SEED);
+	Delayer benchmarkDelayer;
+	benchmarkDelayer.Init(0, latency);
+	benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+	benchmarkDelayer.SetIoMode(options.ioMode);
+	benchmarkDelayer.SetDivert(&injector);
+	if (!benchmarkDelayer.Activate())
+		return false;
+	std::this_thread::sleep_for(profile.duration + std::chrono::milliseconds(latency) + LOAD_TEST_DRAIN_TIME);
+	benchmarkDelayer.Deactivate();
+
+	LOAD_RESULT result = generator.Result();
+	// The packets the emulated driver dropped never reached the delayer.
+	UINT64 held = result.generated - result.queueDropped;
+	UINT64 accounted = result.released + injector.BadPackets();
+	PRINT_INFO(
+		"Injected " << injector.Transient() << " transient errors, " << injector.BadPackets() << " rejected packets, and "
+		<< injector.HandleLosses() << " broken handles."
+	);
+	PRINT_INFO(
+		"The delayer held " << held << " packets, sent " << result.released << ", and "
+		<< result.reordered << " were reordered."
+	);
+	if (accounted < held) {
+		PRINT_ERROR(held - accounted << " held packets were lost.");
+		return false;
+	}
+	PRINT_INFO("No held packets were lost.");
+	return true;
+}
+
+// Compares the cost of a packet on the default settings with the packet path compiled for only the policies they use
+// and with the pre-policy path, which checks every part at runtime. The packets are handed to the path on this thread,
+// pinned to the --receiver-cpus if given, with no latency, so the threads' waits don't add to the cost.
+// Every round runs the pre-policy path, the specialized one, and the pre-policy one again, so the two pre-policy runs
+// measure the noise the rounds see. Returns false if a run didn't send every packet, or if the specialized path costs
+// more than the pre-policy one in the median round by over 5 percent and by over the noise, which is the larger deviation
+// of the middle half of the pre-policy runs' ratios from 1.
+bool RunPolicyBenchmark(const Options& options) {
+	ScopedThreadConfig threadConfig(options.receiverThread, "benchmark");
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(64, address);
+	std::vector<double> baseline;
+	std::vector<double> specialized;
+	std::vector<double> ratios;
+	std::vector<double> noiseRatios;
+	PRINT_INFO("Measuring " << POLICY_BENCHMARK_ROUNDS << " rounds of " << POLICY_BENCHMARK_PACKETS << " packets on each packet path...");
+	for (UINT round = 0; round < POLICY_BENCHMARK_ROUNDS; ++round) {
+		double costs[3];
+		for (UINT run = 0; run < 3; ++run) {
+			BurstDivert divert(packet, address, POLICY_BENCHMARK_PACKETS);
+			Delayer benchmarkDelayer;
+			benchmarkDelayer.Init(0, 0);
+			benchmarkDelayer.SetDivert(&divert);
+			costs[run] = benchmarkDelayer.MeasurePacketPath(packet, address, POLICY_BENCHMARK_PACKETS, run != 1);
+			if (costs[run] < 0)
+				return false;
+			if (!divert.Done()) {
+				PRINT_ERROR("The " << (run != 1 ? "pre-policy" : "specialized") << " packet path didn't send every packet.");
+				return false;
+			}
+		}
+		baseline.push_back(costs[0]);
+		baseline.push_back(costs[2]);
+		specialized.push_back(costs[1]);
+		ratios.push_back(2 * costs[1] / (costs[0] + costs[2]));
+		noiseRatios.push_back(costs[2] / costs[0]);
+	}
+	std::sort(ratios.begin(), ratios.end());
+	std::sort(noiseRatios.begin(), noiseRatios.end());
+	double ratio = ratios[ratios.size() / 2];
+	double noise = std::max(std::abs(noiseRatios[noiseRatios.size() / 4] - 1), std::abs(noiseRatios[noiseRatios.size() * 3 / 4] - 1));
+	PrintSummaryHeader("ns per packet");
+	PrintSummaryRow("pre-policy", SummarizeMicroseconds(baseline));
+	PrintSummaryRow("specialized", SummarizeMicroseconds(specialized));
+	double change = 100.0 * (ratio - 1);
+	PRINT_INFO(
+		"The specialized packet path costs " << change << " % compared to the pre-policy one in the median round, "
+		"with a noise of " << 100.0 * noise << " %."
+	);
+	if (ratio - 1 > std::max(POLICY_BENCHMARK_MAX_REGRESSION, noise)) {
+		PRINT_ERROR("The specialized packet path costs more than the pre-policy one by over the limit and the noise.");
+		return false;
+	}
+	return true;
+}
+
+// Compares the cost of a packet through the receiver and sender with and without the event log, logging to the
+// --event-log file. The packets are handed out as fast as the receiver takes them with a 1 ms latency, and the runs
+// alternate so both see the same conditions. The last log is read back. Returns false if the log's cost at
+// 100k packets per second would take more than 2 % of a CPU, or the log is missing events.
+bool RunEventLogBenchmark(const Options& options) {
+	std::string path = options.eventLogPath.empty() ? "benchmark.events" : options.eventLogPath;
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(64, address);
+	std::vector<double> plain;
+	std::vector<double> logged;
+	PRINT_INFO(
+		"Measuring " << EVENT_LOG_BENCHMARK_ROUNDS << " rounds of " << EVENT_LOG_BENCHMARK_PACKETS
+		<< " packets without and with the event log \"" << path << "\"..."
+	);
+	for (UINT round = 0; round < EVENT_LOG_BENCHMARK_ROUNDS; ++round) {
+		for (bool log : { false, true }) {
+			BurstDivert divert(packet, address, EVENT_LOG_BENCHMARK_PACKETS);
+			Delayer benchmarkDelayer;
+			benchmarkDelayer.Init(0, 1);
+			benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+			benchmarkDelayer.SetDivert(&divert);
+			if (log && !benchmarkDelayer.StartEventLog(path))
+				return false;
+			if (!benchmarkDelayer.Activate())
+				return false;
+			while (!divert.Done())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			benchmarkDelayer.Deactivate();
+			(log ? logged : plain).push_back(divert.NanosecondsPerPacket());
+		}
+	}
+	LATENCY_SUMMARY plainSummary = SummarizeMicroseconds(plain);
+	LATENCY_SUMMARY loggedSummary = SummarizeMicroseconds(logged);
+	PrintSummaryHeader("ns per packet");
+	PrintSummaryRow("no event log", plainSummary);
+	PrintSummaryRow("event log", loggedSummary);
+
+	UINT64 events;
+	std::string error;
+	if (!SummarizeEventLog(path, "", events, error)) {
+		PRINT_ERROR("Reading the event log failed: " << error);
+		return false;
+	}
+	bool success = true;
+	if (events != EVENT_LOG_BENCHMARK_PACKETS) {
+		PRINT_ERROR("The event log has " << events << " of the " << EVENT_LOG_BENCHMARK_PACKETS << " packets.");
+		success = false;
+	}
+	double extraNs = std::max(0.0, loggedSummary.p50 - plainSummary.p50);
+	double busyPercent = extraNs * EVENT_LOG_BENCHMARK_RATE / 1e9 * 100;
+	PRINT_INFO(
+		"The event log costs " << extraNs << " ns per packet, " << busyPercent << " % of a CPU at "
+		<< EVENT_LOG_BENCHMARK_RATE << " packets per second."
+	);
+	if (busyPercent > 2) {
+		PRINT_ERROR("The event log costs more than 2 % of a CPU at " << EVENT_LOG_BENCHMARK_RATE << " packets per second.");
+		success = false;
+	}
+	return success;
+}
+
+// Compares the cost of a packet through the receiver and sender with and without the stats segment, while a reader
+// polls the segment every 100 us. The packets are handed out as fast as the receiver takes them with a 1 ms latency,
+// and the runs alternate so both see the same conditions. Returns false if the segment's cost at 100k packets per second
+// would take more than 2 % of a CPU, a read wasn't consistent, or the last snapshot doesn't count every packet.
+bool RunStatsBenchmark(const Options& options) {
+	std::string name = options.statsName.empty() ? STATS_BENCHMARK_NAME : options.statsName;
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(64, address);
+	std::vector<double> plain;
+	std::vector<double> published;
+	UINT64 reads = 0;
+	UINT64 failedReads = 0;
+	UINT64 inconsistent = 0;
+	bool success = true;
+	PRINT_INFO(
+		"Measuring " << STATS_BENCHMARK_ROUNDS << " rounds of " << STATS_BENCHMARK_PACKETS
+		<< " packets without and with the stats segment \"" << name << "\"..."
+	);
+	for (UINT round = 0; round < STATS_BENCHMARK_ROUNDS; ++round) {
+		for (bool publish : { false, true }) {
+			BurstDivert divert(packet, address, STATS_BENCHMARK_PACKETS);
+			Delayer benchmarkDelayer;
+			benchmarkDelayer.Init(0, 1);
+			benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+			benchmarkDelayer.SetDivert(&divert);
+			if (publish && !benchmarkDelayer.StartStats(name))
+				return false;
+			// The reader checks that every snapshot it gets is one the publisher could have written.
+			StatsReader reader;
+			std::string error;
+			if (publish && !reader.Open(name, error)) {
+				PRINT_ERROR(error);
+				return false;
+			}
+			std::atomic<bool> reading{ publish };
+			std::thread readerThread([&]() {
+				STATS_SNAPSHOT last{};
+				while (reading) {
+					STATS_SNAPSHOT snapshot;
+					reads += 1;
+					// Nothing is published until the publisher thread's first update.
+					if (!reader.Read(snapshot)) {
+						if (last.updates != 0)
+							failedReads += 1;
+					}
+					else {
+						if (snapshot.updates < last.updates || snapshot.sent < last.sent || snapshot.sent > snapshot.received
+							|| snapshot.received > STATS_BENCHMARK_PACKETS)
+							inconsistent += 1;
+						last = snapshot;
+					}
+					std::this_thread::sleep_for(std::chrono::microseconds(STATS_BENCHMARK_POLL_US));
+				}
+			});
+			if (!benchmarkDelayer.Activate()) {
+				reading = false;
+				readerThread.join();
+				return false;
+			}
+			while (!divert.Done())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			benchmarkDelayer.Deactivate();
+			reading = false;
+			readerThread.join();
+			(publish ? published : plain).push_back(divert.NanosecondsPerPacket());
+			if (!publish)
+				continue;
+			// Wait for a snapshot taken after the deactivation.
+			std::this_thread::sleep_for(std::chrono::milliseconds(STATS_PUBLISH_INTERVAL_MS * 3));
+			STATS_SNAPSHOT snapshot;
+			if (!reader.Read(snapshot) || snapshot.received != STATS_BENCHMARK_PACKETS || snapshot.sent != STATS_BENCHMARK_PACKETS
+				|| snapshot.bufferedPackets != 0 || snapshot.bufferedBytes != 0) {
+				PRINT_ERROR("The last snapshot of round " << round << " doesn't show every packet sent.");
+				success = false;
+			}
+			if (round + 1 == STATS_BENCHMARK_ROUNDS) {
+				SYNC_COUT("The last snapshot:");
+				PrintStatsSnapshot(snapshot, nullptr);
+			}
+		}
+	}
+	LATENCY_SUMMARY plainSummary = SummarizeMicroseconds(plain);
+	LATENCY_SUMMARY publishedSummary = SummarizeMicroseconds(published);
+	PrintSummaryHeader("ns per packet");
+	PrintSummaryRow("no stats segment", plainSummary);
+	PrintSummaryRow("stats segment", publishedSummary);
+
+	// Time the reads on their own, while the publisher of a delayer updates the segment.
+	double readNs;
+	{
+		Delayer benchmarkDelayer;
+		benchmarkDelayer.Init(0, 1);
+		if (!benchmarkDelayer.StartStats(name))
+			return false;
+		StatsReader reader;
+		std::string error;
+		if (!reader.Open(name, error)) {
+			PRINT_ERROR(error);
+			return false;
+		}
+		const UINT64 count = 1000000;
+		STATS_SNAPSHOT snapshot;
+		while (!reader.Read(snapshot))
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		auto start = std::chrono::steady_clock::now();
+		for (UINT64 i = 0; i < count; ++i) {
+			if (!reader.Read(snapshot))
+				failedReads += 1;
+		}
+		readNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+	}
+	double extraNs = std::max(0.0, publishedSummary.p50 - plainSummary.p50);
+	double busyPercent = extraNs * EVENT_LOG_BENCHMARK_RATE / 1e9 * 100;
+	PRINT_INFO(
+		"The stats segment costs " << extraNs << " ns per packet, " << busyPercent << " % of a CPU at "
+		<< EVENT_LOG_BENCHMARK_RATE << " packets per second. A read takes " << readNs << " ns. "
+		<< reads << " polls during the runs, " << failedReads << " failed and " << inconsistent << " inconsistent."
+	);
+	if (busyPercent > 2) {
+		PRINT_ERROR("The stats segment costs more than 2 % of a CPU at " << EVENT_LOG_BENCHMARK_RATE << " packets per second.");
+		success = false;
+	}
+	if (failedReads != 0 || inconsistent != 0) {
+		PRINT_ERROR("The reader didn't get a consistent snapshot every time.");
+		success = false;
+	}
+	return success;
+}
+
+// Compares the receiver and sender threads with the event loop. First the packets are handed out as fast as they are
+// taken with a 1 ms latency, and the runs alternate so both modes see the same conditions. Then generated traffic
+// at --load-rate runs through each mode for the given time, and the hold time error and loss are compared.
+void RunIoBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	const IoMode modes[] = { IoMode::Threads, IoMode::Async };
+	const char* names[] = { "receiver and sender threads", "event loop" };
+	WINDIVERT_ADDRESS address;
+	std::vector<BYTE> packet = MakeUdpPacket(64, address);
+	std::vector<double> costs[2];
+	PRINT_INFO("Measuring " << IO_BENCHMARK_ROUNDS << " rounds of " << IO_BENCHMARK_PACKETS << " packets in each I/O mode...");
+	for (UINT round = 0; round < IO_BENCHMARK_ROUNDS; ++round) {
+		for (size_t m = 0; m < 2; ++m) {
+			BurstDivert divert(packet, address, IO_BENCHMARK_PACKETS);
+			Delayer benchmarkDelayer;
+			benchmarkDelayer.Init(0, 1);
+			benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+			benchmarkDelayer.SetIoMode(modes[m]);
+			benchmarkDelayer.SetDivert(&divert);
+			if (!benchmarkDelayer.Activate())
+				return;
+			while (!divert.Done())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			benchmarkDelayer.Deactivate();
+			costs[m].push_back(divert.NanosecondsPerPacket());
+		}
+	}
+	long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+	LATENCY_SUMMARY holdErrors[2];
+	double losses[2];
+	for (size_t m = 0; m < 2; ++m) {
+		LOAD_PROFILE profile = options.loadProfile;
+		profile.duration = duration;
+		LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+		Delayer benchmarkDelayer;
+		benchmarkDelayer.Init(0, latency);
+		benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+		benchmarkDelayer.SetIoMode(modes[m]);
+		benchmarkDelayer.SetDivert(&generator);
+		if (!benchmarkDelayer.Activate())
+			return;
+		std::this_thread::sleep_for(profile.duration + std::chrono::milliseconds(latency) + LOAD_TEST_DRAIN_TIME);
+		benchmarkDelayer.Deactivate();
+		holdErrors[m] = generator.Result().holdError;
+		losses[m] = generator.Result().lossPercent;
+	}
+	PrintSummaryHeader("ns per packet");
+	for (size_t m = 0; m < 2; ++m)
+		PrintSummaryRow(names[m], SummarizeMicroseconds(costs[m]));
+	PrintSummaryHeader("us hold time error");
+	for (size_t m = 0; m < 2; ++m)
+		PrintSummaryRow(names[m], holdErrors[m]);
+	for (size_t m = 0; m < 2; ++m) {
+		PRINT_INFO(
+			"The " << names[m] << " moved " << (long long)(1e9 / SummarizeMicroseconds(costs[m]).p50) << " packets per second with "
+			<< (m == 0 ? 3 : 2) << " threads, and lost " << losses[m] << " % at " << options.loadProfile.packetsPerSecond
+			<< " packets per second."
+		);
+	}
+}
+
+// Measures what an application sees through the delayer. A UDP client sends timestamped datagrams to an echo server
+// on the loopback address at several rates, directly and through a delayer at several latencies, each for the given time.
+// On Windows the delayer diverts the client's packets with WinDivert, elsewhere it runs as a UDP forwarder in between.
+// The added round trip time is compared with the median of the direct path at the same rate.
+// Prints a report of every run and writes it to the report file if one was given.
+// Returns false if a run lost more than --load-max-loss percent of the echoes or added a p99 round trip time
+// more than --load-max-error ms off the latency.
+bool RunLoopbackBenchmark(const Options& options, std::chrono::milliseconds duration) {
+	const double rates[] = { 1000, 10000, 50000 };
+	std::vector<long long> latencies = options.latency != 0
+		? std::vector<long long>{ options.latency } : std::vector<long long>{ 10, 50, 200 };
+	UdpEchoServer server;
+	if (!server.Start())
+		return false;
+#ifdef _WIN32
+	const char* path = "WinDivert on the loopback interface";
+#else
+	const char* path = "in-process UDP forwarder";
+#endif
+
+	std::ostringstream report;
+	report << "Loopback accuracy report: " << path << ", " << ECHO_DATAGRAM_LENGTH << " byte datagrams, "
+		<< duration.count() << " ms per run, limits of " << options.loadThresholds.maxLossPercent << "% loss and "
+		<< options.loadThresholds.maxHoldErrorMs << " ms of p99 error.\n"
+		<< std::right << std::setw(10) << "rate pps" << std::setw(10) << "latency" << std::setw(10) << "sent"
+		<< std::setw(10) << "loss %" << std::setw(11) << "reordered" << std::setw(11) << "rtt p50"
+		<< std::setw(11) << "added p50" << std::setw(11) << "added p99" << std::setw(11) << "added max" << "\n";
+	bool passed = true;
+	for (double rate : rates) {
+		UdpEchoClient directClient;
+		if (!directClient.Open())
+			return false;
+		PRINT_INFO("Measuring the direct path at " << rate << " packets per second.");
+		ECHO_RESULT direct = directClient.Run(server.Port(), rate, duration, LOOPBACK_BENCHMARK_DRAIN);
+		LATENCY_SUMMARY directRtt = SummarizeMicroseconds(direct.rttUs);
+		report << std::fixed << std::setprecision(3) << std::setw(10) << (UINT64)rate << std::setw(10) << "direct"
+			<< std::setw(10) << direct.sent << std::setw(10) << direct.lossPercent << std::setw(11) << direct.reordered
+			<< std::setw(11) << directRtt.p50 / 1000 << std::setw(11) << "-" << std::setw(11) << "-" << std::setw(11) << "-" << "\n";
+
+		for (long long latency : latencies) {
+			UdpEchoClient client;
+			if (!client.Open())
+				return false;
+#ifndef _WIN32
+			// Declared before the delayer, so the delayer is deactivated before the forwarder is destroyed.
+			UdpForwarder forwarder(server.Port());
+#endif
+			Delayer benchmarkDelayer;
+			benchmarkDelayer.Init(client.Port(), latency);
+			benchmarkDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+#ifdef _WIN32
+			UINT16 target = server.Port();
+#else
+			benchmarkDelayer.SetDivert(&forwarder);
+#endif
+			if (!benchmarkDelayer.Activate())
+				return false;
+#ifndef _WIN32
+			UINT16 target = forwarder.Port();
+#endif
+			PRINT_INFO("Measuring " << latency << " ms of latency at " << rate << " packets per second.");
+			ECHO_RESULT delayed = client.Run(target, rate, duration, std::chrono::milliseconds(latency) + LOOPBACK_BENCHMARK_DRAIN);
+			benchmarkDelayer.Deactivate();
+
+			LATENCY_SUMMARY rtt = SummarizeMicroseconds(delayed.rttUs);
+			std::vector<double> added;
+			added.reserve(delayed.rttUs.size());
+			for (double sample : delayed.rttUs)
+				added.push_back(sample - directRtt.p50);
+			LATENCY_SUMMARY addedRtt = SummarizeMicroseconds(added);
+			bool withinLimits = delayed.lossPercent <= options.loadThresholds.maxLossPercent
+				&& std::abs(addedRtt.p99 / 1000 - latency) <= options.loadThresholds.maxHoldErrorMs;
+			passed = passed && withinLimits;
+			report << std::setw(10) << (UINT64)rate << std::setw(10) << (std::to_string(latency) + " ms")
+				<< std::setw(10) << delayed.sent << std::setw(10) << delayed.lossPercent << std::setw(11) << delayed.reordered
+				<< std::setw(11) << rtt.p50 / 1000 << std::setw(11) << addedRtt.p50 / 1000 << std::setw(11) << addedRtt.p99 / 1000
+				<< std::setw(11) << addedRtt.max / 1000 << (withinLimits ? "  ok" : "  over") << "\n";
+		}
+	}
+	server.Stop();
+	report << "Round trip times are in ms. " << (passed ? "Every run stayed within the limits." : "Some runs went over the limits.");
+
+	SYNC_COUT(report.str());
+	if (!options.reportPath.empty()) {
+		std::ofstream file(options.reportPath, std::ios::trunc);
+		file << report.str() << std::endl;
+		if (!file) {
+			PRINT_ERROR("Could not write the report to \"" << options.reportPath << "\".");
+			return false;
+		}
+		PRINT_INFO("Wrote the report to \"" << options.reportPath << "\".");
+	}
+	return passed;
+}
 
+#ifdef _WIN32
+// Tests the shortcuts on a thread of their own until the application is closed.
+void WaitForShortcuts() {
 	std::promise<bool> promise;
 	std::future<bool> future = promise.get_future();
 
@@ -837,8 +4827,309 @@ int main() {
 			break;
 		}
 	}
+}
+
+// Delays the port of every --profile by its latency with a delayer in a pool, which the shortcut activates and
+// deactivates, until the application is closed. Returns false if a delayer couldn't be added to the pool.
+bool RunProfiles(const Options& options) {
+	// The delayers are declared before the pool, so the pool is deactivated before they are destroyed.
+	std::vector<std::unique_ptr<Delayer>> delayers;
+	DelayerPool pool((UINT)options.injectors);
+	pool.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+	for (const PORT_PROFILE& profile : options.profiles) {
+		delayers.emplace_back(new Delayer());
+		Delayer& profileDelayer = *delayers.back();
+		profileDelayer.Init(profile.port, profile.latency);
+		profileDelayer.SetRewriter(options.rewriter);
+		profileDelayer.SetRules(options.rules);
+		profileDelayer.SetSpill(std::chrono::milliseconds(options.spillAfterMs), options.spillDirectory);
+		profileDelayer.SetStampOnReceive(options.stampOnReceive);
+		profileDelayer.SetCompensation(!options.noCompensation);
+		profileDelayer.SetDrain(options.drainPolicy, std::chrono::milliseconds(options.drainTimeoutMs));
+		profileDelayer.SetAckCoalescing(options.coalesceAcks);
+		profileDelayer.SetReleaseOrder(options.releaseOrder, options.queueWeights);
+		if (!options.tracePath.empty() && !profileDelayer.LoadTrace(options.tracePath, options.traceMode, options.traceLoop, options.traceSpeed))
+			return false;
+		if (!pool.Add(profileDelayer))
+			return false;
+	}
+	ShortcutWaiter::pool = &pool;
+	SYNC_COUT("Press F8 to activate or deactivate the delayers of the " << delayers.size() << " profiles.");
+	WaitForShortcuts();
+	ShortcutWaiter::pool = nullptr;
+	return true;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+	Options options;
+	if (!ParseOptions(argc, argv, options)) {
+		PrintUsage();
+		return EXIT_FAILURE;
+	}
+
+	// Convert the CSV file into a trace file if requested.
+	if (!options.convertCsvPath.empty()) {
+		std::string error;
+		if (!ConvertTraceCsv(options.convertCsvPath, options.convertTracePath, options.convertIntervalMs, error)) {
+			PRINT_ERROR("Converting the trace failed: " << error);
+			return EXIT_FAILURE;
+		}
+		PRINT_INFO("Wrote the latency trace to \"" << options.convertTracePath << "\".");
+		return EXIT_SUCCESS;
+	}
+
+	// Summarize the event log if requested.
+	if (!options.readEventsPath.empty()) {
+		std::string error;
+		UINT64 events;
+		if (!SummarizeEventLog(options.readEventsPath, options.readEventsCsvPath, events, error)) {
+			PRINT_ERROR("Reading the event log failed: " << error);
+			return EXIT_FAILURE;
+		}
+		if (!options.readEventsCsvPath.empty())
+			PRINT_INFO("Wrote the events to \"" << options.readEventsCsvPath << "\".");
+		return EXIT_SUCCESS;
+	}
+
+	// Print the statistics another instance publishes if requested.
+	if (!options.readStatsName.empty()) {
+		StatsReader reader;
+		std::string error;
+		if (!reader.Open(options.readStatsName, error)) {
+			PRINT_ERROR(error);
+			return EXIT_FAILURE;
+		}
+		STATS_SNAPSHOT previous;
+		for (long long i = 0; i < options.readStatsCount; ++i) {
+			if (i != 0)
+				std::this_thread::sleep_for(std::chrono::seconds(1));
+			STATS_SNAPSHOT snapshot;
+			if (!reader.Read(snapshot)) {
+				PRINT_ERROR("Process " << reader.WriterProcess() << " hasn't published a consistent snapshot.");
+				return EXIT_FAILURE;
+			}
+			PrintStatsSnapshot(snapshot, i != 0 ? &previous : nullptr);
+			previous = snapshot;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// Run the benchmark if requested.
+	if (!options.benchmark.empty()) {
+		if (options.benchmark == "jitter")
+			RunJitterBenchmark(options.senderThread, SENDER_SLEEP_TIME, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "checksum")
+			RunChecksumBenchmark(std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "rules")
+			RunRuleBenchmark(RULE_BENCHMARK_RULES, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "spill")
+			RunSpillBenchmark(options.spillDirectory, SPILL_BENCHMARK_BYTES, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "capture")
+			RunCaptureBenchmark(options.capturePath.empty() ? "benchmark.pcapng" : options.capturePath, 50000, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "freeze")
+			return RunFreezeBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "compensation")
+			RunCompensationBenchmark(options, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "profiles")
+			RunProfileBenchmark(options, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "loopback")
+			return RunLoopbackBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "policies")
+			return RunPolicyBenchmark(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "io")
+			RunIoBenchmark(options, std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "acks")
+			return RunAckBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "events")
+			return RunEventLogBenchmark(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "stats")
+			return RunStatsBenchmark(options) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "qos")
+			return RunQosBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "target")
+			return RunTargetRttBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "drain")
+			return RunDrainBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else if (options.benchmark == "flows")
+			RunFlowProfileBenchmark(std::chrono::seconds(options.topFlowsWindow != 0 ? options.topFlowsWindow : PROFILER_DEFAULT_WINDOW_S));
+		else if (options.benchmark == "rtt")
+			RunRttBenchmark(std::chrono::milliseconds(options.latency != 0 ? options.latency : 50), std::chrono::seconds(options.benchmarkSeconds));
+		else if (options.benchmark == "faults")
+			return RunFaultBenchmark(options, std::chrono::seconds(options.benchmarkSeconds)) ? EXIT_SUCCESS : EXIT_FAILURE;
+		else {
+			PRINT_ERROR("Unknown benchmark \"" << options.benchmark << "\".");
+			PrintUsage();
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// Run the simulation if requested. The port doesn't matter since nothing is captured.
+	if (options.simulatePackets > 0) {
+		if (options.latency == 0 && options.tracePath.empty()) {
+			PRINT_ERROR("The simulation needs a --latency or a --trace.");
+			return EXIT_FAILURE;
+		}
+		SimulationRecorder recorder;
+		if (!options.simulateCsvPath.empty() && !recorder.OpenCsv(options.simulateCsvPath))
+			return EXIT_FAILURE;
+		delayer.Init(0, options.latency);
+		delayer.SetSpill(std::chrono::milliseconds(options.spillAfterMs), options.spillDirectory);
+		delayer.SetCompensation(!options.noCompensation);
+		if (!options.tracePath.empty() && !delayer.LoadTrace(options.tracePath, options.traceMode, options.traceLoop, options.traceSpeed))
+			return EXIT_FAILURE;
+		auto start = std::chrono::steady_clock::now();
+		if (!delayer.Simulate((UINT64)options.simulatePackets, options.simulateRate, recorder))
+			return EXIT_FAILURE;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		PRINT_INFO("Simulated " << recorder.Released() << " packets in " << seconds << " s.");
+		recorder.PrintSummary();
+		return EXIT_SUCCESS;
+	}
+
+	// Start tracking the target process's ports.
+	if (!options.process.empty() && !processTracker.Start(options.process))
+		return EXIT_FAILURE;
+
+	// Search for the highest sustainable rate if requested.
+	// Every rate is run through a delayer of its own, with the load generator standing in for WinDivert.
+	if (options.loadTest) {
+		long long latency = options.latency != 0 ? options.latency : LOAD_TEST_LATENCY_MS;
+		auto trial = [&](const LOAD_PROFILE& profile) {
+			LoadGenerator generator(profile, std::chrono::milliseconds(latency));
+			Delayer trialDelayer;
+			trialDelayer.Init(0, latency);
+			trialDelayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+			trialDelayer.SetRewriter(options.rewriter);
+			trialDelayer.SetRules(options.rules);
+			if (!options.process.empty())
+				trialDelayer.SetProcessTarget(&processTracker);
+			trialDelayer.SetSpill(std::chrono::milliseconds(options.spillAfterMs), options.spillDirectory);
+			trialDelayer.SetStampOnReceive(options.stampOnReceive);
+			trialDelayer.SetCompensation(!options.noCompensation);
+			trialDelayer.SetIoMode(options.ioMode);
+			trialDelayer.SetFlowProfile(std::chrono::seconds(options.topFlowsWindow));
+			trialDelayer.SetAckCoalescing(options.coalesceAcks);
+			trialDelayer.SetReleaseOrder(options.releaseOrder, options.queueWeights);
+			trialDelayer.SetDivert(&generator);
+			if (trialDelayer.Activate()) {
+				// Wait for the last packet to be released before stopping.
+				std::this_thread::sleep_for(profile.duration + std::chrono::milliseconds(latency) + LOAD_TEST_DRAIN_TIME);
+				trialDelayer.Deactivate();
+			}
+			return generator.Result();
+		};
+		bool sustainable = FindSustainableRate(options.loadProfile, options.loadThresholds, trial) > 0;
+		if (!options.process.empty()) {
+			processTracker.Stop();
+			processTracker.PrintSummary();
+		}
+		return sustainable ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+#ifndef _WIN32
+	PRINT_ERROR("Delaying packets needs the WinDivert driver, which is only available on Windows.");
+	return EXIT_FAILURE;
+#else
+	// Prompt the user for the port(s) unless a process is targeted or the ports are given with their profiles.
+	int port = 0;
+	if (options.process.empty() && options.profiles.empty())
+		port = (int)PromptPositiveNum("Please enter the port the application uses to send network packets: ");
+	// The latency is only needed when it isn't given or played back from a trace.
+	// When freezing, the packets are passed through without one, and with a target round trip time until their flow is measured.
+	long long latency = options.latency;
+	if (latency == 0 && options.tracePath.empty() && !options.freeze && options.targetRttMs == 0 && options.profiles.empty())
+		latency = PromptPositiveNum("Please enter the desired latency (ms): ");
+
+	// Register the control handler.
+	if (SetConsoleCtrlHandler(CtrlHandler, TRUE))
+		PRINT_TRACE("The control handler was registered.");
+	else {
+		PRINT_ERROR("Could not set control handler.");
+		return EXIT_FAILURE;
+	}
+
+	// With profiles, every port has a delayer of its own in a pool, which the shortcut toggles instead of the delayer.
+	if (!options.profiles.empty()) {
+		if (!RunProfiles(options)) {
+			PROMPT_CLOSE
+			return EXIT_FAILURE;
+		}
+		SYNC_COUT("The application is closing...");
+		return EXIT_SUCCESS;
+	}
+
+	// Initialize the delayer with the given port.
+	delayer.Init(port, latency);
+	delayer.SetThreadConfigs(options.receiverThread, options.senderThread, options.loggerThread);
+	delayer.SetRewriter(options.rewriter);
+	delayer.SetRules(options.rules);
+	if (!options.process.empty())
+		delayer.SetProcessTarget(&processTracker);
+	delayer.SetSpill(std::chrono::milliseconds(options.spillAfterMs), options.spillDirectory);
+	delayer.SetStampOnReceive(options.stampOnReceive);
+	delayer.SetCompensation(!options.noCompensation);
+	delayer.SetIoMode(options.ioMode);
+	delayer.SetFlowProfile(std::chrono::seconds(options.topFlowsWindow));
+	delayer.SetFreeze((UINT64)options.freezeCapMb * 1024 * 1024, options.releaseRate);
+	delayer.SetDrain(options.drainPolicy, std::chrono::milliseconds(options.drainTimeoutMs));
+	delayer.SetAckCoalescing(options.coalesceAcks);
+	delayer.SetReleaseOrder(options.releaseOrder, options.queueWeights);
+
+	// Start measuring the round trip times if requested. The monitor sees the flows of the port or the process.
+	if (options.measureRtt) {
+		rttMonitor.SetUdpKey(options.rttUdpKey);
+		rttMonitor.SetTarget(std::chrono::milliseconds(options.targetRttMs));
+		if (!options.process.empty())
+			rttMonitor.SetProcessTarget(&processTracker);
+		delayer.SetRttMonitor(&rttMonitor);
+		if (!rttMonitor.Start(options.process.empty() ? "(tcp or udp) and localPort == " + std::to_string(port) : "tcp or udp")) {
+			PROMPT_CLOSE
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Start the capture if one was requested.
+	if (!options.capturePath.empty() && !delayer.StartCapture(options.capturePath, (UINT64)options.captureRotateMb * 1024 * 1024)) {
+		PROMPT_CLOSE
+		return EXIT_FAILURE;
+	}
+	if (!options.eventLogPath.empty() && !delayer.StartEventLog(options.eventLogPath)) {
+		PROMPT_CLOSE
+		return EXIT_FAILURE;
+	}
+	if (!options.statsName.empty() && !delayer.StartStats(options.statsName)) {
+		PROMPT_CLOSE
+		return EXIT_FAILURE;
+	}
+
+	// Load the latency trace if one was given.
+	if (!options.tracePath.empty() && !delayer.LoadTrace(options.tracePath, options.traceMode, options.traceLoop, options.traceSpeed)) {
+		PROMPT_CLOSE
+		return EXIT_FAILURE;
+	}
+
+	// In freeze mode the delayer stays active, and the shortcut only holds the packets.
+	if (options.freeze) {
+		if (!delayer.Activate()) {
+			PROMPT_CLOSE
+			return EXIT_FAILURE;
+		}
+		ShortcutWaiter::freezeMode = true;
+		SYNC_COUT("Hold F8 to freeze the packets and release it to send them.");
+	}
+
+	WaitForShortcuts();
+
+	rttMonitor.Stop();
+	if (!options.process.empty()) {
+		processTracker.Stop();
+		processTracker.PrintSummary();
+	}
 
 	SYNC_COUT("The application is closing...");
 
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+#endif
+}
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "Platform.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// The magic bytes at the start of every latency trace file.
+#define TRACE_MAGIC "LSTRACE"
+// The current version of the latency trace file format.
+#define TRACE_VERSION 1
+// How many samples the CSV converter buffers before writing them to the trace file.
+#define TRACE_WRITE_BATCH 65536
+
+// The header of a latency trace file.
+// The header is followed by SampleCount delays, each stored as a little-endian 32-bit number of microseconds.
+#pragma pack(push, 1)
+struct TRACE_HEADER {
+	char Magic[8];
+	UINT32 Version;
+	UINT32 Reserved;
+	// The amount of delay samples following the header.
+	UINT64 SampleCount;
+	// The time between two samples in microseconds. Used when the trace is played back by time.
+	UINT64 IntervalUs;
+};
+#pragma pack(pop)
+
+// How the trace is indexed when looking up the delay of a packet.
+enum class TraceMode {
+	// The n:th packet gets the n:th sample.
+	Packet,
+	// A packet received t microseconds after activation gets the sample at t / IntervalUs.
+	Time
+};
+
+// A read-only view of a memory-mapped latency trace file.
+// The samples are never copied to the heap, so opening a trace is instant regardless of its size.
+class LatencyTrace {
+private:
+#ifdef _WIN32
+	HANDLE _file;
+	HANDLE _mapping;
+#else
+	int _file;
+	size_t _viewSize;
+#endif
+	const BYTE* _view;
+
+	const UINT32* _samples;
+	UINT64 _sampleCount;
+	UINT64 _intervalUs;
+
+	TraceMode _mode;
+	bool _loop;
+	double _speed;
+
+	std::string _error;
+
+	// Sets the error message and closes whatever was opened so far. Always returns false.
+	bool _fail(const std::string& error) {
+		Close();
+		_error = error;
+		return false;
+	}
+
+public:
+	LatencyTrace() {
+#ifdef _WIN32
+		_file = INVALID_HANDLE_VALUE;
+		_mapping = NULL;
+#else
+		_file = -1;
+		_viewSize = 0;
+#endif
+		_view = nullptr;
+		_samples = nullptr;
+		_sampleCount = 0;
+		_intervalUs = 0;
+		_mode = TraceMode::Packet;
+		_loop = false;
+		_speed = 1.0;
+	}
+
+	~LatencyTrace() {
+		Close();
+	}
+
+	LatencyTrace(const LatencyTrace&) = delete;
+	LatencyTrace& operator=(const LatencyTrace&) = delete;
+
+	// Maps the given trace file into memory. Returns false and sets the error message on failure.
+	bool Open(const std::string& path) {
+		Close();
+
+#ifdef _WIN32
+		_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (_file == INVALID_HANDLE_VALUE)
+			return _fail("CreateFileA() failed with error code " + std::to_string(GetLastError()) + ".");
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(_file, &fileSize))
+			return _fail("GetFileSizeEx() failed with error code " + std::to_string(GetLastError()) + ".");
+		UINT64 size = (UINT64)fileSize.QuadPart;
+#else
+		_file = open(path.c_str(), O_RDONLY);
+		if (_file < 0)
+			return _fail("open() failed with error code " + std::to_string(errno) + ".");
+
+		struct stat status;
+		if (fstat(_file, &status) != 0)
+			return _fail("fstat() failed with error code " + std::to_string(errno) + ".");
+		UINT64 size = (UINT64)status.st_size;
+#endif
+		if (size < sizeof(TRACE_HEADER))
+			return _fail("The file is too small to be a latency trace.");
+		// A 32-bit process can't map a view larger than its address space.
+		if (size > (UINT64)(SIZE_T)-1)
+			return _fail("The trace is too large to be mapped by a 32-bit process.");
+
+#ifdef _WIN32
+		_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping == NULL)
+			return _fail("CreateFileMappingA() failed with error code " + std::to_string(GetLastError()) + ".");
+
+		_view = (const BYTE*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		if (_view == nullptr)
+			return _fail("MapViewOfFile() failed with error code " + std::to_string(GetLastError()) + ".");
+#else
+		void* view = mmap(nullptr, (size_t)size, PROT_READ, MAP_SHARED, _file, 0);
+		if (view == MAP_FAILED)
+			return _fail("mmap() failed with error code " + std::to_string(errno) + ".");
+		_view = (const BYTE*)view;
+		_viewSize = (size_t)size;
+#endif
+
+		// Validate the header.
+		const TRACE_HEADER* header = (const TRACE_HEADER*)_view;
+		if (std::memcmp(header->Magic, TRACE_MAGIC, sizeof(header->Magic)) != 0)
+			return _fail("The file is not a latency trace. Use --convert-trace to create one from a CSV file.");
+		if (header->Version != TRACE_VERSION)
+			return _fail("Unsupported latency trace version " + std::to_string(header->Version) + ".");
+		if (header->SampleCount == 0)
+			return _fail("The latency trace contains no samples.");
+		if (header->SampleCount > (size - sizeof(TRACE_HEADER)) / sizeof(UINT32))
+			return _fail("The latency trace is truncated.");
+
+		_samples = (const UINT32*)(_view + sizeof(TRACE_HEADER));
+		_sampleCount = header->SampleCount;
+		_intervalUs = header->IntervalUs;
+		_error.clear();
+		return true;
+	}
+
+	// Unmaps the trace file. Safe to call when nothing is open.
+	void Close() {
+#ifdef _WIN32
+		if (_view != nullptr)
+			UnmapViewOfFile(_view);
+		if (_mapping != NULL)
+			CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+		_mapping = NULL;
+#else
+		if (_view != nullptr)
+			munmap((void*)_view, _viewSize);
+		if (_file >= 0)
+			close(_file);
+		_file = -1;
+		_viewSize = 0;
+#endif
+		_view = nullptr;
+		_samples = nullptr;
+		_sampleCount = 0;
+		_intervalUs = 0;
+	}
+
+	// Sets how the trace is played back.
+	// The speed multiplies how fast the trace is stepped through, e.g. 2.0 plays a time trace at double speed.
+	void SetPlayback(TraceMode mode, bool loop, double speed) {
+		_mode = mode;
+		_loop = loop;
+		_speed = speed;
+	}
+
+	bool IsOpen() const {
+		return _samples != nullptr;
+	}
+
+	UINT64 SampleCount() const {
+		return _sampleCount;
+	}
+
+	UINT64 IntervalUs() const {
+		return _intervalUs;
+	}
+
+	const std::string& Error() const {
+		return _error;
+	}
+
+	// Gets the delay of a packet from the trace.
+	// The packet index is the amount of packets received before this one,
+	// and the elapsed time is the time between activation and receiving the packet.
+	// Past the end of the trace the last sample is used, unless the trace loops.
+	std::chrono::microseconds GetDelay(UINT64 packetIndex, std::chrono::microseconds elapsed) const {
+		UINT64 index;
+		if (_mode == TraceMode::Time && _intervalUs != 0)
+			index = (UINT64)(elapsed.count() * _speed / _intervalUs);
+		else
+			index = (UINT64)(packetIndex * _speed);
+		if (index >= _sampleCount)
+			index = _loop ? index % _sampleCount : _sampleCount - 1;
+		return std::chrono::microseconds(_samples[index]);
+	}
+};
+
+// Converts a CSV file into a latency trace file.
+// Each line is either "rtt_ms" or "time_ms,rtt_ms". Empty lines, comments starting with '#'
+// and lines that don't start with a number (such as a header row) are skipped.
+// Timestamped rows are resampled to the given interval by holding the most recent value,
+// while rows without a timestamp are stored as they are.
+// Returns false and sets the error message on failure.
+inline bool ConvertTraceCsv(const std::string& csvPath, const std::string& tracePath, double intervalMs, std::string& error) {
+	std::ifstream input(csvPath);
+	if (!input) {
+		error = "Could not open \"" + csvPath + "\" for reading.";
+		return false;
+	}
+	std::ofstream output(tracePath, std::ios::binary | std::ios::trunc);
+	if (!output) {
+		error = "Could not open \"" + tracePath + "\" for writing.";
+		return false;
+	}
+
+	TRACE_HEADER header = {};
+	std::memcpy(header.Magic, TRACE_MAGIC, sizeof(header.Magic));
+	header.Version = TRACE_VERSION;
+	header.IntervalUs = (UINT64)(intervalMs * 1000);
+	if (header.IntervalUs == 0) {
+		error = "The sample interval must be at least one microsecond.";
+		return false;
+	}
+	// Write a placeholder header, the sample count is filled in at the end.
+	output.write((const char*)&header, sizeof(header));
+
+	std::vector<UINT32> batch;
+	batch.reserve(TRACE_WRITE_BATCH);
+	auto emit = [&](UINT32 sample) {
+		batch.push_back(sample);
+		header.SampleCount += 1;
+		if (batch.size() == TRACE_WRITE_BATCH) {
+			output.write((const char*)batch.data(), batch.size() * sizeof(UINT32));
+			batch.clear();
+		}
+	};
+	auto toMicroseconds = [](double ms) -> UINT32 {
+		if (ms <= 0)
+			return 0;
+		if (ms >= 4294967.295)
+			return 0xFFFFFFFF;
+		return (UINT32)(ms * 1000 + 0.5);
+	};
+
+	// The state of the resampler for timestamped rows.
+	bool timestamped = false;
+	bool havePrevious = false;
+	double previousRtt = 0;
+	double previousTimeUs = 0;
+	double nextTickUs = 0;
+
+	std::string line;
+	size_t lineNumber = 0;
+	while (std::getline(input, line)) {
+		lineNumber += 1;
+		const char* start = line.c_str();
+		while (*start == ' ' || *start == '\t')
+			++start;
+		// Skip empty lines, comments, and headers.
+		if (*start == '\0' || *start == '\r' || *start == '#')
+			continue;
+		char* end;
+		double first = std::strtod(start, &end);
+		if (end == start)
+			continue;
+		while (*end == ' ' || *end == '\t')
+			++end;
+		bool hasSecond = *end == ',' || *end == ';';
+		if (havePrevious && hasSecond != timestamped) {
+			error = "Line " + std::to_string(lineNumber) + " has a different amount of columns than the previous lines.";
+			return false;
+		}
+
+		if (!hasSecond) {
+			havePrevious = true;
+			emit(toMicroseconds(first));
+			continue;
+		}
+
+		const char* secondStart = end + 1;
+		double rtt = std::strtod(secondStart, &end);
+		if (end == secondStart) {
+			error = "Could not parse the latency on line " + std::to_string(lineNumber) + ".";
+			return false;
+		}
+		double timeUs = first * 1000;
+		if (!havePrevious) {
+			// The first timestamp is the start of the trace.
+			timestamped = true;
+			havePrevious = true;
+			nextTickUs = timeUs;
+		}
+		else if (timeUs < previousTimeUs) {
+			error = "The timestamps must be increasing, but line " + std::to_string(lineNumber) + " goes back in time.";
+			return false;
+		}
+		// Every tick before this row gets the latency of the previous row.
+		while (nextTickUs < timeUs) {
+			emit(toMicroseconds(previousRtt));
+			nextTickUs += header.IntervalUs;
+		}
+		previousRtt = rtt;
+		previousTimeUs = timeUs;
+	}
+	if (timestamped)
+		emit(toMicroseconds(previousRtt));
+
+	if (header.SampleCount == 0) {
+		error = "\"" + csvPath + "\" contains no samples.";
+		return false;
+	}
+
+	// Write the remaining samples and the final header.
+	output.write((const char*)batch.data(), batch.size() * sizeof(UINT32));
+	output.seekp(0);
+	output.write((const char*)&header, sizeof(header));
+	output.close();
+	if (!output) {
+		error = "Writing \"" + tracePath + "\" failed.";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,984 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include <queue>
+#include <tuple>
+#include <random>
+#include <condition_variable>
+#include "Platform.h"
+#include "Logging.h"
+#include "PacketHeaders.h"
+#include "Checksum.h"
+#include "PacketDivert.h"
+#include "Benchmarks.h"
+
+// The smallest generated packet: the IPv4 and UDP headers, the sequence number, and the arrival time.
+#define LOAD_MIN_PACKET_LENGTH 44
+#define LOAD_PAYLOAD_OFFSET 28
+// The first source port of the generated flows and the destination port of every flow.
+#define LOAD_FIRST_PORT 10000
+#define LOAD_DESTINATION_PORT 27015
+// Waits longer than this are slept, shorter ones are spun so the packets arrive on time.
+#define LOAD_SPIN_US 200
+// The flood divert's traffic: every period, a burst of bulk packets and then a few game packets, all arriving at once.
+#define FLOOD_PERIOD_MS 10
+#define FLOOD_BULK_PACKETS 300
+#define FLOOD_GAME_PACKETS 8
+#define FLOOD_BULK_LENGTH 1400
+#define FLOOD_GAME_LENGTH 80
+// The game packets are marked Expedited Forwarding, the bulk packets best effort.
+#define FLOOD_GAME_DSCP 46
+// How long the flood divert takes to send a packet, like the driver's injection does.
+#define FLOOD_SEND_NS 2000
+// The echo divert's flows each send a packet every period, which is answered after the flow's base round trip time
+// and up to the jitter more. The period leaves fewer packets in flight than the RTT monitor waits for at once.
+#define ECHO_PERIOD_MS 20
+#define ECHO_PACKET_LENGTH 80
+#define ECHO_JITTER_US 1000
+
+// The traffic the load generator produces.
+struct LOAD_PROFILE {
+	double packetsPerSecond = 10000;
+	// Each packet gets one of the sizes at random, so repeating a size makes it more common.
+	std::vector<UINT> sizes = { 64, 576, 1400 };
+	// The amount of UDP flows, told apart by their source port.
+	UINT flows = 16;
+	// The packets arrive in bursts of this many at once, with the bursts spaced to keep the average rate.
+	UINT burst = 1;
+	std::chrono::milliseconds duration = std::chrono::milliseconds(2000);
+};
+
+// The limits a rate has to stay within to count as sustainable.
+struct LOAD_THRESHOLDS {
+	double maxLossPercent = 0.1;
+	// The 99th percentile of how much longer than the latency the packets were held.
+	double maxHoldErrorMs = 15;
+};
+
+// The outcome of running a profile through the delayer.
+struct LOAD_RESULT {
+	double offeredPps = 0;
+	UINT64 generated = 0;
+	// Packets the emulated driver queue dropped because the receiver didn't keep up.
+	UINT64 queueDropped = 0;
+	UINT64 released = 0;
+	UINT64 reordered = 0;
+	double lossPercent = 0;
+	// How much longer than the latency the released packets were held, in microseconds.
+	LATENCY_SUMMARY holdError;
+	double seconds = 0;
+};
+
+// A stand-in for the WinDivert driver that generates traffic instead of capturing it, and checks the
+// packets the delayer injects back. Packets are due at fixed times whether or not the receiver asks for them,
+// and like the driver, a queue of at most WINDIVERT_PARAM_QUEUE_LENGTH_DEFAULT packets and
+// WINDIVERT_PARAM_QUEUE_TIME_DEFAULT milliseconds is kept for a receiver that falls behind,
+// with older packets dropped.
+class LoadGenerator : public PacketDivert {
+private:
+	LOAD_PROFILE _profile;
+	std::chrono::microseconds _latency;
+	UINT64 _total;
+	std::chrono::steady_clock::time_point _start;
+	std::atomic<bool> _shutdown;
+	bool _opened = false;
+
+	// Used by the receiving thread only.
+	UINT64 _next;
+	UINT64 _queueDropped;
+
+	// Used by the sending threads with the send mutex locked.
+	std::mutex _sendMutex;
+	UINT64 _released;
+	UINT64 _reordered;
+	UINT64 _lastSequence;
+	std::vector<double> _holdErrors;
+	// The latency of every flow if they have their own, and the last sequence number sent in every flow.
+	std::vector<std::chrono::microseconds> _flowLatencies;
+	std::vector<UINT64> _flowLastSequences;
+	std::vector<bool> _flowSent;
+
+	// Gets the time the given packet arrives at, relative to the start.
+	std::chrono::nanoseconds _arrival(UINT64 index) const {
+		UINT64 burstStart = index / _profile.burst * _profile.burst;
+		return std::chrono::nanoseconds((long long)(burstStart * 1e9 / _profile.packetsPerSecond));
+	}
+
+	// Gets the amount of packets that have arrived by the given time.
+	UINT64 _arrived(std::chrono::nanoseconds elapsed) const {
+		UINT64 bursts = (UINT64)(elapsed.count() * _profile.packetsPerSecond / (_profile.burst * 1e9)) + 1;
+		return std::min(_total, bursts * _profile.burst);
+	}
+
+	// Mixes the bits of a number (SplitMix64), so every packet's size and flow look random but are repeatable.
+	static UINT64 _mix(UINT64 value) {
+		value += 0x9E3779B97F4A7C15ull;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+		return value ^ (value >> 31);
+	}
+
+	// Drops the packets the emulated driver queue wouldn't have kept.
+	void _dropOverflow(std::chrono::nanoseconds elapsed, UINT64 arrived) {
+		UINT64 oldest = _next;
+		if (arrived - oldest > WINDIVERT_PARAM_QUEUE_LENGTH_DEFAULT)
+			oldest = arrived - WINDIVERT_PARAM_QUEUE_LENGTH_DEFAULT;
+		std::chrono::nanoseconds queueTime = std::chrono::milliseconds(WINDIVERT_PARAM_QUEUE_TIME_DEFAULT);
+		while (oldest < arrived && elapsed - _arrival(oldest) > queueTime)
+			oldest += _profile.burst - oldest % _profile.burst;
+		oldest = std::min(oldest, arrived);
+		_queueDropped += oldest - _next;
+		_next = oldest;
+	}
+
+	// Writes the packet with the given sequence number into the buffer.
+	void _build(BYTE* packet, UINT length, UINT64 sequence, std::chrono::nanoseconds arrival, WINDIVERT_ADDRESS* address) {
+		std::memset(packet, 0, LOAD_PAYLOAD_OFFSET);
+		UINT flow = (UINT)((_mix(sequence) >> 32) % _profile.flows);
+		// The IPv4 header from 10.0.0.1 to 10.0.0.2.
+		packet[0] = 0x45;
+		WriteNet16(packet + 2, (UINT16)length);
+		packet[IPV4_TTL_OFFSET] = 128;
+		packet[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_UDP;
+		const BYTE addresses[8] = { 10, 0, 0, 1, 10, 0, 0, 2 };
+		std::memcpy(packet + IPV4_SRC_ADDR_OFFSET, addresses, sizeof(addresses));
+		WriteWord(packet + IPV4_CHECKSUM_OFFSET, Checksum(packet, 20));
+		// The UDP header without a checksum.
+		BYTE* udp = packet + 20;
+		WriteNet16(udp + SRC_PORT_OFFSET, (UINT16)(LOAD_FIRST_PORT + flow));
+		WriteNet16(udp + DST_PORT_OFFSET, LOAD_DESTINATION_PORT);
+		WriteNet16(udp + UDP_LENGTH_OFFSET, (UINT16)(length - 20));
+		// The payload starts with the sequence number and the arrival time, the rest is left as it was.
+		INT64 arrivalNs = arrival.count();
+		std::memcpy(packet + LOAD_PAYLOAD_OFFSET, &sequence, sizeof(sequence));
+		std::memcpy(packet + LOAD_PAYLOAD_OFFSET + 8, &arrivalNs, sizeof(arrivalNs));
+
+		std::memset(address, 0, sizeof(*address));
+		address->Layer = WINDIVERT_LAYER_NETWORK;
+		address->Outbound = 1;
+		address->IPChecksum = 1;
+		address->Timestamp = (INT64)std::chrono::duration_cast<std::chrono::nanoseconds>(_start.time_since_epoch() + arrival).count();
+	}
+
+	// Waits until the next packet has arrived. Fails with ERROR_NO_DATA once shut down,
+	// and with ERROR_TIMEOUT if the deadline passes first.
+	bool _waitNext(std::chrono::steady_clock::time_point deadline) {
+		while (true) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			std::chrono::nanoseconds elapsed = now - _start;
+			UINT64 arrived = _arrived(elapsed);
+			_dropOverflow(elapsed, arrived);
+			if (_next < arrived)
+				return true;
+			if (now >= deadline) {
+				SetLastError(ERROR_TIMEOUT);
+				return false;
+			}
+			// Wait for the next packet, or for the shutdown once every packet has been generated.
+			std::chrono::nanoseconds wait = _next < _total ? _arrival(_next) - elapsed : std::chrono::milliseconds(1);
+			wait = std::min<std::chrono::nanoseconds>(wait, deadline - now);
+			if (wait > std::chrono::microseconds(LOAD_SPIN_US))
+				std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(wait - std::chrono::microseconds(LOAD_SPIN_US), std::chrono::milliseconds(1)));
+			else
+				std::this_thread::yield();
+		}
+	}
+
+public:
+	// The latency the delayer is set to, which the hold times are compared against.
+	LoadGenerator(const LOAD_PROFILE& profile, std::chrono::microseconds latency)
+		: _profile(profile), _latency(latency), _shutdown(false) {
+		if (_profile.burst == 0)
+			_profile.burst = 1;
+		if (_profile.flows == 0)
+			_profile.flows = 1;
+		if (_profile.sizes.empty())
+			_profile.sizes.push_back(LOAD_MIN_PACKET_LENGTH);
+		_total = (UINT64)(_profile.packetsPerSecond * _profile.duration.count() / 1000);
+		_next = 0;
+		_queueDropped = 0;
+		_released = 0;
+		_reordered = 0;
+		_lastSequence = 0;
+		_holdErrors.reserve((size_t)_total);
+	}
+
+	// Starts the traffic. Opening again after a shutdown picks up where the traffic was, like reopening the driver.
+	bool Open(const std::string& filter) override {
+		if (!_opened)
+			_start = std::chrono::steady_clock::now();
+		_opened = true;
+		_shutdown = false;
+		return true;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		if (!_waitNext(std::chrono::steady_clock::time_point::max()))
+			return false;
+
+		UINT size = _profile.sizes[(size_t)(_mix(_next) % _profile.sizes.size())];
+		if (length < size) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		_build((BYTE*)packet, size, _next, _arrival(_next), address);
+		*received = size;
+		_next += 1;
+		return true;
+	}
+
+	// Hands out every packet that has arrived, as many as fit.
+	bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) override {
+		if (!_waitNext(std::chrono::steady_clock::now() + timeout))
+			return false;
+		UINT64 arrived = _arrived(std::chrono::steady_clock::now() - _start);
+		UINT taken = 0;
+		UINT offset = 0;
+		while (taken < *count && _next < arrived) {
+			UINT size = _profile.sizes[(size_t)(_mix(_next) % _profile.sizes.size())];
+			if (offset + size > length)
+				break;
+			_build((BYTE*)packets + offset, size, _next, _arrival(_next), &addresses[taken]);
+			offset += size;
+			taken += 1;
+			_next += 1;
+		}
+		if (taken == 0) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		*received = offset;
+		*count = taken;
+		return true;
+	}
+
+	// Gives every flow its own latency, for delayers that delay the flows by their source ports.
+	// The order is then only checked within each flow. Should be called before the delayer is activated.
+	void SetFlowLatencies(const std::vector<std::chrono::microseconds>& latencies) {
+		_flowLatencies = latencies;
+		_flowLastSequences.assign(latencies.size(), 0);
+		_flowSent.assign(latencies.size(), false);
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		if (length < LOAD_MIN_PACKET_LENGTH) {
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+		UINT64 sequence;
+		INT64 arrivalNs;
+		std::memcpy(&sequence, (const BYTE*)packet + LOAD_PAYLOAD_OFFSET, sizeof(sequence));
+		std::memcpy(&arrivalNs, (const BYTE*)packet + LOAD_PAYLOAD_OFFSET + 8, sizeof(arrivalNs));
+		std::chrono::nanoseconds held = std::chrono::steady_clock::now() - _start - std::chrono::nanoseconds(arrivalNs);
+		std::lock_guard<std::mutex> lock(_sendMutex);
+		size_t flow = (size_t)(ReadNet16((const BYTE*)packet + 20 + SRC_PORT_OFFSET) - LOAD_FIRST_PORT);
+		if (flow < _flowLatencies.size()) {
+			_holdErrors.push_back(std::chrono::duration<double, std::micro>(held - _flowLatencies[flow]).count());
+			if (_flowSent[flow] && sequence < _flowLastSequences[flow])
+				_reordered += 1;
+			_flowLastSequences[flow] = sequence;
+			_flowSent[flow] = true;
+		}
+		else {
+			_holdErrors.push_back(std::chrono::duration<double, std::micro>(held - _latency).count());
+			if (_released > 0 && sequence < _lastSequence)
+				_reordered += 1;
+			_lastSequence = sequence;
+		}
+		_released += 1;
+		return true;
+	}
+
+	// The packets are stamped with the steady clock time they arrived at.
+	bool CaptureTime(const WINDIVERT_ADDRESS& address, TIME_DATA& time) override {
+		time = TIME_DATA(std::chrono::nanoseconds(address.Timestamp));
+		return true;
+	}
+
+	bool HasCaptureTime() const override {
+		return true;
+	}
+
+	bool Shutdown() override {
+		_shutdown = true;
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+
+	// Gets how the run went. Should be called after the delayer has stopped.
+	LOAD_RESULT Result() {
+		LOAD_RESULT result;
+		result.offeredPps = _profile.packetsPerSecond;
+		result.generated = _total;
+		result.queueDropped = _queueDropped;
+		result.released = _released;
+		result.reordered = _reordered;
+		result.lossPercent = _total == 0 ? 0 : 100.0 * (_total - std::min(_total, _released)) / _total;
+		result.holdError = SummarizeMicroseconds(_holdErrors);
+		result.seconds = _profile.duration.count() / 1000.0;
+		return result;
+	}
+};
+
+// A divert that hands out copies of one packet as fast as they are received, a given number of times,
+// and counts the packets sent back. Measures what the delayer's own work costs per packet, with no pacing in the way.
+class BurstDivert : public PacketDivert {
+private:
+	std::vector<BYTE> _packet;
+	WINDIVERT_ADDRESS _address;
+	UINT64 _total;
+	UINT64 _handedOut = 0;
+	std::atomic<UINT64> _sent{ 0 };
+	std::atomic<bool> _shutdown{ false };
+	TIME_DATA _first;
+	TIME_DATA _last;
+
+public:
+	BurstDivert(const std::vector<BYTE>& packet, const WINDIVERT_ADDRESS& address, UINT64 total)
+		: _packet(packet), _address(address), _total(total) {}
+
+	bool Open(const std::string& filter) override {
+		_shutdown = false;
+		return true;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		// Once every packet has been handed out, wait for the shutdown.
+		while (_handedOut == _total) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (length < _packet.size()) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		if (_handedOut == 0)
+			_first = std::chrono::steady_clock::now();
+		std::memcpy(packet, _packet.data(), _packet.size());
+		*address = _address;
+		*received = (UINT)_packet.size();
+		_handedOut += 1;
+		return true;
+	}
+
+	bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) override {
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+		while (_handedOut == _total) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			if (std::chrono::steady_clock::now() >= deadline) {
+				SetLastError(ERROR_TIMEOUT);
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		UINT taken = (UINT)std::min<UINT64>({ (UINT64)*count, _total - _handedOut, (UINT64)(length / _packet.size()) });
+		if (taken == 0) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		if (_handedOut == 0)
+			_first = std::chrono::steady_clock::now();
+		for (UINT i = 0; i < taken; ++i) {
+			std::memcpy((BYTE*)packets + i * _packet.size(), _packet.data(), _packet.size());
+			addresses[i] = _address;
+		}
+		*received = (UINT)(taken * _packet.size());
+		*count = taken;
+		_handedOut += taken;
+		return true;
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		if (_sent.fetch_add(1) + 1 == _total)
+			_last = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	bool Shutdown() override {
+		_shutdown = true;
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+
+	// Whether every packet has been sent back.
+	bool Done() const {
+		return _sent == _total;
+	}
+
+	// The time from handing out the first packet to getting the last one back, in nanoseconds per packet.
+	// Should be called once Done() returns true.
+	double NanosecondsPerPacket() const {
+		return std::chrono::duration<double, std::nano>(_last - _first).count() / _total;
+	}
+};
+
+// A divert that hands out a burst of bulk packets followed by a few game packets every period, all stamped with the
+// same arrival time, so the delayer has them all due in the same tick. Sending takes a fixed time per packet, which
+// makes a game packet sent behind the bulk ones late. How long after the first packet of its burst each packet was
+// sent is kept apart for both classes, which leaves out how late the sender woke up.
+class FloodDivert : public PacketDivert {
+private:
+	UINT64 _total;
+	std::chrono::steady_clock::time_point _start;
+	std::atomic<bool> _shutdown{ false };
+	bool _opened = false;
+	// Used by the receiving thread only.
+	UINT64 _next = 0;
+
+	// Used by the sending threads with the send mutex locked.
+	std::mutex _sendMutex;
+	std::vector<double> _gameDelays;
+	std::vector<double> _bulkDelays;
+	// The time the first packet of every burst was sent at, and whether it has been.
+	std::vector<std::chrono::steady_clock::time_point> _burstSends;
+	std::vector<bool> _burstSent;
+
+	static bool _isGame(UINT64 index) {
+		return index % (FLOOD_BULK_PACKETS + FLOOD_GAME_PACKETS) >= FLOOD_BULK_PACKETS;
+	}
+
+	static UINT _length(UINT64 index) {
+		return _isGame(index) ? FLOOD_GAME_LENGTH : FLOOD_BULK_LENGTH;
+	}
+
+	// Gets the time the given packet arrives at, relative to the start.
+	static std::chrono::nanoseconds _arrival(UINT64 index) {
+		return std::chrono::milliseconds(FLOOD_PERIOD_MS) * (long long)(index / (FLOOD_BULK_PACKETS + FLOOD_GAME_PACKETS));
+	}
+
+	// Writes the packet with the given index into the buffer, a UDP packet from 10.0.0.1 to 10.0.0.2
+	// with the index and the arrival time at the start of the payload.
+	void _build(BYTE* packet, UINT64 index, WINDIVERT_ADDRESS* address) {
+		UINT length = _length(index);
+		std::memset(packet, 0, LOAD_PAYLOAD_OFFSET);
+		packet[0] = 0x45;
+		packet[IPV4_TOS_OFFSET] = _isGame(index) ? FLOOD_GAME_DSCP << 2 : 0;
+		WriteNet16(packet + 2, (UINT16)length);
+		packet[IPV4_TTL_OFFSET] = 128;
+		packet[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_UDP;
+		const BYTE addresses[8] = { 10, 0, 0, 1, 10, 0, 0, 2 };
+		std::memcpy(packet + IPV4_SRC_ADDR_OFFSET, addresses, sizeof(addresses));
+		WriteWord(packet + IPV4_CHECKSUM_OFFSET, Checksum(packet, 20));
+		BYTE* udp = packet + 20;
+		WriteNet16(udp + SRC_PORT_OFFSET, (UINT16)(LOAD_FIRST_PORT + (_isGame(index) ? 1 : 0)));
+		WriteNet16(udp + DST_PORT_OFFSET, LOAD_DESTINATION_PORT);
+		WriteNet16(udp + UDP_LENGTH_OFFSET, (UINT16)(length - 20));
+		INT64 arrivalNs = _arrival(index).count();
+		std::memcpy(packet + LOAD_PAYLOAD_OFFSET, &index, sizeof(index));
+		std::memcpy(packet + LOAD_PAYLOAD_OFFSET + 8, &arrivalNs, sizeof(arrivalNs));
+
+		std::memset(address, 0, sizeof(*address));
+		address->Layer = WINDIVERT_LAYER_NETWORK;
+		address->Outbound = 1;
+		address->IPChecksum = 1;
+		address->Timestamp = (INT64)std::chrono::duration_cast<std::chrono::nanoseconds>(_start.time_since_epoch() + _arrival(index)).count();
+	}
+
+	// Waits until the next packet has arrived. Fails with ERROR_NO_DATA once shut down,
+	// and with ERROR_TIMEOUT if the deadline passes first.
+	bool _waitNext(std::chrono::steady_clock::time_point deadline) {
+		while (true) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (_next < _total && now - _start >= _arrival(_next))
+				return true;
+			if (now >= deadline) {
+				SetLastError(ERROR_TIMEOUT);
+				return false;
+			}
+			std::chrono::nanoseconds wait = _next < _total ? _arrival(_next) - (now - _start) : std::chrono::milliseconds(1);
+			std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>({ wait, deadline - now, std::chrono::milliseconds(1) }));
+		}
+	}
+
+public:
+	FloodDivert(std::chrono::milliseconds duration) {
+		size_t bursts = (size_t)(duration.count() / FLOOD_PERIOD_MS);
+		_total = (UINT64)bursts * (FLOOD_BULK_PACKETS + FLOOD_GAME_PACKETS);
+		_gameDelays.reserve(bursts * FLOOD_GAME_PACKETS);
+		_bulkDelays.reserve(bursts * FLOOD_BULK_PACKETS);
+		_burstSends.resize(bursts);
+		_burstSent.assign(bursts, false);
+	}
+
+	bool Open(const std::string& filter) override {
+		if (!_opened)
+			_start = std::chrono::steady_clock::now();
+		_opened = true;
+		_shutdown = false;
+		return true;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		if (!_waitNext(std::chrono::steady_clock::time_point::max()))
+			return false;
+		if (length < _length(_next)) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		_build((BYTE*)packet, _next, address);
+		*received = _length(_next);
+		_next += 1;
+		return true;
+	}
+
+	// Hands out every packet that has arrived, as many as fit.
+	bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) override {
+		if (!_waitNext(std::chrono::steady_clock::now() + timeout))
+			return false;
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - _start;
+		UINT taken = 0;
+		UINT offset = 0;
+		while (taken < *count && _next < _total && _arrival(_next) <= elapsed && offset + _length(_next) <= length) {
+			_build((BYTE*)packets + offset, _next, &addresses[taken]);
+			offset += _length(_next);
+			taken += 1;
+			_next += 1;
+		}
+		if (taken == 0) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		*received = offset;
+		*count = taken;
+		return true;
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (length < LOAD_MIN_PACKET_LENGTH) {
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+		UINT64 index;
+		std::memcpy(&index, (const BYTE*)packet + LOAD_PAYLOAD_OFFSET, sizeof(index));
+		size_t burst = (size_t)(index / (FLOOD_BULK_PACKETS + FLOOD_GAME_PACKETS));
+		if (burst >= _burstSends.size()) {
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(_sendMutex);
+			if (!_burstSent[burst]) {
+				_burstSends[burst] = now;
+				_burstSent[burst] = true;
+			}
+			double delay = std::chrono::duration<double, std::micro>(now - _burstSends[burst]).count();
+			if (((const BYTE*)packet)[IPV4_TOS_OFFSET] >> 2 == FLOOD_GAME_DSCP)
+				_gameDelays.push_back(delay);
+			else
+				_bulkDelays.push_back(delay);
+		}
+		// The injection itself.
+		while (std::chrono::steady_clock::now() - now < std::chrono::nanoseconds(FLOOD_SEND_NS)) {}
+		return true;
+	}
+
+	// The packets are stamped with the steady clock time they arrived at.
+	bool CaptureTime(const WINDIVERT_ADDRESS& address, TIME_DATA& time) override {
+		time = TIME_DATA(std::chrono::nanoseconds(address.Timestamp));
+		return true;
+	}
+
+	bool HasCaptureTime() const override {
+		return true;
+	}
+
+	bool Shutdown() override {
+		_shutdown = true;
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+
+	UINT64 Generated(bool game) const {
+		UINT64 periods = _total / (FLOOD_BULK_PACKETS + FLOOD_GAME_PACKETS);
+		return periods * (game ? FLOOD_GAME_PACKETS : FLOOD_BULK_PACKETS);
+	}
+
+	// Gets how long after the first packet of their burst the game or bulk packets were sent, in microseconds.
+	// Should be called after the delayer has stopped.
+	LATENCY_SUMMARY ReleaseDelay(bool game) {
+		return SummarizeMicroseconds(game ? _gameDelays : _bulkDelays);
+	}
+};
+
+// Stands in for WinDivert with UDP flows that each send a packet every period and get it echoed back after the flow's
+// base round trip time, so the RTT monitor can be fed the answers. Every packet carries a sequence number both ways,
+// which the monitor pairs them by. The base round trip times can be changed while it runs.
+class EchoDivert : public PacketDivert {
+private:
+	UINT _flows;
+	UINT64 _total;
+	std::vector<std::atomic<long long>> _baseUs;
+	std::chrono::steady_clock::time_point _start;
+	std::atomic<bool> _shutdown{ false };
+	bool _opened = false;
+	// Used by the receiving thread only.
+	UINT64 _next = 0;
+
+	// The echoes waiting to be answered, as the time they are due at and the packet's sequence number and arrival time,
+	// earliest first, and the round trip time of every answered packet by flow, with the time since the start it was answered at.
+	std::mutex _answerMutex;
+	std::condition_variable _answerAdded;
+	std::priority_queue<std::tuple<std::chrono::steady_clock::time_point, UINT64, INT64>, std::vector<std::tuple<std::chrono::steady_clock::time_point, UINT64, INT64>>,
+		std::greater<std::tuple<std::chrono::steady_clock::time_point, UINT64, INT64>>> _answers;
+	std::vector<std::vector<std::pair<std::chrono::nanoseconds, double>>> _roundTrips;
+	std::mt19937 _random{ 1 };
+	bool _answersShutdown = false;
+
+	// Gets the time the given packet arrives at, relative to the start.
+	std::chrono::nanoseconds _arrival(UINT64 index) const {
+		return std::chrono::milliseconds(ECHO_PERIOD_MS) * (long long)(index / _flows);
+	}
+
+	// Writes a UDP packet of the flow between 10.0.0.1 and 10.0.0.2, sent or answered, with the sequence number
+	// and the arrival time at the start of the payload.
+	void _build(BYTE* packet, UINT flow, UINT64 index, INT64 arrivalNs, bool outbound, WINDIVERT_ADDRESS* address) const {
+		std::memset(packet, 0, ECHO_PACKET_LENGTH);
+		packet[0] = 0x45;
+		WriteNet16(packet + 2, (UINT16)ECHO_PACKET_LENGTH);
+		packet[IPV4_TTL_OFFSET] = 128;
+		packet[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_UDP;
+		const BYTE local[4] = { 10, 0, 0, 1 };
+		const BYTE remote[4] = { 10, 0, 0, 2 };
+		std::memcpy(packet + IPV4_SRC_ADDR_OFFSET, outbound ? local : remote, 4);
+		std::memcpy(packet + IPV4_DST_ADDR_OFFSET, outbound ? remote : local, 4);
+		WriteWord(packet + IPV4_CHECKSUM_OFFSET, Checksum(packet, 20));
+		BYTE* udp = packet + 20;
+		WriteNet16(udp + (outbound ? SRC_PORT_OFFSET : DST_PORT_OFFSET), (UINT16)(LOAD_FIRST_PORT + flow));
+		WriteNet16(udp + (outbound ? DST_PORT_OFFSET : SRC_PORT_OFFSET), LOAD_DESTINATION_PORT);
+		WriteNet16(udp + UDP_LENGTH_OFFSET, (UINT16)(ECHO_PACKET_LENGTH - 20));
+		std::memcpy(packet + LOAD_PAYLOAD_OFFSET, &index, sizeof(index));
+		std::memcpy(packet + LOAD_PAYLOAD_OFFSET + 8, &arrivalNs, sizeof(arrivalNs));
+
+		std::memset(address, 0, sizeof(*address));
+		address->Layer = WINDIVERT_LAYER_NETWORK;
+		address->Outbound = outbound ? 1 : 0;
+		address->IPChecksum = 1;
+		address->Timestamp = (INT64)std::chrono::duration_cast<std::chrono::nanoseconds>(_start.time_since_epoch()).count() + arrivalNs;
+	}
+
+	// Waits until the next packet has arrived. Fails with ERROR_NO_DATA once shut down,
+	// and with ERROR_TIMEOUT if the deadline passes first.
+	bool _waitNext(std::chrono::steady_clock::time_point deadline) {
+		while (true) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (_next < _total && now - _start >= _arrival(_next))
+				return true;
+			if (now >= deadline) {
+				SetLastError(ERROR_TIMEOUT);
+				return false;
+			}
+			std::chrono::nanoseconds wait = _next < _total ? _arrival(_next) - (now - _start) : std::chrono::milliseconds(1);
+			std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>({ wait, deadline - now, std::chrono::milliseconds(1) }));
+		}
+	}
+
+public:
+	EchoDivert(std::chrono::milliseconds duration, UINT flows) : _flows(std::max<UINT>(flows, 1)), _baseUs(_flows), _roundTrips(_flows) {
+		_total = (UINT64)(duration.count() / ECHO_PERIOD_MS) * _flows;
+		for (std::atomic<long long>& base : _baseUs)
+			base = 0;
+	}
+
+	// Sets how long the answers of the flow take, not counting the jitter.
+	void SetBaseRtt(UINT flow, std::chrono::microseconds base) {
+		if (flow < _flows)
+			_baseUs[flow] = base.count();
+	}
+
+	bool Open(const std::string& filter) override {
+		if (!_opened)
+			_start = std::chrono::steady_clock::now();
+		_opened = true;
+		_shutdown = false;
+		return true;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		if (!_waitNext(std::chrono::steady_clock::time_point::max()))
+			return false;
+		if (length < ECHO_PACKET_LENGTH) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		_build((BYTE*)packet, (UINT)(_next % _flows), _next, _arrival(_next).count(), true, address);
+		*received = ECHO_PACKET_LENGTH;
+		_next += 1;
+		return true;
+	}
+
+	// Hands out every packet that has arrived, as many as fit.
+	bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) override {
+		if (!_waitNext(std::chrono::steady_clock::now() + timeout))
+			return false;
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - _start;
+		UINT taken = 0;
+		while (taken < *count && _next < _total && _arrival(_next) <= elapsed && (taken + 1) * ECHO_PACKET_LENGTH <= length) {
+			_build((BYTE*)packets + taken * ECHO_PACKET_LENGTH, (UINT)(_next % _flows), _next, _arrival(_next).count(), true, &addresses[taken]);
+			taken += 1;
+			_next += 1;
+		}
+		if (taken == 0) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		*received = taken * ECHO_PACKET_LENGTH;
+		*count = taken;
+		return true;
+	}
+
+	// Schedules the echo of the packet after its flow's base round trip time and some jitter.
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (length < LOAD_MIN_PACKET_LENGTH) {
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+		UINT64 index;
+		INT64 arrivalNs;
+		std::memcpy(&index, (const BYTE*)packet + LOAD_PAYLOAD_OFFSET, sizeof(index));
+		std::memcpy(&arrivalNs, (const BYTE*)packet + LOAD_PAYLOAD_OFFSET + 8, sizeof(arrivalNs));
+		{
+			std::lock_guard<std::mutex> lock(_answerMutex);
+			std::chrono::microseconds due(_baseUs[index % _flows] + std::uniform_int_distribution<long long>(0, ECHO_JITTER_US - 1)(_random));
+			_answers.emplace(now + due, index, arrivalNs);
+		}
+		_answerAdded.notify_one();
+		return true;
+	}
+
+	// The packets are stamped with the steady clock time they arrived at.
+	bool CaptureTime(const WINDIVERT_ADDRESS& address, TIME_DATA& time) override {
+		time = TIME_DATA(std::chrono::nanoseconds(address.Timestamp));
+		return true;
+	}
+
+	bool HasCaptureTime() const override {
+		return true;
+	}
+
+	bool Shutdown() override {
+		_shutdown = true;
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+
+	// Waits for the next echo to be due and writes it into the buffer. Fails with ERROR_NO_DATA once the answers are shut down.
+	bool RecvAnswer(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) {
+		std::unique_lock<std::mutex> lock(_answerMutex);
+		while (true) {
+			if (_answersShutdown) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			if (!_answers.empty() && std::get<0>(_answers.top()) <= std::chrono::steady_clock::now())
+				break;
+			if (_answers.empty())
+				_answerAdded.wait(lock);
+			else
+				_answerAdded.wait_until(lock, std::get<0>(_answers.top()));
+		}
+		if (length < ECHO_PACKET_LENGTH) {
+			SetLastError(ERROR_INSUFFICIENT_BUFFER);
+			return false;
+		}
+		UINT64 index = std::get<1>(_answers.top());
+		INT64 arrivalNs = std::get<2>(_answers.top());
+		_answers.pop();
+		_build((BYTE*)packet, (UINT)(index % _flows), index, arrivalNs, false, address);
+		*received = ECHO_PACKET_LENGTH;
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - _start;
+		_roundTrips[index % _flows].emplace_back(elapsed, std::chrono::duration<double, std::micro>(elapsed - std::chrono::nanoseconds(arrivalNs)).count());
+		return true;
+	}
+
+	// Wakes the answers' reader, and fails its calls from then on.
+	void ShutdownAnswers() {
+		{
+			std::lock_guard<std::mutex> lock(_answerMutex);
+			_answersShutdown = true;
+		}
+		_answerAdded.notify_all();
+	}
+
+	UINT64 Generated(UINT flow) const {
+		return flow < _flows ? _total / _flows : 0;
+	}
+
+	// Summarizes the round trip times of the flow's packets answered after the given time since the start, from when
+	// they arrived to when they were answered, in microseconds.
+	LATENCY_SUMMARY RoundTrips(UINT flow, std::chrono::nanoseconds after, size_t& answered) {
+		std::lock_guard<std::mutex> lock(_answerMutex);
+		std::vector<double> roundTrips;
+		answered = flow < _flows ? _roundTrips[flow].size() : 0;
+		for (size_t i = 0; i < answered; ++i) {
+			if (_roundTrips[flow][i].first >= after)
+				roundTrips.push_back(_roundTrips[flow][i].second);
+		}
+		return SummarizeMicroseconds(roundTrips);
+	}
+};
+
+// Hands the echoes of an echo divert to the RTT monitor, as packets that are copied instead of diverted.
+class EchoAnswerDivert : public PacketDivert {
+private:
+	EchoDivert& _echo;
+
+public:
+	EchoAnswerDivert(EchoDivert& echo) : _echo(echo) {}
+
+	bool Open(const std::string& filter) override {
+		return true;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		return _echo.RecvAnswer(packet, length, received, address);
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return false;
+	}
+
+	bool Shutdown() override {
+		_echo.ShutdownAnswers();
+		return true;
+	}
+
+	bool Close() override {
+		return true;
+	}
+};
+
+// Gets the mean size of the profile's packets.
+inline double MeanPacketLength(const LOAD_PROFILE& profile) {
+	double sum = 0;
+	for (UINT size : profile.sizes)
+		sum += size;
+	return profile.sizes.empty() ? 0 : sum / profile.sizes.size();
+}
+
+// Prints a row of the capacity report.
+inline void PrintLoadRow(const LOAD_RESULT& result, bool sustainable) {
+	std::ostringstream row;
+	row << std::right << std::fixed << std::setprecision(0)
+		<< std::setw(12) << result.offeredPps
+		<< std::setw(12) << result.released / result.seconds
+		<< std::setprecision(3) << std::setw(10) << result.lossPercent
+		<< std::setw(12) << result.queueDropped
+		<< std::setprecision(2) << std::setw(10) << result.holdError.p50 / 1000
+		<< std::setw(10) << result.holdError.p99 / 1000
+		<< std::setw(10) << result.holdError.max / 1000
+		<< "  " << (sustainable ? "ok" : "over");
+	SYNC_COUT(row.str());
+}
+
+// Prints the header of the capacity report.
+inline void PrintLoadHeader() {
+	std::ostringstream header;
+	header << std::right << std::setw(12) << "offered pps" << std::setw(12) << "sent pps" << std::setw(10) << "loss %"
+		<< std::setw(12) << "queue drops" << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms";
+	SYNC_COUT("Hold time error is how much longer than the latency the packets were held.");
+	SYNC_COUT(header.str());
+}
+
+// Searches for the highest packet rate the delayer sustains within the thresholds, starting from the profile's rate.
+// The rate is doubled until a run fails, or halved until one passes, and the boundary is then bisected.
+// The trial function runs the profile through the delayer and returns the result.
+// Prints a capacity report of every run once the search is done.
+inline double FindSustainableRate(
+	LOAD_PROFILE profile, const LOAD_THRESHOLDS& thresholds, const std::function<LOAD_RESULT(const LOAD_PROFILE&)>& trial
+) {
+	// The runs in the order they were made, and whether each one was within the thresholds.
+	std::vector<std::pair<LOAD_RESULT, bool>> runs;
+	auto passes = [&](double rate) {
+		profile.packetsPerSecond = rate;
+		LOAD_RESULT result = trial(profile);
+		bool sustainable = result.lossPercent <= thresholds.maxLossPercent && result.holdError.p99 / 1000 <= thresholds.maxHoldErrorMs;
+		runs.emplace_back(result, sustainable);
+		PRINT_INFO("Ran " << (UINT64)rate << " packets per second: " << (sustainable ? "sustainable." : "over the limits."));
+		return sustainable;
+	};
+
+	// The highest rate known to pass and the lowest known to fail. Zero if not known yet.
+	double passed = 0;
+	double failed = 0;
+	double rate = profile.packetsPerSecond;
+	while (passed == 0 || failed == 0) {
+		if (passes(rate)) {
+			passed = rate;
+			rate *= 2;
+		}
+		else {
+			failed = rate;
+			rate /= 2;
+		}
+		// Give up on rates too low to be useful, and stop at rates no capture could deliver.
+		if ((passed == 0 && rate < 100) || (failed == 0 && rate > 1e8))
+			break;
+	}
+	if (passed != 0 && failed != 0) {
+		// Narrow the boundary down to within 5%.
+		while (failed - passed > passed * 0.05) {
+			rate = (passed + failed) / 2;
+			if (passes(rate))
+				passed = rate;
+			else
+				failed = rate;
+		}
+	}
+
+	SYNC_COUT("Capacity report (" << profile.sizes.size() << " packet sizes averaging " << MeanPacketLength(profile) << " bytes, "
+		<< profile.flows << " flows, bursts of " << profile.burst << ", " << profile.duration.count() << " ms per run):");
+	PrintLoadHeader();
+	for (const auto& run : runs)
+		PrintLoadRow(run.first, run.second);
+	if (passed == 0)
+		PRINT_ERROR("No rate stayed within " << thresholds.maxLossPercent << "% loss and " << thresholds.maxHoldErrorMs << " ms of hold time error.");
+	else
+		PRINT_INFO(
+			"The highest sustainable rate is about " << (UINT64)passed << " packets per second ("
+			<< std::fixed << std::setprecision(1) << passed * MeanPacketLength(profile) / 1e6 << " MB/s), "
+			<< "staying within " << thresholds.maxLossPercent << "% loss and " << thresholds.maxHoldErrorMs << " ms of p99 hold time error."
+		);
+	return passed;
+}
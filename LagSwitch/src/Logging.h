@@ -0,0 +1,74 @@
+#pragma once
+
+#include <iostream>
+#include <mutex>
+
+// Locked for the duration of writing a line to the standard output.
+extern std::mutex writeMutex;
+
+// This is the type of std::cout.
+typedef std::basic_ostream<char, std::char_traits<char> > CoutType;
+// This is the function signature of std::endl.
+typedef CoutType& (*StandardEndLine)(CoutType&);
+
+class locked_ostream {
+public:
+	template<typename T>
+	const locked_ostream& operator<<(const T& rhs) const {
+		// Delegate the operation to the std::cout stream.
+		std::cout << rhs;
+		// Return this instance by reference.
+		return *this;
+	}
+
+	// Overload for std::endl;
+	const locked_ostream& operator<<(StandardEndLine manipulator) const {
+		// Call the manipulator with the standard output stream.
+		manipulator(std::cout);
+		// Unlock the write mutex.
+		writeMutex.unlock();
+		// Return this instance by reference.
+		return *this;
+	}
+};
+
+class synchronized_ostream {
+public:
+	template<typename T>
+	const locked_ostream& operator<<(const T& rhs) const {
+		// Lock the write mutex.
+		writeMutex.lock();
+		// Delegate the operation to the std::cout stream.
+		std::cout << rhs;
+		// Create a locked ostream object and return it.
+		return locked_ostream();
+	}
+
+	// Overload for std::endl;
+	const locked_ostream& operator<<(StandardEndLine manipulator) const {
+		// Call the manipulator with the standard output stream.
+		manipulator(std::cout);
+		// Unlock the write mutex.
+		writeMutex.unlock();
+		// Create a locked ostream object and return it.
+		return locked_ostream();
+	}
+
+	void NewLine() {
+		// Lock the write mutex.
+		writeMutex.lock();
+		// Write a new line to the standard output.
+		std::cout << std::endl;
+		// Unlock the write mutex.
+		writeMutex.unlock();
+	}
+};
+
+// This is a more thread-safe version of std::cout. The line should always be ended with std::endl;
+extern synchronized_ostream sync_cout;
+
+#define SYNC_COUT(x) sync_cout << x << std::endl
+
+#define PRINT_TRACE(x) SYNC_COUT("[TRACE]: " << x)
+#define PRINT_INFO(x) SYNC_COUT("[INFO]: " << x)
+#define PRINT_ERROR(x) SYNC_COUT("[ERROR]: " << x)
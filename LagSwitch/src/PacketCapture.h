@@ -0,0 +1,338 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include "Platform.h"
+#include "Logging.h"
+#include "ThreadConfig.h"
+#include "BoundedQueue.h"
+
+// pcapng block types.
+#define PCAPNG_SECTION_HEADER 0x0A0D0D0A
+#define PCAPNG_INTERFACE_DESCRIPTION 0x00000001
+#define PCAPNG_ENHANCED_PACKET 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+// pcapng option codes.
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_SHB_USERAPPL 4
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_EPB_FLAGS 2
+// The link type of packets starting with an IPv4 or IPv6 header.
+#define LINKTYPE_RAW 101
+
+// How many bytes of each packet are captured.
+#define CAPTURE_SNAPLEN 2048
+// How many packets can wait for the writer before new ones are left out of the capture.
+#define CAPTURE_SLOTS 8192
+// How long the writer sleeps when there is nothing to write.
+#define CAPTURE_IDLE_SLEEP std::chrono::milliseconds(1)
+// How many bytes the writer collects before writing them to the file.
+#define CAPTURE_WRITE_BATCH (256 * 1024)
+
+// What happened to a captured packet.
+enum class CaptureResult {
+	Sent,
+	SendFailed,
+	TtlExpired,
+	RuleDropped
+};
+
+inline const char* CaptureResultName(CaptureResult result) {
+	switch (result) {
+	case CaptureResult::Sent: return "sent";
+	case CaptureResult::SendFailed: return "send-failed";
+	case CaptureResult::TtlExpired: return "ttl-expired";
+	case CaptureResult::RuleDropped: return "rule-dropped";
+	default: return "unknown";
+	}
+}
+
+// Writes held packets to pcapng files from a background thread.
+// Capture() copies the packet into a preallocated slot and hands it to the writer thread without locking,
+// so capturing never blocks the receiver or sender. If the writer falls behind and every slot is in use,
+// the packet is left out of the capture and counted instead.
+class PacketCapture {
+private:
+	// A captured packet waiting to be written.
+	struct CAPTURE_RECORD {
+		UINT64 capturedNs;
+		UINT64 releasedNs;
+		UINT32 length;
+		UINT32 capturedLength;
+		bool outbound;
+		CaptureResult result;
+	};
+
+	std::vector<CAPTURE_RECORD> _records;
+	std::vector<BYTE> _data;
+	// The indices of the unused slots and the slots waiting for the writer.
+	BoundedQueue<UINT32> _freeSlots;
+	BoundedQueue<UINT32> _filledSlots;
+
+	std::string _path;
+	UINT64 _rotateBytes;
+	std::ofstream _file;
+	UINT64 _fileBytes;
+	UINT64 _filePackets;
+	unsigned int _fileIndex;
+	std::vector<char> _pending;
+
+	// The offset from steady clock time to time since the Unix epoch.
+	std::chrono::nanoseconds _wallClockOffset;
+
+	std::thread _writerThread;
+	std::atomic<bool> _stopping;
+	bool _open;
+
+	std::atomic<UINT64> _written;
+	std::atomic<UINT64> _missed;
+
+	UINT64 _toUnixNs(std::chrono::steady_clock::time_point time) const {
+		return (UINT64)(std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()) + _wallClockOffset).count();
+	}
+
+	void _append(const void* data, size_t length) {
+		const char* bytes = (const char*)data;
+		_pending.insert(_pending.end(), bytes, bytes + length);
+	}
+
+	void _appendU16(UINT16 value) {
+		_append(&value, sizeof(value));
+	}
+
+	void _appendU32(UINT32 value) {
+		_append(&value, sizeof(value));
+	}
+
+	// Appends an option with its value padded to 32 bits.
+	void _appendOption(UINT16 code, const void* value, UINT16 length) {
+		_appendU16(code);
+		_appendU16(length);
+		_append(value, length);
+		static const char padding[4] = {};
+		_append(padding, (4 - length % 4) % 4);
+	}
+
+	// Appends the section header and interface description that start every file.
+	void _appendFileHeader() {
+		static const char application[] = "LagSwitch";
+		_appendU32(PCAPNG_SECTION_HEADER);
+		UINT32 sectionLength = 28 + 4 + 12 + 4;
+		_appendU32(sectionLength);
+		_appendU32(PCAPNG_BYTE_ORDER_MAGIC);
+		_appendU16(1);
+		_appendU16(0);
+		// The section length is unknown.
+		INT64 unknown = -1;
+		_append(&unknown, sizeof(unknown));
+		_appendOption(PCAPNG_OPT_SHB_USERAPPL, application, sizeof(application) - 1);
+		_appendU32(PCAPNG_OPT_END);
+		_appendU32(sectionLength);
+
+		_appendU32(PCAPNG_INTERFACE_DESCRIPTION);
+		UINT32 interfaceLength = 20 + 8 + 4;
+		_appendU32(interfaceLength);
+		_appendU16(LINKTYPE_RAW);
+		_appendU16(0);
+		_appendU32(CAPTURE_SNAPLEN);
+		// The timestamps are in nanoseconds.
+		BYTE resolution = 9;
+		_appendOption(PCAPNG_OPT_IF_TSRESOL, &resolution, 1);
+		_appendU32(PCAPNG_OPT_END);
+		_appendU32(interfaceLength);
+	}
+
+	// Appends an enhanced packet block. The release time and result are stored as a comment.
+	void _appendPacket(const CAPTURE_RECORD& record, const BYTE* data) {
+		char comment[128];
+		int commentLength = std::snprintf(
+			comment, sizeof(comment), "released_ns=%llu held_us=%lld result=%s",
+			(unsigned long long)record.releasedNs,
+			((long long)record.releasedNs - (long long)record.capturedNs) / 1000,
+			CaptureResultName(record.result)
+		);
+		UINT32 paddedData = (record.capturedLength + 3) & ~3u;
+		UINT32 paddedComment = ((UINT32)commentLength + 3) & ~3u;
+		UINT32 blockLength = 32 + paddedData + (4 + 4) + (4 + paddedComment) + 4;
+		_appendU32(PCAPNG_ENHANCED_PACKET);
+		_appendU32(blockLength);
+		_appendU32(0);
+		_appendU32((UINT32)(record.capturedNs >> 32));
+		_appendU32((UINT32)record.capturedNs);
+		_appendU32(record.capturedLength);
+		_appendU32(record.length);
+		_append(data, record.capturedLength);
+		static const char padding[4] = {};
+		_append(padding, paddedData - record.capturedLength);
+		// The direction is in the lowest two bits of the flags: 1 is inbound, 2 is outbound.
+		UINT32 flags = record.outbound ? 2 : 1;
+		_appendOption(PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+		_appendOption(PCAPNG_OPT_COMMENT, comment, (UINT16)commentLength);
+		_appendU32(PCAPNG_OPT_END);
+		_appendU32(blockLength);
+	}
+
+	// Opens the next file, named by inserting the file index before the extension after the first rotation.
+	bool _openNextFile() {
+		if (_file.is_open())
+			_file.close();
+		std::string path = _path;
+		if (_fileIndex > 0) {
+			size_t dot = path.find_last_of('.');
+			size_t slash = path.find_last_of("/\\");
+			std::string suffix = "-" + std::to_string(_fileIndex);
+			if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+				path += suffix;
+			else
+				path.insert(dot, suffix);
+		}
+		_fileIndex += 1;
+		_file.open(path, std::ios::binary | std::ios::trunc);
+		if (!_file) {
+			PRINT_ERROR("Could not open the capture file \"" << path << "\".");
+			return false;
+		}
+		_fileBytes = 0;
+		_filePackets = 0;
+		_appendFileHeader();
+		return true;
+	}
+
+	void _flush() {
+		if (_pending.empty())
+			return;
+		if (_file.is_open())
+			_file.write(_pending.data(), _pending.size());
+		_fileBytes += _pending.size();
+		_pending.clear();
+	}
+
+	void _writerLoop(THREAD_CONFIG config) {
+		ScopedThreadConfig threadConfig(config, "capture writer");
+		PRINT_TRACE("Capture writer loop started...");
+		while (true) {
+			UINT32 slot;
+			bool wrote = false;
+			while (_filledSlots.TryPop(slot)) {
+				const CAPTURE_RECORD& record = _records[slot];
+				// Rotate before the block that would take the file over the limit. Every file gets at least one packet.
+				if (_rotateBytes != 0 && _filePackets > 0 && _fileBytes + _pending.size() + record.capturedLength + 256 > _rotateBytes) {
+					_flush();
+					_openNextFile();
+				}
+				_appendPacket(record, &_data[(size_t)slot * CAPTURE_SNAPLEN]);
+				_filePackets += 1;
+				_freeSlots.TryPush(slot);
+				_written.fetch_add(1, std::memory_order_relaxed);
+				wrote = true;
+				if (_pending.size() >= CAPTURE_WRITE_BATCH)
+					_flush();
+			}
+			_flush();
+			if (!wrote) {
+				// Everything queued before stopping has been written.
+				if (_stopping.load(std::memory_order_acquire))
+					break;
+				std::this_thread::sleep_for(CAPTURE_IDLE_SLEEP);
+			}
+		}
+		_file.close();
+		PRINT_TRACE("Capture writer loop finished.");
+	}
+
+public:
+	PacketCapture() : _stopping(false), _open(false), _written(0), _missed(0) {
+		_rotateBytes = 0;
+		_fileBytes = 0;
+		_filePackets = 0;
+		_fileIndex = 0;
+	}
+
+	~PacketCapture() {
+		Close();
+	}
+
+	PacketCapture(const PacketCapture&) = delete;
+	PacketCapture& operator=(const PacketCapture&) = delete;
+
+	// Starts capturing to the given file. With a rotation size, a new file is started whenever the current one would
+	// grow past it. The writer thread runs with the given scheduling settings.
+	bool Open(const std::string& path, UINT64 rotateBytes, const THREAD_CONFIG& writerConfig) {
+		if (_open)
+			Close();
+		_path = path;
+		_rotateBytes = rotateBytes;
+		_fileIndex = 0;
+		_pending.clear();
+		_pending.reserve(CAPTURE_WRITE_BATCH * 2);
+		if (!_openNextFile())
+			return false;
+
+		_records.assign(CAPTURE_SLOTS, CAPTURE_RECORD());
+		_data.assign((size_t)CAPTURE_SLOTS * CAPTURE_SNAPLEN, 0);
+		_freeSlots.Reset(CAPTURE_SLOTS);
+		_filledSlots.Reset(CAPTURE_SLOTS);
+		for (UINT32 slot = 0; slot < CAPTURE_SLOTS; ++slot)
+			_freeSlots.TryPush(slot);
+
+		_wallClockOffset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch() - std::chrono::steady_clock::now().time_since_epoch()
+		);
+		_written = 0;
+		_missed = 0;
+		_stopping = false;
+		_writerThread = std::thread(&PacketCapture::_writerLoop, this, writerConfig);
+		_open = true;
+		return true;
+	}
+
+	// Writes the remaining packets and stops the writer thread.
+	void Close() {
+		if (!_open)
+			return;
+		_stopping.store(true, std::memory_order_release);
+		_writerThread.join();
+		_open = false;
+	}
+
+	bool IsOpen() const {
+		return _open;
+	}
+
+	// Queues a packet for writing. Never blocks.
+	void Capture(const void* packet, UINT length, bool outbound,
+		std::chrono::steady_clock::time_point captured, std::chrono::steady_clock::time_point released, CaptureResult result) {
+		UINT32 slot;
+		if (!_freeSlots.TryPop(slot)) {
+			_missed.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		CAPTURE_RECORD& record = _records[slot];
+		record.capturedNs = _toUnixNs(captured);
+		record.releasedNs = _toUnixNs(released);
+		record.length = length;
+		record.capturedLength = length < CAPTURE_SNAPLEN ? length : CAPTURE_SNAPLEN;
+		record.outbound = outbound;
+		record.result = result;
+		std::memcpy(&_data[(size_t)slot * CAPTURE_SNAPLEN], packet, record.capturedLength);
+		_filledSlots.TryPush(slot);
+	}
+
+	// The amount of packets written to the capture files.
+	UINT64 Written() const {
+		return _written.load(std::memory_order_relaxed);
+	}
+
+	// The amount of packets left out because the writer fell behind.
+	UINT64 Missed() const {
+		return _missed.load(std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <chrono>
+#include "Platform.h"
+#include "Clock.h"
+#include "PacketHeaders.h"
+
+// Where the delayer receives the packets from and injects them back to.
+// The functions behave like the WinDivert functions of the same names and report errors through SetLastError,
+// so the delayer can run its whole pipeline against something other than the driver.
+class PacketDivert {
+public:
+	virtual ~PacketDivert() {}
+
+	// Starts diverting the packets that match the WinDivert filter.
+	virtual bool Open(const std::string& filter) = 0;
+
+	// Waits for the next packet. Fails with ERROR_INSUFFICIENT_BUFFER if the buffer is too small for it,
+	// and with ERROR_NO_DATA once the divert has been shut down.
+	virtual bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) = 0;
+
+	virtual bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) = 0;
+
+	// Sends packets that follow each other in the buffer, with an address for each, like WinDivertSendEx.
+	// The amount of bytes sent is stored in sentLength, so the packets that weren't sent are known after a failure.
+	// Sends them one at a time unless overridden. Stops at the first packet that fails.
+	virtual bool SendBatch(const VOID* packets, UINT length, const WINDIVERT_ADDRESS* addresses, UINT count, UINT* sentLength) {
+		const BYTE* packet = (const BYTE*)packets;
+		const BYTE* end = packet + length;
+		*sentLength = 0;
+		for (UINT i = 0; i < count; ++i) {
+			UINT packetLength = IpPacketLength(packet, (UINT)(end - packet));
+			if (packetLength == 0) {
+				SetLastError(ERROR_INVALID_PARAMETER);
+				return false;
+			}
+			if (!Send(packet, packetLength, &addresses[i]))
+				return false;
+			packet += packetLength;
+			*sentLength += packetLength;
+		}
+		return true;
+	}
+
+	// Receives the packets that are waiting, up to the count, into a buffer they follow each other in, with an address
+	// for each, like WinDivertRecvEx. The amount of packets received is stored in count. Waits at most the timeout for
+	// the first packet and fails with ERROR_TIMEOUT if none came. Fails with ERROR_NOT_SUPPORTED unless overridden,
+	// since a blocking Recv can't be given a timeout.
+	virtual bool RecvBatch(PVOID packets, UINT length, UINT* received, WINDIVERT_ADDRESS* addresses, UINT* count, std::chrono::nanoseconds timeout) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return false;
+	}
+
+	// Gets the steady clock time a received packet was captured at from its address.
+	// Returns false if the divert doesn't timestamp its packets, in which case the receiver stamps them itself.
+	virtual bool CaptureTime(const WINDIVERT_ADDRESS& address, TIME_DATA& time) {
+		return false;
+	}
+
+	// Whether CaptureTime can succeed, so the delayer only asks for the capture times of a divert that has them.
+	virtual bool HasCaptureTime() const {
+		return false;
+	}
+
+	// Wakes up the thread blocked in Recv. No more packets are received after this.
+	virtual bool Shutdown() = 0;
+
+	virtual bool Close() = 0;
+};
+
+// Diverts the packets through the WinDivert driver.
+class WinDivertHandle : public PacketDivert {
+private:
+	HANDLE _handle;
+	std::mutex _handleMutex;
+	// The WinDivert flags the handle is opened with, like WINDIVERT_FLAG_SNIFF.
+	UINT64 _flags;
+	// The steady clock time at performance counter zero, and the length of a counter tick,
+	// measured when the handle is opened so converting a capture timestamp is a single multiplication.
+	TIME_DATA _counterBase;
+	double _nanosecondsPerTick = 0;
+
+	HANDLE _getHandle() {
+		std::lock_guard<std::mutex> lock(_handleMutex);
+		return _handle;
+	}
+
+public:
+	WinDivertHandle() : _handle(INVALID_HANDLE_VALUE), _flags(0) {}
+
+	explicit WinDivertHandle(UINT64 flags) : _handle(INVALID_HANDLE_VALUE), _flags(flags) {}
+
+	bool Open(const std::string& filter) override {
+#ifdef _WIN32
+		LARGE_INTEGER counter, frequency;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&counter);
+		TIME_DATA now = std::chrono::steady_clock::now();
+		_nanosecondsPerTick = 1e9 / frequency.QuadPart;
+		_counterBase = now - std::chrono::nanoseconds((long long)(counter.QuadPart * _nanosecondsPerTick));
+#endif
+		HANDLE handle = WinDivertOpen(filter.c_str(), WINDIVERT_LAYER_NETWORK, 0, _flags);
+		std::lock_guard<std::mutex> lock(_handleMutex);
+		_handle = handle;
+		return _handle != INVALID_HANDLE_VALUE;
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		return WinDivertRecv(_getHandle(), packet, length, received, address) != FALSE;
+	}
+
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		return WinDivertSend(_getHandle(), packet, length, NULL, address) != FALSE;
+	}
+
+	bool SendBatch(const VOID* packets, UINT length, const WINDIVERT_ADDRESS* addresses, UINT count, UINT* sentLength) override {
+		*sentLength = 0;
+		return WinDivertSendEx(_getHandle(), packets, length, sentLength, 0, addresses, count * sizeof(WINDIVERT_ADDRESS), NULL) != FALSE;
+	}
+
+	// The driver handle, for starting overlapped operations on it.
+	HANDLE Handle() {
+		return _getHandle();
+	}
+
+	// WinDivert stamps the packets with the performance counter when it captures them.
+	bool CaptureTime(const WINDIVERT_ADDRESS& address, TIME_DATA& time) override {
+		if (_nanosecondsPerTick == 0)
+			return false;
+		time = _counterBase + std::chrono::nanoseconds((long long)(address.Timestamp * _nanosecondsPerTick));
+		return true;
+	}
+
+	bool HasCaptureTime() const override {
+		return _nanosecondsPerTick != 0;
+	}
+
+	bool Shutdown() override {
+		return WinDivertShutdown(_getHandle(), WINDIVERT_SHUTDOWN_RECV) != FALSE;
+	}
+
+	bool Close() override {
+		std::lock_guard<std::mutex> lock(_handleMutex);
+		BOOL success = WinDivertClose(_handle);
+		_handle = INVALID_HANDLE_VALUE;
+		return success != FALSE;
+	}
+};
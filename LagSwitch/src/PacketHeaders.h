@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstring>
+#include "Platform.h"
+
+// IP protocol numbers.
+#define IP_PROTOCOL_ICMP 1
+#define IP_PROTOCOL_TCP 6
+#define IP_PROTOCOL_UDP 17
+#define IP_PROTOCOL_ICMPV6 58
+
+// IPv6 extension headers skipped when looking for the transport header.
+#define IPV6_HOP_BY_HOP 0
+#define IPV6_ROUTING 43
+#define IPV6_DESTINATION_OPTIONS 60
+
+// Byte offsets of the header fields that are read or rewritten.
+#define IPV4_TOS_OFFSET 1
+#define IPV4_FRAGMENT_OFFSET 6
+#define IPV4_TTL_OFFSET 8
+#define IPV4_PROTOCOL_OFFSET 9
+#define IPV4_CHECKSUM_OFFSET 10
+#define IPV4_SRC_ADDR_OFFSET 12
+#define IPV4_DST_ADDR_OFFSET 16
+#define IPV6_PAYLOAD_LENGTH_OFFSET 4
+#define IPV6_NEXT_HEADER_OFFSET 6
+#define IPV6_HOP_LIMIT_OFFSET 7
+#define IPV6_SRC_ADDR_OFFSET 8
+#define IPV6_DST_ADDR_OFFSET 24
+#define IPV6_HEADER_LENGTH 40
+#define TCP_SEQ_OFFSET 4
+#define TCP_ACK_OFFSET 8
+#define TCP_DATA_OFFSET_OFFSET 12
+#define TCP_FLAGS_OFFSET 13
+#define TCP_WINDOW_OFFSET 14
+#define TCP_CHECKSUM_OFFSET 16
+#define UDP_LENGTH_OFFSET 4
+#define UDP_CHECKSUM_OFFSET 6
+#define SRC_PORT_OFFSET 0
+#define DST_PORT_OFFSET 2
+
+// TCP flag bits.
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_URG 0x20
+
+// Pointers to the headers of a packet. The pointers point into the packet buffer.
+struct PACKET_HEADERS {
+	BYTE* ip = nullptr;
+	UINT ipHeaderLength = 0;
+	bool ipv6 = false;
+	// The transport protocol, or the last IPv6 extension header that wasn't skipped.
+	UINT8 protocol = 0;
+	// Set if the packet is a fragment of a larger datagram.
+	bool fragment = false;
+	// The TCP or UDP header. Null for other protocols and for non-first fragments.
+	BYTE* transport = nullptr;
+	// The length of the transport header and payload in this packet.
+	UINT transportLength = 0;
+};
+
+// Reads a big-endian 16-bit number.
+inline UINT16 ReadNet16(const BYTE* data) {
+	return (UINT16)((data[0] << 8) | data[1]);
+}
+
+// Reads a big-endian 32-bit number.
+inline UINT32 ReadNet32(const BYTE* data) {
+	return ((UINT32)data[0] << 24) | ((UINT32)data[1] << 16) | ((UINT32)data[2] << 8) | data[3];
+}
+
+// Writes a big-endian 16-bit number.
+inline void WriteNet16(BYTE* data, UINT16 value) {
+	data[0] = (BYTE)(value >> 8);
+	data[1] = (BYTE)value;
+}
+
+// Writes a big-endian 32-bit number.
+inline void WriteNet32(BYTE* data, UINT32 value) {
+	data[0] = (BYTE)(value >> 24);
+	data[1] = (BYTE)(value >> 16);
+	data[2] = (BYTE)(value >> 8);
+	data[3] = (BYTE)value;
+}
+
+// Reads a 16-bit word in memory order. Used for ones' complement arithmetic, which doesn't depend on byte order.
+inline UINT16 ReadWord(const BYTE* data) {
+	UINT16 word;
+	std::memcpy(&word, data, sizeof(word));
+	return word;
+}
+
+// Writes a 16-bit word in memory order.
+inline void WriteWord(BYTE* data, UINT16 word) {
+	std::memcpy(data, &word, sizeof(word));
+}
+
+// Gets the length of the IP packet at the start of the buffer from its header, or 0 if it isn't a valid one.
+inline UINT IpPacketLength(const BYTE* data, UINT available) {
+	UINT length = 0;
+	if (available >= 20 && (data[0] >> 4) == 4)
+		length = ReadNet16(data + 2);
+	else if (available >= IPV6_HEADER_LENGTH && (data[0] >> 4) == 6)
+		length = IPV6_HEADER_LENGTH + ReadNet16(data + IPV6_PAYLOAD_LENGTH_OFFSET);
+	return length <= available ? length : 0;
+}
+
+// Finds the IP and transport headers of a packet. Returns false if the packet isn't a valid IPv4 or IPv6 packet.
+inline bool ParsePacketHeaders(PVOID packet, UINT length, PACKET_HEADERS& headers) {
+	headers = PACKET_HEADERS();
+	BYTE* data = (BYTE*)packet;
+	if (length < 20)
+		return false;
+	headers.ip = data;
+
+	UINT offset;
+	if ((data[0] >> 4) == 4) {
+		headers.ipHeaderLength = (data[0] & 0x0F) * 4;
+		if (headers.ipHeaderLength < 20 || headers.ipHeaderLength > length)
+			return false;
+		headers.protocol = data[IPV4_PROTOCOL_OFFSET];
+		UINT16 fragment = ReadNet16(data + IPV4_FRAGMENT_OFFSET);
+		// The more fragments flag or a non-zero offset.
+		headers.fragment = (fragment & 0x3FFF) != 0;
+		// Only the first fragment has the transport header.
+		if ((fragment & 0x1FFF) != 0)
+			return true;
+		offset = headers.ipHeaderLength;
+	}
+	else if ((data[0] >> 4) == 6) {
+		if (length < IPV6_HEADER_LENGTH)
+			return false;
+		headers.ipv6 = true;
+		headers.ipHeaderLength = IPV6_HEADER_LENGTH;
+		UINT8 next = data[IPV6_NEXT_HEADER_OFFSET];
+		offset = IPV6_HEADER_LENGTH;
+		// Skip the extension headers that can come before the transport header.
+		while (next == IPV6_HOP_BY_HOP || next == IPV6_ROUTING || next == IPV6_DESTINATION_OPTIONS) {
+			if (offset + 8 > length)
+				return false;
+			UINT extensionLength = (data[offset + 1] + 1) * 8;
+			next = data[offset];
+			offset += extensionLength;
+		}
+		headers.protocol = next;
+	}
+	else
+		return false;
+
+	if (headers.protocol == IP_PROTOCOL_TCP) {
+		if (offset + 20 > length)
+			return true;
+		headers.transport = data + offset;
+	}
+	else if (headers.protocol == IP_PROTOCOL_UDP) {
+		if (offset + 8 > length)
+			return true;
+		headers.transport = data + offset;
+	}
+	if (headers.transport != nullptr)
+		headers.transportLength = length - offset;
+	return true;
+}
+
+// Gets the DSCP of a parsed packet, from the IPv4 type of service or the IPv6 traffic class.
+inline UINT PacketDscp(const PACKET_HEADERS& headers) {
+	if (headers.ipv6)
+		return (ReadNet16(headers.ip) >> 6) & 0x3F;
+	return headers.ip[IPV4_TOS_OFFSET] >> 2;
+}
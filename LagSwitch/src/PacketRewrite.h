@@ -0,0 +1,180 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include "Platform.h"
+#include "PacketHeaders.h"
+#include "Checksum.h"
+
+// The header fields the rewrite stage can change.
+enum class RewriteField {
+	// The IPv4 destination address. IPv6 packets are left alone.
+	DstAddr,
+	DstPort,
+	// Lowers the TTL or hop limit to at most the value.
+	MaxTtl,
+	// Decrements the TTL or hop limit like WinDivertHelperDecrementTTL, dropping the packet when it reaches zero.
+	DecrementTtl,
+	// The DiffServ code point in the upper six bits of the IPv4 TOS or IPv6 traffic class.
+	Dscp
+};
+
+// A single field edit. The address is stored in network byte order.
+struct REWRITE_EDIT {
+	RewriteField field;
+	UINT32 value;
+};
+
+// How the checksums of rewritten packets are kept valid.
+enum class ChecksumMode {
+	// Adjust each checksum for the changed words (RFC 1624). Checksums the driver marked invalid are left as they are.
+	Incremental,
+	// Recalculate every checksum from scratch after the edits, marking them valid.
+	Full
+};
+
+// Parses an IPv4 address in dotted decimal notation into network byte order. Returns false if it is invalid.
+inline bool ParseIPv4(const std::string& text, UINT32& address) {
+	BYTE bytes[4];
+	const char* current = text.c_str();
+	for (int i = 0; i < 4; ++i) {
+		char* end;
+		long part = std::strtol(current, &end, 10);
+		if (end == current || part < 0 || part > 255 || (i < 3 && *end != '.') || (i == 3 && *end != '\0'))
+			return false;
+		bytes[i] = (BYTE)part;
+		current = end + 1;
+	}
+	std::memcpy(&address, bytes, sizeof(address));
+	return true;
+}
+
+// Applies a list of header edits to held packets while keeping their checksums valid.
+class PacketRewriter {
+private:
+	std::vector<REWRITE_EDIT> _edits;
+	ChecksumMode _checksumMode;
+
+	// Replaces a 16-bit word in the packet and records the change in the given checksum.
+	static void _replaceWord(BYTE* word, UINT16 newWord, BYTE* checksum, bool updateChecksum) {
+		UINT16 oldWord = ReadWord(word);
+		WriteWord(word, newWord);
+		if (updateChecksum)
+			WriteWord(checksum, ChecksumAdjust(ReadWord(checksum), oldWord, newWord));
+	}
+
+	// Replaces the byte at the given offset within an aligned 16-bit word and updates the checksum.
+	static void _replaceByte(BYTE* word, int index, BYTE value, BYTE* checksum, bool updateChecksum) {
+		BYTE newBytes[2] = { word[0], word[1] };
+		newBytes[index] = value;
+		_replaceWord(word, ReadWord(newBytes), checksum, updateChecksum);
+	}
+
+public:
+	PacketRewriter() {
+		_checksumMode = ChecksumMode::Incremental;
+	}
+
+	void AddEdit(RewriteField field, UINT32 value) {
+		_edits.push_back({ field, value });
+	}
+
+	void SetChecksumMode(ChecksumMode mode) {
+		_checksumMode = mode;
+	}
+
+	bool IsEmpty() const {
+		return _edits.empty();
+	}
+
+	// Applies the edits to the packet. Returns false if the packet should be dropped because its TTL ran out.
+	// Packets that can't be parsed are passed through unchanged.
+	bool Apply(PVOID packet, UINT length, WINDIVERT_ADDRESS* address) const {
+		PACKET_HEADERS headers;
+		if (!ParsePacketHeaders(packet, length, headers))
+			return true;
+		bool incremental = _checksumMode == ChecksumMode::Incremental;
+		BYTE* ip = headers.ip;
+		// IPv6 has no header checksum.
+		bool ipChecksum = incremental && !headers.ipv6 && address->IPChecksum;
+		BYTE* ipChecksumField = ip + IPV4_CHECKSUM_OFFSET;
+		// The transport checksum, if it is present and valid. An IPv4 UDP checksum of zero means there is none.
+		BYTE* transportChecksumField = nullptr;
+		if (headers.transport != nullptr) {
+			if (headers.protocol == IP_PROTOCOL_TCP && address->TCPChecksum)
+				transportChecksumField = headers.transport + TCP_CHECKSUM_OFFSET;
+			else if (headers.protocol == IP_PROTOCOL_UDP && address->UDPChecksum && ReadWord(headers.transport + UDP_CHECKSUM_OFFSET) != 0)
+				transportChecksumField = headers.transport + UDP_CHECKSUM_OFFSET;
+		}
+		bool transportChecksum = incremental && transportChecksumField != nullptr;
+
+		for (const REWRITE_EDIT& edit : _edits) {
+			switch (edit.field) {
+			case RewriteField::DstAddr: {
+				if (headers.ipv6)
+					break;
+				const BYTE* newAddress = (const BYTE*)&edit.value;
+				BYTE* oldAddress = ip + IPV4_DST_ADDR_OFFSET;
+				for (int half = 0; half < 4; half += 2) {
+					UINT16 oldWord = ReadWord(oldAddress + half);
+					UINT16 newWord = ReadWord(newAddress + half);
+					WriteWord(oldAddress + half, newWord);
+					if (ipChecksum)
+						WriteWord(ipChecksumField, ChecksumAdjust(ReadWord(ipChecksumField), oldWord, newWord));
+					// The address is part of the pseudo header.
+					if (transportChecksum)
+						WriteWord(transportChecksumField, ChecksumAdjust(ReadWord(transportChecksumField), oldWord, newWord));
+				}
+				break;
+			}
+			case RewriteField::DstPort: {
+				if (headers.transport == nullptr)
+					break;
+				BYTE port[2];
+				WriteNet16(port, (UINT16)edit.value);
+				_replaceWord(headers.transport + DST_PORT_OFFSET, ReadWord(port), transportChecksumField, transportChecksum);
+				break;
+			}
+			case RewriteField::MaxTtl:
+			case RewriteField::DecrementTtl: {
+				// The TTL shares a word with the protocol, the hop limit shares one with the next header.
+				BYTE* word = headers.ipv6 ? ip + IPV6_NEXT_HEADER_OFFSET : ip + IPV4_TTL_OFFSET;
+				int index = headers.ipv6 ? 1 : 0;
+				BYTE ttl = word[index];
+				if (edit.field == RewriteField::DecrementTtl) {
+					if (ttl <= 1)
+						return false;
+					ttl -= 1;
+				}
+				else if (ttl > edit.value)
+					ttl = (BYTE)edit.value;
+				if (ttl != word[index])
+					_replaceByte(word, index, ttl, ipChecksumField, ipChecksum);
+				break;
+			}
+			case RewriteField::Dscp: {
+				if (headers.ipv6) {
+					// The traffic class straddles the first two bytes, none of which are checksummed.
+					UINT16 first = ReadNet16(ip);
+					first = (UINT16)((first & 0xF03F) | ((edit.value & 0x3F) << 6));
+					WriteNet16(ip, first);
+				}
+				else {
+					// Keep the two ECN bits.
+					BYTE tos = (BYTE)((ip[IPV4_TOS_OFFSET] & 0x03) | ((edit.value & 0x3F) << 2));
+					_replaceByte(ip, IPV4_TOS_OFFSET, tos, ipChecksumField, ipChecksum);
+				}
+				break;
+			}
+			}
+		}
+
+		if (!incremental)
+			CalcPacketChecksums(packet, length, address);
+		// An adjusted UDP checksum can come out as zero, which would mean no checksum.
+		else if (transportChecksum && headers.protocol == IP_PROTOCOL_UDP && ReadWord(transportChecksumField) == 0)
+			WriteWord(transportChecksumField, 0xFFFF);
+		return true;
+	}
+};
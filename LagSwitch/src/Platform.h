@@ -0,0 +1,107 @@
+#pragma once
+
+// Everything that only needs the Windows types includes this instead of <Windows.h>,
+// so the parts of the program that don't capture packets also build on Linux.
+// There the Win32 types and error codes the program uses are defined here, the WinDivert structures come from
+// windivert.h, and the WinDivert functions fail with ERROR_NOT_SUPPORTED.
+
+#ifdef _WIN32
+// Winsock 2 has to come before Windows.h, which would include the older Winsock otherwise.
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <Windows.h>
+#include "windivert.h"
+#else
+#include <cstdint>
+#include <cstddef>
+
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef int BOOL;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef unsigned char BYTE;
+typedef unsigned char byte;
+typedef short SHORT;
+typedef long LONG;
+typedef size_t SIZE_T;
+typedef void VOID;
+typedef void* PVOID;
+typedef void* HANDLE;
+
+#define TRUE 1
+#define FALSE 0
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+// The Win32 error codes the program checks for.
+#define ERROR_SUCCESS 0
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_INVALID_DATA 13
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_NO_DATA 232
+#define ERROR_OPERATION_ABORTED 995
+#define ERROR_HOST_UNREACHABLE 1232
+#define ERROR_NO_SYSTEM_RESOURCES 1450
+#define ERROR_TIMEOUT 1460
+
+// The last error of the calling thread, like on Windows.
+inline DWORD& LastErrorValue() {
+	static thread_local DWORD error = ERROR_SUCCESS;
+	return error;
+}
+
+inline DWORD GetLastError() {
+	return LastErrorValue();
+}
+
+inline void SetLastError(DWORD error) {
+	LastErrorValue() = error;
+}
+
+// Only the WinDivert structures are needed, the functions are replaced below.
+#define WINDIVERT_KERNEL
+#include "windivert.h"
+#undef WINDIVERT_KERNEL
+
+// WinDivert is only available on Windows, so opening a handle always fails.
+inline HANDLE WinDivertOpen(const char* filter, WINDIVERT_LAYER layer, INT16 priority, UINT64 flags) {
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return INVALID_HANDLE_VALUE;
+}
+
+inline BOOL WinDivertRecv(HANDLE handle, VOID* packet, UINT packetLength, UINT* receivedLength, WINDIVERT_ADDRESS* address) {
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+inline BOOL WinDivertSend(HANDLE handle, const VOID* packet, UINT packetLength, UINT* sentLength, const WINDIVERT_ADDRESS* address) {
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+inline BOOL WinDivertSendEx(HANDLE handle, const VOID* packet, UINT packetLength, UINT* sentLength, UINT64 flags,
+	const WINDIVERT_ADDRESS* address, UINT addressLength, PVOID overlapped) {
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+inline BOOL WinDivertShutdown(HANDLE handle, WINDIVERT_SHUTDOWN how) {
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+
+inline BOOL WinDivertClose(HANDLE handle) {
+	SetLastError(ERROR_NOT_SUPPORTED);
+	return FALSE;
+}
+#endif
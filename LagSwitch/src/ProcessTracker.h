@@ -0,0 +1,472 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <cctype>
+#include "Platform.h"
+#include "Logging.h"
+#include "PacketHeaders.h"
+#include "Benchmarks.h"
+#ifdef _WIN32
+#include <iphlpapi.h>
+#include <tlhelp32.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "iphlpapi.lib")
+#endif
+#else
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+// How often the socket tables are scanned. On Windows the socket events add the ports as they are opened,
+// and the scans only find the ones that were closed. On Linux the scans are the only way to find the ports.
+#ifdef _WIN32
+#define PROCESS_SCAN_INTERVAL std::chrono::milliseconds(1000)
+#else
+#define PROCESS_SCAN_INTERVAL std::chrono::milliseconds(100)
+#endif
+
+// The packet filter used when a process is targeted. The packets of other processes are sent on right away.
+#define PROCESS_FILTER "outbound and (tcp or udp)"
+
+// Tracks the local TCP and UDP ports of a process, given by its ID or executable name, as its sockets open and close.
+// The ports are kept in a bitmap that can be read from the receiver thread without locking.
+// A process given by name is looked up again on every scan, so it can be restarted while it is tracked.
+class ProcessTracker {
+private:
+	std::string _target;
+	// The process ID if the target is a number, otherwise 0.
+	DWORD _targetId;
+
+	// A bit for every TCP port, followed by a bit for every UDP port.
+	std::unique_ptr<std::atomic<UINT64>[]> _ports;
+	// The tracked ports, with the protocol in the upper bits, and the times they were added at.
+	std::map<UINT32, std::chrono::steady_clock::time_point> _tracked;
+	// The IDs of the processes that match the target as of the last scan.
+	std::set<DWORD> _processIds;
+	std::mutex _trackedMutex;
+
+	// How long it took for each port to be tracked after its socket was opened, in milliseconds.
+	std::vector<double> _lags;
+	// Whether the first scan, which finds the ports that were open before tracking started, has finished.
+	bool _scanned;
+	std::chrono::steady_clock::time_point _previousScan;
+
+	std::thread _scanThread;
+	std::atomic<bool> _stopping;
+	std::mutex _stopMutex;
+	std::condition_variable _stopCondition;
+#ifdef _WIN32
+	std::thread _eventThread;
+	HANDLE _socketHandle;
+#endif
+
+	static UINT32 _key(UINT8 protocol, UINT16 port) {
+		return ((UINT32)(protocol == IP_PROTOCOL_UDP ? 1 : 0) << 16) | port;
+	}
+
+	static const char* _protocolName(UINT32 key) {
+		return (key >> 16) != 0 ? "UDP" : "TCP";
+	}
+
+	void _setBit(UINT32 key, bool set) {
+		if (set)
+			_ports[key / 64].fetch_or(1ull << (key % 64), std::memory_order_relaxed);
+		else
+			_ports[key / 64].fetch_and(~(1ull << (key % 64)), std::memory_order_relaxed);
+	}
+
+	bool _matchesName(const std::string& name) const {
+		if (name.size() != _target.size())
+			return false;
+		for (size_t i = 0; i < name.size(); ++i) {
+#ifdef _WIN32
+			// Executable names are case-insensitive on Windows.
+			if (std::tolower((unsigned char)name[i]) != std::tolower((unsigned char)_target[i]))
+				return false;
+#else
+			if (name[i] != _target[i])
+				return false;
+#endif
+		}
+		return true;
+	}
+
+	// Starts tracking a port that was opened at the given time, or at the earliest then if the time isn't exact.
+	// The caller should lock the tracked mutex.
+	void _add(UINT32 key, std::chrono::steady_clock::time_point opened, bool exact, DWORD processId) {
+		if (_tracked.count(key) != 0)
+			return;
+		auto now = std::chrono::steady_clock::now();
+		_tracked[key] = now;
+		_setBit(key, true);
+		// The ports that were open before tracking started don't count towards the lag.
+		if (!_scanned)
+			return;
+		double lagMs = std::chrono::duration<double, std::milli>(now - opened).count();
+		_lags.push_back(lagMs);
+		PRINT_INFO(
+			"Delaying " << _protocolName(key) << " port " << (key & 0xFFFF) << " of process " << processId
+			<< ", " << (exact ? "" : "at most ") << lagMs << " ms after its socket was opened."
+		);
+	}
+
+	// Replaces the tracked ports with the ones found by a scan that started at the given time.
+	void _applyScan(const std::map<UINT32, DWORD>& found, const std::set<DWORD>& processIds, std::chrono::steady_clock::time_point started) {
+		std::lock_guard<std::mutex> lock(_trackedMutex);
+		_processIds = processIds;
+		for (const auto& port : found) {
+			// A socket found by a scan was opened at some point after the previous scan, so the lag is at most this.
+			_add(port.first, _previousScan, false, port.second);
+		}
+		for (auto port = _tracked.begin(); port != _tracked.end();) {
+			// Ports added by events during the scan may be missing from it.
+			if (found.count(port->first) == 0 && port->second < started) {
+				PRINT_INFO("No longer delaying " << _protocolName(port->first) << " port " << (port->first & 0xFFFF) << ", its socket was closed.");
+				_setBit(port->first, false);
+				port = _tracked.erase(port);
+			}
+			else
+				++port;
+		}
+		if (!_scanned)
+			PRINT_INFO("Tracking " << _tracked.size() << " ports of " << processIds.size() << " process(es) matching \"" << _target << "\".");
+		_scanned = true;
+		_previousScan = started;
+	}
+
+#ifdef _WIN32
+	// Finds the IDs of the processes matching the target.
+	bool _findProcesses(std::set<DWORD>& processIds) {
+		if (_targetId != 0) {
+			processIds.insert(_targetId);
+			return true;
+		}
+		HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+		if (snapshot == INVALID_HANDLE_VALUE) {
+			PRINT_ERROR("CreateToolhelp32Snapshot() failed with error code " << GetLastError() << ".");
+			return false;
+		}
+		PROCESSENTRY32W entry;
+		entry.dwSize = sizeof(entry);
+		for (BOOL found = Process32FirstW(snapshot, &entry); found; found = Process32NextW(snapshot, &entry)) {
+			// Executable names are compared as ASCII, which is all the target can be given as.
+			std::string name;
+			for (const wchar_t* c = entry.szExeFile; *c != L'\0'; ++c)
+				name += *c < 0x80 ? (char)*c : '?';
+			if (_matchesName(name))
+				processIds.insert(entry.th32ProcessID);
+		}
+		CloseHandle(snapshot);
+		return true;
+	}
+
+	// Reads one of the IP Helper socket tables, growing the buffer until it fits.
+	template <typename GET_TABLE>
+	static bool _readTable(std::vector<BYTE>& buffer, GET_TABLE getTable, const char* name) {
+		DWORD size = (DWORD)buffer.size();
+		DWORD result;
+		while ((result = getTable(buffer.empty() ? nullptr : buffer.data(), &size)) == ERROR_INSUFFICIENT_BUFFER)
+			buffer.resize(size);
+		if (result != NO_ERROR) {
+			PRINT_ERROR(name << " failed with error code " << result << ".");
+			return false;
+		}
+		return true;
+	}
+
+	// The table ports are in network byte order in the low 16 bits.
+	static UINT16 _tablePort(DWORD port) {
+		return (UINT16)(((port & 0xFF) << 8) | ((port >> 8) & 0xFF));
+	}
+
+	// Finds the local ports of the sockets the processes own.
+	bool _scanSockets(const std::set<DWORD>& processIds, std::map<UINT32, DWORD>& found) {
+		std::vector<BYTE> buffer;
+		const ULONG families[] = { AF_INET, AF_INET6 };
+		for (ULONG family : families) {
+			if (!_readTable(buffer, [&](PVOID table, PDWORD size) {
+				return GetExtendedTcpTable(table, size, FALSE, family, TCP_TABLE_OWNER_PID_ALL, 0);
+			}, "GetExtendedTcpTable()"))
+				return false;
+			if (family == AF_INET) {
+				const MIB_TCPTABLE_OWNER_PID* table = (const MIB_TCPTABLE_OWNER_PID*)buffer.data();
+				for (DWORD i = 0; i < table->dwNumEntries; ++i) {
+					if (processIds.count(table->table[i].dwOwningPid) != 0)
+						found[_key(IP_PROTOCOL_TCP, _tablePort(table->table[i].dwLocalPort))] = table->table[i].dwOwningPid;
+				}
+			}
+			else {
+				const MIB_TCP6TABLE_OWNER_PID* table = (const MIB_TCP6TABLE_OWNER_PID*)buffer.data();
+				for (DWORD i = 0; i < table->dwNumEntries; ++i) {
+					if (processIds.count(table->table[i].dwOwningPid) != 0)
+						found[_key(IP_PROTOCOL_TCP, _tablePort(table->table[i].dwLocalPort))] = table->table[i].dwOwningPid;
+				}
+			}
+			if (!_readTable(buffer, [&](PVOID table, PDWORD size) {
+				return GetExtendedUdpTable(table, size, FALSE, family, UDP_TABLE_OWNER_PID, 0);
+			}, "GetExtendedUdpTable()"))
+				return false;
+			if (family == AF_INET) {
+				const MIB_UDPTABLE_OWNER_PID* table = (const MIB_UDPTABLE_OWNER_PID*)buffer.data();
+				for (DWORD i = 0; i < table->dwNumEntries; ++i) {
+					if (processIds.count(table->table[i].dwOwningPid) != 0)
+						found[_key(IP_PROTOCOL_UDP, _tablePort(table->table[i].dwLocalPort))] = table->table[i].dwOwningPid;
+				}
+			}
+			else {
+				const MIB_UDP6TABLE_OWNER_PID* table = (const MIB_UDP6TABLE_OWNER_PID*)buffer.data();
+				for (DWORD i = 0; i < table->dwNumEntries; ++i) {
+					if (processIds.count(table->table[i].dwOwningPid) != 0)
+						found[_key(IP_PROTOCOL_UDP, _tablePort(table->table[i].dwLocalPort))] = table->table[i].dwOwningPid;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Converts a WinDivert timestamp, which is a performance counter value, to the steady clock.
+	static std::chrono::steady_clock::time_point _eventTime(INT64 timestamp) {
+		LARGE_INTEGER counter, frequency;
+		QueryPerformanceCounter(&counter);
+		QueryPerformanceFrequency(&frequency);
+		auto now = std::chrono::steady_clock::now();
+		INT64 ago = counter.QuadPart - timestamp;
+		return now - std::chrono::nanoseconds((long long)((double)ago * 1e9 / frequency.QuadPart));
+	}
+
+	// Adds the ports of the target's sockets as the socket layer reports them being opened.
+	// Closed sockets are left for the scans to remove, since a listening socket's port stays open
+	// when one of its accepted sockets closes.
+	void _eventLoop() {
+		WINDIVERT_ADDRESS address;
+		while (WinDivertRecv(_socketHandle, NULL, 0, NULL, &address)) {
+			if (address.Event != WINDIVERT_EVENT_SOCKET_BIND && address.Event != WINDIVERT_EVENT_SOCKET_CONNECT
+				&& address.Event != WINDIVERT_EVENT_SOCKET_LISTEN && address.Event != WINDIVERT_EVENT_SOCKET_ACCEPT)
+				continue;
+			if (address.Socket.Protocol != IP_PROTOCOL_TCP && address.Socket.Protocol != IP_PROTOCOL_UDP)
+				continue;
+			std::lock_guard<std::mutex> lock(_trackedMutex);
+			if (_processIds.count(address.Socket.ProcessId) == 0)
+				continue;
+			_add(_key(address.Socket.Protocol, address.Socket.LocalPort), _eventTime(address.Timestamp), true, address.Socket.ProcessId);
+		}
+		if (GetLastError() != ERROR_NO_DATA)
+			PRINT_ERROR("WinDivertRecv() failed on the socket layer with error code " << GetLastError() << ". Only the scans track the ports now.");
+	}
+#else
+	static std::string _readLine(const std::string& path) {
+		std::ifstream file(path);
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+
+	// Finds the IDs of the processes matching the target by their command or executable name.
+	bool _findProcesses(std::set<DWORD>& processIds) {
+		if (_targetId != 0) {
+			if (access(("/proc/" + std::to_string(_targetId)).c_str(), F_OK) == 0)
+				processIds.insert(_targetId);
+			return true;
+		}
+		DIR* proc = opendir("/proc");
+		if (proc == nullptr) {
+			PRINT_ERROR("Could not open /proc.");
+			return false;
+		}
+		while (dirent* entry = readdir(proc)) {
+			if (!std::isdigit((unsigned char)entry->d_name[0]))
+				continue;
+			std::string directory = std::string("/proc/") + entry->d_name;
+			char executable[PATH_MAX];
+			ssize_t length = readlink((directory + "/exe").c_str(), executable, sizeof(executable) - 1);
+			std::string name;
+			if (length > 0) {
+				name.assign(executable, length);
+				name = name.substr(name.find_last_of('/') + 1);
+			}
+			if (_matchesName(name) || _matchesName(_readLine(directory + "/comm")))
+				processIds.insert((DWORD)std::strtoul(entry->d_name, nullptr, 10));
+		}
+		closedir(proc);
+		return true;
+	}
+
+	// Finds the local ports of the sockets the processes own by matching the socket inodes of their
+	// file descriptors with the kernel's socket tables.
+	bool _scanSockets(const std::set<DWORD>& processIds, std::map<UINT32, DWORD>& found) {
+		std::map<unsigned long, DWORD> inodes;
+		for (DWORD processId : processIds) {
+			std::string directory = "/proc/" + std::to_string(processId) + "/fd";
+			DIR* descriptors = opendir(directory.c_str());
+			if (descriptors == nullptr)
+				continue;
+			while (dirent* entry = readdir(descriptors)) {
+				char link[64];
+				ssize_t length = readlink((directory + "/" + entry->d_name).c_str(), link, sizeof(link) - 1);
+				if (length <= 0)
+					continue;
+				link[length] = '\0';
+				unsigned long inode;
+				if (std::sscanf(link, "socket:[%lu]", &inode) == 1)
+					inodes[inode] = processId;
+			}
+			closedir(descriptors);
+		}
+		const char* tables[] = { "/proc/net/tcp", "/proc/net/tcp6", "/proc/net/udp", "/proc/net/udp6" };
+		for (int i = 0; i < 4; ++i) {
+			UINT8 protocol = i < 2 ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+			std::ifstream table(tables[i]);
+			std::string line;
+			// Skip the header.
+			std::getline(table, line);
+			while (std::getline(table, line)) {
+				std::istringstream fields(line);
+				std::string slot, local, remote, state, queues, timer, retransmits, user, timeout;
+				unsigned long inode;
+				if (!(fields >> slot >> local >> remote >> state >> queues >> timer >> retransmits >> user >> timeout >> inode))
+					continue;
+				auto owner = inodes.find(inode);
+				size_t colon = local.find(':');
+				if (owner == inodes.end() || colon == std::string::npos)
+					continue;
+				found[_key(protocol, (UINT16)std::strtoul(local.c_str() + colon + 1, nullptr, 16))] = owner->second;
+			}
+		}
+		return true;
+	}
+#endif
+
+	void _scanLoop() {
+		while (true) {
+			auto started = std::chrono::steady_clock::now();
+			std::set<DWORD> processIds;
+			std::map<UINT32, DWORD> found;
+			if (_findProcesses(processIds) && _scanSockets(processIds, found))
+				_applyScan(found, processIds, started);
+			std::unique_lock<std::mutex> lock(_stopMutex);
+			if (_stopCondition.wait_until(lock, started + PROCESS_SCAN_INTERVAL, [this] { return _stopping.load(); }))
+				return;
+		}
+	}
+
+public:
+	ProcessTracker() : _targetId(0), _scanned(false), _stopping(false) {
+		_ports.reset(new std::atomic<UINT64>[2 * 65536 / 64]);
+		for (size_t i = 0; i < 2 * 65536 / 64; ++i)
+			_ports[i].store(0);
+#ifdef _WIN32
+		_socketHandle = INVALID_HANDLE_VALUE;
+#endif
+	}
+
+	~ProcessTracker() {
+		Stop();
+	}
+
+	ProcessTracker(const ProcessTracker&) = delete;
+	ProcessTracker& operator=(const ProcessTracker&) = delete;
+
+	// Starts tracking the process with the given ID, or the processes with the given executable name.
+	// The ports that are already open are found before this returns.
+	bool Start(const std::string& target) {
+		_target = target;
+		_targetId = 0;
+		if (!target.empty() && std::all_of(target.begin(), target.end(), [](char c) { return std::isdigit((unsigned char)c) != 0; }))
+			_targetId = (DWORD)std::strtoul(target.c_str(), nullptr, 10);
+		_stopping = false;
+		_scanned = false;
+
+		// The first scan runs here, so the ports that are already open are delayed from the start.
+		std::set<DWORD> processIds;
+		std::map<UINT32, DWORD> found;
+		auto started = std::chrono::steady_clock::now();
+		_previousScan = started;
+		if (!_findProcesses(processIds) || !_scanSockets(processIds, found))
+			return false;
+		if (processIds.empty())
+			PRINT_INFO("No process matches \"" << target << "\" yet, its ports are tracked once it starts.");
+		_applyScan(found, processIds, started);
+
+#ifdef _WIN32
+		_socketHandle = WinDivertOpen("tcp or udp", WINDIVERT_LAYER_SOCKET, 0, WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_RECV_ONLY);
+		if (_socketHandle == INVALID_HANDLE_VALUE)
+			PRINT_ERROR("WinDivertOpen() failed on the socket layer with error code " << GetLastError() << ". The ports are only tracked by scanning.");
+		else
+			_eventThread = std::thread(&ProcessTracker::_eventLoop, this);
+#endif
+		_scanThread = std::thread(&ProcessTracker::_scanLoop, this);
+		return true;
+	}
+
+	// Stops tracking. The tracked ports are kept.
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lock(_stopMutex);
+			_stopping = true;
+		}
+		_stopCondition.notify_all();
+		if (_scanThread.joinable())
+			_scanThread.join();
+#ifdef _WIN32
+		if (_socketHandle != INVALID_HANDLE_VALUE) {
+			WinDivertShutdown(_socketHandle, WINDIVERT_SHUTDOWN_RECV);
+			if (_eventThread.joinable())
+				_eventThread.join();
+			WinDivertClose(_socketHandle);
+			_socketHandle = INVALID_HANDLE_VALUE;
+		}
+#endif
+	}
+
+	// Checks if the port is one of the target's. Safe to call from any thread.
+	bool Owns(UINT8 protocol, UINT16 port) const {
+		UINT32 key = _key(protocol, port);
+		return (_ports[key / 64].load(std::memory_order_relaxed) >> (key % 64) & 1) != 0;
+	}
+
+	// Checks if an outbound packet was sent from one of the target's ports.
+	bool OwnsPacket(PVOID packet, UINT length) const {
+		PACKET_HEADERS headers;
+		return ParsePacketHeaders(packet, length, headers) && OwnsPacket(headers);
+	}
+
+	// Checks if an outbound packet whose headers the caller has parsed was sent from one of the target's ports.
+	bool OwnsPacket(const PACKET_HEADERS& headers) const {
+		return headers.transport != nullptr && Owns(headers.protocol, ReadNet16(headers.transport + SRC_PORT_OFFSET));
+	}
+
+	size_t PortCount() {
+		std::lock_guard<std::mutex> lock(_trackedMutex);
+		return _tracked.size();
+	}
+
+	// Prints how long it took for the ports opened while tracking to be delayed.
+	void PrintSummary() {
+		std::vector<double> lags;
+		{
+			std::lock_guard<std::mutex> lock(_trackedMutex);
+			lags = _lags;
+		}
+		if (lags.empty()) {
+			PRINT_INFO("No sockets were opened while \"" << _target << "\" was tracked.");
+			return;
+		}
+		PRINT_INFO("Time from a socket being opened to its packets being delayed, over " << lags.size() << " sockets:");
+		PrintSummaryHeader("ms");
+		PrintSummaryRow(_target, SummarizeMicroseconds(lags));
+	}
+};
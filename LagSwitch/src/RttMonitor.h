@@ -0,0 +1,834 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include "Platform.h"
+#include "Logging.h"
+#include "Clock.h"
+#include "PacketHeaders.h"
+#include "PacketDivert.h"
+#include "ProcessTracker.h"
+#include "Benchmarks.h"
+
+// The amount of flows the table holds. Must be a power of two.
+#define RTT_FLOW_CAPACITY 4096
+// How many slots after a flow's home slot it can be stored in. A new flow that finds them all taken
+// replaces the one that was seen the longest time ago.
+#define RTT_PROBE_LIMIT 8
+// How many sent packets a flow waits for the answer to at once.
+#define RTT_PENDING_MAX 8
+// The most samples kept for the statistics of a second.
+#define RTT_REPORT_SAMPLES 4096
+// The weight of a new sample in a flow's smoothed round trip time, like TCP's SRTT.
+#define RTT_SMOOTHING 0.125
+// A base round trip time that stays this far to the same side of the smoothed one for this many samples in a row has moved,
+// e.g. after a route change. The smoothed one then starts over from those samples instead of taking dozens to follow.
+#define RTT_SHIFT_US 5000
+#define RTT_SHIFT_SAMPLES 4
+// How many flows are listed when the monitor stops.
+#define RTT_SUMMARY_FLOWS 10
+// How often the added delays of the flows are updated in target mode, and how many flows are logged every second.
+#define RTT_TARGET_INTERVAL_MS 100
+#define RTT_TARGET_LOG_FLOWS 4
+// The published delays are kept in buckets of 8 slots, a cache line each, that a flow's hash picks.
+// Must be a power of two.
+#define RTT_TARGET_BUCKETS 1024
+#define RTT_TARGET_BUCKET_SLOTS 8
+// A flow's delay is only moved once it is this far from the one its base round trip time asks for, so the jitter of the samples
+// doesn't make it wander. It rises at once, which only leaves a gap in the flow, but falls by at most the step every update,
+// so a change doesn't bunch up the flow's packets.
+#define RTT_TARGET_DEADBAND_US 1000
+#define RTT_TARGET_STEP_US 10000
+
+// Where in a UDP payload the bytes that pair a request with its response are. UDP isn't measured without a key.
+struct RTT_UDP_KEY {
+	UINT offset = 0;
+	// Between 1 and 8 bytes, or 0 to leave UDP out.
+	UINT length = 0;
+};
+
+// A flow as seen from the local side, so a packet and its answer have the same key.
+struct RTT_FLOW_KEY {
+	BYTE localAddress[16];
+	BYTE remoteAddress[16];
+	UINT16 localPort;
+	UINT16 remotePort;
+	UINT8 protocol;
+	UINT8 reserved[3];
+};
+
+// A sent packet waiting for its answer: the TCP sequence number right after it, or the UDP key,
+// with the steady clock ticks it was sent by the application at and released by the delayer at.
+struct RTT_PENDING {
+	UINT64 key;
+	INT64 sent;
+	INT64 released;
+};
+
+// A flow in the table. Everything a packet needs is stored inline, so handling one touches a single entry.
+struct RTT_FLOW {
+	RTT_FLOW_KEY key;
+	bool used;
+	// Whether the TCP sequence number has been seen, and the end of the highest sent segment.
+	bool sequenced;
+	UINT32 highestSequence;
+	INT64 lastSeen;
+	// A ring of the pending packets, oldest first.
+	RTT_PENDING pending[RTT_PENDING_MAX];
+	UINT8 pendingStart;
+	UINT8 pendingCount;
+	// The smoothed round trip times in microseconds, from the release and from the send, and the lowest from the release.
+	double baseUs;
+	double totalUs;
+	double minBaseUs;
+	UINT64 samples;
+	// The samples in a row that were off the smoothed base round trip time to the same side, which side, and their sums.
+	UINT8 shiftCount;
+	INT8 shiftSide;
+	double shiftBaseUs;
+	double shiftTotalUs;
+	double shiftMinBaseUs;
+	// In target mode, whether the flow has a delay yet, and the delay in microseconds.
+	bool targeted;
+	double targetDelayUs;
+};
+
+// Estimates the round trip time of every flow from the packets it sends and the answers it gets, without
+// changing the traffic. TCP segments are matched with the ACKs that acknowledge them, and UDP requests with
+// the responses that carry the same key. A segment sent again isn't measured, since it can't be told which
+// copy the ACK answers.
+// Every sample has two round trip times: the base one from when the delayer released the packet, and the total
+// one from when the application sent it, which includes the added latency. Without a delayer they are the same.
+// The packets come from a WinDivert handle in sniff mode, which copies them without diverting them.
+// While the delayer is active, it reports the outbound packets as it releases them instead.
+// In target mode, every flow is given the delay that brings its round trip time to the target. The base round trip
+// time doesn't include the delay, so the delay follows the connection without feeding back into itself.
+class RttMonitor {
+private:
+	// The flows, with a slot for every possible home slot plus the probe window.
+	std::vector<RTT_FLOW> _flows;
+	RTT_UDP_KEY _udpKey;
+	std::mutex _mutex;
+
+	// The samples of the current second, in microseconds, and how many there were in all.
+	std::vector<double> _baseSamples;
+	std::vector<double> _totalSamples;
+	UINT64 _sampleCount = 0;
+	UINT64 _retransmits = 0;
+	UINT64 _evictions = 0;
+
+	// Copies the packets of the target without diverting them.
+	WinDivertHandle _winDivert{ WINDIVERT_FLAG_SNIFF | WINDIVERT_FLAG_RECV_ONLY };
+	PacketDivert* _divert = &_winDivert;
+	ProcessTracker* _tracker = nullptr;
+	std::atomic<bool> _fedByDelayer{ false };
+	std::atomic<bool> _running{ false };
+	std::mutex _stopMutex;
+	std::condition_variable _stopped;
+	std::thread _snifferThread;
+	std::thread _loggerThread;
+
+	// The target round trip time, or zero if the delays aren't set by flow.
+	std::chrono::microseconds _target{ 0 };
+	// The delays of the flows, as the tag of the flow in the high half of a slot and the delay in microseconds in the low half,
+	// so a lookup reads both at once. Only the target thread writes them, and the delayer reads them without locking.
+	std::unique_ptr<std::atomic<UINT64>[]> _targetSlots;
+	// The slots as the target thread last wrote them.
+	std::vector<UINT64> _targetWritten;
+	std::thread _targetThread;
+
+	static UINT64 _hash(const RTT_FLOW_KEY& key) {
+		UINT64 words[5];
+		std::memcpy(words, &key, sizeof(words));
+		UINT64 hash = 0x9E3779B97F4A7C15ull;
+		for (UINT64 word : words) {
+			hash ^= word;
+			hash *= 0xBF58476D1CE4E5B9ull;
+			hash ^= hash >> 31;
+		}
+		return hash;
+	}
+
+	// The part of a flow's hash that tells it apart in its bucket. Never zero, which marks a free slot.
+	static UINT32 _tag(UINT64 hash) {
+		return (UINT32)(hash >> 32) | 1;
+	}
+
+	// Whether TCP sequence number a comes after b, allowing for the numbers wrapping around.
+	static bool _sequenceAfter(UINT32 a, UINT32 b) {
+		return (INT32)(a - b) > 0;
+	}
+
+	// Reads the key of a flow from a packet. Returns false if it isn't TCP or UDP.
+	static bool _readKey(const PACKET_HEADERS& headers, bool outbound, RTT_FLOW_KEY& key) {
+		if (headers.transport == nullptr || headers.fragment)
+			return false;
+		std::memset(&key, 0, sizeof(key));
+		UINT addressLength = headers.ipv6 ? 16 : 4;
+		const BYTE* source = headers.ip + (headers.ipv6 ? IPV6_SRC_ADDR_OFFSET : IPV4_SRC_ADDR_OFFSET);
+		const BYTE* destination = headers.ip + (headers.ipv6 ? IPV6_DST_ADDR_OFFSET : IPV4_DST_ADDR_OFFSET);
+		std::memcpy(key.localAddress, outbound ? source : destination, addressLength);
+		std::memcpy(key.remoteAddress, outbound ? destination : source, addressLength);
+		UINT16 sourcePort = ReadNet16(headers.transport + SRC_PORT_OFFSET);
+		UINT16 destinationPort = ReadNet16(headers.transport + DST_PORT_OFFSET);
+		key.localPort = outbound ? sourcePort : destinationPort;
+		key.remotePort = outbound ? destinationPort : sourcePort;
+		key.protocol = headers.protocol;
+		return true;
+	}
+
+	// Finds the flow with the key. If it isn't in the table and create is set, it is added in a free slot
+	// of its probe window, or in place of the flow seen the longest time ago. Returns null otherwise.
+	// The caller should lock the mutex.
+	RTT_FLOW* _find(const RTT_FLOW_KEY& key, INT64 now, bool create) {
+		size_t home = (size_t)(_hash(key) & (RTT_FLOW_CAPACITY - 1));
+		RTT_FLOW* free = nullptr;
+		RTT_FLOW* stalest = nullptr;
+		for (size_t i = 0; i < RTT_PROBE_LIMIT; ++i) {
+			RTT_FLOW& flow = _flows[home + i];
+			if (!flow.used) {
+				if (free == nullptr)
+					free = &flow;
+				continue;
+			}
+			if (std::memcmp(&flow.key, &key, sizeof(key)) == 0)
+				return &flow;
+			if (stalest == nullptr || flow.lastSeen < stalest->lastSeen)
+				stalest = &flow;
+		}
+		if (!create)
+			return nullptr;
+		RTT_FLOW* flow = free != nullptr ? free : stalest;
+		if (free == nullptr)
+			_evictions += 1;
+		std::memset(flow, 0, sizeof(*flow));
+		flow->key = key;
+		flow->used = true;
+		flow->lastSeen = now;
+		return flow;
+	}
+
+	// Adds a sent packet to the flow's pending packets. If they are full, either the oldest one is replaced or the new one is left out.
+	// TCP keeps the oldest, since with more segments in flight than the ring holds the newest would never be acknowledged in time.
+	static void _addPending(RTT_FLOW& flow, UINT64 key, INT64 sent, INT64 released, bool replaceOldest) {
+		if (flow.pendingCount == RTT_PENDING_MAX) {
+			if (!replaceOldest)
+				return;
+			flow.pendingStart = (UINT8)((flow.pendingStart + 1) % RTT_PENDING_MAX);
+			flow.pendingCount -= 1;
+		}
+		RTT_PENDING& pending = flow.pending[(flow.pendingStart + flow.pendingCount) % RTT_PENDING_MAX];
+		pending.key = key;
+		pending.sent = sent;
+		pending.released = released;
+		flow.pendingCount += 1;
+	}
+
+	// Removes the pending packet at the given position in the ring, keeping the order of the rest.
+	static void _removePending(RTT_FLOW& flow, UINT position) {
+		for (UINT i = position; i + 1 < flow.pendingCount; ++i)
+			flow.pending[(flow.pendingStart + i) % RTT_PENDING_MAX] = flow.pending[(flow.pendingStart + i + 1) % RTT_PENDING_MAX];
+		flow.pendingCount -= 1;
+	}
+
+	// Records the round trip of a pending packet answered at the given time.
+	// The caller should lock the mutex.
+	void _sample(RTT_FLOW& flow, const RTT_PENDING& pending, INT64 answered) {
+		double baseUs = std::chrono::duration<double, std::micro>(TIME_DATA::duration(answered - pending.released)).count();
+		double totalUs = std::chrono::duration<double, std::micro>(TIME_DATA::duration(answered - pending.sent)).count();
+		if (baseUs < 0)
+			return;
+		INT8 side = baseUs > flow.baseUs + RTT_SHIFT_US ? 1 : baseUs < flow.baseUs - RTT_SHIFT_US ? -1 : 0;
+		if (side == 0 || side != flow.shiftSide) {
+			flow.shiftCount = 0;
+			flow.shiftBaseUs = 0;
+			flow.shiftTotalUs = 0;
+			flow.shiftMinBaseUs = baseUs;
+		}
+		flow.shiftSide = side;
+		if (side != 0) {
+			flow.shiftCount += 1;
+			flow.shiftBaseUs += baseUs;
+			flow.shiftTotalUs += totalUs;
+			flow.shiftMinBaseUs = std::min(flow.shiftMinBaseUs, baseUs);
+		}
+		if (flow.samples == 0) {
+			flow.baseUs = baseUs;
+			flow.totalUs = totalUs;
+			flow.minBaseUs = baseUs;
+		}
+		// The round trip time has moved, so the samples from before are aged out.
+		else if (flow.shiftCount == RTT_SHIFT_SAMPLES) {
+			flow.baseUs = flow.shiftBaseUs / flow.shiftCount;
+			flow.totalUs = flow.shiftTotalUs / flow.shiftCount;
+			flow.minBaseUs = flow.shiftMinBaseUs;
+			flow.shiftCount = 0;
+			flow.shiftSide = 0;
+		}
+		else {
+			flow.baseUs += (baseUs - flow.baseUs) * RTT_SMOOTHING;
+			flow.totalUs += (totalUs - flow.totalUs) * RTT_SMOOTHING;
+			flow.minBaseUs = std::min(flow.minBaseUs, baseUs);
+		}
+		flow.samples += 1;
+		_sampleCount += 1;
+		if (_baseSamples.size() < RTT_REPORT_SAMPLES) {
+			_baseSamples.push_back(baseUs);
+			_totalSamples.push_back(totalUs);
+		}
+	}
+
+	// Reads the UDP key from a packet. Returns false if UDP isn't measured or the payload is too short.
+	bool _readUdpKey(const PACKET_HEADERS& headers, UINT64& key) const {
+		if (_udpKey.length == 0 || headers.transportLength < 8 + _udpKey.offset + _udpKey.length)
+			return false;
+		key = 0;
+		std::memcpy(&key, headers.transport + 8 + _udpKey.offset, _udpKey.length);
+		return true;
+	}
+
+	void _snifferLoop() {
+		PRINT_TRACE("RTT sniffer loop started...");
+		std::vector<BYTE> packet(WINDIVERT_MTU_MAX);
+		WINDIVERT_ADDRESS address;
+		UINT received;
+		while (_running) {
+			if (!_divert->Recv(packet.data(), (UINT)packet.size(), &received, &address)) {
+				DWORD error = GetLastError();
+				if (error == ERROR_NO_DATA || error == ERROR_INVALID_HANDLE || error == ERROR_OPERATION_ABORTED)
+					break;
+				continue;
+			}
+			TIME_DATA time;
+			if (!_divert->CaptureTime(address, time))
+				time = std::chrono::steady_clock::now();
+			if (!address.Outbound)
+				OnInbound(packet.data(), received, time);
+			// The delayer reports the packets it holds with the times it released them at.
+			else if (!_fedByDelayer && (_tracker == nullptr || _tracker->OwnsPacket(packet.data(), received)))
+				OnOutbound(packet.data(), received, time, time);
+		}
+		PRINT_INFO("The RTT sniffer thread is closing.");
+	}
+
+	void _loggingLoop() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(_stopMutex);
+				if (_stopped.wait_for(lock, std::chrono::seconds(1), [this]() { return !_running; }))
+					break;
+			}
+			std::vector<double> base;
+			std::vector<double> total;
+			UINT64 count;
+			size_t flows;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				base.swap(_baseSamples);
+				total.swap(_totalSamples);
+				count = _sampleCount;
+				_sampleCount = 0;
+				flows = 0;
+				for (const RTT_FLOW& flow : _flows)
+					flows += flow.used && flow.samples != 0 ? 1 : 0;
+			}
+			if (count == 0)
+				continue;
+			LATENCY_SUMMARY baseSummary = SummarizeMicroseconds(base);
+			LATENCY_SUMMARY totalSummary = SummarizeMicroseconds(total);
+			if (_fedByDelayer) {
+				PRINT_INFO(
+					"RTT of " << flows << " flows: base " << baseSummary.p50 / 1000 << " ms (p99 " << baseSummary.p99 / 1000
+					<< " ms), with the added latency " << totalSummary.p50 / 1000 << " ms (p99 " << totalSummary.p99 / 1000
+					<< " ms), from " << count << " samples."
+				);
+				// In target mode every flow has a latency of its own, so the busiest are listed.
+				if (_target.count() != 0) {
+					for (const RTT_FLOW& flow : _busiestFlows(RTT_TARGET_LOG_FLOWS))
+						PRINT_INFO("  " << _describe(flow));
+				}
+			}
+			else {
+				PRINT_INFO(
+					"RTT of " << flows << " flows: " << baseSummary.p50 / 1000 << " ms (p99 " << baseSummary.p99 / 1000
+					<< " ms), from " << count << " samples."
+				);
+			}
+		}
+	}
+
+	// Moves the delay of every measured flow towards the target minus its base round trip time and publishes the delays.
+	// A flow keeps its slot from one update to the next, so the packet path never misses it while the slots are written.
+	// A flow whose bucket is full keeps the latency.
+	void _updateTargets() {
+		double targetUs = (double)_target.count();
+		std::vector<UINT64> next(_targetWritten.size(), 0);
+		// The bucket and slot value of the flows that don't have a slot yet.
+		std::vector<std::pair<size_t, UINT64>> unplaced;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (RTT_FLOW& flow : _flows) {
+				if (!flow.used || flow.samples == 0)
+					continue;
+				double wanted = std::max(0.0, targetUs - flow.baseUs);
+				if (!flow.targeted) {
+					flow.targetDelayUs = wanted;
+					flow.targeted = true;
+				}
+				else if (std::abs(wanted - flow.targetDelayUs) > RTT_TARGET_DEADBAND_US)
+					flow.targetDelayUs += std::max<double>(-RTT_TARGET_STEP_US, wanted - flow.targetDelayUs);
+				UINT64 hash = _hash(flow.key);
+				UINT32 tag = _tag(hash);
+				size_t bucket = (size_t)(hash & (RTT_TARGET_BUCKETS - 1)) * RTT_TARGET_BUCKET_SLOTS;
+				UINT64 slot = (UINT64)tag << 32 | (UINT32)std::llround(flow.targetDelayUs);
+				bool placed = false;
+				for (size_t i = bucket; i < bucket + RTT_TARGET_BUCKET_SLOTS && !placed; ++i) {
+					if ((UINT32)(_targetWritten[i] >> 32) == tag) {
+						next[i] = slot;
+						placed = true;
+					}
+				}
+				if (!placed)
+					unplaced.emplace_back(bucket, slot);
+			}
+		}
+		for (const std::pair<size_t, UINT64>& flow : unplaced) {
+			for (size_t i = flow.first; i < flow.first + RTT_TARGET_BUCKET_SLOTS; ++i) {
+				if (next[i] == 0) {
+					next[i] = flow.second;
+					break;
+				}
+			}
+		}
+		for (size_t i = 0; i < next.size(); ++i) {
+			if (next[i] != _targetWritten[i])
+				_targetSlots[i].store(next[i], std::memory_order_relaxed);
+		}
+		_targetWritten.swap(next);
+	}
+
+	void _targetLoop() {
+		PRINT_TRACE("RTT target loop started...");
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(_stopMutex);
+				if (_stopped.wait_for(lock, std::chrono::milliseconds(RTT_TARGET_INTERVAL_MS), [this]() { return !_running; }))
+					break;
+			}
+			_updateTargets();
+		}
+	}
+
+	// Copies the measured flows, the ones with the most samples first.
+	std::vector<RTT_FLOW> _busiestFlows(size_t count) {
+		std::vector<RTT_FLOW> flows;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (const RTT_FLOW& flow : _flows) {
+				if (flow.used && flow.samples != 0)
+					flows.push_back(flow);
+			}
+		}
+		std::sort(flows.begin(), flows.end(), [](const RTT_FLOW& a, const RTT_FLOW& b) { return a.samples > b.samples; });
+		if (flows.size() > count)
+			flows.resize(count);
+		return flows;
+	}
+
+	// Describes a flow's ports and smoothed round trip times in milliseconds, and its delay in target mode.
+	std::string _describe(const RTT_FLOW& flow) const {
+		std::ostringstream row;
+		row << (flow.key.protocol == IP_PROTOCOL_TCP ? "TCP " : "UDP ") << flow.key.localPort << " -> " << flow.key.remotePort
+			<< std::fixed << std::setprecision(2) << ": base " << flow.baseUs / 1000 << " (min " << flow.minBaseUs / 1000
+			<< "), with the added latency " << flow.totalUs / 1000;
+		if (_target.count() != 0)
+			row << ", adding " << (flow.targeted ? flow.targetDelayUs : 0) / 1000;
+		row << ", " << flow.samples << " samples";
+		return row.str();
+	}
+
+public:
+	RttMonitor() : _flows(RTT_FLOW_CAPACITY + RTT_PROBE_LIMIT), _targetSlots(new std::atomic<UINT64>[RTT_TARGET_BUCKETS * RTT_TARGET_BUCKET_SLOTS]),
+		_targetWritten(RTT_TARGET_BUCKETS * RTT_TARGET_BUCKET_SLOTS, 0) {
+		_baseSamples.reserve(RTT_REPORT_SAMPLES);
+		_totalSamples.reserve(RTT_REPORT_SAMPLES);
+		for (size_t i = 0; i < _targetWritten.size(); ++i)
+			_targetSlots[i].store(0, std::memory_order_relaxed);
+	}
+
+	~RttMonitor() {
+		Stop();
+	}
+
+	RttMonitor(const RttMonitor&) = delete;
+	RttMonitor& operator=(const RttMonitor&) = delete;
+
+	// Measures UDP flows, pairing the requests and responses by the bytes at the key.
+	void SetUdpKey(const RTT_UDP_KEY& key) {
+		_udpKey = key;
+	}
+
+	// Sets the delay of every measured flow to the target minus its base round trip time, or stops if zero.
+	// Should be set before the monitor starts.
+	void SetTarget(std::chrono::microseconds target) {
+		_target = std::max(target, std::chrono::microseconds(0));
+	}
+
+	bool HasTarget() const {
+		return _target.count() != 0;
+	}
+
+	// Copies the packets from the given divert instead of WinDivert.
+	void SetDivert(PacketDivert* divert) {
+		_divert = divert != nullptr ? divert : &_winDivert;
+	}
+
+	// Only measures the flows of the tracked process.
+	void SetProcessTarget(ProcessTracker* tracker) {
+		_tracker = tracker;
+	}
+
+	// Set while the delayer reports the outbound packets, so the copies from the divert are left out.
+	void SetFedByDelayer(bool fed) {
+		_fedByDelayer = fed;
+	}
+
+	// Starts copying the packets that match the filter, and logging the round trip times every second.
+	bool Start(const std::string& filter) {
+		if (_running)
+			return true;
+		if (!_divert->Open(filter)) {
+			PRINT_ERROR("WinDivertOpen() failed for the RTT sniffer with error code " << GetLastError() << ".");
+			return false;
+		}
+		_running = true;
+		_snifferThread = std::thread(&RttMonitor::_snifferLoop, this);
+		_loggerThread = std::thread(&RttMonitor::_loggingLoop, this);
+		if (_target.count() != 0) {
+			_targetThread = std::thread(&RttMonitor::_targetLoop, this);
+			PRINT_INFO("Delaying every flow to a round trip time of " << _target.count() / 1000.0 << " ms once it is measured.");
+		}
+		PRINT_INFO("Measuring the round trip times of \"" << filter << "\".");
+		return true;
+	}
+
+	// Stops copying packets and lists the round trip times of the flows with the most samples.
+	void Stop() {
+		if (!_running)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(_stopMutex);
+			_running = false;
+		}
+		_stopped.notify_all();
+		_divert->Shutdown();
+		_snifferThread.join();
+		_loggerThread.join();
+		if (_targetThread.joinable())
+			_targetThread.join();
+		// The flows get the latency again until the next start.
+		for (size_t i = 0; i < _targetWritten.size(); ++i) {
+			_targetSlots[i].store(0, std::memory_order_relaxed);
+			_targetWritten[i] = 0;
+		}
+		_divert->Close();
+		PrintSummary();
+	}
+
+	// Handles a packet the application sent at the given time and the delayer released at the other.
+	void OnOutbound(const void* packet, UINT length, TIME_DATA sent, TIME_DATA released) {
+		PACKET_HEADERS headers;
+		RTT_FLOW_KEY key;
+		if (!ParsePacketHeaders((PVOID)packet, length, headers) || !_readKey(headers, true, key))
+			return;
+		INT64 sentTicks = sent.time_since_epoch().count();
+		INT64 releasedTicks = released.time_since_epoch().count();
+		UINT64 pendingKey;
+		if (headers.protocol == IP_PROTOCOL_TCP) {
+			if (headers.transportLength < 20)
+				return;
+			UINT headerLength = (headers.transport[TCP_DATA_OFFSET_OFFSET] >> 4) * 4;
+			BYTE flags = headers.transport[TCP_FLAGS_OFFSET];
+			UINT32 sequence = ReadNet32(headers.transport + TCP_SEQ_OFFSET);
+			// SYN and FIN take up a sequence number, so they are acknowledged like data.
+			UINT32 sequenceLength = (headers.transportLength > headerLength ? headers.transportLength - headerLength : 0)
+				+ ((flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) != 0 ? 1 : 0);
+			// A bare ACK isn't answered.
+			if (sequenceLength == 0)
+				return;
+			UINT32 end = sequence + sequenceLength;
+			std::lock_guard<std::mutex> lock(_mutex);
+			RTT_FLOW* flow = _find(key, releasedTicks, true);
+			flow->lastSeen = releasedTicks;
+			if (flow->sequenced && !_sequenceAfter(end, flow->highestSequence)) {
+				// A segment sent again makes the pending segments after it ambiguous, so they are forgotten.
+				_retransmits += 1;
+				while (flow->pendingCount != 0) {
+					const RTT_PENDING& last = flow->pending[(flow->pendingStart + flow->pendingCount - 1) % RTT_PENDING_MAX];
+					if (!_sequenceAfter((UINT32)last.key, sequence))
+						break;
+					flow->pendingCount -= 1;
+				}
+				return;
+			}
+			flow->sequenced = true;
+			flow->highestSequence = end;
+			_addPending(*flow, end, sentTicks, releasedTicks, false);
+		}
+		else if (_readUdpKey(headers, pendingKey)) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			RTT_FLOW* flow = _find(key, releasedTicks, true);
+			flow->lastSeen = releasedTicks;
+			_addPending(*flow, pendingKey, sentTicks, releasedTicks, true);
+		}
+	}
+
+	// Handles a packet received at the given time, which may answer a pending packet of its flow.
+	void OnInbound(const void* packet, UINT length, TIME_DATA received) {
+		PACKET_HEADERS headers;
+		RTT_FLOW_KEY key;
+		if (!ParsePacketHeaders((PVOID)packet, length, headers) || !_readKey(headers, false, key))
+			return;
+		INT64 receivedTicks = received.time_since_epoch().count();
+		if (headers.protocol == IP_PROTOCOL_TCP) {
+			if (headers.transportLength < 20 || (headers.transport[TCP_FLAGS_OFFSET] & TCP_FLAG_ACK) == 0)
+				return;
+			UINT32 acknowledged = ReadNet32(headers.transport + TCP_ACK_OFFSET);
+			std::lock_guard<std::mutex> lock(_mutex);
+			RTT_FLOW* flow = _find(key, receivedTicks, false);
+			if (flow == nullptr || flow->pendingCount == 0)
+				return;
+			flow->lastSeen = receivedTicks;
+			// An ACK acknowledges every segment up to it. The newest of them gives the sample,
+			// since the older ones may have waited for a delayed ACK.
+			bool answered = false;
+			RTT_PENDING newest;
+			while (flow->pendingCount != 0) {
+				const RTT_PENDING& oldest = flow->pending[flow->pendingStart];
+				if (_sequenceAfter((UINT32)oldest.key, acknowledged))
+					break;
+				newest = oldest;
+				answered = true;
+				flow->pendingStart = (UINT8)((flow->pendingStart + 1) % RTT_PENDING_MAX);
+				flow->pendingCount -= 1;
+			}
+			if (answered)
+				_sample(*flow, newest, receivedTicks);
+		}
+		else {
+			UINT64 pendingKey;
+			if (!_readUdpKey(headers, pendingKey))
+				return;
+			std::lock_guard<std::mutex> lock(_mutex);
+			RTT_FLOW* flow = _find(key, receivedTicks, false);
+			if (flow == nullptr)
+				return;
+			flow->lastSeen = receivedTicks;
+			for (UINT i = 0; i < flow->pendingCount; ++i) {
+				const RTT_PENDING& pending = flow->pending[(flow->pendingStart + i) % RTT_PENDING_MAX];
+				if (pending.key != pendingKey)
+					continue;
+				RTT_PENDING answered = pending;
+				_removePending(*flow, i);
+				_sample(*flow, answered, receivedTicks);
+				return;
+			}
+		}
+	}
+
+	// Gets the smoothed round trip times of a flow in microseconds. Returns false if it has no samples.
+	bool FlowRtt(const RTT_FLOW_KEY& key, double& baseUs, double& totalUs) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		RTT_FLOW* flow = _find(key, 0, false);
+		if (flow == nullptr || flow->samples == 0)
+			return false;
+		baseUs = flow->baseUs;
+		totalUs = flow->totalUs;
+		return true;
+	}
+
+	// Gets the delay that brings the flow of an outbound packet to the target round trip time, and the flow's hash.
+	// Returns false if the flow hasn't been measured yet. Doesn't lock, so the delayer calls it for every packet.
+	bool TargetDelay(const void* packet, UINT length, std::chrono::microseconds& delay, UINT64& flowHash) const {
+		PACKET_HEADERS headers;
+		return _target.count() != 0 && ParsePacketHeaders((PVOID)packet, length, headers) && TargetDelay(headers, delay, flowHash);
+	}
+
+	// Gets the target delay of an outbound packet whose headers the caller has parsed.
+	bool TargetDelay(const PACKET_HEADERS& headers, std::chrono::microseconds& delay, UINT64& flowHash) const {
+		RTT_FLOW_KEY key;
+		if (_target.count() == 0 || !_readKey(headers, true, key))
+			return false;
+		flowHash = _hash(key);
+		UINT32 tag = _tag(flowHash);
+		const std::atomic<UINT64>* bucket = &_targetSlots[(size_t)(flowHash & (RTT_TARGET_BUCKETS - 1)) * RTT_TARGET_BUCKET_SLOTS];
+		for (size_t i = 0; i < RTT_TARGET_BUCKET_SLOTS; ++i) {
+			UINT64 slot = bucket[i].load(std::memory_order_relaxed);
+			if ((UINT32)(slot >> 32) == tag) {
+				delay = std::chrono::microseconds((UINT32)slot);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Gets the delay of a flow in target mode in microseconds. Returns false if it has none yet.
+	bool FlowTargetDelay(const RTT_FLOW_KEY& key, double& delayUs) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		RTT_FLOW* flow = _find(key, 0, false);
+		if (flow == nullptr || !flow->targeted)
+			return false;
+		delayUs = flow->targetDelayUs;
+		return true;
+	}
+
+	UINT64 Retransmits() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _retransmits;
+	}
+
+	UINT64 Evictions() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _evictions;
+	}
+
+	// Lists the round trip times of the flows with the most samples.
+	void PrintSummary() {
+		std::vector<RTT_FLOW> flows = _busiestFlows(RTT_SUMMARY_FLOWS);
+		if (flows.empty()) {
+			PRINT_INFO("No round trip times were measured.");
+			return;
+		}
+		SYNC_COUT("Smoothed round trip times of the busiest flows (ms):");
+		for (const RTT_FLOW& flow : flows)
+			SYNC_COUT(_describe(flow));
+	}
+};
+
+// Feeds the monitor simulated TCP flows, each with its own base round trip time, through a delayer that adds the
+// given latency, and checks the round trip times it estimates. Runs once with fewer flows than the table holds and once
+// with more, so flows are evicted. Reports the cost of every packet and how far off the estimates were.
+// The traffic runs on a simulated clock as fast as it can be generated, so the packet rate is far above a real link's.
+inline void RunRttBenchmark(std::chrono::milliseconds addedLatency, std::chrono::seconds duration) {
+	const int minBaseMs = 5;
+	const int maxBaseMs = 150;
+	struct RUN {
+		UINT flows;
+		UINT measured;
+		UINT64 packets;
+		double nanosecondsPerPacket;
+		LATENCY_SUMMARY baseError;
+		LATENCY_SUMMARY totalError;
+		UINT64 evictions;
+	};
+	std::vector<RUN> runs;
+	std::chrono::seconds share = std::max<std::chrono::seconds>(std::chrono::seconds(1), duration / 2);
+	PRINT_INFO("Measuring the RTT monitor for " << share.count() * 2 << " s...");
+	for (UINT flowCount : { (UINT)(RTT_FLOW_CAPACITY / 4), (UINT)(RTT_FLOW_CAPACITY * 2) }) {
+		RttMonitor monitor;
+		std::mt19937_64 random(flowCount);
+		std::uniform_int_distribution<int> baseMs(minBaseMs, maxBaseMs);
+		// The ACKs arrive up to a millisecond late, like over a link with some jitter.
+		std::uniform_int_distribution<int> jitterUs(0, 999);
+		std::vector<int> bases(flowCount);
+		std::vector<UINT32> sequences(flowCount);
+		for (UINT i = 0; i < flowCount; ++i) {
+			bases[i] = baseMs(random);
+			sequences[i] = (UINT32)random();
+		}
+		// Every flow sends a 1000 byte segment every millisecond of simulated time to port 443, from its own port and address.
+		// The ACK comes back after the added latency and the flow's base round trip time.
+		WINDIVERT_ADDRESS address;
+		std::vector<BYTE> segment = MakeUdpPacket(20 + 20 + 1000, address);
+		std::vector<BYTE> ack = MakeUdpPacket(20 + 20, address);
+		for (std::vector<BYTE>* packet : { &segment, &ack }) {
+			std::memset(&(*packet)[IPV4_SRC_ADDR_OFFSET], 0, 8);
+			(*packet)[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_TCP;
+			(*packet)[20 + TCP_DATA_OFFSET_OFFSET] = 5 << 4;
+			(*packet)[20 + TCP_FLAGS_OFFSET] = TCP_FLAG_ACK;
+		}
+		WriteNet16(&segment[20 + DST_PORT_OFFSET], 443);
+		WriteNet16(&ack[20 + SRC_PORT_OFFSET], 443);
+		// The ACKs due at every millisecond, as the flow and the sequence number acknowledged, in a wheel that
+		// covers the longest round trip.
+		size_t wheelSize = (size_t)(addedLatency.count() + maxBaseMs + 1);
+		std::vector<std::vector<std::pair<UINT, UINT32>>> wheel(wheelSize);
+		TIME_DATA start = std::chrono::steady_clock::now();
+		UINT64 packets = 0;
+		auto benchmarkStart = std::chrono::steady_clock::now();
+		auto benchmarkEnd = benchmarkStart + share;
+		for (UINT64 step = 0; std::chrono::steady_clock::now() < benchmarkEnd; ++step) {
+			TIME_DATA now = start + std::chrono::milliseconds(step);
+			std::vector<std::pair<UINT, UINT32>>& due = wheel[step % wheelSize];
+			for (const std::pair<UINT, UINT32>& answer : due) {
+				WriteNet16(&ack[20 + DST_PORT_OFFSET], (UINT16)(answer.first % 60000 + 1024));
+				ack[IPV4_DST_ADDR_OFFSET + 3] = (BYTE)(answer.first / 60000 + 1);
+				WriteNet32(&ack[20 + TCP_ACK_OFFSET], answer.second);
+				monitor.OnInbound(ack.data(), (UINT)ack.size(), now + std::chrono::microseconds(jitterUs(random)));
+			}
+			packets += due.size();
+			due.clear();
+			for (UINT flow = 0; flow < flowCount; ++flow) {
+				WriteNet16(&segment[20 + SRC_PORT_OFFSET], (UINT16)(flow % 60000 + 1024));
+				segment[IPV4_SRC_ADDR_OFFSET + 3] = (BYTE)(flow / 60000 + 1);
+				WriteNet32(&segment[20 + TCP_SEQ_OFFSET], sequences[flow]);
+				sequences[flow] += 1000;
+				monitor.OnOutbound(segment.data(), (UINT)segment.size(), now, now + addedLatency);
+				wheel[(step + addedLatency.count() + bases[flow]) % wheelSize].emplace_back(flow, sequences[flow]);
+			}
+			packets += flowCount;
+		}
+		double elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - benchmarkStart).count();
+
+		// Compare the estimate of every flow that has one with its real round trip time.
+		std::vector<double> baseErrors;
+		std::vector<double> totalErrors;
+		for (UINT i = 0; i < flowCount; ++i) {
+			RTT_FLOW_KEY key;
+			std::memset(&key, 0, sizeof(key));
+			key.localAddress[3] = (BYTE)(i / 60000 + 1);
+			key.localPort = (UINT16)(i % 60000 + 1024);
+			key.remotePort = 443;
+			key.protocol = IP_PROTOCOL_TCP;
+			double baseUs;
+			double totalUs;
+			if (!monitor.FlowRtt(key, baseUs, totalUs))
+				continue;
+			// The mean jitter is part of the real round trip time.
+			double realUs = bases[i] * 1000.0 + 500;
+			baseErrors.push_back(std::abs(baseUs - realUs));
+			totalErrors.push_back(std::abs(totalUs - realUs - std::chrono::duration<double, std::micro>(addedLatency).count()));
+		}
+		RUN run;
+		run.flows = flowCount;
+		run.measured = (UINT)baseErrors.size();
+		run.packets = packets;
+		run.nanosecondsPerPacket = elapsedNs / std::max<UINT64>(packets, 1);
+		run.baseError = SummarizeMicroseconds(baseErrors);
+		run.totalError = SummarizeMicroseconds(totalErrors);
+		run.evictions = monitor.Evictions();
+		runs.push_back(run);
+	}
+	SYNC_COUT("Error of the smoothed per-flow round trip times, with " << addedLatency.count() << " ms of added latency:");
+	PrintSummaryHeader("us error");
+	for (RUN& run : runs) {
+		PrintSummaryRow(std::to_string(run.flows) + " flows, base", run.baseError);
+		PrintSummaryRow(std::to_string(run.flows) + " flows, with latency", run.totalError);
+	}
+	for (RUN& run : runs) {
+		std::ostringstream row;
+		row << run.flows << " flows: " << run.measured << " measured, " << std::fixed << std::setprecision(1)
+			<< run.nanosecondsPerPacket << " ns per packet over " << run.packets << " packets, "
+			<< run.evictions << " flows evicted from the table of " << RTT_FLOW_CAPACITY << ".";
+		SYNC_COUT(row.str());
+	}
+}
@@ -0,0 +1,559 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include "Platform.h"
+#include "PacketHeaders.h"
+#include "PacketRewrite.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// The amount of packet queues. Queue 0 is the default one, the others are only used by rules.
+#define RULE_QUEUE_COUNT 8
+
+// The field values of packets that don't have the field, e.g. the ports of an ICMP packet or the IPv4 address
+// of an IPv6 packet. They are outside of every range a rule can give, so only rules without the field match them.
+#define RULE_NO_PORT 0x10000ull
+#define RULE_NO_ADDRESS 0x100000000ull
+#define RULE_NO_TCP_FLAGS 0x100
+
+// The amount of intervals that may start in a /16 network before its addresses are looked up by their /24 network first.
+#define RULE_DENSE_NETWORK_INTERVALS 8
+
+// What is done to a packet that matches a rule.
+enum class RuleActionType {
+	// Delay the packet with the latency or the trace, like packets that don't match any rule.
+	Latency,
+	// Delay the packet by the rule's own delay.
+	Delay,
+	// Send the packet right away.
+	Bypass,
+	Drop
+};
+
+struct RULE_ACTION {
+	RuleActionType type = RuleActionType::Latency;
+	std::chrono::microseconds delay = std::chrono::microseconds(0);
+	// The queue the packet waits in. Packets only wait for the packets in front of them in the same queue.
+	UINT queue = 0;
+};
+
+// An inclusive range of field values.
+struct RULE_RANGE {
+	UINT64 min;
+	UINT64 max;
+};
+
+// The match fields of a rule, in the order they are compiled in.
+enum RuleField {
+	RuleSrcPort,
+	RuleDstPort,
+	RuleSrcAddr,
+	RuleDstAddr,
+	RuleSize,
+	RuleDscp,
+	RuleRangeFieldCount
+};
+
+// A packet matches a rule if every field is within the rule's range.
+struct PACKET_RULE {
+	// An IP protocol number, or -1 for any protocol.
+	int protocol = -1;
+	RULE_RANGE ranges[RuleRangeFieldCount] = {
+		{ 0, RULE_NO_PORT }, { 0, RULE_NO_PORT }, { 0, RULE_NO_ADDRESS }, { 0, RULE_NO_ADDRESS }, { 0, 0xFFFF }, { 0, 63 }
+	};
+	// The TCP flags in the mask must have the values in the value. Only TCP packets match a non-zero mask.
+	BYTE tcpFlagsMask = 0;
+	BYTE tcpFlagsValue = 0;
+	RULE_ACTION action;
+	// The rule as it was given.
+	std::string text;
+};
+
+// Gets the index of the lowest set bit of a non-zero number.
+inline UINT LowestSetBit(UINT64 value) {
+#ifdef _MSC_VER
+#ifdef _M_X64
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return index;
+#else
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long)value))
+		return index;
+	_BitScanForward(&index, (unsigned long)(value >> 32));
+	return index + 32;
+#endif
+#else
+	return (UINT)__builtin_ctzll(value);
+#endif
+}
+
+// Parses a number or an inclusive range of numbers, e.g. "80" or "27015-27030".
+inline bool ParseRuleRange(const std::string& text, UINT64 max, RULE_RANGE& range) {
+	size_t separator = text.find('-');
+	std::string first = text.substr(0, separator);
+	std::string last = separator == std::string::npos ? first : text.substr(separator + 1);
+	char* end;
+	range.min = std::strtoull(first.c_str(), &end, 10);
+	if (first.empty() || *end != '\0')
+		return false;
+	range.max = std::strtoull(last.c_str(), &end, 10);
+	if (last.empty() || *end != '\0')
+		return false;
+	return range.min <= range.max && range.max <= max;
+}
+
+// Parses an IPv4 address, a network like "10.0.0.0/8", or a range like "10.0.0.1-10.0.0.9" into host byte order.
+inline bool ParseRuleAddressRange(const std::string& text, RULE_RANGE& range) {
+	size_t slash = text.find('/');
+	size_t dash = text.find('-');
+	UINT32 first, last;
+	if (slash != std::string::npos) {
+		if (!ParseIPv4(text.substr(0, slash), first))
+			return false;
+		char* end;
+		long prefix = std::strtol(text.c_str() + slash + 1, &end, 10);
+		if (*end != '\0' || slash + 1 == text.size() || prefix < 0 || prefix > 32)
+			return false;
+		UINT64 start = ReadNet32((const BYTE*)&first);
+		UINT64 size = 1ull << (32 - prefix);
+		range.min = start & ~(size - 1);
+		range.max = range.min + size - 1;
+		return true;
+	}
+	if (!ParseIPv4(text.substr(0, dash), first))
+		return false;
+	last = first;
+	if (dash != std::string::npos && !ParseIPv4(text.substr(dash + 1), last))
+		return false;
+	range.min = ReadNet32((const BYTE*)&first);
+	range.max = ReadNet32((const BYTE*)&last);
+	return range.min <= range.max;
+}
+
+// Parses a rule made of comma or space separated terms. Returns false and sets the error if it is invalid.
+// The match terms are tcp, udp, icmp, proto=<number>, src-port=<range>, dst-port=<range>,
+// src-addr=<address range>, dst-addr=<address range>, size=<range>, dscp=<range>, and +<flag> or -<flag>
+// for a TCP flag (fin, syn, rst, psh, ack, urg) that must be set or unset.
+// The action terms are delay=<ms>, bypass, drop, and queue=<1-7>.
+inline bool ParseRule(const std::string& text, PACKET_RULE& rule, std::string& error) {
+	rule = PACKET_RULE();
+	rule.text = text;
+	std::string normalized = text;
+	std::replace(normalized.begin(), normalized.end(), ',', ' ');
+	std::istringstream terms(normalized);
+	std::string term;
+	bool hasAction = false;
+	while (terms >> term) {
+		size_t separator = term.find('=');
+		std::string key = term.substr(0, separator);
+		std::string value = separator == std::string::npos ? "" : term.substr(separator + 1);
+		bool valid = true;
+		if (key == "tcp" || key == "udp" || key == "icmp")
+			rule.protocol = key == "tcp" ? IP_PROTOCOL_TCP : key == "udp" ? IP_PROTOCOL_UDP : IP_PROTOCOL_ICMP;
+		else if (key == "proto") {
+			RULE_RANGE protocol;
+			valid = ParseRuleRange(value, 255, protocol) && protocol.min == protocol.max;
+			rule.protocol = (int)protocol.min;
+		}
+		else if (key == "src-port")
+			valid = ParseRuleRange(value, 0xFFFF, rule.ranges[RuleSrcPort]);
+		else if (key == "dst-port")
+			valid = ParseRuleRange(value, 0xFFFF, rule.ranges[RuleDstPort]);
+		else if (key == "src-addr")
+			valid = ParseRuleAddressRange(value, rule.ranges[RuleSrcAddr]);
+		else if (key == "dst-addr")
+			valid = ParseRuleAddressRange(value, rule.ranges[RuleDstAddr]);
+		else if (key == "size")
+			valid = ParseRuleRange(value, 0xFFFF, rule.ranges[RuleSize]);
+		else if (key == "dscp")
+			valid = ParseRuleRange(value, 63, rule.ranges[RuleDscp]);
+		else if ((key[0] == '+' || key[0] == '-') && separator == std::string::npos) {
+			static const char* flagNames[] = { "fin", "syn", "rst", "psh", "ack", "urg" };
+			std::string name = key.substr(1);
+			BYTE flag = 0;
+			for (int i = 0; i < 6; ++i) {
+				if (name == flagNames[i])
+					flag = (BYTE)(1 << i);
+			}
+			valid = flag != 0;
+			rule.tcpFlagsMask |= flag;
+			if (key[0] == '+')
+				rule.tcpFlagsValue |= flag;
+			else
+				rule.tcpFlagsValue &= (BYTE)~flag;
+		}
+		else if (key == "delay" || key == "bypass" || key == "drop") {
+			if (hasAction) {
+				error = "A rule can only have one of delay, bypass, and drop.";
+				return false;
+			}
+			hasAction = true;
+			if (key == "delay") {
+				RULE_RANGE delay;
+				valid = ParseRuleRange(value, 3600000, delay);
+				rule.action.type = RuleActionType::Delay;
+				rule.action.delay = std::chrono::milliseconds(delay.min);
+				valid = valid && delay.min == delay.max;
+			}
+			else {
+				valid = value.empty();
+				rule.action.type = key == "bypass" ? RuleActionType::Bypass : RuleActionType::Drop;
+			}
+		}
+		else if (key == "queue") {
+			RULE_RANGE queue;
+			valid = ParseRuleRange(value, RULE_QUEUE_COUNT - 1, queue) && queue.min == queue.max && queue.min > 0;
+			rule.action.queue = (UINT)queue.min;
+		}
+		else
+			valid = false;
+		if (!valid) {
+			error = "Invalid term \"" + term + "\".";
+			return false;
+		}
+	}
+	if (!hasAction && rule.action.queue == 0) {
+		error = "The rule has no action. Give it a delay, bypass, drop, or queue.";
+		return false;
+	}
+	if (rule.tcpFlagsMask != 0 && rule.protocol != -1 && rule.protocol != IP_PROTOCOL_TCP) {
+		error = "Only TCP packets have TCP flags.";
+		return false;
+	}
+	return true;
+}
+
+// The bitmaps of the rules each value of a field matches, one row per value or interval of values.
+// Each row also has a summary with a bit set for each of its words that isn't zero.
+struct RULE_BITMAPS {
+	std::vector<UINT64> bitmaps;
+	std::vector<UINT64> summaries;
+};
+
+// Matches packets against an ordered list of rules, where the first matching rule wins.
+// The rules are compiled into bitmaps per field value: each field's values are split into the intervals
+// no rule starts or ends in, and each interval gets a bitmap of the rules it matches. A packet is classified by
+// looking up the row of each of its fields and ANDing their bitmaps 64 rules at a time, stopping at the first
+// word with a bit set, whose lowest bit is the first matching rule. The summaries are ANDed first,
+// so only the words every field has some rule in are looked at. The fields most rules restrict are ANDed first,
+// and a word is left as soon as it has no bit left.
+class RuleEngine {
+private:
+	std::vector<PACKET_RULE> _rules;
+	// The amount of 64-bit words in a bitmap and in a summary.
+	size_t _words;
+	size_t _summaryWords;
+
+	// The start of each interval of the range fields.
+	std::vector<UINT64> _starts[RuleRangeFieldCount];
+	// The interval of every value of the port, size, and DSCP fields, which are small enough to index directly,
+	// and of the first address of every /16 network. An address is then only searched for among the few intervals
+	// that start within its network.
+	// Empty if there are too many intervals to fit the table entries, in which case the starts are searched.
+	std::vector<UINT16> _rowOfValue[RuleRangeFieldCount];
+	// The interval of the first address of every /24 network in the /16 networks more than
+	// RULE_DENSE_NETWORK_INTERVALS intervals start in, 256 entries for each of them, and the block of
+	// every /16 network plus one, or 0 if its intervals are searched right away.
+	std::vector<UINT16> _rowOfSubnet[RuleRangeFieldCount];
+	std::vector<UINT16> _subnetBlock[RuleRangeFieldCount];
+	// The bitmaps of the range fields' intervals, every protocol number,
+	// and every TCP flags byte with RULE_NO_TCP_FLAGS for packets other than TCP.
+	RULE_BITMAPS _bitmaps[RuleRangeFieldCount + 2];
+
+	static const int _protocolField = RuleRangeFieldCount;
+	static const int _tcpFlagsField = RuleRangeFieldCount + 1;
+	static const int _fieldCount = RuleRangeFieldCount + 2;
+	// The fields in the order they are ANDed, the ones the most rules restrict first.
+	int _fieldOrder[_fieldCount];
+
+	void _setBit(int field, size_t row, size_t rule) {
+		_bitmaps[field].bitmaps[row * _words + rule / 64] |= 1ull << (rule % 64);
+	}
+
+	void _allocate(int field, size_t rows) {
+		_bitmaps[field].bitmaps.assign(rows * _words, 0);
+		_bitmaps[field].summaries.assign(rows * _summaryWords, 0);
+	}
+
+	void _summarize(int field) {
+		RULE_BITMAPS& table = _bitmaps[field];
+		for (size_t word = 0; word < table.bitmaps.size(); ++word) {
+			if (table.bitmaps[word] != 0) {
+				size_t row = word / _words;
+				size_t column = word % _words;
+				table.summaries[row * _summaryWords + column / 64] |= 1ull << (column % 64);
+			}
+		}
+	}
+
+	void _compileRange(int field) {
+		std::vector<UINT64>& starts = _starts[field];
+		starts.assign(1, 0);
+		for (const PACKET_RULE& rule : _rules) {
+			starts.push_back(rule.ranges[field].min);
+			starts.push_back(rule.ranges[field].max + 1);
+		}
+		std::sort(starts.begin(), starts.end());
+		starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+		_allocate(field, starts.size());
+		for (size_t i = 0; i < _rules.size(); ++i) {
+			const RULE_RANGE& range = _rules[i].ranges[field];
+			size_t first = std::lower_bound(starts.begin(), starts.end(), range.min) - starts.begin();
+			for (size_t row = first; row < starts.size() && starts[row] <= range.max; ++row)
+				_setBit(field, row, i);
+		}
+		_rowOfValue[field].clear();
+		_rowOfSubnet[field].clear();
+		_subnetBlock[field].clear();
+		if (starts.size() <= 0x10000) {
+			UINT shift = _valueShift(field);
+			_appendRows(starts, 0, field == RuleDscp ? 64 : shift != 0 ? (size_t)(RULE_NO_ADDRESS >> shift) + 1 : RULE_NO_PORT + 1,
+				shift, _rowOfValue[field]);
+			if (shift != 0) {
+				const std::vector<UINT16>& rows = _rowOfValue[field];
+				_subnetBlock[field].assign(rows.size() - 1, 0);
+				for (size_t network = 0; network + 1 < rows.size(); ++network) {
+					if (rows[network + 1] - rows[network] > RULE_DENSE_NETWORK_INTERVALS) {
+						_appendRows(starts, (UINT64)network << 16, 256, 8, _rowOfSubnet[field]);
+						_subnetBlock[field][network] = (UINT16)(_rowOfSubnet[field].size() / 256);
+					}
+				}
+			}
+		}
+	}
+
+	// Appends the interval of the given amount of values, each shift bits apart from the first one.
+	static void _appendRows(const std::vector<UINT64>& starts, UINT64 first, size_t count, UINT shift, std::vector<UINT16>& rows) {
+		size_t row = _lastStartAtOrBefore(starts, 0, starts.size() - 1, first);
+		for (size_t index = 0; index < count; ++index) {
+			UINT64 value = first + ((UINT64)index << shift);
+			while (row + 1 < starts.size() && starts[row + 1] <= value)
+				row += 1;
+			rows.push_back((UINT16)row);
+		}
+	}
+
+	// Gets how far a value of the field is shifted right to index the table of its intervals.
+	static UINT _valueShift(int field) {
+		return field == RuleSrcAddr || field == RuleDstAddr ? 16 : 0;
+	}
+
+	// Gets the last of the starts from the first to the last index that isn't after the value. The first one mustn't be.
+	// The search picks the half with a conditional move instead of a branch, which the CPU can't predict for packets
+	// from many addresses.
+	static size_t _lastStartAtOrBefore(const std::vector<UINT64>& starts, size_t first, size_t last, UINT64 value) {
+		const UINT64* base = starts.data() + first;
+		size_t count = last - first + 1;
+		while (count > 1) {
+			size_t half = count / 2;
+			base = base[half] <= value ? base + half : base;
+			count -= half;
+		}
+		return base - starts.data();
+	}
+
+	size_t _findRow(int field, UINT64 value) const {
+		const std::vector<UINT64>& starts = _starts[field];
+		const std::vector<UINT16>& rows = _rowOfValue[field];
+		if (rows.empty())
+			return _lastStartAtOrBefore(starts, 0, starts.size() - 1, value);
+		UINT shift = _valueShift(field);
+		size_t index = (size_t)(value >> shift);
+		if (shift == 0 || index + 1 == rows.size())
+			return rows[index];
+		// The value is in the interval of the first value of its network or in one that starts after it within the network.
+		size_t first = rows[index];
+		size_t last = rows[index + 1];
+		UINT16 block = _subnetBlock[field][index];
+		if (block != 0) {
+			const UINT16* subnetRows = _rowOfSubnet[field].data() + (block - 1) * 256;
+			size_t subnet = (size_t)(value >> 8) & 0xFF;
+			first = subnetRows[subnet];
+			if (subnet != 0xFF)
+				last = subnetRows[subnet + 1];
+		}
+		return _lastStartAtOrBefore(starts, first, last, value);
+	}
+
+public:
+	RuleEngine() : _words(0), _summaryWords(0) {
+		for (int field = 0; field < _fieldCount; ++field)
+			_fieldOrder[field] = field;
+	}
+
+	void AddRule(const PACKET_RULE& rule) {
+		_rules.push_back(rule);
+	}
+
+	bool IsEmpty() const {
+		return _rules.empty();
+	}
+
+	const std::vector<PACKET_RULE>& Rules() const {
+		return _rules;
+	}
+
+	// Reads the rules from a file with a rule on each line. Empty lines and lines starting with # are skipped.
+	bool LoadFile(const std::string& path, std::string& error) {
+		std::ifstream file(path);
+		if (!file) {
+			error = "Could not open \"" + path + "\".";
+			return false;
+		}
+		std::string line;
+		size_t lineNumber = 0;
+		while (std::getline(file, line)) {
+			lineNumber += 1;
+			size_t start = line.find_first_not_of(" \t\r");
+			if (start == std::string::npos || line[start] == '#')
+				continue;
+			PACKET_RULE rule;
+			std::string ruleError;
+			if (!ParseRule(line.substr(start, line.find_last_not_of(" \t\r") - start + 1), rule, ruleError)) {
+				error = path + ":" + std::to_string(lineNumber) + ": " + ruleError;
+				return false;
+			}
+			AddRule(rule);
+		}
+		return true;
+	}
+
+	// Builds the bitmaps. Has to be called after the rules are added and before packets are classified.
+	void Compile() {
+		_words = (_rules.size() + 63) / 64;
+		_summaryWords = (_words + 63) / 64;
+		for (int field = 0; field < RuleRangeFieldCount; ++field)
+			_compileRange(field);
+		_allocate(_protocolField, 256);
+		_allocate(_tcpFlagsField, RULE_NO_TCP_FLAGS + 1);
+		for (size_t i = 0; i < _rules.size(); ++i) {
+			const PACKET_RULE& rule = _rules[i];
+			for (int protocol = 0; protocol < 256; ++protocol) {
+				if (rule.protocol == -1 || rule.protocol == protocol)
+					_setBit(_protocolField, protocol, i);
+			}
+			for (int flags = 0; flags < RULE_NO_TCP_FLAGS; ++flags) {
+				if ((flags & rule.tcpFlagsMask) == rule.tcpFlagsValue)
+					_setBit(_tcpFlagsField, flags, i);
+			}
+			if (rule.tcpFlagsMask == 0)
+				_setBit(_tcpFlagsField, RULE_NO_TCP_FLAGS, i);
+		}
+		for (int field = 0; field < _fieldCount; ++field)
+			_summarize(field);
+		// A field that few rules restrict has most bits set in every row, so ANDing it first rarely rules out a word.
+		size_t restricting[_fieldCount] = {};
+		const PACKET_RULE defaults;
+		for (const PACKET_RULE& rule : _rules) {
+			for (int field = 0; field < RuleRangeFieldCount; ++field) {
+				if (rule.ranges[field].min != defaults.ranges[field].min || rule.ranges[field].max != defaults.ranges[field].max)
+					restricting[field] += 1;
+			}
+			if (rule.protocol != -1)
+				restricting[_protocolField] += 1;
+			if (rule.tcpFlagsMask != 0)
+				restricting[_tcpFlagsField] += 1;
+		}
+		for (int field = 0; field < _fieldCount; ++field)
+			_fieldOrder[field] = field;
+		std::stable_sort(_fieldOrder, _fieldOrder + _fieldCount, [&](int a, int b) {
+			return restricting[a] > restricting[b];
+		});
+	}
+
+	// Gets the index of the first rule the packet matches, or -1 if it matches none.
+	int Match(const void* packet, UINT length) const {
+		if (_words == 0)
+			return -1;
+		PACKET_HEADERS headers;
+		if (!ParsePacketHeaders((PVOID)packet, length, headers))
+			return -1;
+		return Match(headers, length);
+	}
+
+	// Gets the index of the first rule a packet of the given length matches from its parsed headers,
+	// so a caller that has already parsed them doesn't parse them again.
+	int Match(const PACKET_HEADERS& headers, UINT length) const {
+		if (_words == 0)
+			return -1;
+		size_t rows[_fieldCount];
+		rows[RuleSrcPort] = _findRow(RuleSrcPort, headers.transport != nullptr ? ReadNet16(headers.transport + SRC_PORT_OFFSET) : RULE_NO_PORT);
+		rows[RuleDstPort] = _findRow(RuleDstPort, headers.transport != nullptr ? ReadNet16(headers.transport + DST_PORT_OFFSET) : RULE_NO_PORT);
+		rows[RuleSrcAddr] = _findRow(RuleSrcAddr, headers.ipv6 ? RULE_NO_ADDRESS : ReadNet32(headers.ip + IPV4_SRC_ADDR_OFFSET));
+		rows[RuleDstAddr] = _findRow(RuleDstAddr, headers.ipv6 ? RULE_NO_ADDRESS : ReadNet32(headers.ip + IPV4_DST_ADDR_OFFSET));
+		rows[RuleSize] = _findRow(RuleSize, length);
+		rows[RuleDscp] = _findRow(RuleDscp, PacketDscp(headers));
+		rows[_protocolField] = headers.protocol;
+		rows[_tcpFlagsField] = headers.transport != nullptr && headers.protocol == IP_PROTOCOL_TCP
+			? headers.transport[TCP_FLAGS_OFFSET] : RULE_NO_TCP_FLAGS;
+		// The rows' bitmaps and summaries in the order the fields are ANDed.
+		const UINT64* bitmaps[_fieldCount];
+		const UINT64* summaries[_fieldCount];
+		for (int i = 0; i < _fieldCount; ++i) {
+			int field = _fieldOrder[i];
+			bitmaps[i] = _bitmaps[field].bitmaps.data() + rows[field] * _words;
+			summaries[i] = _bitmaps[field].summaries.data() + rows[field] * _summaryWords;
+		}
+		for (size_t summaryWord = 0; summaryWord < _summaryWords; ++summaryWord) {
+			UINT64 candidates = summaries[0][summaryWord];
+			for (int i = 1; i < _fieldCount && candidates != 0; ++i)
+				candidates &= summaries[i][summaryWord];
+			while (candidates != 0) {
+				size_t word = summaryWord * 64 + LowestSetBit(candidates);
+				UINT64 matches = bitmaps[0][word];
+				for (int i = 1; i < _fieldCount && matches != 0; ++i)
+					matches &= bitmaps[i][word];
+				if (matches != 0)
+					return (int)(word * 64 + LowestSetBit(matches));
+				candidates &= candidates - 1;
+			}
+		}
+		return -1;
+	}
+
+	// Gets the action of the first rule the packet matches, or null if it matches none.
+	const RULE_ACTION* Classify(const void* packet, UINT length) const {
+		int rule = Match(packet, length);
+		return rule < 0 ? nullptr : &_rules[rule].action;
+	}
+
+	// Gets the action of the first rule a parsed packet matches, or null if it matches none.
+	const RULE_ACTION* Classify(const PACKET_HEADERS& headers, UINT length) const {
+		int rule = Match(headers, length);
+		return rule < 0 ? nullptr : &_rules[rule].action;
+	}
+
+	// Finds the first matching rule by checking the rules one at a time. Gives the same result as Match().
+	int MatchLinear(const void* packet, UINT length) const {
+		PACKET_HEADERS headers;
+		if (!ParsePacketHeaders((PVOID)packet, length, headers))
+			return -1;
+		UINT64 srcPort = headers.transport != nullptr ? ReadNet16(headers.transport + SRC_PORT_OFFSET) : RULE_NO_PORT;
+		UINT64 dstPort = headers.transport != nullptr ? ReadNet16(headers.transport + DST_PORT_OFFSET) : RULE_NO_PORT;
+		UINT64 srcAddr = headers.ipv6 ? RULE_NO_ADDRESS : ReadNet32(headers.ip + IPV4_SRC_ADDR_OFFSET);
+		UINT64 dstAddr = headers.ipv6 ? RULE_NO_ADDRESS : ReadNet32(headers.ip + IPV4_DST_ADDR_OFFSET);
+		UINT64 dscp = PacketDscp(headers);
+		bool tcp = headers.transport != nullptr && headers.protocol == IP_PROTOCOL_TCP;
+		BYTE tcpFlags = tcp ? headers.transport[TCP_FLAGS_OFFSET] : 0;
+		for (size_t i = 0; i < _rules.size(); ++i) {
+			const PACKET_RULE& rule = _rules[i];
+			auto within = [&](int field, UINT64 value) {
+				return rule.ranges[field].min <= value && value <= rule.ranges[field].max;
+			};
+			if ((rule.protocol == -1 || rule.protocol == headers.protocol)
+				&& within(RuleSrcPort, srcPort) && within(RuleDstPort, dstPort)
+				&& within(RuleSrcAddr, srcAddr) && within(RuleDstAddr, dstAddr) && within(RuleSize, length) && within(RuleDscp, dscp)
+				&& (rule.tcpFlagsMask == 0 || (tcp && (tcpFlags & rule.tcpFlagsMask) == rule.tcpFlagsValue)))
+				return (int)i;
+		}
+		return -1;
+	}
+};
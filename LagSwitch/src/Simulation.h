@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include "Platform.h"
+#include "Logging.h"
+#include "Clock.h"
+#include "Benchmarks.h"
+
+// The release lateness histogram has a bucket for every microsecond up to this, later releases share the last bucket.
+// Releases ahead of their send time, which the hold time compensation makes, are counted on their own and as on time in it.
+#define SIMULATION_HISTOGRAM_US 1000000
+
+// Collects the release times of a simulation run.
+// The lateness of each release, how long after its send time the packet went out, is kept in a histogram
+// so runs of any length take the same amount of memory. Every release can also be written to a CSV file
+// with exact nanosecond times relative to the start of the run, for comparing runs against each other.
+class SimulationRecorder {
+private:
+	TIME_DATA _start;
+	std::ofstream _csv;
+	std::vector<UINT64> _latenessHistogram;
+	UINT64 _released;
+	UINT64 _early;
+	double _earliestUs;
+	double _latenessSumUs;
+	double _latenessMaxUs;
+	double _holdSumUs;
+	double _holdMaxUs;
+
+	static long long _sinceNs(TIME_DATA start, TIME_DATA time) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time - start).count();
+	}
+
+	// Gets the lateness below which the given fraction of the releases were.
+	double _latenessPercentileUs(double fraction) const {
+		UINT64 target = (UINT64)(_released * fraction);
+		UINT64 seen = 0;
+		for (size_t i = 0; i < _latenessHistogram.size(); ++i) {
+			seen += _latenessHistogram[i];
+			if (seen > target)
+				return (double)i;
+		}
+		return (double)(_latenessHistogram.size() - 1);
+	}
+
+public:
+	SimulationRecorder() : _latenessHistogram(SIMULATION_HISTOGRAM_US + 1, 0) {
+		Start(TIME_DATA());
+	}
+
+	// Writes every release to the given CSV file. Returns false if it couldn't be opened.
+	bool OpenCsv(const std::string& path) {
+		_csv.open(path, std::ios::out | std::ios::trunc);
+		if (!_csv) {
+			PRINT_ERROR("Could not open \"" << path << "\" for writing.");
+			return false;
+		}
+		_csv << "received_ns,send_ns,released_ns\n";
+		return true;
+	}
+
+	// Clears the recorded releases. The CSV times are relative to the given start time.
+	void Start(TIME_DATA start) {
+		_start = start;
+		std::fill(_latenessHistogram.begin(), _latenessHistogram.end(), 0);
+		_released = 0;
+		_early = 0;
+		_earliestUs = 0;
+		_latenessSumUs = 0;
+		_latenessMaxUs = 0;
+		_holdSumUs = 0;
+		_holdMaxUs = 0;
+	}
+
+	void Record(TIME_DATA received, TIME_DATA send, TIME_DATA released) {
+		double latenessUs = std::chrono::duration<double, std::micro>(released - send).count();
+		double holdUs = std::chrono::duration<double, std::micro>(released - received).count();
+		if (latenessUs < 0) {
+			_early += 1;
+			_earliestUs = std::min(_earliestUs, latenessUs);
+			_latenessHistogram[0] += 1;
+		}
+		else
+			_latenessHistogram[(size_t)std::min(latenessUs, (double)SIMULATION_HISTOGRAM_US)] += 1;
+		_released += 1;
+		_latenessSumUs += latenessUs;
+		_latenessMaxUs = _released == 1 ? latenessUs : std::max(_latenessMaxUs, latenessUs);
+		_holdSumUs += holdUs;
+		_holdMaxUs = std::max(_holdMaxUs, holdUs);
+		if (_csv.is_open())
+			_csv << _sinceNs(_start, received) << ',' << _sinceNs(_start, send) << ',' << _sinceNs(_start, released) << '\n';
+	}
+
+	UINT64 Released() const {
+		return _released;
+	}
+
+	void PrintSummary() const {
+		LATENCY_SUMMARY lateness;
+		lateness.count = (size_t)_released;
+		if (_released > 0) {
+			lateness.mean = _latenessSumUs / _released;
+			lateness.p50 = _latenessPercentileUs(0.5);
+			lateness.p99 = _latenessPercentileUs(0.99);
+			lateness.max = _latenessMaxUs;
+		}
+		PrintSummaryHeader("us");
+		PrintSummaryRow("Release lateness", lateness);
+		if (_early > 0)
+			PRINT_INFO(_early << " packets were released early, the earliest " << -_earliestUs / 1000 << " ms before its send time.");
+		if (_released > 0)
+			PRINT_INFO("Mean hold time " << _holdSumUs / _released / 1000 << " ms, longest " << _holdMaxUs / 1000 << " ms.");
+	}
+};
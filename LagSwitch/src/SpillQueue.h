@@ -0,0 +1,316 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include "Platform.h"
+#include "Logging.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// The size of a spill segment file. Only the segments being written and read are mapped,
+// so this bounds the memory spilling takes no matter how much is spilled.
+#define SPILL_SEGMENT_BYTES (64 * 1024 * 1024)
+// The records are aligned to this many bytes.
+#define SPILL_RECORD_ALIGNMENT 8
+
+// The header of a spilled packet. The packet data follows it.
+struct SPILL_RECORD {
+	// The receive and send times as steady clock ticks.
+	INT64 received;
+	INT64 send;
+	UINT32 length;
+	UINT32 reserved;
+	WINDIVERT_ADDRESS address;
+};
+
+// A temporary file the spilled packets are appended to. The file is deleted when it is closed.
+// A segment can also be allocated in memory, in which case it is always mapped.
+class SpillSegment {
+private:
+	bool _inMemory;
+#ifdef _WIN32
+	HANDLE _file;
+	HANDLE _mapping;
+#else
+	int _file;
+#endif
+	BYTE* _view;
+	UINT64 _size;
+
+public:
+	// The offsets the next record is written to and read from.
+	UINT64 writeOffset;
+	UINT64 readOffset;
+
+	SpillSegment() {
+		_inMemory = false;
+#ifdef _WIN32
+		_file = INVALID_HANDLE_VALUE;
+		_mapping = NULL;
+#else
+		_file = -1;
+#endif
+		_view = nullptr;
+		_size = 0;
+		writeOffset = 0;
+		readOffset = 0;
+	}
+
+	~SpillSegment() {
+		Close();
+	}
+
+	SpillSegment(const SpillSegment&) = delete;
+	SpillSegment& operator=(const SpillSegment&) = delete;
+
+	// Creates the file with the given size and maps it.
+	bool Open(const std::string& path, UINT64 size) {
+		_size = size;
+#ifdef _WIN32
+		_file = CreateFileA(
+			path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL
+		);
+		if (_file == INVALID_HANDLE_VALUE) {
+			PRINT_ERROR("CreateFileA() failed for the spill file \"" << path << "\" with error code " << GetLastError() << ".");
+			return false;
+		}
+		_mapping = CreateFileMappingA(_file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+		if (_mapping == NULL) {
+			PRINT_ERROR("CreateFileMappingA() failed for the spill file with error code " << GetLastError() << ".");
+			Close();
+			return false;
+		}
+#else
+		_file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (_file < 0) {
+			PRINT_ERROR("open() failed for the spill file \"" << path << "\" with error code " << errno << ".");
+			return false;
+		}
+		// The file is only reached through the descriptor, so it disappears when that is closed.
+		unlink(path.c_str());
+		if (ftruncate(_file, (off_t)size) != 0) {
+			PRINT_ERROR("ftruncate() failed for the spill file with error code " << errno << ".");
+			Close();
+			return false;
+		}
+#endif
+		return Map();
+	}
+
+	// Allocates the segment in memory instead of a file.
+	bool OpenMemory(UINT64 size) {
+		_size = size;
+		_inMemory = true;
+#ifdef _WIN32
+		_view = (BYTE*)VirtualAlloc(NULL, (SIZE_T)size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (_view == nullptr) {
+			PRINT_ERROR("VirtualAlloc() failed for a packet segment with error code " << GetLastError() << ".");
+			return false;
+		}
+#else
+		void* view = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (view == MAP_FAILED) {
+			PRINT_ERROR("mmap() failed for a packet segment with error code " << errno << ".");
+			return false;
+		}
+		_view = (BYTE*)view;
+#endif
+		return true;
+	}
+
+	// Maps the file into memory if it isn't already.
+	bool Map() {
+		if (_view != nullptr)
+			return true;
+#ifdef _WIN32
+		_view = (BYTE*)MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		if (_view == nullptr) {
+			PRINT_ERROR("MapViewOfFile() failed for the spill file with error code " << GetLastError() << ".");
+			return false;
+		}
+#else
+		void* view = mmap(nullptr, (size_t)_size, PROT_READ | PROT_WRITE, MAP_SHARED, _file, 0);
+		if (view == MAP_FAILED) {
+			PRINT_ERROR("mmap() failed for the spill file with error code " << errno << ".");
+			return false;
+		}
+		_view = (BYTE*)view;
+		// The file is written and read front to back.
+		madvise(_view, (size_t)_size, MADV_SEQUENTIAL);
+#endif
+		return true;
+	}
+
+	// Unmaps the file so its pages don't take up memory while it is neither written nor read.
+	void Unmap() {
+		if (_view == nullptr || _inMemory)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(_view);
+#else
+		munmap(_view, (size_t)_size);
+#endif
+		_view = nullptr;
+	}
+
+	void Close() {
+		if (_inMemory && _view != nullptr) {
+#ifdef _WIN32
+			VirtualFree(_view, 0, MEM_RELEASE);
+#else
+			munmap(_view, (size_t)_size);
+#endif
+			_view = nullptr;
+		}
+		Unmap();
+#ifdef _WIN32
+		if (_mapping != NULL)
+			CloseHandle(_mapping);
+		if (_file != INVALID_HANDLE_VALUE)
+			CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+		_mapping = NULL;
+#else
+		if (_file >= 0)
+			close(_file);
+		_file = -1;
+#endif
+	}
+
+	// Gets a pointer into the mapped file. The file must be mapped.
+	BYTE* At(UINT64 offset) {
+		return _view + offset;
+	}
+
+	UINT64 Size() const {
+		return _size;
+	}
+};
+
+// The disk tier of the packet queue. Packets are appended to memory-mapped segment files in arrival order
+// and read back in the same order, so both the writes and the reads are sequential.
+// Segments are deleted once read, except for the last one, which is reused when the queue empties.
+// The queue can also keep its segments in memory, which stores many packets without an allocation for each.
+// Not thread-safe, the delayer calls it with the packet mutex locked.
+class SpillQueue {
+private:
+	std::string _directory;
+	bool _inMemory;
+	UINT64 _segmentBytes;
+	std::deque<std::unique_ptr<SpillSegment>> _segments;
+	size_t _count;
+	UINT64 _bytes;
+	UINT64 _nextSegment;
+
+	static UINT64 _recordSize(UINT length) {
+		UINT64 size = sizeof(SPILL_RECORD) + length;
+		return (size + SPILL_RECORD_ALIGNMENT - 1) / SPILL_RECORD_ALIGNMENT * SPILL_RECORD_ALIGNMENT;
+	}
+
+	std::string _segmentPath() {
+#ifdef _WIN32
+		unsigned long processId = GetCurrentProcessId();
+#else
+		unsigned long processId = (unsigned long)getpid();
+#endif
+		std::string directory = _directory.empty() ? "." : _directory;
+		return directory + "/lagswitch-spill-" + std::to_string(processId) + "-" + std::to_string(_nextSegment++) + ".tmp";
+	}
+
+public:
+	SpillQueue() : _inMemory(false), _segmentBytes(SPILL_SEGMENT_BYTES), _count(0), _bytes(0), _nextSegment(0) {}
+
+	// Creates a queue that keeps its segments of the given size in memory.
+	explicit SpillQueue(UINT64 segmentBytes) : _inMemory(true), _segmentBytes(segmentBytes), _count(0), _bytes(0), _nextSegment(0) {}
+
+	// Sets the directory the segment files are created in. Defaults to the working directory.
+	void SetDirectory(const std::string& directory) {
+		_directory = directory;
+	}
+
+	bool IsEmpty() const {
+		return _count == 0;
+	}
+
+	size_t Count() const {
+		return _count;
+	}
+
+	// The amount of packet bytes spilled and not yet read back.
+	UINT64 Bytes() const {
+		return _bytes;
+	}
+
+	// Appends a packet. Returns false if it couldn't be written, in which case nothing was spilled.
+	bool Push(const void* packet, UINT length, const WINDIVERT_ADDRESS* address, INT64 received, INT64 send) {
+		UINT64 size = _recordSize(length);
+		if (_segments.empty() || _segments.back()->writeOffset + size > _segments.back()->Size()) {
+			std::unique_ptr<SpillSegment> segment(new SpillSegment());
+			UINT64 segmentSize = std::max<UINT64>(_segmentBytes, size);
+			if (_inMemory ? !segment->OpenMemory(segmentSize) : !segment->Open(_segmentPath(), segmentSize))
+				return false;
+			// The previous segment is no longer written to. Unmap it unless it is being read.
+			if (_segments.size() > 1)
+				_segments.back()->Unmap();
+			_segments.push_back(std::move(segment));
+		}
+		SpillSegment& segment = *_segments.back();
+		SPILL_RECORD* record = (SPILL_RECORD*)segment.At(segment.writeOffset);
+		record->received = received;
+		record->send = send;
+		record->length = length;
+		record->reserved = 0;
+		if (address != nullptr)
+			record->address = *address;
+		else
+			std::memset(&record->address, 0, sizeof(record->address));
+		if (length > 0)
+			std::memcpy(record + 1, packet, length);
+		segment.writeOffset += size;
+		_count += 1;
+		_bytes += length;
+		return true;
+	}
+
+	// Gets the oldest spilled packet, followed by its data. The queue must not be empty.
+	// The pointer stays valid until the next Push or Pop. Returns null if the segment couldn't be mapped.
+	const SPILL_RECORD* Front() {
+		SpillSegment& segment = *_segments.front();
+		if (!segment.Map())
+			return nullptr;
+		return (const SPILL_RECORD*)segment.At(segment.readOffset);
+	}
+
+	// Removes the oldest spilled packet.
+	void Pop() {
+		SpillSegment& segment = *_segments.front();
+		const SPILL_RECORD* record = (const SPILL_RECORD*)segment.At(segment.readOffset);
+		_bytes -= record->length;
+		segment.readOffset += _recordSize(record->length);
+		_count -= 1;
+		if (segment.readOffset < segment.writeOffset)
+			return;
+		// The segment has been read. The last one is kept for the next packets, the rest are deleted.
+		if (_segments.size() == 1) {
+			segment.readOffset = 0;
+			segment.writeOffset = 0;
+		}
+		else
+			_segments.pop_front();
+	}
+
+	// Deletes every spilled packet and segment.
+	void Clear() {
+		_segments.clear();
+		_count = 0;
+		_bytes = 0;
+	}
+};
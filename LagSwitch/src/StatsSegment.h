@@ -0,0 +1,441 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "Platform.h"
+#include "Logging.h"
+#include "ThreadConfig.h"
+#include "RuleEngine.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// The magic bytes at the start of the statistics segment, and its version. The version changes when a field is moved
+// or removed. New fields are added at the end of the snapshot, which a reader can tell from the snapshot size.
+#define STATS_SEGMENT_MAGIC "LSSTATS"
+#define STATS_SEGMENT_VERSION 1
+// The name of the segment unless another one is given. It is "Local\<name>" on Windows and "/<name>" on Linux.
+#define STATS_DEFAULT_NAME "LagSwitchStats"
+// How often the snapshot is updated.
+#define STATS_PUBLISH_INTERVAL_MS 50
+// The hold times are counted in 8 buckets for every power of two of microseconds, so a percentile is off by at most
+// an eighth. The last bucket takes every hold time of over 2^33 microseconds.
+#define STATS_HOLD_SUB_BUCKETS 8
+#define STATS_HOLD_BUCKETS (32 * STATS_HOLD_SUB_BUCKETS)
+// How many times a reader tries to copy the snapshot while it is being updated before giving up.
+#define STATS_READ_ATTEMPTS 10000
+
+// The statistics of the delayer, as published in the segment. Every field takes 64 bits, so the snapshot is copied
+// word by word.
+struct STATS_SNAPSHOT {
+	// The wall clock time of the update in nanoseconds since the Unix epoch, and how many updates there have been.
+	UINT64 updatedNs;
+	UINT64 updates;
+	// Whether the delayer is active, and whether it holds every packet.
+	UINT64 active;
+	UINT64 frozen;
+	// The packets since the delayer was initialized.
+	UINT64 received;
+	UINT64 sent;
+	UINT64 dropped;
+	UINT64 coalesced;
+	// The packets and bytes held anywhere, and the packets in each packet list.
+	UINT64 bufferedPackets;
+	UINT64 bufferedBytes;
+	UINT64 queuePackets[RULE_QUEUE_COUNT];
+	// The latency, the hold time compensation, and the mean hold time error left after it, in microseconds.
+	INT64 latencyUs;
+	INT64 compensationUs;
+	INT64 holdErrorUs;
+	// The packets released since the previous update, and how long they were held in microseconds.
+	UINT64 windowReleased;
+	UINT64 holdP50Us;
+	UINT64 holdP90Us;
+	UINT64 holdP99Us;
+	UINT64 holdMaxUs;
+};
+
+#define STATS_SNAPSHOT_WORDS (sizeof(STATS_SNAPSHOT) / sizeof(UINT64))
+
+// The layout of the segment. The header is written once before the first snapshot.
+struct STATS_SEGMENT {
+	char magic[8];
+	UINT32 version;
+	UINT32 snapshotBytes;
+	UINT64 writerProcess;
+	// Odd while the writer changes the snapshot. A reader copies the snapshot again if the sequence was odd
+	// or changed while it copied.
+	std::atomic<UINT64> sequence;
+	std::atomic<UINT64> snapshot[STATS_SNAPSHOT_WORDS];
+};
+
+// Gets the platform's name of the segment.
+inline std::string StatsSegmentPath(const std::string& name) {
+#ifdef _WIN32
+	return "Local\\" + name;
+#else
+	return "/" + name;
+#endif
+}
+
+// Publishes the statistics of the delayer in a named shared memory segment, a file mapping on Windows and a POSIX
+// shared memory object on Linux, so overlays and monitoring agents can poll them without parsing the log.
+// A publisher thread collects the statistics every 50 ms and writes them under a sequence lock: the writer never waits
+// for a reader, and a reader gets a consistent snapshot with nothing but memory reads.
+// The hold times of the released packets are counted in a histogram with relaxed atomic increments, which the
+// publisher turns into percentiles and clears on every update.
+class StatsSegment {
+private:
+	STATS_SEGMENT* _segment = nullptr;
+	std::string _name;
+#ifdef _WIN32
+	HANDLE _mapping = NULL;
+#endif
+	std::function<void(STATS_SNAPSHOT&)> _collect;
+	std::atomic<UINT64> _holdBuckets[STATS_HOLD_BUCKETS];
+	std::atomic<UINT64> _holdMaxUs{ 0 };
+	UINT64 _updates = 0;
+
+	std::thread _publisherThread;
+	THREAD_CONFIG _threadConfig;
+	std::mutex _stopMutex;
+	std::condition_variable _stopped;
+	bool _stopping = false;
+	std::atomic<bool> _open{ false };
+
+	// Gets the bucket of a hold time. The first 8 buckets count single microseconds.
+	static UINT _bucket(UINT64 us) {
+		if (us < STATS_HOLD_SUB_BUCKETS)
+			return (UINT)us;
+		UINT exponent = 3;
+		while (exponent < 33 && (us >> (exponent + 1)) != 0)
+			exponent += 1;
+		UINT sub = (UINT)(us >> (exponent - 3)) & (STATS_HOLD_SUB_BUCKETS - 1);
+		return std::min<UINT>((exponent - 2) * STATS_HOLD_SUB_BUCKETS + sub, STATS_HOLD_BUCKETS - 1);
+	}
+
+	// Gets the middle of the hold times a bucket counts, in microseconds.
+	static UINT64 _bucketValue(UINT bucket) {
+		if (bucket < STATS_HOLD_SUB_BUCKETS)
+			return bucket;
+		UINT exponent = bucket / STATS_HOLD_SUB_BUCKETS + 2;
+		UINT64 width = 1ull << (exponent - 3);
+		return (STATS_HOLD_SUB_BUCKETS + bucket % STATS_HOLD_SUB_BUCKETS) * width + width / 2;
+	}
+
+	// Sets the hold time percentiles of the snapshot from the histogram and clears it.
+	void _takeHoldTimes(STATS_SNAPSHOT& snapshot) {
+		UINT64 counts[STATS_HOLD_BUCKETS];
+		UINT64 total = 0;
+		for (UINT i = 0; i < STATS_HOLD_BUCKETS; ++i) {
+			counts[i] = _holdBuckets[i].exchange(0, std::memory_order_relaxed);
+			total += counts[i];
+		}
+		snapshot.windowReleased = total;
+		snapshot.holdMaxUs = _holdMaxUs.exchange(0, std::memory_order_relaxed);
+		UINT64* percentiles[] = { &snapshot.holdP50Us, &snapshot.holdP90Us, &snapshot.holdP99Us };
+		const double ranks[] = { 0.5, 0.9, 0.99 };
+		for (size_t p = 0; p < 3; ++p) {
+			*percentiles[p] = 0;
+			if (total == 0)
+				continue;
+			UINT64 rank = (UINT64)std::ceil(ranks[p] * total);
+			UINT64 seen = 0;
+			for (UINT i = 0; i < STATS_HOLD_BUCKETS; ++i) {
+				seen += counts[i];
+				if (seen >= rank) {
+					*percentiles[p] = std::min(_bucketValue(i), snapshot.holdMaxUs);
+					break;
+				}
+			}
+		}
+	}
+
+	// Writes the snapshot under the sequence lock. Only the publisher thread writes.
+	void _write(const STATS_SNAPSHOT& snapshot) {
+		UINT64 words[STATS_SNAPSHOT_WORDS];
+		std::memcpy(words, &snapshot, sizeof(words));
+		UINT64 sequence = _segment->sequence.load(std::memory_order_relaxed);
+		_segment->sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < STATS_SNAPSHOT_WORDS; ++i)
+			_segment->snapshot[i].store(words[i], std::memory_order_relaxed);
+		_segment->sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	void _publish() {
+		STATS_SNAPSHOT snapshot;
+		std::memset(&snapshot, 0, sizeof(snapshot));
+		_collect(snapshot);
+		_takeHoldTimes(snapshot);
+		snapshot.updatedNs = (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		_updates += 1;
+		snapshot.updates = _updates;
+		_write(snapshot);
+	}
+
+	void _publisherLoop() {
+		ScopedThreadConfig threadConfig(_threadConfig, "stats");
+		PRINT_TRACE("Stats publisher loop started...");
+		while (true) {
+			_publish();
+			std::unique_lock<std::mutex> lock(_stopMutex);
+			if (_stopped.wait_for(lock, std::chrono::milliseconds(STATS_PUBLISH_INTERVAL_MS), [this]() { return _stopping; }))
+				break;
+		}
+		// The last snapshot shows the final counts.
+		_publish();
+		PRINT_INFO("The stats publisher thread is closing.");
+	}
+
+	void _unmap() {
+#ifdef _WIN32
+		if (_segment != nullptr)
+			UnmapViewOfFile(_segment);
+		if (_mapping != NULL)
+			CloseHandle(_mapping);
+		_mapping = NULL;
+#else
+		if (_segment != nullptr) {
+			munmap(_segment, sizeof(STATS_SEGMENT));
+			shm_unlink(StatsSegmentPath(_name).c_str());
+		}
+#endif
+		_segment = nullptr;
+	}
+
+public:
+	StatsSegment() {
+		for (std::atomic<UINT64>& bucket : _holdBuckets)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+
+	~StatsSegment() {
+		Close();
+	}
+
+	StatsSegment(const StatsSegment&) = delete;
+	StatsSegment& operator=(const StatsSegment&) = delete;
+
+	// Creates the segment with the given name and starts publishing what the function collects every 50 ms.
+	// The function is called on the publisher thread, which takes the given scheduling settings.
+	bool Open(const std::string& name, const THREAD_CONFIG& config, std::function<void(STATS_SNAPSHOT&)> collect) {
+		if (_open)
+			return true;
+		_name = name;
+		std::string path = StatsSegmentPath(name);
+#ifdef _WIN32
+		_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)sizeof(STATS_SEGMENT), path.c_str());
+		if (_mapping == NULL) {
+			PRINT_ERROR("CreateFileMappingA() failed for the stats segment \"" << path << "\" with error code " << GetLastError() << ".");
+			return false;
+		}
+		if (GetLastError() == ERROR_ALREADY_EXISTS) {
+			PRINT_ERROR("The stats segment \"" << path << "\" is already published by another process.");
+			_unmap();
+			return false;
+		}
+		_segment = (STATS_SEGMENT*)MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, sizeof(STATS_SEGMENT));
+		if (_segment == nullptr) {
+			PRINT_ERROR("MapViewOfFile() failed for the stats segment with error code " << GetLastError() << ".");
+			_unmap();
+			return false;
+		}
+#else
+		// A segment left behind by a process that didn't exit cleanly is replaced.
+		int file = shm_open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (file < 0) {
+			PRINT_ERROR("shm_open() failed for the stats segment \"" << path << "\" with error code " << errno << ".");
+			return false;
+		}
+		void* view = MAP_FAILED;
+		if (ftruncate(file, sizeof(STATS_SEGMENT)) == 0)
+			view = mmap(nullptr, sizeof(STATS_SEGMENT), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		int error = errno;
+		// The mapping keeps the object open.
+		close(file);
+		if (view == MAP_FAILED) {
+			PRINT_ERROR("Mapping the stats segment \"" << path << "\" failed with error code " << error << ".");
+			shm_unlink(path.c_str());
+			return false;
+		}
+		_segment = (STATS_SEGMENT*)view;
+#endif
+		// The header is written before the sequence is, so a reader that sees a snapshot sees the header.
+		std::memcpy(_segment->magic, STATS_SEGMENT_MAGIC, sizeof(_segment->magic));
+		_segment->version = STATS_SEGMENT_VERSION;
+		_segment->snapshotBytes = (UINT32)sizeof(STATS_SNAPSHOT);
+#ifdef _WIN32
+		_segment->writerProcess = GetCurrentProcessId();
+#else
+		_segment->writerProcess = (UINT64)getpid();
+#endif
+		_segment->sequence.store(0, std::memory_order_release);
+		_collect = collect;
+		_threadConfig = config;
+		_stopping = false;
+		_updates = 0;
+		_open = true;
+		_publisherThread = std::thread(&StatsSegment::_publisherLoop, this);
+		PRINT_INFO("Publishing the statistics in the shared memory segment \"" << path << "\".");
+		return true;
+	}
+
+	// Stops publishing and removes the segment. Readers that still have it mapped keep the last snapshot.
+	void Close() {
+		if (!_open)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(_stopMutex);
+			_stopping = true;
+		}
+		_stopped.notify_all();
+		_publisherThread.join();
+		_unmap();
+		_open = false;
+	}
+
+	bool IsOpen() const {
+		return _open.load(std::memory_order_relaxed);
+	}
+
+	// Counts how long a released packet was held. Called on the packet path, so it only takes two relaxed atomic operations
+	// unless the hold time is the longest of the update.
+	void RecordHold(std::chrono::nanoseconds held) {
+		UINT64 us = held.count() > 0 ? (UINT64)(held.count() / 1000) : 0;
+		_holdBuckets[_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+		UINT64 max = _holdMaxUs.load(std::memory_order_relaxed);
+		while (us > max && !_holdMaxUs.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+	}
+};
+
+// Reads the snapshots of a segment another process publishes. Reading takes no system calls once the segment is mapped.
+class StatsReader {
+private:
+	const STATS_SEGMENT* _segment = nullptr;
+#ifdef _WIN32
+	HANDLE _mapping = NULL;
+#endif
+
+public:
+	~StatsReader() {
+		Close();
+	}
+
+	// Maps the segment with the given name. Returns false with the reason if it doesn't exist or isn't a stats segment.
+	bool Open(const std::string& name, std::string& error) {
+		Close();
+		std::string path = StatsSegmentPath(name);
+#ifdef _WIN32
+		_mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, path.c_str());
+		if (_mapping == NULL) {
+			error = "No stats segment \"" + path + "\" is published (error code " + std::to_string(GetLastError()) + ").";
+			return false;
+		}
+		_segment = (const STATS_SEGMENT*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, sizeof(STATS_SEGMENT));
+		if (_segment == nullptr) {
+			error = "MapViewOfFile() failed for the stats segment with error code " + std::to_string(GetLastError()) + ".";
+			Close();
+			return false;
+		}
+#else
+		int file = shm_open(path.c_str(), O_RDONLY, 0);
+		if (file < 0) {
+			error = "No stats segment \"" + path + "\" is published (error code " + std::to_string(errno) + ").";
+			return false;
+		}
+		void* view = mmap(nullptr, sizeof(STATS_SEGMENT), PROT_READ, MAP_SHARED, file, 0);
+		int mapError = errno;
+		close(file);
+		if (view == MAP_FAILED) {
+			error = "Mapping the stats segment \"" + path + "\" failed with error code " + std::to_string(mapError) + ".";
+			return false;
+		}
+		_segment = (const STATS_SEGMENT*)view;
+#endif
+		if (std::memcmp(_segment->magic, STATS_SEGMENT_MAGIC, sizeof(_segment->magic)) != 0 || _segment->version != STATS_SEGMENT_VERSION) {
+			error = "\"" + path + "\" isn't a stats segment of version " + std::to_string(STATS_SEGMENT_VERSION) + ".";
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (_segment != nullptr)
+			UnmapViewOfFile(_segment);
+		if (_mapping != NULL)
+			CloseHandle(_mapping);
+		_mapping = NULL;
+#else
+		if (_segment != nullptr)
+			munmap((void*)_segment, sizeof(STATS_SEGMENT));
+#endif
+		_segment = nullptr;
+	}
+
+	UINT64 WriterProcess() const {
+		return _segment != nullptr ? _segment->writerProcess : 0;
+	}
+
+	// Copies the latest snapshot. Fields the writer doesn't publish are left zero.
+	// Returns false if nothing was published yet or the writer kept changing the snapshot while it was copied.
+	bool Read(STATS_SNAPSHOT& snapshot) const {
+		if (_segment == nullptr)
+			return false;
+		UINT64 words[STATS_SNAPSHOT_WORDS] = {};
+		size_t count = std::min<size_t>(STATS_SNAPSHOT_WORDS, _segment->snapshotBytes / sizeof(UINT64));
+		for (UINT attempt = 0; attempt < STATS_READ_ATTEMPTS; ++attempt) {
+			UINT64 before = _segment->sequence.load(std::memory_order_acquire);
+			if (before == 0)
+				return false;
+			if ((before & 1) != 0)
+				continue;
+			for (size_t i = 0; i < count; ++i)
+				words[i] = _segment->snapshot[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (_segment->sequence.load(std::memory_order_relaxed) == before) {
+				std::memcpy(&snapshot, words, sizeof(snapshot));
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Prints a snapshot on one line, with the packet rates since the previous one if one is given.
+inline void PrintStatsSnapshot(const STATS_SNAPSHOT& snapshot, const STATS_SNAPSHOT* previous) {
+	std::ostringstream row;
+	row << (snapshot.active == 0 ? "inactive" : snapshot.frozen != 0 ? "frozen" : "active")
+		<< ", received " << snapshot.received << ", sent " << snapshot.sent << ", dropped " << snapshot.dropped;
+	if (previous != nullptr && snapshot.updatedNs > previous->updatedNs) {
+		double seconds = (snapshot.updatedNs - previous->updatedNs) / 1e9;
+		row << std::fixed << std::setprecision(0) << " (" << (snapshot.received - previous->received) / seconds << " / "
+			<< (snapshot.sent - previous->sent) / seconds << " pps)";
+	}
+	row << ", buffered " << snapshot.bufferedPackets << " (" << snapshot.bufferedBytes / 1024 << " KB)";
+	for (UINT q = 1; q < RULE_QUEUE_COUNT; ++q) {
+		if (snapshot.queuePackets[q] != 0)
+			row << ", queue " << q << " " << snapshot.queuePackets[q];
+	}
+	row << std::fixed << std::setprecision(2) << ", latency " << snapshot.latencyUs / 1000.0 << " ms";
+	if (snapshot.windowReleased != 0) {
+		row << ", held p50 " << snapshot.holdP50Us / 1000.0 << " p90 " << snapshot.holdP90Us / 1000.0 << " p99 "
+			<< snapshot.holdP99Us / 1000.0 << " max " << snapshot.holdMaxUs / 1000.0 << " ms";
+	}
+	SYNC_COUT(row.str());
+}
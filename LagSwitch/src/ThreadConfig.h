@@ -0,0 +1,191 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#ifdef _WIN32
+#include <Windows.h>
+#include <avrt.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Avrt.lib")
+#endif
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include "Logging.h"
+
+// The MMCSS task the data-plane threads are registered as.
+#define MMCSS_TASK_NAME "Games"
+// The SCHED_FIFO priorities used on Linux for the two highest priority levels.
+#define FIFO_PRIORITY_HIGHEST 50
+#define FIFO_PRIORITY_TIME_CRITICAL 80
+
+// The scheduling priority of a thread, mapped to the closest equivalent of each platform.
+enum class ThreadPriority {
+	Lowest,
+	BelowNormal,
+	Normal,
+	AboveNormal,
+	// On Linux, this and TimeCritical use SCHED_FIFO when permitted.
+	Highest,
+	TimeCritical
+};
+
+// The scheduling settings of a single thread.
+struct THREAD_CONFIG {
+	// The CPUs the thread may run on as a bit mask. Zero leaves the affinity unchanged.
+	uint64_t affinityMask = 0;
+	ThreadPriority priority = ThreadPriority::Normal;
+	// Whether or not the thread is registered with the Multimedia Class Scheduler Service. Ignored on Linux.
+	bool mmcss = false;
+};
+
+// Parses a thread priority name. Returns false if the name is unknown.
+inline bool ParseThreadPriority(const std::string& name, ThreadPriority& priority) {
+	if (name == "lowest")
+		priority = ThreadPriority::Lowest;
+	else if (name == "below-normal")
+		priority = ThreadPriority::BelowNormal;
+	else if (name == "normal")
+		priority = ThreadPriority::Normal;
+	else if (name == "above-normal")
+		priority = ThreadPriority::AboveNormal;
+	else if (name == "highest")
+		priority = ThreadPriority::Highest;
+	else if (name == "time-critical")
+		priority = ThreadPriority::TimeCritical;
+	else
+		return false;
+	return true;
+}
+
+// Parses a CPU list such as "2,4-6" into a bit mask. Returns false if the list is invalid.
+inline bool ParseCpuList(const std::string& list, uint64_t& mask) {
+	mask = 0;
+	const char* current = list.c_str();
+	while (*current != '\0') {
+		char* end;
+		long first = std::strtol(current, &end, 10);
+		if (end == current || first < 0 || first > 63)
+			return false;
+		long last = first;
+		if (*end == '-') {
+			current = end + 1;
+			last = std::strtol(current, &end, 10);
+			if (end == current || last < first || last > 63)
+				return false;
+		}
+		for (long cpu = first; cpu <= last; ++cpu)
+			mask |= (uint64_t)1 << cpu;
+		if (*end == ',')
+			++end;
+		else if (*end != '\0')
+			return false;
+		current = end;
+	}
+	return mask != 0;
+}
+
+// Gets the mask of the CPUs this process may run on.
+inline uint64_t GetProcessCpuMask() {
+#ifdef _WIN32
+	DWORD_PTR processMask, systemMask;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+		return 0;
+	return (uint64_t)processMask;
+#else
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return 0;
+	uint64_t mask = 0;
+	for (int cpu = 0; cpu < 64; ++cpu) {
+		if (CPU_ISSET(cpu, &set))
+			mask |= (uint64_t)1 << cpu;
+	}
+	return mask;
+#endif
+}
+
+// Applies a thread configuration to the calling thread for as long as the object exists.
+// Failures are logged but not fatal, since the thread works the same way with default scheduling.
+class ScopedThreadConfig {
+private:
+#ifdef _WIN32
+	HANDLE _mmcssHandle;
+#endif
+
+public:
+	ScopedThreadConfig(const THREAD_CONFIG& config, const char* name) {
+#ifdef _WIN32
+		_mmcssHandle = NULL;
+		HANDLE thread = GetCurrentThread();
+		if (config.affinityMask != 0 && SetThreadAffinityMask(thread, (DWORD_PTR)config.affinityMask) == 0)
+			PRINT_ERROR("SetThreadAffinityMask() failed for the " << name << " thread with error code " << GetLastError() << ".");
+		// MMCSS boosts the thread into the real-time range, so it replaces the plain priority.
+		if (config.mmcss) {
+			DWORD taskIndex = 0;
+			_mmcssHandle = AvSetMmThreadCharacteristicsA(MMCSS_TASK_NAME, &taskIndex);
+			if (_mmcssHandle == NULL)
+				PRINT_ERROR("AvSetMmThreadCharacteristics() failed for the " << name << " thread with error code " << GetLastError() << ".");
+		}
+		int priority;
+		switch (config.priority) {
+		case ThreadPriority::Lowest: priority = THREAD_PRIORITY_LOWEST; break;
+		case ThreadPriority::BelowNormal: priority = THREAD_PRIORITY_BELOW_NORMAL; break;
+		case ThreadPriority::AboveNormal: priority = THREAD_PRIORITY_ABOVE_NORMAL; break;
+		case ThreadPriority::Highest: priority = THREAD_PRIORITY_HIGHEST; break;
+		case ThreadPriority::TimeCritical: priority = THREAD_PRIORITY_TIME_CRITICAL; break;
+		default: priority = THREAD_PRIORITY_NORMAL; break;
+		}
+		if (priority != THREAD_PRIORITY_NORMAL && !SetThreadPriority(thread, priority))
+			PRINT_ERROR("SetThreadPriority() failed for the " << name << " thread with error code " << GetLastError() << ".");
+#else
+		if (config.affinityMask != 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (int cpu = 0; cpu < 64; ++cpu) {
+				if (config.affinityMask & ((uint64_t)1 << cpu))
+					CPU_SET(cpu, &set);
+			}
+			int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if (error != 0)
+				PRINT_ERROR("pthread_setaffinity_np() failed for the " << name << " thread with error code " << error << ".");
+		}
+		if (config.priority == ThreadPriority::Highest || config.priority == ThreadPriority::TimeCritical) {
+			sched_param param = {};
+			param.sched_priority = config.priority == ThreadPriority::Highest ? FIFO_PRIORITY_HIGHEST : FIFO_PRIORITY_TIME_CRITICAL;
+			int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+			// SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit, so fall back to the highest nice value allowed.
+			if (error != 0) {
+				PRINT_ERROR("SCHED_FIFO is not permitted for the " << name << " thread (error code " << error << "), raising its nice priority instead.");
+				setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), -10);
+			}
+		}
+		else if (config.priority != ThreadPriority::Normal) {
+			int nice;
+			switch (config.priority) {
+			case ThreadPriority::Lowest: nice = 10; break;
+			case ThreadPriority::BelowNormal: nice = 5; break;
+			default: nice = -5; break;
+			}
+			if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0)
+				PRINT_ERROR("setpriority() failed for the " << name << " thread with error code " << errno << ".");
+		}
+#endif
+	}
+
+	~ScopedThreadConfig() {
+#ifdef _WIN32
+		if (_mmcssHandle != NULL)
+			AvRevertMmThreadCharacteristics(_mmcssHandle);
+#endif
+	}
+
+	ScopedThreadConfig(const ScopedThreadConfig&) = delete;
+	ScopedThreadConfig& operator=(const ScopedThreadConfig&) = delete;
+};
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include "Platform.h"
+#include "Logging.h"
+#include "PacketHeaders.h"
+#include "Checksum.h"
+#include "PacketDivert.h"
+#ifdef _WIN32
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#ifndef SIO_UDP_CONNRESET
+#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12)
+#endif
+#else
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+// The echo datagrams start with the sequence number and the steady clock time they were sent at,
+// and are padded to this length.
+#define ECHO_DATAGRAM_LENGTH 64
+#define ECHO_HEADER_LENGTH 16
+// How long a receive waits for a datagram before the caller checks whether it should stop.
+#define ECHO_POLL_MS 10
+// The largest datagram the sockets receive.
+#define ECHO_MAX_DATAGRAM 65507
+// The IPv4 and UDP headers the forwarder puts in front of a datagram.
+#define FORWARDER_HEADER_LENGTH 28
+
+// A UDP socket bound to the loopback address.
+class LoopbackSocket {
+private:
+#ifdef _WIN32
+	SOCKET _socket = INVALID_SOCKET;
+#else
+	int _socket = -1;
+#endif
+	UINT16 _port = 0;
+
+	static int _lastError() {
+#ifdef _WIN32
+		return WSAGetLastError();
+#else
+		return errno;
+#endif
+	}
+
+	static sockaddr_in _loopback(UINT16 port) {
+		sockaddr_in address;
+		std::memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		return address;
+	}
+
+public:
+	LoopbackSocket() {}
+
+	~LoopbackSocket() {
+		Close();
+	}
+
+	LoopbackSocket(const LoopbackSocket&) = delete;
+	LoopbackSocket& operator=(const LoopbackSocket&) = delete;
+
+	// Binds the socket to the given port, or to a free one if zero.
+	bool Open(UINT16 port) {
+		Close();
+#ifdef _WIN32
+		// Winsock is started once and left running for the rest of the program.
+		static bool started = [] {
+			WSADATA data;
+			return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}();
+		if (!started) {
+			PRINT_ERROR("WSAStartup() failed.");
+			return false;
+		}
+		_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (_socket == INVALID_SOCKET) {
+#else
+		_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (_socket < 0) {
+#endif
+			PRINT_ERROR("socket() failed with error code " << _lastError() << ".");
+			return false;
+		}
+#ifdef _WIN32
+		// Windows fails the next receive when an earlier send got a port unreachable message back.
+		BOOL reportReset = FALSE;
+		DWORD returned = 0;
+		WSAIoctl(_socket, SIO_UDP_CONNRESET, &reportReset, sizeof(reportReset), NULL, 0, &returned, NULL, NULL);
+#endif
+		// A larger receive buffer keeps a burst of released packets from overflowing it.
+		int bufferBytes = 4 * 1024 * 1024;
+		setsockopt(_socket, SOL_SOCKET, SO_RCVBUF, (const char*)&bufferBytes, sizeof(bufferBytes));
+		sockaddr_in address = _loopback(port);
+		if (bind(_socket, (const sockaddr*)&address, sizeof(address)) != 0) {
+			PRINT_ERROR("bind() failed for the port " << port << " with error code " << _lastError() << ".");
+			Close();
+			return false;
+		}
+		socklen_t length = sizeof(address);
+		getsockname(_socket, (sockaddr*)&address, &length);
+		_port = ntohs(address.sin_port);
+		return true;
+	}
+
+	UINT16 Port() const {
+		return _port;
+	}
+
+	bool SendTo(const void* data, UINT length, UINT16 port) {
+		sockaddr_in address = _loopback(port);
+		return sendto(_socket, (const char*)data, (int)length, 0, (const sockaddr*)&address, sizeof(address)) == (int)length;
+	}
+
+	// Waits up to ECHO_POLL_MS for a datagram and stores the port it came from.
+	// Returns the length of the datagram, 0 if none arrived in time, or -1 on an error.
+	int Receive(void* buffer, UINT length, UINT16* fromPort) {
+		sockaddr_in address;
+		socklen_t addressLength = sizeof(address);
+#ifndef _WIN32
+		// Only wait when nothing is queued, so a busy socket takes one call per datagram.
+		int waiting = (int)recvfrom(_socket, buffer, length, MSG_DONTWAIT, (sockaddr*)&address, &addressLength);
+		if (waiting >= 0) {
+			*fromPort = ntohs(address.sin_port);
+			return waiting;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+#endif
+		pollfd descriptor;
+		descriptor.fd = _socket;
+		descriptor.events = POLLIN;
+		descriptor.revents = 0;
+#ifdef _WIN32
+		int ready = WSAPoll(&descriptor, 1, ECHO_POLL_MS);
+#else
+		int ready = poll(&descriptor, 1, ECHO_POLL_MS);
+#endif
+		if (ready <= 0)
+			return ready;
+		addressLength = sizeof(address);
+		int received = (int)recvfrom(_socket, (char*)buffer, (int)length, 0, (sockaddr*)&address, &addressLength);
+		if (received < 0)
+			return -1;
+		*fromPort = ntohs(address.sin_port);
+		return received;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (_socket != INVALID_SOCKET)
+			closesocket(_socket);
+		_socket = INVALID_SOCKET;
+#else
+		if (_socket >= 0)
+			close(_socket);
+		_socket = -1;
+#endif
+		_port = 0;
+	}
+};
+
+// Runs the delayer between a UDP client and server on the loopback address without WinDivert.
+// The client sends to the forwarder's port instead of the server's. Every datagram from the client is handed to
+// the delayer as an IPv4 packet from the client's port to the server's, and sent on to the server once the delayer
+// injects it. The server's replies come back to the forwarder and are sent straight on to the client,
+// like the inbound packets the delayer's filter doesn't match, so only the client's packets are delayed.
+class UdpForwarder : public PacketDivert {
+private:
+	UINT16 _serverPort;
+	LoopbackSocket _socket;
+	std::atomic<UINT16> _clientPort{ 0 };
+	std::atomic<bool> _shutdown{ false };
+	// Used by the receiving thread only.
+	std::vector<BYTE> _datagram = std::vector<BYTE>(ECHO_MAX_DATAGRAM);
+
+public:
+	explicit UdpForwarder(UINT16 serverPort) : _serverPort(serverPort) {}
+
+	// The port the client should send to. The forwarder must be open.
+	UINT16 Port() const {
+		return _socket.Port();
+	}
+
+	// Binds the forwarder to a free port. Opening again after a shutdown keeps the port, so the client can keep sending.
+	bool Open(const std::string& filter) override {
+		_shutdown = false;
+		if (_socket.Port() != 0)
+			return true;
+		return _socket.Open(0);
+	}
+
+	bool Recv(PVOID packet, UINT length, UINT* received, WINDIVERT_ADDRESS* address) override {
+		while (true) {
+			if (_shutdown.load(std::memory_order_relaxed)) {
+				SetLastError(ERROR_NO_DATA);
+				return false;
+			}
+			UINT16 fromPort = 0;
+			int datagramLength = _socket.Receive(_datagram.data(), (UINT)_datagram.size(), &fromPort);
+			if (datagramLength < 0) {
+				SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+				return false;
+			}
+			if (datagramLength == 0 && fromPort == 0)
+				continue;
+			if (fromPort == _serverPort) {
+				_socket.SendTo(_datagram.data(), (UINT)datagramLength, _clientPort);
+				continue;
+			}
+			_clientPort = fromPort;
+			UINT packetLength = FORWARDER_HEADER_LENGTH + (UINT)datagramLength;
+			// Like the driver, a packet that doesn't fit the buffer is dropped.
+			if (length < packetLength) {
+				SetLastError(ERROR_INSUFFICIENT_BUFFER);
+				return false;
+			}
+			BYTE* data = (BYTE*)packet;
+			std::memset(data, 0, FORWARDER_HEADER_LENGTH);
+			data[0] = 0x45;
+			WriteNet16(data + 2, (UINT16)packetLength);
+			data[IPV4_TTL_OFFSET] = 128;
+			data[IPV4_PROTOCOL_OFFSET] = IP_PROTOCOL_UDP;
+			const BYTE addresses[8] = { 127, 0, 0, 1, 127, 0, 0, 1 };
+			std::memcpy(data + IPV4_SRC_ADDR_OFFSET, addresses, sizeof(addresses));
+			WriteWord(data + IPV4_CHECKSUM_OFFSET, Checksum(data, 20));
+			WriteNet16(data + 20 + SRC_PORT_OFFSET, fromPort);
+			WriteNet16(data + 20 + DST_PORT_OFFSET, _serverPort);
+			WriteNet16(data + 20 + UDP_LENGTH_OFFSET, (UINT16)(packetLength - 20));
+			std::memcpy(data + FORWARDER_HEADER_LENGTH, _datagram.data(), (size_t)datagramLength);
+			std::memset(address, 0, sizeof(*address));
+			address->Layer = WINDIVERT_LAYER_NETWORK;
+			address->Outbound = 1;
+			address->Loopback = 1;
+			*received = packetLength;
+			return true;
+		}
+	}
+
+	// Sends the datagram in the packet on to the server.
+	bool Send(const VOID* packet, UINT length, const WINDIVERT_ADDRESS* address) override {
+		if (length < FORWARDER_HEADER_LENGTH) {
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return false;
+		}
+		if (!_socket.SendTo((const BYTE*)packet + FORWARDER_HEADER_LENGTH, length - FORWARDER_HEADER_LENGTH, _serverPort)) {
+			SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+			return false;
+		}
+		return true;
+	}
+
+	bool Shutdown() override {
+		_shutdown = true;
+		return true;
+	}
+
+	// The socket is kept open so a reopen keeps the port. It is closed when the forwarder is destroyed.
+	bool Close() override {
+		return true;
+	}
+};
+
+// Sends every datagram it receives back to where it came from.
+class UdpEchoServer {
+private:
+	LoopbackSocket _socket;
+	std::thread _thread;
+	std::atomic<bool> _stopping{ false };
+
+	void _echoLoop() {
+		std::vector<BYTE> datagram(ECHO_MAX_DATAGRAM);
+		while (!_stopping) {
+			UINT16 fromPort = 0;
+			int length = _socket.Receive(datagram.data(), (UINT)datagram.size(), &fromPort);
+			if (length > 0)
+				_socket.SendTo(datagram.data(), (UINT)length, fromPort);
+		}
+	}
+
+public:
+	~UdpEchoServer() {
+		Stop();
+	}
+
+	// Starts echoing on a free port.
+	bool Start() {
+		if (!_socket.Open(0))
+			return false;
+		_stopping = false;
+		_thread = std::thread(&UdpEchoServer::_echoLoop, this);
+		return true;
+	}
+
+	UINT16 Port() const {
+		return _socket.Port();
+	}
+
+	void Stop() {
+		_stopping = true;
+		if (_thread.joinable())
+			_thread.join();
+	}
+};
+
+// What an echo client measured.
+struct ECHO_RESULT {
+	UINT64 sent = 0;
+	UINT64 received = 0;
+	// The echoes that came back with a lower sequence number than one that came back before them.
+	UINT64 reordered = 0;
+	double lossPercent = 0;
+	// The round trip time of every echo in microseconds.
+	std::vector<double> rttUs;
+};
+
+// Sends timestamped datagrams at a steady rate and measures how long each one takes to be echoed back.
+class UdpEchoClient {
+private:
+	LoopbackSocket _socket;
+
+public:
+	// Binds the client to a free port, so the port is known before the traffic starts.
+	bool Open() {
+		return _socket.Open(0);
+	}
+
+	UINT16 Port() const {
+		return _socket.Port();
+	}
+
+	// Sends to the given port at the given rate for the given time, then waits for the late echoes
+	// for the given drain time.
+	ECHO_RESULT Run(UINT16 targetPort, double packetsPerSecond, std::chrono::milliseconds duration, std::chrono::milliseconds drain) {
+		ECHO_RESULT result;
+		UINT64 total = (UINT64)(packetsPerSecond * duration.count() / 1000);
+		result.rttUs.reserve((size_t)total);
+		std::atomic<bool> stopping{ false };
+		std::thread receiver([&]() {
+			std::vector<BYTE> datagram(ECHO_MAX_DATAGRAM);
+			UINT64 lastSequence = 0;
+			while (!stopping) {
+				UINT16 fromPort = 0;
+				int length = _socket.Receive(datagram.data(), (UINT)datagram.size(), &fromPort);
+				if (length < ECHO_HEADER_LENGTH)
+					continue;
+				INT64 now = std::chrono::steady_clock::now().time_since_epoch().count();
+				UINT64 sequence;
+				INT64 sentAt;
+				std::memcpy(&sequence, datagram.data(), sizeof(sequence));
+				std::memcpy(&sentAt, datagram.data() + 8, sizeof(sentAt));
+				double rtt = std::chrono::duration<double, std::micro>(
+					std::chrono::steady_clock::duration(now - sentAt)
+				).count();
+				result.rttUs.push_back(rtt);
+				if (result.received > 0 && sequence < lastSequence)
+					result.reordered += 1;
+				lastSequence = sequence;
+				result.received += 1;
+			}
+		});
+
+		BYTE datagram[ECHO_DATAGRAM_LENGTH] = {};
+		auto start = std::chrono::steady_clock::now();
+		for (UINT64 sequence = 0; sequence < total; ++sequence) {
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds((long long)(sequence * 1e9 / packetsPerSecond)));
+			INT64 sentAt = std::chrono::steady_clock::now().time_since_epoch().count();
+			std::memcpy(datagram, &sequence, sizeof(sequence));
+			std::memcpy(datagram + 8, &sentAt, sizeof(sentAt));
+			if (_socket.SendTo(datagram, sizeof(datagram), targetPort))
+				result.sent += 1;
+		}
+		std::this_thread::sleep_for(drain);
+		stopping = true;
+		receiver.join();
+		result.lossPercent = total == 0 ? 0 : 100.0 * (total - std::min(total, result.received)) / total;
+		return result;
+	}
+};